@@ -1,22 +1,234 @@
 // Client (daytime_client.c)
 #include <stdio.h>
+#include <stdlib.h>
 #include <winsock2.h>
+#include <windows.h>
+#include <process.h> // For _beginthreadex
+#include <math.h> // For sqrt
 
 #pragma comment(lib, "ws2_32.lib")
 
 #define PORT 13
 #define MAX_BUFFER_SIZE 256
+#define BENCH_MAX_THREADS 64 // Upper bound for concurrent benchmark connections
+#define UDP_TIMEOUT_MS 2000 // How long to wait for a UDP answer
+
+// --- Time-offset probes (must match the server) ---
+#define TIME_PROBE_MAGIC 0x544F4653U // "TOFS"
+#define TIME_PROBE_SIZE 16
+#define TIME_REPLY_SIZE 32
+#define OFFSET_MAX_PROBES 10000 // Upper bound for one burst
+#define OFFSET_PROBE_TIMEOUT_MS 500 // A probe without a reply by then counts as lost
+#define OFFSET_BEST_PERCENT 10 // Offset is estimated from the samples with the lowest round-trip times
+
+// One offset/round-trip sample (NTP on-wire calculation)
+typedef struct {
+    long long offset_ns; // Server clock minus ours
+    long long delay_ns; // Round trip minus the server's processing time
+} OffsetSample;
+
+struct sockaddr_in server_address;
+
+// Wall-clock time in nanoseconds since the Unix epoch (same clock as the server uses)
+unsigned long long now_ns(void) {
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    unsigned long long ticks = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (ticks - 116444736000000000ULL) * 100; // FILETIME counts 100 ns intervals since 1601
+}
+
+void put_u32(unsigned char* p, unsigned int v) {
+    for (int i = 3; i >= 0; i--, v >>= 8) p[i] = (unsigned char)v;
+}
+
+void put_u64(unsigned char* p, unsigned long long v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = (unsigned char)v;
+}
+
+unsigned int get_u32(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+unsigned long long get_u64(const unsigned char* p) {
+    return ((unsigned long long)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+int compare_by_delay(const void* a, const void* b) {
+    long long da = ((const OffsetSample*)a)->delay_ns, db = ((const OffsetSample*)b)->delay_ns;
+    return (da > db) - (da < db);
+}
+
+// Send a burst of timestamped probes and estimate the clock offset NTP-style. Samples with the
+// lowest round-trip times suffer least from queuing, so only those feed the estimate; the true
+// offset lies within +/- half the best round trip of the best sample's offset.
+int measure_offset(int count, int interval_ms) {
+    unsigned char packet[TIME_REPLY_SIZE];
+    DWORD timeout = OFFSET_PROBE_TIMEOUT_MS;
+    OffsetSample *samples = (OffsetSample*)malloc(sizeof(OffsetSample) * count);
+    int received = 0;
+
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == INVALID_SOCKET || samples == NULL) {
+        fprintf(stderr, "Socket creation failed: %d\n", WSAGetLastError());
+        free(samples);
+        return 1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    // connect() filters out datagrams from anyone but the server
+    connect(sock, (struct sockaddr*)&server_address, sizeof(server_address));
+
+    printf("Sending %d probes, %d ms apart...\n", count, interval_ms);
+    for (unsigned int seq = 0; seq < (unsigned int)count; seq++) {
+        put_u32(packet, TIME_PROBE_MAGIC);
+        put_u32(packet + 4, seq);
+        unsigned long long t1 = now_ns();
+        put_u64(packet + 8, t1);
+        if (send(sock, (const char*)packet, TIME_PROBE_SIZE, 0) == SOCKET_ERROR) break;
+
+        // Skip replies to earlier probes that arrived late
+        while (1) {
+            int n = recv(sock, (char*)packet, sizeof(packet), 0);
+            unsigned long long t4 = now_ns();
+            if (n == SOCKET_ERROR) break; // Lost (timeout)
+            if (n != TIME_REPLY_SIZE || get_u32(packet) != TIME_PROBE_MAGIC || get_u32(packet + 4) != seq ||
+                get_u64(packet + 8) != t1) {
+                continue;
+            }
+            long long t2 = (long long)get_u64(packet + 16), t3 = (long long)get_u64(packet + 24);
+            samples[received].offset_ns = ((t2 - (long long)t1) + (t3 - (long long)t4)) / 2;
+            samples[received].delay_ns = ((long long)t4 - (long long)t1) - (t3 - t2);
+            received++;
+            break;
+        }
+        if (interval_ms > 0) Sleep(interval_ms);
+    }
+    closesocket(sock);
+
+    if (received == 0) {
+        printf("No replies (%d probes lost).\n", count);
+        free(samples);
+        return 1;
+    }
+
+    qsort(samples, received, sizeof(OffsetSample), compare_by_delay);
+    int best = received * OFFSET_BEST_PERCENT / 100;
+    if (best < 1) best = 1;
+
+    double mean = 0.0, variance = 0.0;
+    for (int i = 0; i < best; i++) mean += samples[i].offset_ns;
+    mean /= best;
+    for (int i = 0; i < best; i++) variance += (samples[i].offset_ns - mean) * (samples[i].offset_ns - mean);
+    variance /= best;
+
+    double min_delay_us = samples[0].delay_ns / 1000.0;
+    double best_offset_us = samples[0].offset_ns / 1000.0;
+    printf("%d of %d replies received (%.1f%% lost).\n", received, count, 100.0 * (count - received) / count);
+    printf("RTT: min %.1f us, median %.1f us, max %.1f us\n", min_delay_us,
+           samples[received / 2].delay_ns / 1000.0, samples[received - 1].delay_ns / 1000.0);
+    printf("Offset (server - local), min-RTT sample: %+.1f us, bounds [%+.1f, %+.1f] us\n",
+           best_offset_us, best_offset_us - min_delay_us / 2, best_offset_us + min_delay_us / 2);
+    printf("Offset, mean of %d lowest-RTT samples: %+.1f us (stddev %.1f us)\n", best, mean / 1000.0, sqrt(variance) / 1000.0);
+    free(samples);
+    return 0;
+}
+
+// Benchmark: each thread opens short connections back to back until the deadline
+typedef struct {
+    ULONGLONG deadline;
+    long long completed;
+    long long failed;
+} BenchWorker;
+
+unsigned __stdcall bench_thread(void *arg) {
+    BenchWorker *worker = (BenchWorker*)arg;
+    char buffer[MAX_BUFFER_SIZE];
+
+    while (GetTickCount64() < worker->deadline) {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            worker->failed++;
+            continue;
+        }
+        // Abortive close so client-side TIME_WAIT does not exhaust ephemeral ports during the run
+        struct linger no_linger = { 1, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char*)&no_linger, sizeof(no_linger));
+        if (connect(sock, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR ||
+            recv(sock, buffer, MAX_BUFFER_SIZE - 1, 0) <= 0) {
+            worker->failed++;
+        } else {
+            worker->completed++;
+        }
+        closesocket(sock);
+    }
+    return 0;
+}
+
+// Open as many short connections as possible for the given time and report the rate
+int run_benchmark(int seconds, int threads) {
+    HANDLE handles[BENCH_MAX_THREADS];
+    BenchWorker workers[BENCH_MAX_THREADS];
+    long long completed = 0, failed = 0;
+
+    printf("Benchmarking %d s with %d concurrent connections...\n", seconds, threads);
+    ULONGLONG start = GetTickCount64();
+    for (int i = 0; i < threads; i++) {
+        workers[i].deadline = start + (ULONGLONG)seconds * 1000;
+        workers[i].completed = 0;
+        workers[i].failed = 0;
+        handles[i] = (HANDLE)_beginthreadex(NULL, 0, bench_thread, &workers[i], 0, NULL);
+        if (handles[i] == NULL) {
+            fprintf(stderr, "Thread creation failed: %lu\n", GetLastError());
+            threads = i;
+            break;
+        }
+    }
+    WaitForMultipleObjects(threads, handles, TRUE, INFINITE);
+    double elapsed = (GetTickCount64() - start) / 1000.0;
+    for (int i = 0; i < threads; i++) {
+        completed += workers[i].completed;
+        failed += workers[i].failed;
+        CloseHandle(handles[i]);
+    }
+
+    printf("%lld connections served, %lld failed, in %.1f s: %.0f connections/s\n",
+           completed, failed, elapsed, elapsed > 0.0 ? completed / elapsed : 0.0);
+    return completed > 0 ? 0 : 1;
+}
+
+// Ask for the time over UDP (any datagram is answered)
+int query_udp(void) {
+    char buffer[MAX_BUFFER_SIZE];
+    DWORD timeout = UDP_TIMEOUT_MS;
+
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == INVALID_SOCKET) {
+        fprintf(stderr, "Socket creation failed: %d\n", WSAGetLastError());
+        return 1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    sendto(sock, "", 0, 0, (struct sockaddr*)&server_address, sizeof(server_address));
+
+    int bytes_received = recvfrom(sock, buffer, MAX_BUFFER_SIZE - 1, 0, NULL, NULL);
+    if (bytes_received >= 0) {
+        buffer[bytes_received] = '\0';
+        printf("Current date and time: %s\n", buffer);
+    } else {
+        fprintf(stderr, "Receive failed: %d\n", WSAGetLastError());
+    }
+    closesocket(sock);
+    return bytes_received >= 0 ? 0 : 1;
+}
 
 int main(int argc, char *argv[]) {
     WSADATA wsaData;
     SOCKET client_socket;
-    struct sockaddr_in server_address;
     char buffer[MAX_BUFFER_SIZE];
     int bytes_received;
     const char* server_ip;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
+    if (argc < 2 || (argc >= 3 && _stricmp(argv[2], "udp") != 0 && _stricmp(argv[2], "bench") != 0 &&
+                     _stricmp(argv[2], "offset") != 0)) {
+        fprintf(stderr, "Usage: %s <server_ip> [udp | bench [seconds] [connections] | offset [probes] [interval_ms]]\n", argv[0]);
         return 1;
     }
 
@@ -27,6 +239,31 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(PORT);
+    server_address.sin_addr.s_addr = inet_addr(server_ip);
+
+    if (argc >= 3) {
+        int result;
+        if (_stricmp(argv[2], "udp") == 0) {
+            result = query_udp();
+        } else if (_stricmp(argv[2], "offset") == 0) {
+            int count = argc >= 4 ? atoi(argv[3]) : 100;
+            int interval_ms = argc >= 5 ? atoi(argv[4]) : 10;
+            if (count <= 0 || count > OFFSET_MAX_PROBES) count = 100;
+            if (interval_ms < 0) interval_ms = 10;
+            result = measure_offset(count, interval_ms);
+        } else {
+            int seconds = argc >= 4 ? atoi(argv[3]) : 10;
+            int threads = argc >= 5 ? atoi(argv[4]) : 8;
+            if (seconds <= 0) seconds = 10;
+            if (threads <= 0 || threads > BENCH_MAX_THREADS) threads = 8;
+            result = run_benchmark(seconds, threads);
+        }
+        WSACleanup();
+        return result;
+    }
+
     client_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (client_socket == INVALID_SOCKET) {
         fprintf(stderr, "Socket creation failed: %d\n", WSAGetLastError());
@@ -34,10 +271,6 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT);
-    server_address.sin_addr.s_addr = inet_addr(server_ip);
-
     if (connect(client_socket, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
         fprintf(stderr, "Connect failed: %d\n", WSAGetLastError());
         closesocket(client_socket);
@@ -1,20 +1,77 @@
 // Server (daytime_server.c)
 #include <stdio.h>
 #include <winsock2.h>
+#include <windows.h>
 #include <time.h>
+#include <string.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
 #define PORT 13
 #define MAX_BUFFER_SIZE 256
+#define ACCEPT_BATCH 64 // Connections accepted per wake-up before checking the UDP socket again
+#define STATS_INTERVAL_SECONDS 10 // Print request counters this often
 
-int main() {
+// --- Time-offset probes ---
+// A UDP datagram of exactly TIME_PROBE_SIZE bytes starting with TIME_PROBE_MAGIC is a binary probe
+// (all fields big-endian): magic(4) seq(4) client_tx_ns(8). The reply is TIME_REPLY_SIZE bytes:
+// magic(4) seq(4) client_tx_ns(8) server_rx_ns(8) server_tx_ns(8), nanoseconds since 1970-01-01 UTC.
+#define TIME_PROBE_MAGIC 0x544F4653U // "TOFS"
+#define TIME_PROBE_SIZE 16
+#define TIME_REPLY_SIZE 32
+
+// The response is formatted at most once per second and shared by every TCP and UDP request
+char cached_response[MAX_BUFFER_SIZE];
+int cached_response_len = 0;
+time_t cached_second = -1;
+int format_per_request = 0; // "percall" mode: format for every request (to benchmark the cache)
+
+// Wall-clock time in nanoseconds since the Unix epoch (100 ns resolution from the precise system clock)
+unsigned long long now_ns(void) {
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    unsigned long long ticks = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (ticks - 116444736000000000ULL) * 100; // FILETIME counts 100 ns intervals since 1601
+}
+
+void put_u64(unsigned char* p, unsigned long long v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = (unsigned char)v;
+}
+
+unsigned int get_u32(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+// Refresh the cached response if the second has changed. Returns 0 on a clock error.
+int refresh_cached_response(void) {
+    time_t current_time = time(NULL);
+    if (current_time == -1) {
+        fprintf(stderr, "Time error.\n");
+        return 0;
+    }
+    if (current_time != cached_second || format_per_request) {
+        cached_response_len = (int)strftime(cached_response, sizeof(cached_response), "%Y-%m-%d %H:%M:%S %Z", localtime(&current_time));
+        cached_second = current_time;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
     WSADATA wsaData;
-    SOCKET server_socket, client_socket;
+    SOCKET server_socket, client_socket, udp_socket;
     struct sockaddr_in server_address, client_address;
     int client_address_len = sizeof(client_address);
     char buffer[MAX_BUFFER_SIZE];
-    time_t current_time;
+    u_long non_blocking = 1;
+    long long tcp_served = 0, udp_served = 0, probes_served = 0;
+    time_t stats_since;
+
+    if (argc > 1 && _stricmp(argv[1], "percall") == 0) {
+        format_per_request = 1;
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [percall]\n", argv[0]);
+        return 1;
+    }
 
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         fprintf(stderr, "WSAStartup failed: %d\n", WSAGetLastError());
@@ -22,8 +79,10 @@ int main() {
     }
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == INVALID_SOCKET) {
+    udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_socket == INVALID_SOCKET || udp_socket == INVALID_SOCKET) {
         fprintf(stderr, "Socket creation failed: %d\n", WSAGetLastError());
+        if (server_socket != INVALID_SOCKET) closesocket(server_socket);
         WSACleanup();
         return 1;
     }
@@ -32,46 +91,102 @@ int main() {
     server_address.sin_addr.s_addr = INADDR_ANY;
     server_address.sin_port = htons(PORT);
 
-    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
+    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR ||
+        bind(udp_socket, (struct sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
         fprintf(stderr, "Bind failed: %d\n", WSAGetLastError());
         closesocket(server_socket);
+        closesocket(udp_socket);
         WSACleanup();
         return 1;
     }
 
-    if (listen(server_socket, 1) == SOCKET_ERROR) {
+    // A deep backlog absorbs bursts of probes; each connection is answered and closed at once
+    if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
         fprintf(stderr, "Listen failed: %d\n", WSAGetLastError());
         closesocket(server_socket);
+        closesocket(udp_socket);
         WSACleanup();
         return 1;
     }
 
-    printf("Server listening on port %d...\n", PORT);
+    // Both sockets are drained until they would block, so one select wake-up serves many requests
+    ioctlsocket(server_socket, FIONBIO, &non_blocking);
+    ioctlsocket(udp_socket, FIONBIO, &non_blocking);
 
-    client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_address_len);
-    if (client_socket == INVALID_SOCKET) {
-        fprintf(stderr, "Accept failed: %d\n", WSAGetLastError());
-        closesocket(server_socket);
-        WSACleanup();
-        return 1;
-    }
+    printf("Server listening on port %d (TCP and UDP)%s...\n", PORT, format_per_request ? ", formatting per request" : "");
+    stats_since = time(NULL);
 
-    printf("Client connected.\n");
+    while (1) {
+        fd_set read_set;
+        struct timeval timeout = { 1, 0 };
+        FD_ZERO(&read_set);
+        FD_SET(server_socket, &read_set);
+        FD_SET(udp_socket, &read_set);
 
-    current_time = time(NULL);
-    if (current_time == -1) {
-        fprintf(stderr, "Time error.\n");
-        closesocket(client_socket);
-        closesocket(server_socket);
-        WSACleanup();
-        return 1;
-    }
+        int ready = select(0, &read_set, NULL, NULL, &timeout);
+        if (ready == SOCKET_ERROR) {
+            fprintf(stderr, "Select failed: %d\n", WSAGetLastError());
+            break;
+        }
 
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S %Z", localtime(&current_time));
-    send(client_socket, buffer, (int)strlen(buffer), 0);
+        if (FD_ISSET(server_socket, &read_set)) {
+            // TCP (RFC 867): one write of the cached string, then close
+            for (int n = 0; n < ACCEPT_BATCH; n++) {
+                client_address_len = sizeof(client_address);
+                client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_address_len);
+                if (client_socket == INVALID_SOCKET) {
+                    if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                        fprintf(stderr, "Accept failed: %d\n", WSAGetLastError());
+                    }
+                    break;
+                }
+                if (refresh_cached_response()) {
+                    send(client_socket, cached_response, cached_response_len, 0);
+                    tcp_served++;
+                }
+                closesocket(client_socket);
+            }
+        }
+
+        if (FD_ISSET(udp_socket, &read_set)) {
+            // UDP (RFC 867): any datagram is answered with the cached string
+            while (1) {
+                client_address_len = sizeof(client_address);
+                int received = recvfrom(udp_socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&client_address, &client_address_len);
+                unsigned long long rx_ns = now_ns(); // As close to the arrival as user space gets
+                if (received == SOCKET_ERROR) {
+                    int error = WSAGetLastError();
+                    if (error == WSAECONNRESET || error == WSAEMSGSIZE) continue; // One bad peer must not stall the loop
+                    break; // WSAEWOULDBLOCK: drained
+                }
+                if (received == TIME_PROBE_SIZE && get_u32((unsigned char*)buffer) == TIME_PROBE_MAGIC) {
+                    // Binary probe: echo magic, seq and the client's timestamp, add ours
+                    unsigned char *reply = (unsigned char*)buffer;
+                    put_u64(reply + 16, rx_ns);
+                    put_u64(reply + 24, now_ns()); // Taken last, right before the send
+                    sendto(udp_socket, buffer, TIME_REPLY_SIZE, 0, (struct sockaddr*)&client_address, client_address_len);
+                    probes_served++;
+                } else if (refresh_cached_response()) {
+                    sendto(udp_socket, cached_response, cached_response_len, 0, (struct sockaddr*)&client_address, client_address_len);
+                    udp_served++;
+                }
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now - stats_since >= STATS_INTERVAL_SECONDS) {
+            if (tcp_served || udp_served || probes_served) {
+                printf("Served %lld TCP, %lld UDP and %lld time-offset requests in %d s (%.0f requests/s).\n",
+                       tcp_served, udp_served, probes_served, (int)(now - stats_since),
+                       (double)(tcp_served + udp_served + probes_served) / (double)(now - stats_since));
+            }
+            tcp_served = udp_served = probes_served = 0;
+            stats_since = now;
+        }
+    }
 
-    closesocket(client_socket);
     closesocket(server_socket);
+    closesocket(udp_socket);
     WSACleanup();
 
     printf("Server finished.\n");
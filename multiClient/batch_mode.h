@@ -0,0 +1,177 @@
+// batch_mode.h
+// Batch mode (--batch) shared by the chat clients (multiClient and multiclientUdp).
+//
+// Commands come from a script and every received event becomes one record per line on stdout,
+// "<ms since start>\t<type>\t<text>" with \\, \t, \n and \r escaped; prompts and errors go to stderr.
+// Messages a script sends to its own ID are timed until their delivery back, and the summary at exit
+// reports those round trips along with what was sent and received.
+//
+// Header-only (static functions), like compress_codec.h, so each client still builds from its own
+// source file. Only one thread receives, so the counters and latency samples it updates take no lock;
+// the pending self-message send times are shared with the sending thread and guarded by self_cs.
+#ifndef BATCH_MODE_H
+#define BATCH_MODE_H
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h> // For qsort, realloc, atoi
+#include <string.h>
+
+#define BATCH_LINGER_MS 1000 // Exit once nothing has arrived for this long after the script ends
+#define BATCH_OUTPUT_BUFFER (64 * 1024) // stdout is fully buffered and flushed at exit
+#define SELF_PENDING_MAX 65536 // Messages to ourselves awaiting their delivery (latency samples)
+
+static int batch_mode = 0;
+static LARGE_INTEGER batch_start, perf_frequency;
+static HANDLE activity_event = NULL; // Set whenever something arrives, so the end of the replies can be detected
+static long long commands_sent = 0; // Sending thread only
+static long long received_msg = 0, received_info = 0, received_error = 0, received_other = 0; // Receiving thread only
+// Send times of messages addressed to our own ID: their delivery back to us gives the round-trip latency.
+// A delivery is matched to the oldest send, so a lost message shows up in the summary, not as a bad sample.
+static CRITICAL_SECTION self_cs;
+static LONGLONG self_sent_at[SELF_PENDING_MAX];
+static int self_head = 0, self_count = 0;
+static double *latency_ms = NULL; // Receiving thread only
+static int latency_count = 0, latency_capacity = 0;
+
+// Enter batch mode: called once from main before any thread starts
+static void batch_init(void) {
+    batch_mode = 1;
+    setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    InitializeCriticalSection(&self_cs);
+    activity_event = CreateEvent(NULL, FALSE, FALSE, NULL); // Auto-reset
+    QueryPerformanceFrequency(&perf_frequency);
+    QueryPerformanceCounter(&batch_start);
+}
+
+static double batch_elapsed_ms(LONGLONG since, LONGLONG until) {
+    return (double)(until - since) * 1000.0 / (double)perf_frequency.QuadPart;
+}
+
+// Read the next script command into command (size bytes), with "$ME" replaced by my_id. Blank lines and
+// "#" comments are skipped and "SLEEP <ms>" pauses. Returns 0 at the end of the script.
+static int batch_next_command(FILE *script, char *line, char *command, int size, int my_id) {
+    char my_id_text[16];
+
+    sprintf(my_id_text, "%d", my_id);
+    while (fgets(line, size, script) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (_strnicmp(line, "SLEEP ", 6) == 0) {
+            Sleep((DWORD)atoi(line + 6));
+            continue;
+        }
+        int n = 0;
+        for (const char *p = line; *p && n < size - 16; ) {
+            if (strncmp(p, "$ME", 3) == 0) {
+                n += sprintf(command + n, "%s", my_id_text);
+                p += 3;
+            } else {
+                command[n++] = *p++;
+            }
+        }
+        command[n] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+// After the last command: close the script, then wait while replies keep arriving (until the stream has
+// been quiet for BATCH_LINGER_MS or *running drops)
+static void batch_finish(FILE *script, volatile int *running) {
+    if (script != stdin) fclose(script);
+    while (*running && WaitForSingleObject(activity_event, BATCH_LINGER_MS) == WAIT_OBJECT_0) {
+    }
+}
+
+// One record per received event: "<ms since start>\t<type>\t<text>"
+static void batch_output(const char *type, const char *text) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    printf("%.3f\t%s\t", batch_elapsed_ms(batch_start.QuadPart, now.QuadPart), type);
+    for (const char *p = text; *p; p++) {
+        switch (*p) {
+            case '\\': fputs("\\\\", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            case '\r': fputs("\\r", stdout); break;
+            default: putchar(*p); break;
+        }
+    }
+    putchar('\n');
+    SetEvent(activity_event);
+}
+
+// A message to our own ID is about to go out at sent_at (take it before sending, so the delivery can
+// never be seen first)
+static void record_self_send(LONGLONG sent_at) {
+    EnterCriticalSection(&self_cs);
+    if (self_count < SELF_PENDING_MAX) {
+        self_sent_at[(self_head + self_count++) % SELF_PENDING_MAX] = sent_at;
+    }
+    LeaveCriticalSection(&self_cs);
+}
+
+// A "MSG <my_id>: ..." delivery ends the oldest pending self-message round trip
+static void record_self_delivery(const char *text, int my_id) {
+    char prefix[32];
+    LARGE_INTEGER now;
+    LONGLONG sent_at = 0;
+    int found = 0;
+
+    sprintf(prefix, "MSG %d: ", my_id);
+    if (strncmp(text, prefix, strlen(prefix)) != 0) return;
+    QueryPerformanceCounter(&now);
+    EnterCriticalSection(&self_cs);
+    if (self_count > 0) {
+        sent_at = self_sent_at[self_head];
+        self_head = (self_head + 1) % SELF_PENDING_MAX;
+        self_count--;
+        found = 1;
+    }
+    LeaveCriticalSection(&self_cs);
+    if (!found) return;
+
+    if (latency_count == latency_capacity) {
+        int capacity = latency_capacity ? latency_capacity * 2 : 1024;
+        double *grown = (double*)realloc(latency_ms, capacity * sizeof(double));
+        if (grown == NULL) return;
+        latency_ms = grown;
+        latency_capacity = capacity;
+    }
+    latency_ms[latency_count++] = batch_elapsed_ms(sent_at, now.QuadPart);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// The summary goes to stderr after every record has been flushed; a client can add its own lines after it
+static void print_batch_summary(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    double seconds = batch_elapsed_ms(batch_start.QuadPart, now.QuadPart) / 1000.0;
+
+    fflush(stdout); // Every record before the summary
+    fprintf(stderr, "\n--- Batch Summary ---\n");
+    fprintf(stderr, "Elapsed: %.3f s\n", seconds);
+    fprintf(stderr, "Commands sent: %lld (%.0f/s)\n", commands_sent, seconds > 0.0 ? commands_sent / seconds : 0.0);
+    fprintf(stderr, "Received: %lld MSG, %lld INFO, %lld ERROR, %lld other\n",
+            received_msg, received_info, received_error, received_other);
+    if (latency_count > 0) {
+        double sum = 0.0;
+        qsort(latency_ms, latency_count, sizeof(double), compare_doubles);
+        for (int i = 0; i < latency_count; i++) sum += latency_ms[i];
+        fprintf(stderr, "Self-message latency (%d samples): min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                latency_count, latency_ms[0], sum / latency_count, latency_ms[latency_count / 2],
+                latency_ms[(int)(latency_count * 0.99)], latency_ms[latency_count - 1]);
+    } else {
+        fprintf(stderr, "Self-message latency: no samples (send to $ME to measure)\n");
+    }
+    if (self_count > 0) fprintf(stderr, "Messages to ourselves never delivered: %d\n", self_count);
+    free(latency_ms);
+    latency_ms = NULL;
+}
+
+#endif
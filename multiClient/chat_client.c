@@ -0,0 +1,1018 @@
+// chat_client.c
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "chat_client.h"
+#include "compress_codec.h"
+#include <stdio.h>
+#include <mswsock.h> // For ConnectEx and TransmitFile
+#include <string.h> // For memchr, memcpy, strncmp
+#include <stdlib.h> // For calloc, free, _atoi64
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 15 // ws2ipdef.h (Windows 10 1607+); older SDKs lack it
+#endif
+
+#define RECV_BUFFER_SIZE 2048 // Bytes per receive (one server message usually arrives in one receive)
+#define COMPLETION_BATCH 64 // Completions dequeued per wake-up
+#define SEND_GATHER_MAX 64 // Queued commands handed to one WSASend
+#define RESUME_TOKEN_LEN 32 // Length of the resume token sent with our ID
+#define RESUME_ATTEMPTS 6 // Reconnect attempts after a dropped connection (server holds our ID for 30 s)
+#define RESUME_RETRY_DELAY_MS 500 // Back-off step between reconnect attempts
+#define FILE_MARKER '\x01' // Starts a file frame in the server's stream (every frame marker follows a newline)
+#define FILE_READY_TIMEOUT_MS 10000 // How long to wait for the server to accept a SENDFILE
+#define FILE_TRANSMIT_CHUNK (1024LL * 1024 * 1024) // Bytes per TransmitFile call (limit is just under 2 GB)
+#define FILE_LINE_MAX 512 // Longest control line inside a file frame
+#define SESSION_MARKER '\x03' // Starts a tagged frame for virtual sessions: "\n\x03@<tags> <len>\n<payload>"
+#define TAG_LINE_MAX 1024 // Longest tagged frame header
+#define TAG_IDS_MAX 128 // IDs one tagged frame may list (the server sends one, or "*")
+#define MAX_MESSAGE_SIZE (1024 * 1024) // Largest message a compressed frame may expand to
+
+// Completion keys that are not sessions
+#define SUBMIT_KEY ((ULONG_PTR)1) // A request queued by a chat_* call on any thread
+#define WAKE_KEY ((ULONG_PTR)2) // chat_loop_wake
+
+// --- Types ---
+typedef enum { OP_START, OP_CONNECT, OP_RECV, OP_SEND, OP_TRANSMIT, OP_CLOSE } OpKind;
+
+// One overlapped operation or queued request. Sends carry their bytes in data.
+typedef struct ChatOp {
+    OVERLAPPED overlapped; // Must be first: completions hand back this pointer
+    OpKind kind;
+    ChatSession *session;
+    struct ChatOp *next; // Send queue link
+    HANDLE file; // SENDFILE command: file to stream once accepted; OP_TRANSMIT: file being streamed
+    long long file_size, file_sent;
+    int len;
+    char data[1];
+} ChatOp;
+
+typedef enum { STATE_CONNECTING, STATE_RESUMING, STATE_OPEN, STATE_WAITING, STATE_CLOSED } SessionState;
+
+struct ChatSession {
+    ChatLoop *loop;
+    ChatSession *next; // Loop's session list
+    ChatCallbacks callbacks;
+    void *user;
+    struct sockaddr_in addr; // Kept for reconnects
+    SOCKET sock;
+    SessionState state;
+    int closing; // chat_close reached the front of the send queue
+    int pending_io; // Overlapped operations still owned by the kernel
+    volatile LONG submitted; // Requests posted to the loop but not yet handled
+    volatile int id; // Client ID assigned by the server
+    char token[RESUME_TOKEN_LEN + 1]; // Lets us reclaim our ID after a dropped connection
+    int relogin_id; // ID a refused RESUME left behind; LOGIN takes it back (-1 if none)
+    char relogin_token[RESUME_TOKEN_LEN + 1];
+    unsigned long long stream_bytes; // Bytes received in this session (resume position)
+    int attempt; // Reconnect attempt in progress, 0 while connected
+    ULONGLONG retry_at; // When the next reconnect starts (STATE_WAITING)
+
+    ChatOp connect_op, recv_op;
+    char recv_buffer[RECV_BUFFER_SIZE + 1]; // +1 so received text can be terminated in place
+    char reply_line[128]; // "RESUMED ..." or "ERROR ..." after a RESUME request
+    int reply_len;
+
+    // Sends go out one at a time, in request order. A SENDFILE command holds the rest of the queue
+    // until the server answers, since the file's bytes must follow it directly.
+    ChatOp *send_head, *send_tail;
+    int send_in_flight, sends_held;
+    HANDLE out_file; // Announced with SENDFILE, waiting for FILEREADY
+    long long out_size;
+    ULONGLONG out_deadline;
+    LARGE_INTEGER out_start;
+
+    // A frame may start next: the stream so far ends with a newline or a frame (resumes keep it)
+    int at_line_start;
+
+    // Incoming file frame
+    int in_file_mode;
+    long long in_size, in_received, chunk_remaining;
+    char file_line[FILE_LINE_MAX];
+    int file_line_len;
+
+    // Compressed frame being received
+    int in_compressed_frame;
+    char frame_line[64];
+    int frame_line_len;
+    int frame_raw_len, frame_len, frame_have;
+    unsigned char *frame_data;
+
+    // Tagged frame (virtual sessions) being received
+    int in_tagged_frame;
+    char tag_line[TAG_LINE_MAX];
+    int tag_line_len;
+    int tag_len, tag_have;
+    char *tag_data;
+};
+
+struct ChatLoop {
+    HANDLE port; // Completion port for every session's socket and for submitted requests
+    ChatSession *sessions; // Only touched by the loop thread
+    volatile LONG open_sessions; // Sessions not yet freed (including ones still being submitted)
+    LPFN_CONNECTEX connect_ex;
+};
+
+// --- Function Prototypes ---
+static void start_connect(ChatSession *s);
+static void connection_lost(ChatSession *s);
+static void pump_sends(ChatSession *s);
+static void consume_stream(ChatSession *s, char *data, int len);
+static void handle_server_message(ChatSession *s, const char *text);
+
+// --- Requests (any thread) ---
+
+static ChatOp *new_op(OpKind kind, int len) {
+    ChatOp *op = (ChatOp*)calloc(1, sizeof(ChatOp) + len);
+    if (op != NULL) {
+        op->kind = kind;
+        op->file = INVALID_HANDLE_VALUE;
+        op->len = len;
+    }
+    return op;
+}
+
+static void free_op(ChatOp *op) {
+    if (op->file != INVALID_HANDLE_VALUE) CloseHandle(op->file);
+    free(op);
+}
+
+// Free a send and the commands gathered behind it
+static void free_send_chain(ChatOp *op) {
+    while (op != NULL) {
+        ChatOp *next = op->next;
+        free_op(op);
+        op = next;
+    }
+}
+
+// Hand a request to the loop thread
+static int submit(ChatSession *s, ChatOp *op) {
+    op->session = s;
+    InterlockedIncrement(&s->submitted);
+    if (!PostQueuedCompletionStatus(s->loop->port, 0, SUBMIT_KEY, &op->overlapped)) {
+        InterlockedDecrement(&s->submitted);
+        free_op(op);
+        return 0;
+    }
+    return 1;
+}
+
+// Commands are newline-terminated on the wire, so the server can split pipelined ones apart
+static int submit_text(ChatSession *s, const char *text, int len) {
+    ChatOp *op = new_op(OP_SEND, len + 1);
+    if (op == NULL) return 0;
+    memcpy(op->data, text, len);
+    op->data[len] = '\n';
+    return submit(s, op);
+}
+
+ChatLoop *chat_loop_create(void) {
+    ChatLoop *loop = (ChatLoop*)calloc(1, sizeof(ChatLoop));
+    if (loop == NULL) return NULL;
+    // One thread runs the loop, so only one needs to be released at a time
+    loop->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (loop->port == NULL) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void chat_loop_wake(ChatLoop *loop) {
+    PostQueuedCompletionStatus(loop->port, 0, WAKE_KEY, NULL);
+}
+
+void chat_loop_destroy(ChatLoop *loop) {
+    CloseHandle(loop->port);
+    free(loop);
+}
+
+ChatSession *chat_connect(ChatLoop *loop, const char *ip, int port, const ChatCallbacks *callbacks, void *user) {
+    unsigned long address = inet_addr(ip);
+    if (address == INADDR_NONE && strcmp(ip, "255.255.255.255") != 0) return NULL;
+
+    ChatSession *s = (ChatSession*)calloc(1, sizeof(ChatSession));
+    ChatOp *op = new_op(OP_START, 0);
+    if (s == NULL || op == NULL) {
+        free(s);
+        free(op);
+        return NULL;
+    }
+    s->loop = loop;
+    if (callbacks != NULL) s->callbacks = *callbacks;
+    s->user = user;
+    s->addr.sin_family = AF_INET;
+    s->addr.sin_port = htons((u_short)port);
+    s->addr.sin_addr.s_addr = address;
+    s->sock = INVALID_SOCKET;
+    s->id = -1;
+    s->relogin_id = -1;
+    s->at_line_start = 1;
+    s->out_file = INVALID_HANDLE_VALUE;
+
+    InterlockedIncrement(&loop->open_sessions);
+    if (!submit(s, op)) {
+        InterlockedDecrement(&loop->open_sessions);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+int chat_send_to(ChatSession *session, int target_id, const char *message) {
+    size_t message_len = strlen(message);
+    ChatOp *op = new_op(OP_SEND, (int)message_len + 32);
+    if (op == NULL) return 0;
+    op->len = sprintf(op->data, "SEND %d ", target_id);
+    memcpy(op->data + op->len, message, message_len);
+    op->len += (int)message_len;
+    op->data[op->len++] = '\n';
+    return submit(session, op);
+}
+
+int chat_send_command(ChatSession *session, const char *command) {
+    return submit_text(session, command, (int)strlen(command));
+}
+
+int chat_open_virtual(ChatSession *session, int count) {
+    char command[32];
+    return submit_text(session, command, sprintf(command, "VOPEN %d", count));
+}
+
+int chat_send_as(ChatSession *session, int virtual_id, int target_id, const char *message) {
+    size_t message_len = strlen(message);
+    ChatOp *op = new_op(OP_SEND, (int)message_len + 48);
+    if (op == NULL) return 0;
+    op->len = sprintf(op->data, "@%d SEND %d ", virtual_id, target_id);
+    memcpy(op->data + op->len, message, message_len);
+    op->len += (int)message_len;
+    op->data[op->len++] = '\n';
+    return submit(session, op);
+}
+
+int chat_close_virtual(ChatSession *session, int virtual_id) {
+    char command[32];
+    return submit_text(session, command, sprintf(command, "@%d CLOSE", virtual_id));
+}
+
+int chat_send_file(ChatSession *session, int target_id, const char *path) {
+    LARGE_INTEGER size;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return 0;
+    }
+
+    ChatOp *op = new_op(OP_SEND, MAX_PATH + 64);
+    if (op == NULL) {
+        CloseHandle(file);
+        return 0;
+    }
+    // Only the base name travels; spaces would split the server's command parsing
+    const char *name = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '\\' || *p == '/' || *p == ':') name = p + 1;
+    }
+    int n = sprintf(op->data, "SENDFILE %d %lld ", target_id, size.QuadPart);
+    for (const char *p = name; *p && n < MAX_PATH + 62; p++) {
+        op->data[n++] = (*p == ' ') ? '_' : *p;
+    }
+    op->data[n++] = '\n';
+    op->len = n;
+    op->file = file;
+    op->file_size = size.QuadPart;
+    return submit(session, op);
+}
+
+void chat_close(ChatSession *session) {
+    ChatOp *op = new_op(OP_CLOSE, 0);
+    if (op != NULL) submit(session, op);
+}
+
+void *chat_user(ChatSession *session) {
+    return session->user;
+}
+
+int chat_id(ChatSession *session) {
+    return session->id;
+}
+
+const char *chat_token(ChatSession *session) {
+    return session->token;
+}
+
+// --- Sending (loop thread) ---
+
+static void queue_send(ChatSession *s, ChatOp *op, int front) {
+    if (front) {
+        op->next = s->send_head;
+        s->send_head = op;
+        if (s->send_tail == NULL) s->send_tail = op;
+    } else {
+        op->next = NULL;
+        if (s->send_tail != NULL) s->send_tail->next = op; else s->send_head = op;
+        s->send_tail = op;
+    }
+}
+
+static int issue_send(ChatSession *s, ChatOp *op) {
+    memset(&op->overlapped, 0, sizeof(op->overlapped));
+    if (op->kind == OP_TRANSMIT) {
+        // The file's bytes go from the file cache to the socket without passing through our buffers
+        long long chunk = op->file_size - op->file_sent;
+        if (chunk > FILE_TRANSMIT_CHUNK) chunk = FILE_TRANSMIT_CHUNK;
+        op->len = (int)chunk;
+        op->overlapped.Offset = (DWORD)op->file_sent;
+        op->overlapped.OffsetHigh = (DWORD)(op->file_sent >> 32);
+        if (!TransmitFile(s->sock, op->file, (DWORD)chunk, 0, &op->overlapped, NULL, 0) &&
+            WSAGetLastError() != WSA_IO_PENDING) {
+            return 0;
+        }
+    } else {
+        // op->next chains the commands gathered into this send
+        WSABUF bufs[SEND_GATHER_MAX];
+        DWORD count = 0;
+        for (ChatOp *o = op; o != NULL && count < SEND_GATHER_MAX; o = o->next, count++) {
+            bufs[count].buf = o->data;
+            bufs[count].len = o->len;
+        }
+        if (WSASend(s->sock, bufs, count, NULL, 0, &op->overlapped, NULL) == SOCKET_ERROR &&
+            WSAGetLastError() != WSA_IO_PENDING) {
+            return 0;
+        }
+    }
+    s->send_in_flight = 1;
+    s->pending_io++;
+    return 1;
+}
+
+static void release_sends(ChatSession *s) {
+    s->sends_held = 0;
+    pump_sends(s);
+}
+
+// Report an announced file that will not be sent (refused, timed out or the connection dropped)
+static void fail_outgoing_file(ChatSession *s) {
+    if (s->out_file == INVALID_HANDLE_VALUE) return;
+    CloseHandle(s->out_file);
+    s->out_file = INVALID_HANDLE_VALUE;
+    if (s->callbacks.on_file_sent) s->callbacks.on_file_sent(s, 0, 0.0, 1);
+}
+
+static void pump_sends(ChatSession *s) {
+    while (s->state == STATE_OPEN && !s->send_in_flight && !s->sends_held && s->send_head != NULL) {
+        ChatOp *op = s->send_head;
+        s->send_head = op->next;
+        if (s->send_head == NULL) s->send_tail = NULL;
+        op->next = NULL;
+
+        if (op->kind == OP_CLOSE) {
+            // Everything requested before the close has been sent
+            free_op(op);
+            s->closing = 1;
+            shutdown(s->sock, SD_BOTH);
+            connection_lost(s);
+            return;
+        }
+        if (op->kind == OP_SEND && op->file != INVALID_HANDLE_VALUE) {
+            // SENDFILE: nothing else may be sent until the server answers
+            s->out_file = op->file;
+            s->out_size = op->file_size;
+            s->out_deadline = GetTickCount64() + FILE_READY_TIMEOUT_MS;
+            s->sends_held = 1;
+            op->file = INVALID_HANDLE_VALUE;
+        } else if (op->kind == OP_SEND) {
+            // Pipelined commands leave together: gather the plain sends queued behind this one
+            ChatOp *last = op;
+            for (int n = 1; n < SEND_GATHER_MAX && s->send_head != NULL && s->send_head->kind == OP_SEND &&
+                            s->send_head->file == INVALID_HANDLE_VALUE; n++) {
+                last->next = s->send_head;
+                last = s->send_head;
+                s->send_head = last->next;
+                last->next = NULL;
+            }
+        }
+        if (s->send_head == NULL) s->send_tail = NULL;
+        if (!issue_send(s, op)) {
+            free_send_chain(op);
+            connection_lost(s);
+            return;
+        }
+    }
+}
+
+// FILEREADY <size>: stream the announced file ahead of anything queued after it
+static void file_ready(ChatSession *s, long long size) {
+    if (s->out_file == INVALID_HANDLE_VALUE) return;
+    ChatOp *op = new_op(OP_TRANSMIT, 0);
+    if (op == NULL || size != s->out_size) {
+        free(op);
+        fail_outgoing_file(s);
+        release_sends(s);
+        return;
+    }
+    op->file = s->out_file;
+    op->file_size = s->out_size;
+    s->out_file = INVALID_HANDLE_VALUE;
+    QueryPerformanceCounter(&s->out_start);
+    queue_send(s, op, 1);
+    release_sends(s);
+}
+
+static void send_done(ChatSession *s, ChatOp *op, int failed) {
+    s->pending_io--;
+    s->send_in_flight = 0;
+    int stale = s->sock == INVALID_SOCKET;
+
+    if (op->kind == OP_TRANSMIT) {
+        if (!failed && !stale) op->file_sent += op->len;
+        if (!failed && !stale && op->file_sent < op->file_size) {
+            if (issue_send(s, op)) return;
+            failed = 1;
+        }
+        LARGE_INTEGER end, frequency;
+        QueryPerformanceCounter(&end);
+        QueryPerformanceFrequency(&frequency);
+        double seconds = (double)(end.QuadPart - s->out_start.QuadPart) / (double)frequency.QuadPart;
+        if (s->callbacks.on_file_sent && s->state != STATE_CLOSED) {
+            s->callbacks.on_file_sent(s, op->file_sent, seconds, op->file_sent < op->file_size);
+        }
+    }
+    free_send_chain(op);
+    if (stale) return;
+    if (failed) {
+        connection_lost(s);
+        return;
+    }
+    pump_sends(s);
+}
+
+// --- Connection (loop thread) ---
+
+static int post_receive(ChatSession *s) {
+    WSABUF buf;
+    DWORD flags = 0;
+    buf.buf = s->recv_buffer;
+    buf.len = RECV_BUFFER_SIZE;
+    memset(&s->recv_op.overlapped, 0, sizeof(s->recv_op.overlapped));
+    s->recv_op.kind = OP_RECV;
+    if (WSARecv(s->sock, &buf, 1, NULL, &flags, &s->recv_op.overlapped, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        return 0;
+    }
+    s->pending_io++;
+    return 1;
+}
+
+static void start_connect(ChatSession *s) {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET; // ConnectEx needs a bound socket
+
+    s->state = STATE_CONNECTING;
+    s->sock = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (s->sock == INVALID_SOCKET || bind(s->sock, (struct sockaddr*)&local, sizeof(local)) == SOCKET_ERROR ||
+        CreateIoCompletionPort((HANDLE)s->sock, s->loop->port, (ULONG_PTR)s, 0) == NULL) {
+        connection_lost(s);
+        return;
+    }
+    if (s->loop->connect_ex == NULL) {
+        GUID guid = WSAID_CONNECTEX;
+        DWORD returned = 0;
+        WSAIoctl(s->sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+                 &s->loop->connect_ex, sizeof(s->loop->connect_ex), &returned, NULL, NULL);
+    }
+    // A new session announces itself with the connect, so the server skips its RESUME wait; with a
+    // cached Fast Open cookie the HELLO rides in the SYN. Reconnects send RESUME once connected instead.
+    static const char hello[] = "HELLO\n";
+    int fresh = s->token[0] == '\0';
+    if (fresh) {
+        DWORD fast_open = 1;
+        setsockopt(s->sock, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&fast_open, sizeof(fast_open)); // Best effort
+    }
+    memset(&s->connect_op.overlapped, 0, sizeof(s->connect_op.overlapped));
+    s->connect_op.kind = OP_CONNECT;
+    if (s->loop->connect_ex == NULL ||
+        (!s->loop->connect_ex(s->sock, (struct sockaddr*)&s->addr, sizeof(s->addr), fresh ? (PVOID)hello : NULL,
+                              fresh ? (DWORD)(sizeof(hello) - 1) : 0, NULL, &s->connect_op.overlapped) &&
+         WSAGetLastError() != ERROR_IO_PENDING)) {
+        connection_lost(s);
+        return;
+    }
+    s->pending_io++;
+}
+
+static void connect_done(ChatSession *s, int failed) {
+    s->pending_io--;
+    if (s->sock == INVALID_SOCKET) return;
+    if (failed) {
+        connection_lost(s);
+        return;
+    }
+    setsockopt(s->sock, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+
+    if (s->token[0] != '\0') {
+        // Reconnect: "RESUME <token> <bytes-received>", answered by one line and then the bytes we missed
+        char request[64 + RESUME_TOKEN_LEN];
+        int n = sprintf(request, "RESUME %s %llu\n", s->token, s->stream_bytes);
+        ChatOp *op = new_op(OP_SEND, n);
+        s->state = STATE_RESUMING;
+        s->reply_len = 0;
+        if (op == NULL) {
+            connection_lost(s);
+            return;
+        }
+        memcpy(op->data, request, n);
+        if (!issue_send(s, op)) {
+            free_op(op);
+            connection_lost(s);
+            return;
+        }
+    } else {
+        s->state = STATE_OPEN;
+    }
+    if (!post_receive(s)) {
+        connection_lost(s);
+        return;
+    }
+    pump_sends(s);
+}
+
+static void end_incoming_file(ChatSession *s, int complete, const char *reason) {
+    s->in_file_mode = 0;
+    s->chunk_remaining = 0;
+    if (s->callbacks.on_file_end) s->callbacks.on_file_end(s, complete, reason);
+}
+
+static void reset_compressed_frame(ChatSession *s) {
+    free(s->frame_data);
+    s->frame_data = NULL;
+    s->in_compressed_frame = 0;
+}
+
+static void reset_tagged_frame(ChatSession *s) {
+    free(s->tag_data);
+    s->tag_data = NULL;
+    s->in_tagged_frame = 0;
+}
+
+// The session is over: drop everything still queued and tell the owner. Freed once the kernel
+// has returned every overlapped operation.
+static void finish_session(ChatSession *s) {
+    s->state = STATE_CLOSED;
+    if (s->sock != INVALID_SOCKET) {
+        closesocket(s->sock);
+        s->sock = INVALID_SOCKET;
+    }
+    while (s->send_head != NULL) {
+        ChatOp *op = s->send_head;
+        s->send_head = op->next;
+        free_op(op);
+    }
+    s->send_tail = NULL;
+    fail_outgoing_file(s);
+    reset_compressed_frame(s);
+    reset_tagged_frame(s);
+    if (s->callbacks.on_closed) s->callbacks.on_closed(s);
+}
+
+// Close the socket and either schedule a resume or end the session. Requests still queued are sent
+// once the session is resumed.
+static void connection_lost(ChatSession *s) {
+    if (s->state == STATE_WAITING || s->state == STATE_CLOSED) return;
+    if (s->sock != INVALID_SOCKET) {
+        closesocket(s->sock); // Outstanding operations complete with errors and are ignored
+        s->sock = INVALID_SOCKET;
+    }
+    // A file frame cannot survive the reconnect; the server aborts the relay on its side
+    if (s->in_file_mode) end_incoming_file(s, 0, "interrupted by the reconnect");
+    fail_outgoing_file(s);
+    s->sends_held = 0;
+
+    if (!s->closing && s->token[0] != '\0' && s->attempt < RESUME_ATTEMPTS) {
+        s->attempt++;
+        s->state = STATE_WAITING;
+        s->retry_at = GetTickCount64() + (ULONGLONG)RESUME_RETRY_DELAY_MS * s->attempt;
+        if (s->callbacks.on_reconnecting) s->callbacks.on_reconnecting(s, s->attempt, RESUME_ATTEMPTS);
+        return;
+    }
+    finish_session(s);
+}
+
+// --- Receiving (loop thread) ---
+
+// The line answering RESUME; returns how many bytes it used
+static int consume_resume_reply(ChatSession *s, const char *data, int len) {
+    int used = 0;
+    while (used < len) {
+        char c = data[used++];
+        if (c != '\n') {
+            if (s->reply_len < (int)sizeof(s->reply_line) - 1) s->reply_line[s->reply_len++] = c;
+            continue;
+        }
+        s->reply_line[s->reply_len] = '\0';
+        s->state = STATE_OPEN;
+        s->attempt = 0;
+        if (strncmp(s->reply_line, "RESUMED ", 8) == 0) {
+            if (s->callbacks.on_registered) s->callbacks.on_registered(s, s->id, 1);
+        } else {
+            // The server could not resume us; it registers a new session and sends a new ID, and
+            // what was waiting for the old one goes to the offline log: LOGIN collects it
+            s->relogin_id = s->id;
+            strcpy(s->relogin_token, s->token);
+            s->stream_bytes = 0;
+            s->at_line_start = 1;
+            s->token[0] = '\0';
+            s->id = -1;
+            reset_compressed_frame(s); // The rest of that frame belongs to the old stream
+            reset_tagged_frame(s);
+            if (s->callbacks.on_message) s->callbacks.on_message(s, s->reply_line);
+        }
+        pump_sends(s);
+        break;
+    }
+    return used;
+}
+
+static void receive_done(ChatSession *s, DWORD bytes, int failed) {
+    s->pending_io--;
+    if (s->sock == INVALID_SOCKET) return;
+    if (failed || bytes == 0) {
+        connection_lost(s);
+        return;
+    }
+    char *data = s->recv_buffer;
+    int len = (int)bytes;
+    if (s->state == STATE_RESUMING) {
+        int used = consume_resume_reply(s, data, len);
+        data += used;
+        len -= used;
+    }
+    consume_stream(s, data, len);
+    if (s->sock != INVALID_SOCKET && !post_receive(s)) connection_lost(s);
+}
+
+// Handle one control line of a file frame: FILE, CHUNK, FILEEND or FILEABORT
+static void handle_file_line(ChatSession *s, const char *line) {
+    int sender_id = 0;
+    long long value = 0;
+    char name[FILE_LINE_MAX];
+
+    if (sscanf(line, "FILE %d %lld %255s", &sender_id, &value, name) == 3) {
+        // Never trust a path from the network: keep only the base name
+        const char *base = name;
+        for (const char *p = name; *p; p++) {
+            if (*p == '\\' || *p == '/' || *p == ':') base = p + 1;
+        }
+        s->in_size = value;
+        s->in_received = 0;
+        if (s->callbacks.on_file_begin) s->callbacks.on_file_begin(s, sender_id, value, base);
+    } else if (sscanf(line, "CHUNK %lld", &value) == 1) {
+        s->chunk_remaining = value;
+    } else if (strcmp(line, "FILEEND") == 0) {
+        end_incoming_file(s, s->in_received == s->in_size, NULL);
+    } else if (strncmp(line, "FILEABORT", 9) == 0) {
+        char reason[FILE_LINE_MAX + 16];
+        snprintf(reason, sizeof(reason), "aborted:%s", line + 9);
+        end_incoming_file(s, 0, reason);
+    }
+}
+
+// Consume bytes of a file frame; returns how many were used (stops after FILEEND/FILEABORT)
+static int consume_file_stream(ChatSession *s, const char *data, int len) {
+    int consumed = 0;
+    while (consumed < len && s->in_file_mode) {
+        if (s->chunk_remaining > 0) {
+            // Chunk payload goes straight from the receive buffer to the owner
+            int n = (s->chunk_remaining < len - consumed) ? (int)s->chunk_remaining : len - consumed;
+            if (s->callbacks.on_file_data) s->callbacks.on_file_data(s, data + consumed, n);
+            s->in_received += n;
+            s->chunk_remaining -= n;
+            consumed += n;
+            continue;
+        }
+        char c = data[consumed++];
+        if (c != '\n') {
+            if (s->file_line_len < FILE_LINE_MAX - 1) s->file_line[s->file_line_len++] = c;
+            continue;
+        }
+        s->file_line[s->file_line_len] = '\0';
+        s->file_line_len = 0;
+        handle_file_line(s, s->file_line);
+    }
+    return consumed;
+}
+
+// Consume bytes of a compressed frame; returns how many were used (the frame's message is handled once complete)
+static int consume_compressed_frame(ChatSession *s, const char *data, int len) {
+    int consumed = 0;
+
+    // Header line: "Z <raw-len> <compressed-len>"
+    while (s->frame_data == NULL && consumed < len) {
+        char c = data[consumed++];
+        if (c != '\n') {
+            if (s->frame_line_len < (int)sizeof(s->frame_line) - 1) s->frame_line[s->frame_line_len++] = c;
+            continue;
+        }
+        s->frame_line[s->frame_line_len] = '\0';
+        if (sscanf(s->frame_line, "Z %d %d", &s->frame_raw_len, &s->frame_len) != 2 || s->frame_raw_len <= 0 ||
+            s->frame_raw_len > MAX_MESSAGE_SIZE || s->frame_len <= 0 || s->frame_len > s->frame_raw_len) {
+            s->in_compressed_frame = 0; // Malformed header: dropped
+            return consumed;
+        }
+        s->frame_data = (unsigned char*)malloc(s->frame_len);
+        s->frame_have = 0;
+        if (s->frame_data == NULL) {
+            s->in_compressed_frame = 0;
+            return consumed;
+        }
+    }
+    if (s->frame_data == NULL) return consumed;
+
+    // Payload, possibly spread over several receives
+    int n = (s->frame_len - s->frame_have < len - consumed) ? s->frame_len - s->frame_have : len - consumed;
+    memcpy(s->frame_data + s->frame_have, data + consumed, n);
+    s->frame_have += n;
+    consumed += n;
+    if (s->frame_have < s->frame_len) return consumed;
+
+    char *message = (char*)malloc((size_t)s->frame_raw_len + 1);
+    if (message != NULL && decompress_message(s->frame_data, s->frame_len, message, s->frame_raw_len) == s->frame_raw_len) {
+        message[s->frame_raw_len] = '\0';
+        handle_server_message(s, message);
+    } // Otherwise the frame is corrupt and dropped
+    free(message);
+    reset_compressed_frame(s);
+    return consumed;
+}
+
+// Hand a complete tagged frame to the owner. "<id>[,<id>...]" lists the recipients; "*" means every
+// virtual session on this connection and "*-<id>" all but one.
+static void dispatch_tagged_frame(ChatSession *s) {
+    int ids[TAG_IDS_MAX];
+    int id_count = 0, exclude_id = -1;
+    char *tags = s->tag_line + 1; // Past the '@'
+
+    if (!s->callbacks.on_virtual_message) return;
+    *strchr(tags, ' ') = '\0'; // Checked by the caller
+    if (tags[0] == '*') {
+        if (tags[1] == '-') exclude_id = atoi(tags + 2);
+        s->callbacks.on_virtual_message(s, NULL, 0, exclude_id, s->tag_data);
+        return;
+    }
+    for (char *p = tags; *p && id_count < TAG_IDS_MAX; ) {
+        ids[id_count++] = atoi(p);
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+    s->callbacks.on_virtual_message(s, ids, id_count, -1, s->tag_data);
+}
+
+// Consume bytes of a tagged frame; returns how many were used (the frame is handled once complete)
+static int consume_tagged_frame(ChatSession *s, const char *data, int len) {
+    int consumed = 0;
+
+    // Header line: "@<tags> <payload-len>"
+    while (s->tag_data == NULL && consumed < len) {
+        char c = data[consumed++];
+        if (c != '\n') {
+            if (s->tag_line_len < TAG_LINE_MAX - 1) s->tag_line[s->tag_line_len++] = c;
+            continue;
+        }
+        s->tag_line[s->tag_line_len] = '\0';
+        char *space = strrchr(s->tag_line, ' ');
+        s->tag_len = space != NULL ? atoi(space + 1) : -1;
+        if (s->tag_line[0] != '@' || space == NULL || s->tag_len < 0 || s->tag_len > MAX_MESSAGE_SIZE ||
+            (s->tag_data = (char*)malloc((size_t)s->tag_len + 1)) == NULL) {
+            s->in_tagged_frame = 0; // Malformed header: dropped
+            return consumed;
+        }
+        s->tag_have = 0;
+    }
+    if (s->tag_data == NULL) return consumed;
+
+    // Payload, possibly spread over several receives
+    int n = (s->tag_len - s->tag_have < len - consumed) ? s->tag_len - s->tag_have : len - consumed;
+    memcpy(s->tag_data + s->tag_have, data + consumed, n);
+    s->tag_have += n;
+    consumed += n;
+    if (s->tag_have < s->tag_len) return consumed;
+
+    s->tag_data[s->tag_len] = '\0';
+    dispatch_tagged_frame(s);
+    reset_tagged_frame(s);
+    return consumed;
+}
+
+// Find where the next frame starts: a marker right after a newline (or at the start of data when the
+// stream so far ends a line). A marker byte anywhere else is inside a chat line and stays text.
+static char *find_frame(ChatSession *s, char *data, int len) {
+    char *end = data + len;
+    if (len > 0 && s->at_line_start && (data[0] == FILE_MARKER || data[0] == COMPRESS_MARKER || data[0] == SESSION_MARKER)) {
+        return data;
+    }
+    for (char *nl = (char*)memchr(data, '\n', len); nl != NULL && nl + 1 < end; nl = (char*)memchr(nl + 1, '\n', end - nl - 1)) {
+        if (nl[1] == FILE_MARKER || nl[1] == COMPRESS_MARKER || nl[1] == SESSION_MARKER) return nl + 1;
+    }
+    return NULL;
+}
+
+// Split received data into chat messages, file frames (FILE_MARKER), compressed frames (COMPRESS_MARKER)
+// and tagged frames for virtual sessions (SESSION_MARKER).
+// data must have room for a terminator at data[len].
+static void consume_stream(ChatSession *s, char *data, int len) {
+    while (len > 0 && s->sock != INVALID_SOCKET) {
+        if (s->in_file_mode) {
+            int used = consume_file_stream(s, data, len);
+            data += used;
+            len -= used;
+            continue;
+        }
+        if (s->in_compressed_frame || s->in_tagged_frame) {
+            int used = s->in_compressed_frame ? consume_compressed_frame(s, data, len) : consume_tagged_frame(s, data, len);
+            s->stream_bytes += used; // Compressed and tagged frames are part of the resumable stream
+            data += used;
+            len -= used;
+            continue;
+        }
+        char *marker = find_frame(s, data, len);
+        int text_len = marker != NULL ? (int)(marker - data) : len;
+        if (text_len > 0) {
+            // Chat bytes (starting with the ID line) count towards our resume position; file frames do not
+            s->stream_bytes += text_len;
+            s->at_line_start = data[text_len - 1] == '\n';
+            // The newline a frame starts with is not part of the message before it
+            int message_len = s->at_line_start ? text_len - 1 : text_len;
+            if (message_len > 0) {
+                data[message_len] = '\0';
+                handle_server_message(s, data);
+            }
+        }
+        if (marker == NULL) break;
+        s->at_line_start = 1; // Whatever follows the frame starts afresh
+        if (*marker == COMPRESS_MARKER) {
+            s->in_compressed_frame = 1;
+            s->frame_line_len = 0;
+            s->stream_bytes += 1;
+        } else if (*marker == SESSION_MARKER) {
+            s->in_tagged_frame = 1;
+            s->tag_line_len = 0;
+            s->stream_bytes += 1;
+        } else {
+            s->in_file_mode = 1;
+            s->file_line_len = 0;
+        }
+        data = marker + 1;
+        len -= text_len + 1;
+    }
+}
+
+// Act on the protocol messages the library owns and pass everything else to on_message
+static void handle_server_message(ChatSession *s, const char *text) {
+    // "ID <id> TOKEN <token>" on connect and again after a successful LOGIN (that ID's token)
+    if (strncmp(text, "ID ", 3) == 0) {
+        int id;
+        char token[RESUME_TOKEN_LEN + 1];
+        int fields = sscanf(text + 3, "%d TOKEN %32s", &id, token);
+        if (fields >= 1) {
+            int fresh = s->id == -1;
+            s->id = id;
+            if (fields == 2) strcpy(s->token, token); // RESUME presents the token of the ID we hold
+            if (fields == 2 && fresh) {
+                // A new session: offer compression with our dictionary, and take back the ID a
+                // refused RESUME left behind
+                char offer[64 + RESUME_TOKEN_LEN];
+                int n = sprintf(offer, "COMPRESS %d\n", COMPRESS_DICT_VERSION);
+                if (s->relogin_id != -1) {
+                    n += sprintf(offer + n, "LOGIN %d %s\n", s->relogin_id, s->relogin_token);
+                    s->relogin_id = -1;
+                }
+                ChatOp *op = new_op(OP_SEND, n);
+                if (op != NULL) {
+                    memcpy(op->data, offer, n);
+                    queue_send(s, op, 0);
+                    pump_sends(s);
+                }
+            }
+            if (s->callbacks.on_registered) s->callbacks.on_registered(s, id, 0);
+            return;
+        }
+    }
+    // "VIDS <first-id> <count>" answers VOPEN
+    else if (strncmp(text, "VIDS ", 5) == 0 && s->callbacks.on_virtual_opened) {
+        int first_id, count;
+        if (sscanf(text + 5, "%d %d", &first_id, &count) == 2) {
+            s->callbacks.on_virtual_opened(s, first_id, count);
+            return;
+        }
+    }
+    // The server accepted our SENDFILE
+    else if (strncmp(text, "FILEREADY ", 10) == 0) {
+        file_ready(s, _atoi64(text + 10));
+        return;
+    }
+    // While a SENDFILE is outstanding, an error is the server refusing it
+    else if (strncmp(text, "ERROR ", 6) == 0 && s->out_file != INVALID_HANDLE_VALUE) {
+        fail_outgoing_file(s);
+        release_sends(s);
+    }
+    if (s->callbacks.on_message) s->callbacks.on_message(s, text);
+}
+
+// --- Event Loop ---
+
+static void handle_submit(ChatOp *op) {
+    ChatSession *s = op->session;
+
+    InterlockedDecrement(&s->submitted);
+    if (op->kind == OP_START) {
+        free_op(op);
+        s->next = s->loop->sessions;
+        s->loop->sessions = s;
+        start_connect(s);
+        return;
+    }
+    if (s->state == STATE_CLOSED) {
+        free_op(op);
+        return;
+    }
+    if (op->kind == OP_CLOSE && s->state == STATE_WAITING) {
+        // Nothing is connected to flush to
+        free_op(op);
+        s->closing = 1;
+        finish_session(s);
+        return;
+    }
+    queue_send(s, op, 0);
+    pump_sends(s);
+}
+
+static void handle_completion(ChatSession *s, ChatOp *op, DWORD bytes, int failed) {
+    switch (op->kind) {
+        case OP_CONNECT: connect_done(s, failed); break;
+        case OP_RECV: receive_done(s, bytes, failed); break;
+        default: send_done(s, op, failed); break;
+    }
+}
+
+// Start due reconnects, expire unanswered SENDFILEs and free finished sessions.
+// Returns how long the loop may sleep before the next deadline.
+static DWORD run_timers(ChatLoop *loop, DWORD timeout_ms) {
+    ULONGLONG now = GetTickCount64();
+    DWORD wait = timeout_ms;
+
+    for (ChatSession **link = &loop->sessions; *link != NULL;) {
+        ChatSession *s = *link;
+        if (s->state == STATE_WAITING && s->pending_io == 0 && now >= s->retry_at) {
+            start_connect(s);
+        }
+        if (s->out_file != INVALID_HANDLE_VALUE && now >= s->out_deadline) {
+            fail_outgoing_file(s);
+            release_sends(s);
+        }
+        if (s->state == STATE_CLOSED && s->pending_io == 0 && s->submitted == 0) {
+            *link = s->next;
+            free(s);
+            InterlockedDecrement(&loop->open_sessions);
+            continue;
+        }
+        // A reconnect waits for the old socket's operations to drain; their completions wake us
+        if (s->state == STATE_WAITING && s->pending_io == 0 && s->retry_at - now < wait) {
+            wait = (DWORD)(s->retry_at - now);
+        }
+        if (s->out_file != INVALID_HANDLE_VALUE && s->out_deadline - now < wait) {
+            wait = (DWORD)(s->out_deadline - now);
+        }
+        link = &s->next;
+    }
+    return wait;
+}
+
+int chat_loop_run(ChatLoop *loop, DWORD timeout_ms) {
+    OVERLAPPED_ENTRY entries[COMPLETION_BATCH];
+    ULONG count = 0;
+
+    DWORD wait = run_timers(loop, timeout_ms);
+    if (GetQueuedCompletionStatusEx(loop->port, entries, COMPLETION_BATCH, &count, wait, FALSE)) {
+        for (ULONG i = 0; i < count; i++) {
+            ULONG_PTR key = entries[i].lpCompletionKey;
+            if (key == WAKE_KEY || entries[i].lpOverlapped == NULL) continue;
+            ChatOp *op = (ChatOp*)entries[i].lpOverlapped;
+            if (key == SUBMIT_KEY) {
+                handle_submit(op);
+            } else {
+                // A non-zero status means the operation failed
+                handle_completion((ChatSession*)key, op, entries[i].dwNumberOfBytesTransferred,
+                                  entries[i].lpOverlapped->Internal != 0);
+            }
+        }
+    }
+    run_timers(loop, 0);
+    return (int)loop->open_sessions;
+}
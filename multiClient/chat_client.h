@@ -0,0 +1,74 @@
+// chat_client.h
+// Event-driven client for the multiClient chat server.
+//
+// One ChatLoop drives any number of ChatSessions on a single I/O completion port. All socket I/O,
+// protocol parsing, session resumption, compression and file frames run on the thread that calls
+// chat_loop_run(); results come back through callbacks on that thread. The chat_* request functions
+// may be called from any thread: they only queue work for the loop. A session must not be used once
+// its on_closed callback has run. Winsock must be initialized (WSAStartup) by the caller.
+//
+// Build: gcc client.c chat_client.c -o client -lws2_32 -lmswsock
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <winsock2.h>
+#include <windows.h>
+
+typedef struct ChatLoop ChatLoop;
+typedef struct ChatSession ChatSession;
+
+// Every callback is optional (NULL) and runs on the loop thread
+typedef struct {
+    // The server assigned our ID (resumed = 1 when a dropped connection got its session back)
+    void (*on_registered)(ChatSession *session, int id, int resumed);
+    // Any other message: "MSG ...", "INFO ...", "ERROR ...", LIST and HISTORY output, ...
+    void (*on_message)(ChatSession *session, const char *text);
+    // The connection dropped and reconnect attempt `attempt` of `attempts` is scheduled
+    void (*on_reconnecting)(ChatSession *session, int attempt, int attempts);
+    // Incoming file: begin (name is a bare file name), data in arrival order, end (complete = 0 if aborted)
+    void (*on_file_begin)(ChatSession *session, int sender_id, long long size, const char *name);
+    void (*on_file_data)(ChatSession *session, const char *data, int len);
+    void (*on_file_end)(ChatSession *session, int complete, const char *reason);
+    // Outgoing file from chat_send_file() finished; error = 0 if every byte was sent
+    void (*on_file_sent)(ChatSession *session, long long bytes, double seconds, int error);
+    // The session is over; the pointer is freed as soon as this returns
+    void (*on_closed)(ChatSession *session);
+    // chat_open_virtual() registered IDs first_id .. first_id + count - 1 on this connection
+    void (*on_virtual_opened)(ChatSession *session, int first_id, int count);
+    // A message for virtual sessions on this connection: the listed IDs, or (ids == NULL) every one of
+    // them except exclude_id (-1 if none)
+    void (*on_virtual_message)(ChatSession *session, const int *ids, int id_count, int exclude_id, const char *text);
+} ChatCallbacks;
+
+// --- Event Loop ---
+ChatLoop *chat_loop_create(void);
+// Process completions and timers for up to timeout_ms (INFINITE allowed); returns the number of open sessions
+int chat_loop_run(ChatLoop *loop, DWORD timeout_ms);
+// Make a chat_loop_run() blocked on another thread return early
+void chat_loop_wake(ChatLoop *loop);
+// Only once every session is closed
+void chat_loop_destroy(ChatLoop *loop);
+
+// --- Sessions ---
+// Start connecting; returns NULL only for an invalid address. Registration is reported by on_registered.
+ChatSession *chat_connect(ChatLoop *loop, const char *ip, int port, const ChatCallbacks *callbacks, void *user);
+// Requests are sent in call order, newline-terminated, and may be pipelined without waiting for replies.
+// Each returns 0 if it could not be queued.
+int chat_send_to(ChatSession *session, int target_id, const char *message);
+int chat_send_command(ChatSession *session, const char *command); // LIST, HISTORY ..., LOGIN ...
+int chat_send_file(ChatSession *session, int target_id, const char *path);
+// Close after everything already requested has been sent; on_closed follows
+void chat_close(ChatSession *session);
+
+// --- Virtual Sessions ---
+// A bot host registers many logical users on its one connection; they cost the server no socket or thread.
+// Their messages arrive through on_virtual_message, and they end with the connection (or chat_close_virtual).
+int chat_open_virtual(ChatSession *session, int count);
+int chat_send_as(ChatSession *session, int virtual_id, int target_id, const char *message);
+int chat_close_virtual(ChatSession *session, int virtual_id);
+
+void *chat_user(ChatSession *session);
+int chat_id(ChatSession *session); // -1 until registered
+const char *chat_token(ChatSession *session); // Secret of our ID: "LOGIN <id> <token>" takes it back later
+
+#endif
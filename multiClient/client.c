@@ -5,331 +5,494 @@
 #include <stdio.h>
 #include <winsock2.h>
 #include <windows.h>
-#include <stdint.h>
 #include <process.h> // For _beginthreadex, _endthreadex
-#include <string.h> // For strchr, strlen, memset, strcat, strcspn, strncpy
+#include <string.h> // For strchr, strlen, strcspn
 #include <stdlib.h> // For sscanf, _stricmp, _strnicmp
+#include "chat_client.h" // Connection, protocol and session handling
+#include "batch_mode.h" // --batch records and summary, shared with the UDP client
 
 #pragma comment(lib, "ws2_32.lib")
 
-#define BUFFER_SIZE 2048 // Increased buffer size for messages and lists
 #define MAX_INPUT_SIZE 1024 // Maximum size for user command input
 
 // --- Global Variables ---
-// Use volatile for variables accessed by multiple threads and potentially changed unexpectedly
-volatile SOCKET server_socket = INVALID_SOCKET; // Connection to the server
-HANDLE receive_thread_handle = NULL; // Handle for the background receive thread
+// The interactive shell: the main thread reads commands, the loop thread runs the chat session
+ChatLoop *loop = NULL;
+ChatSession *session = NULL;
 volatile int connected = 0; // Flag indicating connection state (0 = disconnected, 1 = connected)
-volatile int my_id = -1; // Client ID assigned by the server
+HANDLE registered_event = NULL; // Set once the server has given us an ID, or the session has ended
+
+FILE *ui = NULL; // Prompts and local errors: stdout, or stderr in batch mode so stdout stays machine-readable
+
+// Incoming file being written to disk (loop thread only)
+HANDLE incoming_file = INVALID_HANDLE_VALUE;
+char incoming_name[MAX_PATH];
+LARGE_INTEGER incoming_start;
 
 // --- Function Prototypes ---
-// Thread function responsible for receiving messages from the server
-unsigned __stdcall receive_from_server_thread(void *arg);
+// Thread function that runs the chat loop until the session is closed
+unsigned __stdcall chat_loop_thread(void *arg);
+// Parse and send one command line; returns 0 for EXIT
+int run_command(char *input_buffer);
+// Batch mode: send a whole script back-to-back and wait for the replies to stop (batch_mode.h summarizes)
+void run_batch(FILE *script);
+// Session callbacks (run on the loop thread)
+void on_registered(ChatSession *s, int id, int resumed);
+void on_message(ChatSession *s, const char *text);
+void on_reconnecting(ChatSession *s, int attempt, int attempts);
+void on_file_begin(ChatSession *s, int sender_id, long long size, const char *name);
+void on_file_data(ChatSession *s, const char *data, int len);
+void on_file_end(ChatSession *s, int complete, const char *reason);
+void on_file_sent(ChatSession *s, long long bytes, double seconds, int error);
+void on_closed(ChatSession *s);
+void on_virtual_opened(ChatSession *s, int first_id, int count);
+void on_virtual_message(ChatSession *s, const int *ids, int id_count, int exclude_id, const char *text);
 
 // --- Main Function ---
-int main() {
+int main(int argc, char *argv[]) {
     WSADATA wsa;
-    struct sockaddr_in server_addr;
     char server_ip[20]; // Sufficient buffer for IPv4 string + null terminator
     int server_port;
     char input_buffer[MAX_INPUT_SIZE]; // Buffer for user input
-    char message_buffer[BUFFER_SIZE]; // Buffer for constructing messages to send
-
-    // 1. Get server details from user
-    printf("Enter server IP: ");
-    // Use %19s to prevent buffer overflow for server_ip
-    if (scanf("%19s", server_ip) != 1) {
-        printf("Error reading server IP.\n");
-        return 1;
-    }
-    printf("Enter server port: ");
-     if (scanf("%d", &server_port) != 1) {
-        printf("Error reading server port.\n");
+    FILE *script = NULL; // Batch mode command source
+    ChatCallbacks callbacks = { on_registered, on_message, on_reconnecting, on_file_begin, on_file_data,
+                                on_file_end, on_file_sent, on_closed, on_virtual_opened, on_virtual_message };
+
+    ui = stdout;
+    if (argc >= 4 && _stricmp(argv[3], "--batch") == 0) {
+        // client <ip> <port> --batch [script]: the script defaults to stdin (a pipe)
+        ui = stderr;
+        strncpy(server_ip, argv[1], sizeof(server_ip) - 1);
+        server_ip[sizeof(server_ip) - 1] = '\0';
+        server_port = atoi(argv[2]);
+        script = (argc > 4 && strcmp(argv[4], "-") != 0) ? fopen(argv[4], "r") : stdin;
+        if (script == NULL) {
+            fprintf(stderr, "Cannot open script '%s'.\n", argv[4]);
+            return 1;
+        }
+        batch_init();
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [<server IP> <port> --batch [<script> | -]]\n", argv[0]);
         return 1;
+    } else {
+        // 1. Get server details from user
+        printf("Enter server IP: ");
+        // Use %19s to prevent buffer overflow for server_ip
+        if (scanf("%19s", server_ip) != 1) {
+            printf("Error reading server IP.\n");
+            return 1;
+        }
+        printf("Enter server port: ");
+         if (scanf("%d", &server_port) != 1) {
+            printf("Error reading server port.\n");
+            return 1;
+        }
+        getchar(); // Consume the leftover newline character after reading the integer
     }
-    getchar(); // Consume the leftover newline character after reading the integer
 
     // 2. Initialize Winsock library
-    printf("Initializing Winsock...\n");
+    fprintf(ui, "Initializing Winsock...\n");
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError());
+        fprintf(ui, "WSAStartup failed. Error Code: %d\n", WSAGetLastError());
         return 1;
     }
-    printf("Winsock Initialized.\n");
-
-    // 3. Create a TCP socket for connecting to the server
-    server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (server_socket == INVALID_SOCKET) {
-        printf("Could not create server socket. Error Code: %d\n", WSAGetLastError());
-        WSACleanup(); return 1;
-    }
-
-    // Prepare the server address structure
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port); // Convert port to network byte order
+    fprintf(ui, "Winsock Initialized.\n");
 
-    // Convert IP string to network address structure
-    // inet_addr is deprecated; consider using InetPton or WSAStringToAddress for robustness
-    server_addr.sin_addr.s_addr = inet_addr(server_ip);
-    if (server_addr.sin_addr.s_addr == INADDR_NONE && strcmp(server_ip, "255.255.255.255") != 0) {
-         // Note: inet_addr treats "255.255.255.255" specially. Handle other invalid inputs.
-         printf("Invalid server IP address format: %s\n", server_ip);
-         closesocket(server_socket);
-         WSACleanup();
-         return 1;
+    loop = chat_loop_create();
+    registered_event = CreateEvent(NULL, TRUE, FALSE, NULL); // Manual reset: stays set once we are registered
+    if (loop == NULL || registered_event == NULL) {
+        fprintf(ui, "Could not create the chat loop. Error: %lu\n", GetLastError());
+        WSACleanup();
+        return 1;
     }
 
-
-    // 4. Connect to the server
-    printf("Connecting to server %s:%d...\n", server_ip, server_port);
-    if (connect(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        printf("Failed to connect to server. Error Code: %d\n", WSAGetLastError());
-        closesocket(server_socket); WSACleanup(); return 1;
+    // 3. Start connecting; the session reports back through the callbacks
+    fprintf(ui, "Connecting to server %s:%d...\n", server_ip, server_port);
+    session = chat_connect(loop, server_ip, server_port, &callbacks, NULL);
+    if (session == NULL) {
+        fprintf(ui, "Invalid server IP address format: %s\n", server_ip);
+        chat_loop_destroy(loop);
+        WSACleanup();
+        return 1;
     }
-    printf("Connected to server.\n");
-    connected = 1; // Set connection flag to true
-
-    // 5. Start the background thread to handle receiving messages from the server
-    // This is done immediately after connecting so we don't miss the initial ID or other messages
-    uintptr_t server_socket_ptr = (uintptr_t)server_socket; // Safe cast for passing socket handle
-    receive_thread_handle = (HANDLE)_beginthreadex(NULL, 0, receive_from_server_thread, (void*)server_socket_ptr, 0, NULL);
+    connected = 1;
 
-    if (receive_thread_handle == NULL) {
-         printf("Failed to create receive thread. Error: %d\n", GetLastError());
-         // Signal disconnection if thread fails to start
-         connected = 0;
-         closesocket(server_socket);
+    // 4. Run the chat loop in the background
+    HANDLE loop_thread_handle = (HANDLE)_beginthreadex(NULL, 0, chat_loop_thread, NULL, 0, NULL);
+    if (loop_thread_handle == NULL) {
+         fprintf(ui, "Failed to create chat loop thread. Error: %lu\n", GetLastError());
          WSACleanup();
          return 1;
     }
-    // Close the thread handle in the main thread as we don't need to manage its lifetime beyond waiting for it to exit
-    CloseHandle(receive_thread_handle);
-    receive_thread_handle = NULL; // Set to NULL to indicate handle is closed
-
-    // 6. Wait for the server to send the client's ID
-    printf("Waiting for ID from server...\n");
-    // Poll the my_id variable until it's set by the receive thread, or until disconnected
-    while (my_id == -1 && connected) {
-        Sleep(50); // Wait briefly to avoid busy-waiting
-    }
 
-    // Check if connection was lost while waiting for ID
+    // 5. Wait for the server to send the client's ID (or for the connection to fail)
+    fprintf(ui, "Waiting for ID from server...\n");
+    WaitForSingleObject(registered_event, INFINITE);
     if (!connected) {
-         printf("Connection lost before receiving ID.\n");
-         // Cleanup already handled by connected flag logic
-         closesocket(server_socket);
+         fprintf(ui, "Connection lost before receiving ID.\n");
+         WaitForSingleObject(loop_thread_handle, INFINITE);
+         CloseHandle(loop_thread_handle);
+         chat_loop_destroy(loop);
          WSACleanup();
          return 1;
     }
 
-    // 7. Display available commands and enter the main command loop
-    printf("\n--- Commands ---\n");
-    printf("LIST - Get list of clients\n");
-    printf("<id> <message> - Send a message to client <id> (Use %d for broadcast)\n", 101); // Show broadcast ID
-    printf("EXIT - Quit the application\n");
-    printf("------------------\n");
+    // 6. Batch mode sends the script; otherwise display available commands and enter the main command loop
+    if (batch_mode) {
+        run_batch(script);
+    } else {
+        printf("\n--- Commands ---\n");
+        printf("LIST - Get list of clients\n");
+        printf("<id> <message> - Send a message to client <id> (Use %d for broadcast)\n", 101); // Show broadcast ID
+        printf("HISTORY <n> | HISTORY SINCE <seq> - Show recent broadcasts and join/leave notices\n");
+        printf("LOGIN <id> <token> - Take back an earlier ID (with the token shown when it was issued) and receive messages queued for it\n");
+        printf("STATS - Show the server's rate limiting counters\n");
+        printf("SENDFILE <id> <path> - Send a file to client <id>\n");
+        printf("VOPEN <n> - Register n virtual users on this connection\n");
+        printf("AS <vid> <id> <message> - Send a message as virtual user <vid>\n");
+        printf("EXIT - Quit the application\n");
+        printf("------------------\n");
+    }
 
     // Main loop for handling user input and sending commands to the server
-    while (connected) {
+    while (connected && !batch_mode) {
         printf("> "); // Display prompt for user input
         fflush(stdout); // Ensure the prompt is displayed immediately
 
         // Read user input line by line
         if (fgets(input_buffer, MAX_INPUT_SIZE, stdin) == NULL) {
             printf("Input error or stream closed. Exiting.\n");
-            connected = 0; // Assume disconnection or error
             break; // Exit main loop
         }
         // Remove the trailing newline character read by fgets
         input_buffer[strcspn(input_buffer, "\n")] = 0;
 
         // Ignore empty input lines
-        if (strlen(input_buffer) == 0) {
+        if (strlen(input_buffer) == 0 || !connected) {
             continue;
         }
 
         // Handle EXIT command
-        if (_stricmp(input_buffer, "EXIT") == 0) {
+        if (!run_command(input_buffer)) {
             printf("Exiting...\n");
             break; // Exit the main command loop
         }
+    } // End of main command loop
+
+    // 7. Cleanup: close the session once everything typed so far has been sent
+    fprintf(ui, "Cleaning up...\n");
+    if (connected) chat_close(session);
+    WaitForSingleObject(loop_thread_handle, INFINITE); // The loop ends with the session
+    CloseHandle(loop_thread_handle);
+    CloseHandle(registered_event);
+    chat_loop_destroy(loop);
+    if (batch_mode) print_batch_summary();
+
+    // Clean up the Winsock library
+    WSACleanup();
+    fprintf(ui, "Cleanup complete. Goodbye.\n");
+    return 0;
+}
 
-        // Handle LIST command
-        if (_stricmp(input_buffer, "LIST") == 0) {
-            // Send the LIST command to the server
-            if (send(server_socket, "LIST", 4, 0) == SOCKET_ERROR) {
-                 printf("Failed to send LIST command. Error: %d\n", WSAGetLastError());
-                 connected = 0; // Assume connection lost if sending fails
+// --- Commands ---
+// Parse one command line and queue it for the server; problems are reported on ui
+int run_command(char *input_buffer) {
+    if (_stricmp(input_buffer, "EXIT") == 0) {
+        return 0;
+    }
+
+    // Handle LIST, STATS, LOGIN (take back an earlier ID) and HISTORY (recent broadcasts); sent as typed
+    if (_stricmp(input_buffer, "LIST") == 0 || _stricmp(input_buffer, "STATS") == 0 || _strnicmp(input_buffer, "LOGIN ", 6) == 0 ||
+        _strnicmp(input_buffer, "HISTORY ", 8) == 0) {
+        if (!chat_send_command(session, _stricmp(input_buffer, "LIST") == 0 ? "LIST" : input_buffer)) {
+             fprintf(ui, "Failed to send command. Error: %lu\n", GetLastError());
+        } else {
+            commands_sent++;
+        }
+    }
+    // Handle SENDFILE <id> <path>: the file is streamed once the server is ready
+    else if (_strnicmp(input_buffer, "SENDFILE ", 9) == 0) {
+        int target_id = -1, path_start = 0;
+        if (sscanf(input_buffer + 9, "%d %n", &target_id, &path_start) == 1 && input_buffer[9 + path_start] != '\0') {
+            const char *path = input_buffer + 9 + path_start;
+            if (chat_send_file(session, target_id, path)) {
+                fprintf(ui, "Offering '%s' to %d...\n", path, target_id);
+                commands_sent++;
+            } else {
+                fprintf(ui, "Cannot open '%s' (or it is empty). Error: %lu\n", path, GetLastError());
+            }
+        } else {
+            fprintf(ui, "Invalid format. Use: SENDFILE <id> <path>\n");
+        }
+    }
+    // Handle VOPEN <n>: more users on this one connection, reported by on_virtual_opened
+    else if (_strnicmp(input_buffer, "VOPEN ", 6) == 0) {
+        if (!chat_open_virtual(session, atoi(input_buffer + 6))) {
+            fprintf(ui, "Failed to send command. Error: %lu\n", GetLastError());
+        } else {
+            commands_sent++;
+        }
+    }
+    // Handle AS <vid> <id> <message>: send as one of our virtual users
+    else if (_strnicmp(input_buffer, "AS ", 3) == 0) {
+        int virtual_id = -1, target_id = -1, message_start = 0;
+        if (sscanf(input_buffer + 3, "%d %d %n", &virtual_id, &target_id, &message_start) == 2 && message_start > 0 &&
+            input_buffer[3 + message_start] != '\0') {
+            if (!chat_send_as(session, virtual_id, target_id, input_buffer + 3 + message_start)) {
+                fprintf(ui, "Failed to send message. Error: %lu\n", GetLastError());
+            } else {
+                commands_sent++;
             }
+        } else {
+            fprintf(ui, "Invalid format. Use: AS <virtual id> <id> <message>\n");
         }
-        // Handle SEND command format: "<id> <message>"
-        else {
-            int target_id = -1;
-            char *message_start = NULL;
-
-            // Attempt to parse the target ID at the beginning of the input
-            // Find the first space to separate ID from message
-            message_start = strchr(input_buffer, ' ');
-
-            if (message_start != NULL) {
-                // Null-terminate the string temporarily at the space to parse the ID
-                *message_start = '\0';
-                // Parse the integer ID from the beginning of the buffer
-                if (sscanf(input_buffer, "%d", &target_id) == 1) {
-                    // Restore the space in the input buffer
-                    *message_start = ' ';
-                     // Move message_start to the character *after* the space
-                    message_start++;
-
-                    // Check if there is a message part after the ID and space
-                    if (strlen(message_start) > 0) {
-                        // Construct the full SEND command string as required by the server
-                        sprintf(message_buffer, "SEND %d %s", target_id, message_start);
-
-                        // Send the constructed command to the server
-                        if (send(server_socket, message_buffer, strlen(message_buffer), 0) == SOCKET_ERROR) {
-                             printf("Failed to send message. Error: %d\n", WSAGetLastError());
-                             connected = 0; // Assume connection lost
-                        }
-                    } else {
-                         // User provided an ID but no message
-                         *message_start = ' '; // Restore space before printing error
-                         printf("Invalid format: Message cannot be empty after ID %d.\n", target_id);
-                    }
+    }
+    // Handle SEND command format: "<id> <message>"
+    else {
+        int target_id = -1;
+        char *message_start = strchr(input_buffer, ' '); // Separates the ID from the message
+
+        if (message_start != NULL && sscanf(input_buffer, "%d", &target_id) == 1) {
+            message_start++; // The message starts after the space
+            // Check if there is a message part after the ID and space
+            if (strlen(message_start) > 0) {
+                LARGE_INTEGER now;
+                QueryPerformanceCounter(&now);
+                if (batch_mode && target_id == chat_id(session)) {
+                    record_self_send(now.QuadPart); // Before queueing
+                }
+                if (!chat_send_to(session, target_id, message_start)) {
+                     fprintf(ui, "Failed to send message. Error: %lu\n", GetLastError());
                 } else {
-                    // Failed to parse an integer ID at the start
-                     *message_start = ' '; // Restore space
-                     printf("Unknown command or invalid format. Expected ID or command. Use: LIST, EXIT, or <id> <message>\n");
+                    commands_sent++;
                 }
             } else {
-                 // No space found, input is a single word
-                 printf("Unknown command or invalid format. Expected ID or command. Use: LIST, EXIT, or <id> <message>\n");
+                 // User provided an ID but no message
+                 fprintf(ui, "Invalid format: Message cannot be empty after ID %d.\n", target_id);
             }
+        } else {
+             // No ID (or a single word)
+             fprintf(ui, "Unknown command or invalid format. Expected ID or command. Use: LIST, EXIT, or <id> <message>\n");
         }
-    } // End of main command loop
-
-    // 8. Cleanup: Disconnect and clean up resources
-    printf("Cleaning up...\n");
-    connected = 0; // Signal the receive thread to stop its loop
-
-    // Gracefully shutdown the socket connection
-    if (server_socket != INVALID_SOCKET) {
-        // SD_BOTH means disable both sends and receives
-        shutdown(server_socket, SD_BOTH);
-        closesocket(server_socket);
-        server_socket = INVALID_SOCKET; // Mark as invalid after closing
-    }
-
-    // Wait for the receive thread to finish execution
-    if (receive_thread_handle != NULL) {
-        // WaitForSingleObject returns WAIT_OBJECT_0 if the thread handle is signaled (thread exited)
-        // or WAIT_TIMEOUT if the timeout (1000ms) elapsed.
-        if (WaitForSingleObject(receive_thread_handle, 1000) == WAIT_TIMEOUT) {
-            printf("Warning: Receive thread did not exit gracefully within timeout.\n");
-            // In a real application, you might forcefully terminate the thread here,
-            // but it's generally discouraged. Better to fix the thread's exit condition.
-        }
-        CloseHandle(receive_thread_handle); // Close the handle
     }
-
-    // Clean up the Winsock library
-    WSACleanup();
-    printf("Cleanup complete. Goodbye.\n");
-    return 0;
+    return 1;
 }
 
+// --- Batch Mode ---
 
-// --- Server Receive Function (Thread) ---
-// This thread continuously listens for and processes messages sent by the server
-unsigned __stdcall receive_from_server_thread(void *arg) {
-    SOCKET sock = (SOCKET)(uintptr_t)arg; // Cast the argument back to a SOCKET handle
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
+// Send every script line back-to-back (see batch_next_command); EXIT ends the script early
+void run_batch(FILE *script) {
+    char line[MAX_INPUT_SIZE], command[MAX_INPUT_SIZE];
 
-    printf("[Receive Thread] Started.\n");
+    while (connected && batch_next_command(script, line, command, sizeof(command), chat_id(session))) {
+        if (!run_command(command)) break;
+    }
+    batch_finish(script, &connected);
+}
 
-    // Loop while the client is connected
-    while (connected) {
-        memset(buffer, 0, BUFFER_SIZE); // Clear the buffer
-        // Attempt to receive data from the server
-        bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+// --- Chat Loop Thread ---
+unsigned __stdcall chat_loop_thread(void *arg) {
+    while (chat_loop_run(loop, INFINITE) > 0) {
+        // Every completion and timer of the session is handled inside chat_loop_run
+    }
+    _endthreadex(0); // Cleanly exit the thread
+    return 0; // Should not be reached
+}
 
-        // Check the connection flag again after recv returns (recv can block)
-        if (!connected) break;
+// --- Session Callbacks ---
+
+void on_registered(ChatSession *s, int id, int resumed) {
+    if (batch_mode) {
+        char text[32];
+        sprintf(text, "%d", id);
+        batch_output(resumed ? "RESUMED" : "ID", text);
+    } else if (resumed) {
+        printf("\n*** Reconnected. Session resumed as ID %d ***\n> ", id);
+    } else {
+        printf("\n*** Successfully registered with server. Your ID is: %d (token %s) ***\n> ", id, chat_token(s));
+    }
+    fflush(stdout); // Reprint prompt after ID message
+    SetEvent(registered_event);
+}
 
-        if (bytes_received == SOCKET_ERROR) {
-            // Check if the error occurred while we were still actively connected
-            if (connected) {
-                int error_code = WSAGetLastError();
-                // Ignore error 10004 (WSAEINTR) which can happen if socket is closed while recv is blocking
-                if (error_code != WSAEINTR) {
-                    printf("\n[Receive Thread] recv failed. Connection lost? Error: %d\n", error_code);
-                }
-                connected = 0; // Signal main thread connection is lost
-            }
-            break; // Exit the receive loop on error
+// Print one message from the server
+void on_message(ChatSession *s, const char *buffer) {
+    if (batch_mode) {
+        const char *type = "TEXT"; // LIST and HISTORY output and anything unrecognised
+        if (strncmp(buffer, "MSG ", 4) == 0) {
+            type = "MSG";
+            received_msg++;
+            record_self_delivery(buffer, chat_id(session));
+        } else if (strncmp(buffer, "INFO ", 5) == 0) {
+            type = "INFO";
+            received_info++;
+        } else if (strncmp(buffer, "ERROR ", 6) == 0) {
+            type = "ERROR";
+            received_error++;
+        } else {
+            if (strncmp(buffer, "COMPRESS ", 9) == 0) type = "COMPRESS";
+            else if (strncmp(buffer, "FILE", 4) == 0) type = "FILE";
+            received_other++;
         }
-
-        if (bytes_received == 0) {
-            // Server closed the connection gracefully
-            if (connected) {
-                printf("\n[Receive Thread] Server closed the connection gracefully.\n");
-                connected = 0; // Signal main thread
-            }
-            break; // Exit the loop
+        batch_output(type, buffer);
+        return;
+    }
+    // Relayed user messages: "MSG <sender_id>: <message>" or "MSG <sender_id> (Broadcast): <message>"
+    if (strncmp(buffer, "MSG ", 4) == 0) {
+        printf("\n%s\n", buffer);
+    }
+    // Informational messages (e.g., user joined/left)
+    else if (strncmp(buffer, "INFO ", 5) == 0) {
+        printf("\n[%s]\n", buffer);
+    }
+    // Answer to the library's COMPRESS offer
+    else if (strncmp(buffer, "COMPRESS ", 9) == 0) {
+        printf("\n[Compression %s]\n", strncmp(buffer + 9, "ON", 2) == 0 ? "enabled" : "not available (dictionary mismatch)");
+    }
+    // File transfer progress for our own SENDFILE
+    else if (strncmp(buffer, "FILEPROGRESS ", 13) == 0 || strncmp(buffer, "FILEDONE ", 9) == 0 ||
+             strncmp(buffer, "FILEABORT ", 10) == 0) {
+        long long done = 0, total = 0;
+        double seconds = 0.0, mb_per_s = 0.0;
+        if (sscanf(buffer, "FILEPROGRESS %lld %lld", &done, &total) == 2) {
+            printf("\n[File transfer: %lld of %lld bytes relayed]\n", done, total);
+        } else if (sscanf(buffer, "FILEDONE %lld %lf %lf", &done, &seconds, &mb_per_s) == 3) {
+            printf("\n[File delivered: %lld bytes in %.2f s (%.1f MB/s at the server)]\n", done, seconds, mb_per_s);
+        } else {
+            printf("\n[File transfer aborted: %s]\n", buffer + 10);
         }
+    }
+    // Error messages from the server (e.g., target ID not found)
+    else if (strncmp(buffer, "ERROR ", 6) == 0) {
+        printf("\n[Server Error: %s]\n", buffer + 6);
+    }
+    // Anything else is a LIST or HISTORY response or other unformatted message
+    else {
+        printf("\n%s\n", buffer);
+    }
+    printf("> "); fflush(stdout); // Reprint prompt after the message
+}
+
+void on_reconnecting(ChatSession *s, int attempt, int attempts) {
+    if (batch_mode) {
+        char text[32];
+        sprintf(text, "%d/%d", attempt, attempts);
+        batch_output("RECONNECTING", text);
+        return;
+    }
+    printf("\n[Connection lost] Reconnecting (attempt %d of %d)...\n", attempt, attempts);
+    fflush(stdout);
+}
 
-        // Null-terminate the received data to treat it as a string
-        buffer[bytes_received] = '\0';
+void on_file_begin(ChatSession *s, int sender_id, long long size, const char *name) {
+    snprintf(incoming_name, sizeof(incoming_name), "received_%s", name);
+    incoming_file = CreateFileA(incoming_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (incoming_file == INVALID_HANDLE_VALUE) {
+        printf("\n[Cannot create '%s'; the incoming file will be discarded]\n", incoming_name);
+    }
+    QueryPerformanceCounter(&incoming_start);
+    if (batch_mode) {
+        char text[MAX_PATH + 64];
+        snprintf(text, sizeof(text), "BEGIN %d %lld %s", sender_id, size, incoming_name);
+        batch_output("FILE", text);
+        return;
+    }
+    printf("\n[Receiving '%s' (%lld bytes) from %d]\n> ", incoming_name, size, sender_id);
+    fflush(stdout);
+}
 
-        // --- Process different message types received from the server ---
+void on_file_data(ChatSession *s, const char *data, int len) {
+    DWORD written = 0;
+    if (incoming_file != INVALID_HANDLE_VALUE) WriteFile(incoming_file, data, len, &written, NULL);
+}
 
-        // If we haven't received our ID yet, check for the "ID " message
-        if (my_id == -1 && strncmp(buffer, "ID ", 3) == 0) {
-            // Attempt to parse the integer ID from the message
-            if (sscanf(buffer + 3, "%d", &my_id) == 1) {
-                printf("\n*** Successfully registered with server. Your ID is: %d ***\n", my_id);
-                 printf("> "); fflush(stdout); // Reprint prompt after ID message
-            } else {
-                 // Received "ID " but invalid format
-                 printf("\n[Receive Thread] Received invalid ID format from server: %s\n", buffer);
-                 connected = 0; // Cannot proceed without a valid ID
-                 break;
-            }
-        }
-        // Check for relayed user messages starting with "MSG "
-        else if (strncmp(buffer, "MSG ", 4) == 0) {
-            // Print the message directly. The server formats it as "MSG <sender_id>: <message>" or "MSG <sender_id> (Broadcast): <message>"
-            printf("\n%s\n", buffer);
-            printf("> "); fflush(stdout); // Reprint prompt after message
-        }
-        // Check for informational messages starting with "INFO "
-        else if (strncmp(buffer, "INFO ", 5) == 0) {
-            // Print informational messages (e.g., user joined/left)
-            printf("\n[%s]\n", buffer);
-            printf("> "); fflush(stdout); // Reprint prompt after info message
+void on_file_end(ChatSession *s, int complete, const char *reason) {
+    if (complete) {
+        LARGE_INTEGER end, frequency, size;
+        QueryPerformanceCounter(&end);
+        QueryPerformanceFrequency(&frequency);
+        double seconds = (double)(end.QuadPart - incoming_start.QuadPart) / (double)frequency.QuadPart;
+        size.QuadPart = 0;
+        if (incoming_file != INVALID_HANDLE_VALUE) GetFileSizeEx(incoming_file, &size);
+        if (batch_mode) {
+            char text[MAX_PATH + 64];
+            snprintf(text, sizeof(text), "END %lld %.3f %s", size.QuadPart, seconds, incoming_name);
+            batch_output("FILE", text);
+        } else {
+            printf("\n[Received '%s': %lld bytes in %.2f s (%.1f MB/s)]\n> ", incoming_name, size.QuadPart, seconds,
+                   seconds > 0.0 ? (size.QuadPart / (1024.0 * 1024.0)) / seconds : 0.0);
         }
-        // Check for error messages from the server starting with "ERROR "
-        else if (strncmp(buffer, "ERROR ", 6) == 0) {
-            // Print error messages from the server (e.g., target ID not found)
-            printf("\n[Server Error: %s]\n", buffer + 6); // Print message after "ERROR "
-            printf("> "); fflush(stdout); // Reprint prompt after error message
-        }
-        // Assume anything else is potentially a LIST response or other unformatted message
-        else {
-            // Print the received data directly (e.g., the list of clients)
-            printf("\n%s\n", buffer);
-            printf("> "); fflush(stdout); // Reprint prompt after list/other message
-        }
-    } // End of while(connected) receive loop
+    } else if (batch_mode) {
+        char text[MAX_PATH + 600];
+        snprintf(text, sizeof(text), "ABORT %s %s", incoming_name, reason != NULL ? reason : "incomplete");
+        batch_output("FILE", text);
+    } else {
+        printf("\n[Transfer of '%s' %s]\n> ", incoming_name, reason != NULL ? reason : "incomplete");
+    }
+    if (!batch_mode) fflush(stdout);
+    if (incoming_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(incoming_file);
+        incoming_file = INVALID_HANDLE_VALUE;
+        if (!complete) DeleteFileA(incoming_name); // Never leave a partial file behind
+    }
+}
+
+void on_file_sent(ChatSession *s, long long bytes, double seconds, int error) {
+    if (batch_mode) {
+        char text[96];
+        sprintf(text, "SENT %lld %.3f %s", bytes, seconds, error ? "FAILED" : "OK");
+        batch_output("FILE", text);
+        return;
+    }
+    if (error && bytes == 0) {
+        printf("\n[Server did not accept the file transfer]\n> ");
+    } else if (error) {
+        printf("\n[File transfer failed after %lld bytes]\n> ", bytes);
+    } else {
+        printf("\n[Sent %lld bytes in %.2f s (%.1f MB/s)]\n> ", bytes, seconds,
+               seconds > 0.0 ? (bytes / (1024.0 * 1024.0)) / seconds : 0.0);
+    }
+    fflush(stdout);
+}
 
-    printf("[Receive Thread] Exiting...\n");
-    connected = 0; // Ensure connection flag is 0 before exiting thread
+void on_closed(ChatSession *s) {
+    if (batch_mode) batch_output("CLOSED", "");
+    else if (connected) printf("\n[Disconnected from server]\n");
+    connected = 0;
+    SetEvent(registered_event); // Releases the main thread if it is still waiting for an ID
+}
 
-    // Note: The socket cleanup (closesocket) should ideally be handled by the main thread
-    // after signaling the receive thread to stop. This avoids potential race conditions
-    // where both threads try to close the socket.
+void on_virtual_opened(ChatSession *s, int first_id, int count) {
+    if (batch_mode) {
+        char text[32];
+        sprintf(text, "%d %d", first_id, count);
+        batch_output("VIDS", text);
+        return;
+    }
+    printf("\n[Virtual users %d-%d registered on this connection]\n> ", first_id, first_id + count - 1);
+    fflush(stdout);
+}
 
-    _endthreadex(0); // Cleanly exit the thread
-    return 0; // Should not be reached
-}
\ No newline at end of file
+// A message for our virtual users, prefixed with who it is for: "@5,6", "@*" or "@*-5"
+void on_virtual_message(ChatSession *s, const int *ids, int id_count, int exclude_id, const char *text) {
+    char tags[64];
+    int n = 0;
+    if (ids == NULL) {
+        n = exclude_id != -1 ? sprintf(tags, "@*-%d", exclude_id) : sprintf(tags, "@*");
+    } else {
+        for (int i = 0; i < id_count && n < (int)sizeof(tags) - 16; i++) {
+            n += sprintf(tags + n, i == 0 ? "@%d" : ",%d", ids[i]);
+        }
+    }
+    if (batch_mode) {
+        char *record = (char*)malloc(strlen(text) + n + 2);
+        if (record == NULL) return;
+        sprintf(record, "%s %s", tags, text);
+        if (strncmp(text, "MSG ", 4) == 0) received_msg++; else received_other++;
+        batch_output("VMSG", record);
+        free(record);
+        return;
+    }
+    printf("\n[%s] %s\n> ", tags, text);
+    fflush(stdout);
+}
@@ -0,0 +1,185 @@
+// cluster_bench.c
+// Cross-node benchmark for a multiClient cluster: one session on each of two nodes, and messages from the
+// first to the second, pipelined up to a window. Both sessions live in this process, so one clock
+// timestamps both ends and the latency is the true one-way delivery time (client -> node A -> link ->
+// node B -> client). Point both at the same node for a single-node baseline.
+//
+// Build: gcc cluster_bench.c chat_client.c -o cluster_bench -lws2_32 -lmswsock
+// Usage: cluster_bench <ip> <port> <ip> <port> [messages] [window]
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "chat_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define DEFAULT_MESSAGES 100000
+#define DEFAULT_WINDOW 256 // Messages in flight at once
+#define REGISTER_TIMEOUT_MS 10000 // How long both sessions may take to get their IDs
+#define IDLE_TIMEOUT_MS 5000 // Give up on the rest once nothing has arrived for this long
+
+// --- Global Variables ---
+// Everything runs on the main thread, which also runs the chat loop
+ChatLoop *loop = NULL;
+ChatSession *sender = NULL, *receiver = NULL;
+int sender_id = -1, receiver_id = -1;
+int sessions_closed = 0;
+
+int message_count = DEFAULT_MESSAGES;
+LARGE_INTEGER frequency;
+LONGLONG *sent_at = NULL; // Send time per sequence number
+unsigned char *delivered = NULL; // Per sequence number, so duplicates are not counted twice
+double *latency_ms = NULL;
+int received_count = 0, error_count = 0;
+ULONGLONG last_progress = 0;
+
+// --- Function Prototypes ---
+void on_registered(ChatSession *s, int id, int resumed);
+void on_message(ChatSession *s, const char *text);
+void on_closed(ChatSession *s);
+int compare_doubles(const void *a, const void *b);
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    WSADATA wsa;
+    int window = DEFAULT_WINDOW;
+    ChatCallbacks callbacks = { on_registered, on_message, NULL, NULL, NULL, NULL, NULL, on_closed, NULL, NULL };
+
+    if (argc < 5) {
+        printf("Usage: %s <ip> <port> <ip> <port> [messages] [window]\n", argv[0]);
+        printf("Sends from a session on the first node to a session on the second.\n");
+        return 1;
+    }
+    if (argc > 5) message_count = atoi(argv[5]);
+    if (argc > 6) window = atoi(argv[6]);
+    if (message_count <= 0 || window <= 0) {
+        printf("Messages and window must be positive.\n");
+        return 1;
+    }
+
+    sent_at = (LONGLONG*)calloc(message_count, sizeof(LONGLONG));
+    delivered = (unsigned char*)calloc(message_count, 1);
+    latency_ms = (double*)malloc(message_count * sizeof(double));
+    if (sent_at == NULL || delivered == NULL || latency_ms == NULL) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError());
+        return 1;
+    }
+    loop = chat_loop_create();
+    if (loop == NULL) {
+        printf("Could not create the chat loop. Error: %lu\n", GetLastError());
+        WSACleanup();
+        return 1;
+    }
+    sender = chat_connect(loop, argv[1], atoi(argv[2]), &callbacks, NULL);
+    receiver = chat_connect(loop, argv[3], atoi(argv[4]), &callbacks, NULL);
+    if (sender == NULL || receiver == NULL) {
+        printf("Invalid server IP address.\n");
+        return 1;
+    }
+
+    // 1. Both sessions need their IDs before anything can be addressed
+    ULONGLONG deadline = GetTickCount64() + REGISTER_TIMEOUT_MS;
+    while ((sender_id == -1 || receiver_id == -1) && !sessions_closed && GetTickCount64() < deadline) {
+        chat_loop_run(loop, 100);
+    }
+    if (sender_id == -1 || receiver_id == -1) {
+        printf("Could not register on both nodes.\n");
+        return 1;
+    }
+    printf("Sender ID %d on %s:%s, receiver ID %d on %s:%s\n", sender_id, argv[1], argv[2], receiver_id, argv[3], argv[4]);
+    printf("Sending %d messages with up to %d in flight...\n", message_count, window);
+
+    // 2. Keep the window full until everything has arrived or the stream stalls
+    LARGE_INTEGER start, end;
+    int sent = 0;
+    QueryPerformanceCounter(&start);
+    last_progress = GetTickCount64();
+    while (received_count < message_count && !sessions_closed && GetTickCount64() - last_progress < IDLE_TIMEOUT_MS) {
+        while (sent < message_count && sent - received_count < window) {
+            char message[32];
+            LARGE_INTEGER now;
+            sprintf(message, "BENCH %d", sent);
+            QueryPerformanceCounter(&now);
+            sent_at[sent] = now.QuadPart;
+            if (!chat_send_to(sender, receiver_id, message)) break;
+            sent++;
+        }
+        chat_loop_run(loop, 100);
+    }
+    QueryPerformanceCounter(&end);
+
+    // 3. Report
+    double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    printf("\n--- Cluster Benchmark ---\n");
+    printf("Delivered: %d of %d in %.3f s (%.0f messages/s)\n", received_count, message_count, seconds,
+           seconds > 0.0 ? received_count / seconds : 0.0);
+    if (sent > received_count) printf("Lost or late: %d\n", sent - received_count);
+    if (error_count > 0) printf("Errors reported to the sender: %d\n", error_count);
+    if (received_count > 0) {
+        double sum = 0.0;
+        qsort(latency_ms, received_count, sizeof(double), compare_doubles);
+        for (int i = 0; i < received_count; i++) sum += latency_ms[i];
+        printf("Latency: min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+               latency_ms[0], sum / received_count, latency_ms[received_count / 2],
+               latency_ms[(int)(received_count * 0.99)], latency_ms[(int)(received_count * 0.999)],
+               latency_ms[received_count - 1]);
+    }
+
+    // 4. Cleanup
+    if (!sessions_closed) {
+        chat_close(sender);
+        chat_close(receiver);
+    }
+    while (chat_loop_run(loop, 100) > 0) {
+    }
+    chat_loop_destroy(loop);
+    WSACleanup();
+    free(sent_at);
+    free(delivered);
+    free(latency_ms);
+    return 0;
+}
+
+// --- Session Callbacks ---
+
+void on_registered(ChatSession *s, int id, int resumed) {
+    if (s == sender) sender_id = id; else receiver_id = id;
+}
+
+// Several relayed messages may arrive in one receive, so every "BENCH <seq>" in the text counts
+void on_message(ChatSession *s, const char *text) {
+    if (s == sender) {
+        if (strncmp(text, "ERROR ", 6) == 0) {
+            error_count++;
+            if (error_count == 1) printf("Server: %s\n", text);
+        }
+        return;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    for (const char *p = strstr(text, "BENCH "); p != NULL; p = strstr(p + 6, "BENCH ")) {
+        int seq = atoi(p + 6);
+        if (seq < 0 || seq >= message_count || sent_at[seq] == 0 || delivered[seq]) continue;
+        delivered[seq] = 1;
+        latency_ms[received_count++] = (double)(now.QuadPart - sent_at[seq]) * 1000.0 / (double)frequency.QuadPart;
+        last_progress = GetTickCount64();
+    }
+}
+
+void on_closed(ChatSession *s) {
+    sessions_closed++;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,159 @@
+// compress_codec.h
+// Message compression shared by the chat servers and clients (multiClient and multiclientUdp).
+//
+// A peer that negotiated "COMPRESS <version>" receives large messages as
+// "\x02Z <raw-len> <compressed-len>\n<payload>". The payload is a small LZ77 variant: sequences of
+// (token, literals, 16-bit offset, match length) where the window starts with a shared dictionary
+// of common chat text, so even short messages find matches. Both ends must use the same dictionary;
+// bump COMPRESS_DICT_VERSION whenever it changes.
+//
+// Header-only (static inline functions), so each program still builds from its own source files and
+// one that only decodes carries no encoder.
+#ifndef COMPRESS_CODEC_H
+#define COMPRESS_CODEC_H
+
+#include <stdint.h>
+#include <stdlib.h> // For malloc
+#include <string.h> // For memcpy
+
+#define COMPRESS_DICT_VERSION 1 // Bump whenever compress_dictionary changes
+#define COMPRESS_MARKER '\x02' // First byte of a compressed frame
+#define COMPRESS_HASH_BITS 12 // Match finder hash table size (4096 entries)
+#define COMPRESS_MIN_MATCH 4 // Shortest back-reference
+#define COMPRESS_MAX_OFFSET 65535 // Back-references are 16 bits
+
+// Shared compression dictionary (version COMPRESS_DICT_VERSION); frequent text sits at the end so it
+// is reachable with the shortest offsets.
+static const char compress_dictionary[] =
+    "{\"type\":\"status\",\"status\":\"ok\",\"state\":\"online\",\"timestamp\":\"2025-01-01T00:00:00Z\","
+    "\"user\":\"bot\",\"name\":\"\",\"message\":\"\",\"value\":null,\"count\":0,\"ok\":true,\"error\":false}, "
+    "ERROR User ID  not found or is inactive. INFO User  is offline. Message queued for delivery. "
+    "INFO User  has joined. INFO User  has left. INFO User  is now User  has timed out or left. "
+    "the and you that this with for are have what will be there about just your http://https://www. "
+    "MSG 1: MSG 2: MSG 3: MSG 1 (Broadcast): MSG 2 (Broadcast): MSG 3 (Broadcast): MSG  (Broadcast): ";
+
+// Hash of the next COMPRESS_MIN_MATCH bytes
+static inline unsigned int compress_hash(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+// Index the dictionary once into dict_table (1 << COMPRESS_HASH_BITS entries); every compression
+// starts from a copy of it
+static inline void compress_init(int* dict_table) {
+    const unsigned char *dict = (const unsigned char*)compress_dictionary;
+    int dict_len = (int)sizeof(compress_dictionary) - 1;
+    for (int i = 0; i < (1 << COMPRESS_HASH_BITS); i++) dict_table[i] = -1;
+    for (int pos = 0; pos + COMPRESS_MIN_MATCH <= dict_len; pos++) {
+        dict_table[compress_hash(dict + pos)] = pos;
+    }
+}
+
+// Append one sequence (literals, then a back-reference unless match_len is 0). Returns the new
+// output length, or -1 if it would not fit.
+static inline int compress_emit(unsigned char* out, int op, int cap, const unsigned char* literals, int literal_len, int offset, int match_len) {
+    int match_code = match_len ? match_len - COMPRESS_MIN_MATCH : 0;
+    if (op + 1 + literal_len / 255 + 1 + literal_len + 2 + match_code / 255 + 1 > cap) return -1;
+
+    unsigned char *token = out + op++;
+    *token = (unsigned char)(((literal_len < 15 ? literal_len : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_len >= 15) {
+        int n = literal_len - 15;
+        for (; n >= 255; n -= 255) out[op++] = 255;
+        out[op++] = (unsigned char)n;
+    }
+    memcpy(out + op, literals, literal_len);
+    op += literal_len;
+    if (match_len) {
+        out[op++] = (unsigned char)(offset & 0xFF);
+        out[op++] = (unsigned char)(offset >> 8);
+        if (match_code >= 15) {
+            int n = match_code - 15;
+            for (; n >= 255; n -= 255) out[op++] = 255;
+            out[op++] = (unsigned char)n;
+        }
+    }
+    return op;
+}
+
+// Compress a message against the shared dictionary into out (cap bytes), starting from the table
+// compress_init built. Returns the compressed length, or 0 if the result would not be smaller.
+static inline int compress_message(const int* dict_table, const char* message, int len, unsigned char* out, int cap) {
+    int dict_len = (int)sizeof(compress_dictionary) - 1;
+    int table[1 << COMPRESS_HASH_BITS];
+    // Matches may reach back into the dictionary, so it is laid out in front of the message
+    unsigned char *window = (unsigned char*)malloc((size_t)dict_len + len);
+    if (window == NULL) return 0;
+    memcpy(window, compress_dictionary, dict_len);
+    memcpy(window + dict_len, message, len);
+    memcpy(table, dict_table, sizeof(table));
+
+    int end = dict_len + len, pos = dict_len, anchor = dict_len, op = 0;
+    while (op >= 0 && pos + COMPRESS_MIN_MATCH <= end) {
+        unsigned int h = compress_hash(window + pos);
+        int candidate = table[h];
+        table[h] = pos;
+        if (candidate < 0 || pos - candidate > COMPRESS_MAX_OFFSET ||
+            memcmp(window + candidate, window + pos, COMPRESS_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        int match_len = COMPRESS_MIN_MATCH;
+        while (pos + match_len < end && window[candidate + match_len] == window[pos + match_len]) match_len++;
+        op = compress_emit(out, op, cap, window + anchor, pos - anchor, pos - candidate, match_len);
+        pos += match_len;
+        anchor = pos;
+    }
+    if (op >= 0) op = compress_emit(out, op, cap, window + anchor, end - anchor, 0, 0);
+    free(window);
+    return (op > 0 && op < len) ? op : 0;
+}
+
+// Expand a compressed payload into out, which must hold raw_len bytes. Back-references may reach
+// into the shared dictionary. Returns raw_len, or -1 if corrupt.
+static inline int decompress_message(const unsigned char* in, int len, char* out, int raw_len) {
+    const unsigned char *end = in + len;
+    int dict_len = (int)sizeof(compress_dictionary) - 1;
+    int op = 0;
+
+    while (in < end) {
+        int token = *in++;
+        int literal_len = token >> 4;
+        if (literal_len == 15) {
+            int b;
+            do {
+                if (in >= end) return -1;
+                b = *in++;
+                literal_len += b;
+            } while (b == 255);
+        }
+        if (literal_len > end - in || literal_len > raw_len - op) return -1;
+        memcpy(out + op, in, literal_len);
+        in += literal_len;
+        op += literal_len;
+        if (in >= end) break; // The last sequence carries literals only
+
+        if (end - in < 2) return -1;
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int match_len = (token & 15) + COMPRESS_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int b;
+            do {
+                if (in >= end) return -1;
+                b = *in++;
+                match_len += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > op + dict_len || match_len > raw_len - op) return -1;
+        // Byte by byte: the source may overlap what is being written
+        for (int i = 0; i < match_len; i++, op++) {
+            int from = op - offset;
+            out[op] = from >= 0 ? out[from] : compress_dictionary[dict_len + from];
+        }
+    }
+    return op == raw_len ? op : -1;
+}
+
+#endif
@@ -0,0 +1,91 @@
+// compress_report.c
+// Offline compression report: runs the chat servers' codec (compress_codec.h) over a captured
+// workload and prints what it would have saved. The input is either a batch-mode client capture
+// ("<ms>\t<type>\t<text>" per received message) or plain text, one message per line. Messages below
+// the servers' COMPRESS_MIN_SIZE go out raw there, so they are counted here the same way. Every
+// compressed message is decompressed again to check the round trip.
+//
+// Build: gcc compress_report.c -o compress_report
+// Usage: compress_report <capture> [min-size]
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress_codec.h"
+
+#define DEFAULT_MIN_SIZE 64 // Same as COMPRESS_MIN_SIZE in the servers
+#define MAX_LINE 65536
+#define FRAME_HEADER_MAX 32 // "\x02Z <raw-len> <compressed-len>\n"
+
+int main(int argc, char *argv[]) {
+    int dict_table[1 << COMPRESS_HASH_BITS];
+    static char line[MAX_LINE], check[MAX_LINE];
+    static unsigned char out[MAX_LINE];
+    LARGE_INTEGER frequency, start, end;
+    long long messages = 0, small = 0, compressed = 0, skipped = 0, corrupt = 0;
+    long long raw_bytes = 0, sent_bytes = 0, cpu_ticks = 0;
+    int min_size = DEFAULT_MIN_SIZE;
+
+    if (argc < 2) {
+        printf("Usage: %s <capture> [min-size]\n", argv[0]);
+        printf("Reports how the chat compression would do on a captured workload (batch-mode TSV or one message per line).\n");
+        return 1;
+    }
+    if (argc > 2) min_size = atoi(argv[2]);
+    FILE *capture = fopen(argv[1], "rb");
+    if (capture == NULL) {
+        printf("Could not open %s.\n", argv[1]);
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    compress_init(dict_table);
+
+    while (fgets(line, sizeof(line), capture) != NULL) {
+        char *text = line;
+        // Batch-mode records carry the message after the second tab
+        char *tab = strchr(line, '\t');
+        if (tab != NULL && strchr(tab + 1, '\t') != NULL) text = strchr(tab + 1, '\t') + 1;
+        int len = (int)strcspn(text, "\r\n");
+        if (len == 0) continue;
+        text[len++] = '\n'; // The servers send the line with its newline
+
+        messages++;
+        raw_bytes += len;
+        if (len < min_size) {
+            small++;
+            sent_bytes += len;
+            continue;
+        }
+
+        QueryPerformanceCounter(&start);
+        int clen = compress_message(dict_table, text, len, out, len);
+        QueryPerformanceCounter(&end);
+        cpu_ticks += end.QuadPart - start.QuadPart;
+        if (clen == 0) {
+            skipped++;
+            sent_bytes += len;
+            continue;
+        }
+        if (decompress_message(out, clen, check, len) != len || memcmp(check, text, len) != 0) corrupt++;
+        char header[FRAME_HEADER_MAX];
+        compressed++;
+        sent_bytes += sprintf(header, "%cZ %d %d\n", COMPRESS_MARKER, len, clen) + clen;
+    }
+    fclose(capture);
+
+    if (messages == 0) {
+        printf("No messages in %s.\n", argv[1]);
+        return 1;
+    }
+    long long attempts = compressed + skipped;
+    printf("%lld messages, %lld bytes (dictionary version %d, minimum %d bytes)\n", messages, raw_bytes, COMPRESS_DICT_VERSION, min_size);
+    printf("  below minimum: %lld, compressed: %lld, not smaller: %lld\n", small, compressed, skipped);
+    printf("  sent: %lld bytes instead of %lld (ratio %.2f, %.1f%% saved)\n", sent_bytes, raw_bytes,
+           (double)raw_bytes / (double)sent_bytes, 100.0 * (double)(raw_bytes - sent_bytes) / (double)raw_bytes);
+    printf("  compression CPU: %.2f us per attempted message\n",
+           attempts > 0 ? (double)cpu_ticks * 1000000.0 / (double)frequency.QuadPart / (double)attempts : 0.0);
+    if (corrupt > 0) printf("  ROUND TRIP FAILED for %lld messages\n", corrupt);
+    return corrupt > 0 ? 1 : 0;
+}
@@ -0,0 +1,252 @@
+// file_bench.c
+// File relay benchmark for the multiClient server: one session sends a large file (1 GB by default) to
+// another over loopback while a third keeps chatting to the recipient. Reports the transfer rate seen
+// by both ends and whether every chat message held back during the transfer arrived afterwards. All
+// sessions live on one chat loop in this process. To push more chat than the recipient's queue holds
+// (the rest waits in the offline log), build the server with RATE_ACTION RATE_OFF.
+//
+// Build: gcc file_bench.c chat_client.c -o file_bench -lws2_32 -lmswsock
+// Usage: file_bench <ip> <port> [megabytes] [chat-messages] [message-bytes]
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "chat_client.h"
+#include <stdio.h>
+#include <stdint.h> // For intptr_t
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define DEFAULT_MEGABYTES 1024
+#define DEFAULT_CHAT_MESSAGES 10000
+#define DEFAULT_MESSAGE_BYTES 1000
+#define BENCH_FILE_NAME "file_bench.tmp"
+#define WRITE_CHUNK (4 * 1024 * 1024) // Bytes per WriteFile while creating the test file
+#define REGISTER_TIMEOUT_MS 10000 // How long all sessions may take to get their IDs
+#define IDLE_TIMEOUT_MS 30000 // Give up once nothing has arrived for this long
+
+enum { SENDER, RECEIVER, CHATTER, SESSION_COUNT };
+
+// --- Global Variables ---
+// Everything runs on the main thread, which also runs the chat loop
+ChatLoop *loop = NULL;
+ChatSession *sessions[SESSION_COUNT];
+int ids[SESSION_COUNT] = { -1, -1, -1 };
+int registered = 0, sessions_closed = 0;
+
+LARGE_INTEGER frequency, file_started, file_ended;
+long long file_size = 0, file_received = 0;
+unsigned char file_expected = 0; // Next byte of the test pattern
+int file_begun = 0, file_done = 0, file_ok = 0, file_corrupt = 0;
+long long sent_bytes = 0;
+double sent_seconds = 0.0;
+int sent_done = 0, sent_error = 0;
+int chat_received = 0, chat_during_file = 0, error_count = 0;
+ULONGLONG last_progress = 0;
+
+// --- Function Prototypes ---
+int create_test_file(const char* path, long long size);
+void on_registered(ChatSession *s, int id, int resumed);
+void on_message(ChatSession *s, const char *text);
+void on_file_begin(ChatSession *s, int sender_id, long long size, const char *name);
+void on_file_data(ChatSession *s, const char *data, int len);
+void on_file_end(ChatSession *s, int complete, const char *reason);
+void on_file_sent(ChatSession *s, long long bytes, double seconds, int error);
+void on_closed(ChatSession *s);
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    WSADATA wsa;
+    int megabytes = DEFAULT_MEGABYTES, chat_messages = DEFAULT_CHAT_MESSAGES, message_bytes = DEFAULT_MESSAGE_BYTES;
+    ChatCallbacks callbacks = { on_registered, on_message, NULL, on_file_begin, on_file_data,
+                                on_file_end, on_file_sent, on_closed, NULL, NULL };
+
+    if (argc < 3) {
+        printf("Usage: %s <ip> <port> [megabytes] [chat-messages] [message-bytes]\n", argv[0]);
+        printf("Relays a file between two local sessions while a third chats to the recipient.\n");
+        return 1;
+    }
+    if (argc > 3) megabytes = atoi(argv[3]);
+    if (argc > 4) chat_messages = atoi(argv[4]);
+    if (argc > 5) message_bytes = atoi(argv[5]);
+    if (megabytes <= 0 || chat_messages < 0 || message_bytes <= 0 || message_bytes > 1900) {
+        printf("Megabytes must be positive, chat messages zero or more and message bytes 1..1900.\n");
+        return 1;
+    }
+
+    char *payload = (char*)malloc(message_bytes + 1);
+    if (payload == NULL) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    memset(payload, 'x', message_bytes);
+    payload[message_bytes] = '\0';
+    QueryPerformanceFrequency(&frequency);
+
+    printf("Creating a %d MB test file...\n", megabytes);
+    if (!create_test_file(BENCH_FILE_NAME, (long long)megabytes * 1024 * 1024)) {
+        printf("Could not create %s. Error: %lu\n", BENCH_FILE_NAME, GetLastError());
+        return 1;
+    }
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError());
+        DeleteFileA(BENCH_FILE_NAME);
+        return 1;
+    }
+    loop = chat_loop_create();
+    if (loop == NULL) {
+        printf("Could not create the chat loop. Error: %lu\n", GetLastError());
+        WSACleanup();
+        DeleteFileA(BENCH_FILE_NAME);
+        return 1;
+    }
+    for (int i = 0; i < SESSION_COUNT; i++) {
+        sessions[i] = chat_connect(loop, argv[1], atoi(argv[2]), &callbacks, (void*)(intptr_t)i);
+        if (sessions[i] == NULL) {
+            printf("Invalid server IP address.\n");
+            return 1;
+        }
+    }
+
+    // 1. Every session needs an ID before the file and the chat can be addressed
+    ULONGLONG deadline = GetTickCount64() + REGISTER_TIMEOUT_MS;
+    while (registered < SESSION_COUNT && !sessions_closed && GetTickCount64() < deadline) {
+        chat_loop_run(loop, 100);
+    }
+    if (registered < SESSION_COUNT) {
+        printf("Only %d of %d sessions registered.\n", registered, SESSION_COUNT);
+        return 1;
+    }
+
+    // 2. Start the file, and once the recipient is inside it, send all the chat
+    printf("Sending %d MB from ID %d to ID %d; ID %d sends %d chat message(s) of %d bytes meanwhile...\n",
+           megabytes, ids[SENDER], ids[RECEIVER], ids[CHATTER], chat_messages, message_bytes);
+    if (!chat_send_file(sessions[SENDER], ids[RECEIVER], BENCH_FILE_NAME)) {
+        printf("Could not start the file transfer.\n");
+        return 1;
+    }
+    int chat_sent = 0;
+    last_progress = GetTickCount64();
+    while (!sessions_closed && GetTickCount64() - last_progress < IDLE_TIMEOUT_MS) {
+        if (file_begun && !file_done) {
+            while (chat_sent < chat_messages && chat_send_to(sessions[CHATTER], ids[RECEIVER], payload)) chat_sent++;
+        }
+        if (file_done && sent_done && chat_received >= chat_sent && chat_sent == chat_messages) break;
+        if (file_done && sent_done && (sent_error || !file_ok)) break;
+        chat_loop_run(loop, 10);
+    }
+
+    // 3. Report
+    double file_seconds = (double)(file_ended.QuadPart - file_started.QuadPart) / (double)frequency.QuadPart;
+    printf("\n--- File Relay Benchmark ---\n");
+    if (sent_done) {
+        printf("Sender: %lld bytes in %.2f s (%.1f MB/s)%s\n", sent_bytes, sent_seconds,
+               sent_seconds > 0.0 ? sent_bytes / (1024.0 * 1024.0) / sent_seconds : 0.0, sent_error ? ", with an error" : "");
+    } else {
+        printf("Sender: did not finish.\n");
+    }
+    if (file_done) {
+        printf("Recipient: %lld of %lld bytes in %.2f s (%.1f MB/s), %s%s\n", file_received, file_size, file_seconds,
+               file_seconds > 0.0 ? file_received / (1024.0 * 1024.0) / file_seconds : 0.0,
+               file_ok ? "complete" : "aborted", file_corrupt ? ", CONTENT MISMATCH" : "");
+    } else {
+        printf("Recipient: %lld bytes, the file never ended.\n", file_received);
+    }
+    printf("Chat: %d of %d message(s) arrived (%d before the file ended), %d error(s)\n",
+           chat_received, chat_sent, chat_during_file, error_count);
+
+    // 4. Cleanup
+    if (!sessions_closed) {
+        for (int i = 0; i < SESSION_COUNT; i++) chat_close(sessions[i]);
+    }
+    while (chat_loop_run(loop, 100) > 0) {
+    }
+    chat_loop_destroy(loop);
+    WSACleanup();
+    DeleteFileA(BENCH_FILE_NAME);
+    free(payload);
+    return (file_ok && !file_corrupt && chat_received == chat_messages) ? 0 : 1;
+}
+
+// Write size bytes of a repeating 0..250 pattern, so the recipient can check every byte cheaply
+int create_test_file(const char* path, long long size) {
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    unsigned char *chunk = (unsigned char*)malloc(WRITE_CHUNK);
+    int ok = chunk != NULL;
+    unsigned char value = 0;
+    for (long long written = 0; ok && written < size; ) {
+        DWORD n = (size - written < WRITE_CHUNK) ? (DWORD)(size - written) : WRITE_CHUNK, done = 0;
+        for (DWORD i = 0; i < n; i++) {
+            chunk[i] = value;
+            value = (value == 250) ? 0 : value + 1;
+        }
+        ok = WriteFile(file, chunk, n, &done, NULL) && done == n;
+        written += n;
+    }
+    free(chunk);
+    CloseHandle(file);
+    if (!ok) DeleteFileA(path);
+    return ok;
+}
+
+// --- Session Callbacks ---
+
+void on_registered(ChatSession *s, int id, int resumed) {
+    ids[(int)(intptr_t)chat_user(s)] = id;
+    if (!resumed) registered++;
+}
+
+// Several messages may arrive in one receive: every "MSG <chatter>:" counts
+void on_message(ChatSession *s, const char *text) {
+    if (s != sessions[RECEIVER]) return;
+    last_progress = GetTickCount64();
+    for (const char *p = strstr(text, "MSG "); p != NULL; p = strstr(p + 4, "MSG ")) {
+        if (atoi(p + 4) != ids[CHATTER]) continue;
+        chat_received++;
+        if (!file_done) chat_during_file++;
+    }
+    if (strncmp(text, "ERROR ", 6) == 0) {
+        error_count++;
+        printf("%s\n", text);
+    }
+}
+
+void on_file_begin(ChatSession *s, int sender_id, long long size, const char *name) {
+    QueryPerformanceCounter(&file_started);
+    file_size = size;
+    file_begun = 1;
+    last_progress = GetTickCount64();
+}
+
+void on_file_data(ChatSession *s, const char *data, int len) {
+    unsigned char value = file_expected;
+    for (int i = 0; i < len; i++) {
+        if ((unsigned char)data[i] != value) file_corrupt = 1;
+        value = (value == 250) ? 0 : value + 1;
+    }
+    file_expected = value;
+    file_received += len;
+    last_progress = GetTickCount64();
+}
+
+void on_file_end(ChatSession *s, int complete, const char *reason) {
+    QueryPerformanceCounter(&file_ended);
+    file_done = 1;
+    file_ok = complete && file_received == file_size;
+    if (!complete) printf("File aborted: %s\n", reason);
+}
+
+void on_file_sent(ChatSession *s, long long bytes, double seconds, int error) {
+    sent_bytes = bytes;
+    sent_seconds = seconds;
+    sent_error = error;
+    sent_done = 1;
+    last_progress = GetTickCount64();
+}
+
+void on_closed(ChatSession *s) {
+    sessions_closed++;
+}
@@ -0,0 +1,208 @@
+// lane_bench.c
+// Control-plane benchmark for the multiClient server: several sessions flood one receiver with bulk
+// messages while the receiver keeps asking for LIST, a control reply that has to get through that
+// flood. Reports the LIST round-trip percentiles and how evenly the flooders shared the receiver's
+// connection. Every session lives on one chat loop in this process.
+//
+// Build: gcc lane_bench.c chat_client.c -o lane_bench -lws2_32 -lmswsock
+// Usage: lane_bench <ip> <port> [flooders] [seconds] [message-bytes]
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "chat_client.h"
+#include <stdio.h>
+#include <stdint.h> // For intptr_t
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define DEFAULT_FLOODERS 8
+#define DEFAULT_SECONDS 10
+#define DEFAULT_MESSAGE_BYTES 1000
+#define MAX_FLOODERS 64
+#define FLOOD_BUDGET (2 * 1024 * 1024) // Bytes in flight across all flooders (below the server's per-connection queue limit)
+#define PROBE_INTERVAL_MS 10 // Pause between a LIST reply and the next LIST
+#define MAX_PROBES 100000
+#define REGISTER_TIMEOUT_MS 10000 // How long all sessions may take to get their IDs
+
+// --- Global Variables ---
+// Everything runs on the main thread, which also runs the chat loop
+ChatLoop *loop = NULL;
+ChatSession *receiver = NULL;
+ChatSession *flooders[MAX_FLOODERS];
+int flooder_ids[MAX_FLOODERS];
+long long flood_sent[MAX_FLOODERS], flood_received[MAX_FLOODERS];
+int flooder_count = DEFAULT_FLOODERS;
+int registered = 0, sessions_closed = 0;
+
+LARGE_INTEGER frequency;
+LONGLONG probe_sent_at = 0; // 0 while no LIST is outstanding
+double *probe_ms = NULL;
+int probe_count = 0;
+
+// --- Function Prototypes ---
+void on_registered(ChatSession *s, int id, int resumed);
+void on_message(ChatSession *s, const char *text);
+void on_closed(ChatSession *s);
+int compare_doubles(const void *a, const void *b);
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    WSADATA wsa;
+    int seconds = DEFAULT_SECONDS, message_bytes = DEFAULT_MESSAGE_BYTES, window;
+    ChatCallbacks callbacks = { on_registered, on_message, NULL, NULL, NULL, NULL, NULL, on_closed, NULL, NULL };
+
+    if (argc < 3) {
+        printf("Usage: %s <ip> <port> [flooders] [seconds] [message-bytes]\n", argv[0]);
+        printf("Floods one session with messages and measures its LIST round trip meanwhile.\n");
+        return 1;
+    }
+    if (argc > 3) flooder_count = atoi(argv[3]);
+    if (argc > 4) seconds = atoi(argv[4]);
+    if (argc > 5) message_bytes = atoi(argv[5]);
+    if (flooder_count <= 0 || flooder_count > MAX_FLOODERS || seconds <= 0 || message_bytes <= 0 || message_bytes > 1900) {
+        printf("Flooders must be 1..%d, seconds positive and message bytes 1..1900.\n", MAX_FLOODERS);
+        return 1;
+    }
+
+    char *payload = (char*)malloc(message_bytes + 1);
+    probe_ms = (double*)malloc(MAX_PROBES * sizeof(double));
+    if (payload == NULL || probe_ms == NULL) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    window = FLOOD_BUDGET / (flooder_count * (message_bytes + 32)); // Messages per flooder sent but not yet received
+    if (window < 1) window = 1;
+    memset(payload, 'x', message_bytes);
+    payload[message_bytes] = '\0';
+    QueryPerformanceFrequency(&frequency);
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError());
+        return 1;
+    }
+    loop = chat_loop_create();
+    if (loop == NULL) {
+        printf("Could not create the chat loop. Error: %lu\n", GetLastError());
+        WSACleanup();
+        return 1;
+    }
+    receiver = chat_connect(loop, argv[1], atoi(argv[2]), &callbacks, (void*)(intptr_t)-1);
+    for (int i = 0; i < flooder_count; i++) {
+        flooder_ids[i] = -1;
+        flooders[i] = chat_connect(loop, argv[1], atoi(argv[2]), &callbacks, (void*)(intptr_t)i);
+        if (flooders[i] == NULL) receiver = NULL;
+    }
+    if (receiver == NULL) {
+        printf("Invalid server IP address.\n");
+        return 1;
+    }
+
+    // 1. Everyone needs an ID before the flood can be addressed and attributed
+    ULONGLONG deadline = GetTickCount64() + REGISTER_TIMEOUT_MS;
+    while (registered < flooder_count + 1 && !sessions_closed && GetTickCount64() < deadline) {
+        chat_loop_run(loop, 100);
+    }
+    if (registered < flooder_count + 1) {
+        printf("Only %d of %d sessions registered.\n", registered, flooder_count + 1);
+        return 1;
+    }
+    int receiver_id = chat_id(receiver);
+    printf("Receiver ID %d, %d flooder(s) sending %d-byte messages for %d s...\n", receiver_id, flooder_count, message_bytes, seconds);
+
+    // 2. Flood with every window full, and keep one LIST in flight on the receiver
+    LARGE_INTEGER start, now;
+    ULONGLONG next_probe = 0;
+    QueryPerformanceCounter(&start);
+    deadline = GetTickCount64() + (ULONGLONG)seconds * 1000;
+    while (!sessions_closed && GetTickCount64() < deadline) {
+        for (int i = 0; i < flooder_count; i++) {
+            while (flood_sent[i] - flood_received[i] < window && chat_send_to(flooders[i], receiver_id, payload)) {
+                flood_sent[i]++;
+            }
+        }
+        if (probe_sent_at == 0 && probe_count < MAX_PROBES && GetTickCount64() >= next_probe) {
+            QueryPerformanceCounter(&now);
+            probe_sent_at = now.QuadPart;
+            chat_send_command(receiver, "LIST");
+            next_probe = GetTickCount64() + PROBE_INTERVAL_MS;
+        }
+        chat_loop_run(loop, 1);
+    }
+    QueryPerformanceCounter(&now);
+
+    // 3. Report
+    double elapsed = (double)(now.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    long long total = 0, fewest = -1, most = 0;
+    for (int i = 0; i < flooder_count; i++) {
+        total += flood_received[i];
+        if (fewest == -1 || flood_received[i] < fewest) fewest = flood_received[i];
+        if (flood_received[i] > most) most = flood_received[i];
+    }
+    printf("\n--- Control Lane Benchmark ---\n");
+    printf("Bulk: %lld messages in %.2f s (%.0f messages/s, %.1f MB/s); per flooder fewest %lld, most %lld (%.2fx)\n",
+           total, elapsed, elapsed > 0.0 ? total / elapsed : 0.0,
+           elapsed > 0.0 ? total * (double)message_bytes / (1024.0 * 1024.0) / elapsed : 0.0,
+           fewest, most, fewest > 0 ? (double)most / (double)fewest : 0.0);
+    if (probe_count > 0) {
+        double sum = 0.0;
+        qsort(probe_ms, probe_count, sizeof(double), compare_doubles);
+        for (int i = 0; i < probe_count; i++) sum += probe_ms[i];
+        printf("LIST round trip under the flood (%d probes): min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+               probe_count, probe_ms[0], sum / probe_count, probe_ms[probe_count / 2],
+               probe_ms[(int)(probe_count * 0.99)], probe_ms[(int)(probe_count * 0.999)], probe_ms[probe_count - 1]);
+    } else {
+        printf("No LIST reply arrived during the flood.\n");
+    }
+
+    // 4. Cleanup
+    if (!sessions_closed) {
+        chat_close(receiver);
+        for (int i = 0; i < flooder_count; i++) chat_close(flooders[i]);
+    }
+    while (chat_loop_run(loop, 100) > 0) {
+    }
+    chat_loop_destroy(loop);
+    WSACleanup();
+    free(payload);
+    free(probe_ms);
+    return 0;
+}
+
+// --- Session Callbacks ---
+
+void on_registered(ChatSession *s, int id, int resumed) {
+    int i = (int)(intptr_t)chat_user(s);
+    if (i >= 0) flooder_ids[i] = id;
+    registered++;
+}
+
+// Several messages may arrive in one receive: every "MSG <sender>:" counts for its flooder
+void on_message(ChatSession *s, const char *text) {
+    if (s != receiver) return;
+    for (const char *p = strstr(text, "MSG "); p != NULL; p = strstr(p + 4, "MSG ")) {
+        int sender = atoi(p + 4);
+        for (int i = 0; i < flooder_count; i++) {
+            if (flooder_ids[i] == sender) {
+                flood_received[i]++;
+                break;
+            }
+        }
+    }
+    if (probe_sent_at != 0 && strstr(text, "--- Active Clients ---") != NULL) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        probe_ms[probe_count++] = (double)(now.QuadPart - probe_sent_at) * 1000.0 / (double)frequency.QuadPart;
+        probe_sent_at = 0;
+    }
+}
+
+void on_closed(ChatSession *s) {
+    sessions_closed++;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,107 @@
+// rate_limit.h
+// SEND flood protection shared by the chat servers (multiClient and multiclientUdp).
+//
+// Every sender has token buckets for messages and bytes, and a stricter one for broadcasts (each costs
+// a pass over every client). A SEND that finds a bucket empty gets RATE_ACTION. A RateLimit belongs to
+// one sender and is only charged by whichever thread runs that sender's commands, so a charge takes no
+// lock; the counters are shared and updated with interlocked operations.
+//
+// Header-only (static functions), like compress_codec.h, so each server still builds from its own
+// source file. Define RATE_ACTION before including it (or on the compiler command line) to change the
+// action.
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <windows.h>
+#include <stdio.h> // For sprintf
+
+#define RATE_OFF 0
+#define RATE_QUEUE 1 // Hold the sender's SENDs until the buckets refill (up to RATE_QUEUE_MAX_WAIT_MS)
+#define RATE_REJECT 2 // Refuse with an ERROR that says when to retry
+#define RATE_MUTE 3 // Refuse, then drop every SEND for RATE_MUTE_SECONDS
+#ifndef RATE_ACTION
+#define RATE_ACTION RATE_QUEUE
+#endif
+#define RATE_MESSAGES_PER_SEC 50
+#define RATE_MESSAGE_BURST 100
+#define RATE_BYTES_PER_SEC (64 * 1024)
+#define RATE_BYTE_BURST (128 * 1024) // A larger message needs a full bucket and leaves a debt
+#define RATE_BROADCASTS_PER_SEC 5
+#define RATE_BROADCAST_BURST 10
+#define RATE_QUEUE_MAX_WAIT_MS 1000 // A SEND that would wait longer is refused even in RATE_QUEUE
+#define RATE_MUTE_SECONDS 10
+
+// A token bucket. Tokens are kept in thousandths, so a rate per second refills rate units per millisecond.
+typedef struct {
+    LONG64 tokens; // May go negative in RATE_QUEUE: the debt is what holds the next SEND back
+    ULONGLONG updated; // GetTickCount64 at the last refill; 0 = not used yet (starts full)
+} TokenBucket;
+
+// Flood protection state of one sender; all zero is a fresh sender with full buckets
+typedef struct {
+    TokenBucket messages, bytes, broadcasts;
+    ULONGLONG muted_until; // GetTickCount64; 0 = not muted
+    long long limited; // SENDs delayed, refused or dropped
+} RateLimit;
+
+// Counters over every sender (STATS reports them)
+static volatile LONG64 rate_allowed = 0, rate_queued = 0, rate_rejected = 0, rate_dropped = 0, rate_mutes = 0;
+static const char *rate_action_names[] = { "off", "queue", "reject", "mute" };
+
+// Refill a bucket and return the milliseconds until it holds cost tokens (0 = it does now). A cost
+// above the burst only needs a full bucket, and leaves a debt behind.
+static LONG64 bucket_wait(TokenBucket* bucket, LONG64 cost, LONG64 rate, LONG64 burst, ULONGLONG now) {
+    if (bucket->updated == 0) bucket->tokens = burst * 1000;
+    else bucket->tokens += (LONG64)(now - bucket->updated) * rate;
+    if (bucket->tokens > burst * 1000) bucket->tokens = burst * 1000;
+    bucket->updated = now;
+    LONG64 missing = (cost < burst ? cost : burst) * 1000 - bucket->tokens;
+    return missing <= 0 ? 0 : (missing + rate - 1) / rate;
+}
+
+// Charge one SEND of len bytes (a broadcast also against the broadcast bucket). Returns 0 to run it
+// now, the milliseconds to hold it first (RATE_QUEUE; already charged), or -1 if it is refused, with
+// the ERROR for the sender in refusal (empty while a mute lasts: it was told once).
+static LONG64 rate_charge(RateLimit* limit, int len, int broadcast, char* refusal) {
+    ULONGLONG now = GetTickCount64();
+    refusal[0] = '\0';
+    if (RATE_ACTION == RATE_OFF) return 0;
+    if (now < limit->muted_until) {
+        InterlockedIncrement64(&rate_dropped);
+        limit->limited++;
+        return -1;
+    }
+
+    LONG64 wait = bucket_wait(&limit->messages, 1, RATE_MESSAGES_PER_SEC, RATE_MESSAGE_BURST, now);
+    LONG64 byte_wait = bucket_wait(&limit->bytes, len, RATE_BYTES_PER_SEC, RATE_BYTE_BURST, now);
+    if (byte_wait > wait) wait = byte_wait;
+    if (broadcast) {
+        LONG64 broadcast_wait = bucket_wait(&limit->broadcasts, 1, RATE_BROADCASTS_PER_SEC, RATE_BROADCAST_BURST, now);
+        if (broadcast_wait > wait) wait = broadcast_wait;
+    }
+    if (wait == 0 || (RATE_ACTION == RATE_QUEUE && wait <= RATE_QUEUE_MAX_WAIT_MS)) {
+        limit->messages.tokens -= 1000;
+        limit->bytes.tokens -= (LONG64)len * 1000;
+        if (broadcast) limit->broadcasts.tokens -= 1000;
+        if (wait == 0) {
+            InterlockedIncrement64(&rate_allowed);
+        } else {
+            InterlockedIncrement64(&rate_queued);
+            limit->limited++;
+        }
+        return wait;
+    }
+
+    limit->limited++;
+    if (RATE_ACTION == RATE_MUTE) {
+        limit->muted_until = now + RATE_MUTE_SECONDS * 1000;
+        InterlockedIncrement64(&rate_mutes);
+        sprintf(refusal, "ERROR Rate limit exceeded. You are muted for %d seconds.", RATE_MUTE_SECONDS);
+    } else {
+        InterlockedIncrement64(&rate_rejected);
+        sprintf(refusal, "ERROR Rate limit exceeded. Try again in %lld ms.", (long long)wait);
+    }
+    return -1;
+}
+
+#endif
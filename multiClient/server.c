@@ -1,23 +1,198 @@
 // server.c
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
+#define _CRT_RAND_S // For rand_s (resume tokens)
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0601
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601 // Windows 7: processor groups and the RSS query used for thread placement
+#endif
 
 #include <stdio.h>
 #include <winsock2.h>
+#include <mstcpip.h> // For SIO_QUERY_RSS_PROCESSOR_INFO
 #include <windows.h>
 #include <stdint.h>
 #include <process.h> // For _beginthreadex
 #include <string.h> // For strchr, strlen, memset, strcpy, strcat, strcspn
 #include <stdlib.h> // For sscanf, _stricmp, _strnicmp
+#include <time.h> // For the resume grace window
+#include <limits.h> // For INT_MAX
+#include "shm_ring.h" // Shared-memory transport for clients on this host
+#include "compress_codec.h" // Message compression shared with the clients
+#include "rate_limit.h" // SEND flood protection shared with the UDP server
 
 #pragma comment(lib, "ws2_32.lib")
 
-#define SERVER_PORT 9000
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 15 // ws2ipdef.h (Windows 10 1607+); older SDKs lack it
+#endif
+
+#define SERVER_PORT 9000 // Default when not run as a cluster node
 #define MAX_CLIENTS 100
 #define BUFFER_SIZE 2048
 #define INET_ADDRSTRLEN_IPV4 16 // Standard length for IPv4 dotted-decimal + null terminator
 #define BROADCAST_ID 101 // Define the special ID for broadcasting
 
+// --- Offline message log ---
+// Messages for issued-but-disconnected IDs are appended to memory-mapped segment files and
+// replayed when a client takes that ID back with LOGIN <id> <token>. The token is the one the ID
+// was issued with ("ID <id> TOKEN <token>"), so only its holder can claim the queued messages.
+#define OFFLINE_LOG_DIR "offline_log"
+#define OFFLINE_SEGMENT_SIZE (64 * 1024 * 1024) // Bytes per memory-mapped segment file
+#define OFFLINE_MAX_SEGMENTS 64 // Segment slots (live + sealed) kept open at once
+#define OFFLINE_INDEX_BUCKETS 1024 // Hash buckets for the per-recipient index
+#define OFFLINE_RECORD_MAGIC 0x324C464FU // "OFL2"; a zero magic marks the end of a segment
+#define OFFLINE_MAINTENANCE_INTERVAL_MS 1000 // Flush dirty pages / compact this often
+#define OFFLINE_COMPACT_LIVE_PERCENT 25 // Sealed segments with fewer live records are rewritten
+#define OFFLINE_REPLAY_BATCH 64 // Records per WSASend during replay
+
+// --- Message history ---
+// Broadcasts and INFO notices are kept in a fixed ring so late joiners can ask for them with HISTORY.
+#define HISTORY_MEMORY_BUDGET (4 * 1024 * 1024) // Upper bound for the ring's memory (rounded down to a power-of-two slot count)
+#define HISTORY_ENTRY_SIZE (BUFFER_SIZE + 64) // Largest formatted message stored per slot
+
+// --- Session resumption ---
+// Each client gets a token with its ID. If the connection drops, the slot is kept for a grace
+// window and everything sent to it is counted in a per-client byte stream whose tail is kept,
+// so "RESUME <token> <bytes-received>" on a new connection restores the ID and replays the gap.
+#define RESUME_TOKEN_LEN 32 // Hex characters
+#define RESUME_GRACE_SECONDS 30 // How long a dropped client's slot and ID are held
+#define RESUME_TAIL_SIZE (64 * 1024) // Outbound bytes kept per client for replay
+#define RESUME_HELLO_WAIT_MS 20 // How long a new connection may take to send RESUME before it gets a fresh ID (it is written right after connect, so it trails the handshake closely)
+
+// --- Accept path ---
+// Built for reconnect storms: a large backlog absorbs the SYN burst, and every wake-up drains the
+// non-blocking listener until it would block. A client that opens with "HELLO\n" (sent with the connect,
+// in the SYN when TCP Fast Open applies) gets its ID at once instead of after the RESUME wait.
+#define ACCEPT_BACKLOG 16384 // Requested with SOMAXCONN_HINT (Windows clamps it to 200..65535)
+#define ACCEPT_FAST_OPEN 1 // Enable TCP Fast Open on the listener (ignored where unsupported)
+
+// --- Placement ---
+// A connection's thread runs where its packets arrive: the socket's RSS processor (the CPU whose receive
+// queue the NIC steers the flow to) becomes the thread's ideal processor, and the thread is kept on that
+// CPU's NUMA node, so the scheduler only moves it where memory is local. Relay buffers come from the
+// same node. The server counts how many commands run on the RSS CPU, on its node, or elsewhere.
+#define PLACEMENT_ENABLED 1 // 0 leaves every thread where the scheduler puts it
+#define PLACEMENT_REPORT_INTERVAL 10000 // Print placement statistics every this many commands
+
+// --- Outbound scheduling ---
+// Nothing is sent while cs is held: deliveries are queued per connection and drained by a writer thread
+// per slot. Control traffic (IDs, replies, ERROR and INFO notices) always goes out first; bulk messages
+// wait in one queue per sender and are interleaved by deficit round robin, so a flooding sender delays
+// neither the control plane nor other senders. A small socket send buffer keeps the backlog in these
+// queues, where it can still be reordered, rather than in the kernel. Both kinds are bounded: a message
+// that does not fit is dropped and the sender of a direct message is told so, except that nothing is
+// dropped for a client that is not reading at all (detached, or receiving a file); it goes to the
+// offline log instead.
+#define OUTBOUND_CONTROL -1 // Flow of control traffic; bulk flows are keyed by sender ID
+#define OUTBOUND_BACKLOG 0 // Bulk flow of HISTORY output and offline replays (no client has ID 0)
+#define OUTBOUND_FLOWS 16 // Bulk queues per connection (senders hash onto them)
+#define OUTBOUND_QUANTUM 4096 // Bytes a bulk queue may send per round
+#define OUTBOUND_BATCH 16 // Queued items gathered into one WSASend
+#define OUTBOUND_QUEUE_LIMIT (4 * 1024 * 1024) // Bulk bytes queued for one connection before new bulk is dropped
+#define OUTBOUND_CONTROL_LIMIT (1024 * 1024) // Control bytes queued for one connection before new control traffic is dropped
+#define OUTBOUND_DROPPED -2 // deliver_to_client result when the message was neither queued nor logged
+#define OUTBOUND_SEND_BUFFER (64 * 1024) // SO_SNDBUF of client connections
+#define OUTBOUND_REPORT_INTERVAL 1000 // Print queueing latency every this many control messages
+#define OUTBOUND_LATENCY_BUCKETS 32 // Power-of-two microsecond histogram
+
+// --- Rate limiting ---
+// Limits and actions are in rate_limit.h. Every connection has its own buckets, and so does each virtual
+// session it carries, so a host of many sessions gets each of them a user's share. All of a connection's
+// buckets are charged by the connection's thread, so a charge takes no lock (a virtual session's is
+// charged under cs only because the registry is).
+
+// --- File transfer ---
+// SENDFILE <id> <size> <name> relays <size> raw bytes from the sender's connection to the target
+// through a small ring of reusable pages: each page is received once and handed to an overlapped
+// WSASend together with a "CHUNK <n>" header, so the payload is never parsed, formatted or copied again.
+#define FILE_RELAY_PAGES 4 // Pages in the relay ring (sends of earlier pages overlap the next recv)
+#define FILE_RELAY_PAGE_SIZE (256 * 1024) // Bytes per page
+#define FILE_PROGRESS_STEP (64LL * 1024 * 1024) // Send FILEPROGRESS to the sender every this many bytes
+#define FILE_NAME_MAX 255 // Longest file name passed through
+#define FILE_MARKER '\x01' // Starts a file frame on the recipient's stream, right after a newline
+
+// --- Compression ---
+// A client that sends "COMPRESS <version>" gets messages of COMPRESS_MIN_SIZE bytes or more as
+// "\n\x02Z <raw-len> <compressed-len>\n<payload>" frames. The codec and its dictionary are in
+// compress_codec.h, shared with the clients and the UDP server.
+#define COMPRESS_MIN_SIZE 64 // Shorter messages go out raw
+#define COMPRESS_REPORT_INTERVAL 1000 // Print compression statistics every this many compressed messages
+
+// --- Virtual sessions ---
+// One connection may carry many logical users (a bot host): VOPEN registers a range of IDs on it,
+// commands for one of them are sent as "@<id> <command>", and messages for them come back as tagged
+// frames. A virtual session is a registry entry only: no socket, thread or resume tail of its own.
+#define MAX_VIRTUAL_SESSIONS 32768 // Registry size across all connections
+#define VIRTUAL_BUCKETS 4096 // Hash buckets for ID lookup
+#define VIRTUAL_OPEN_MAX 4096 // IDs one VOPEN may register
+#define SESSION_MARKER '\x03' // Starts a tagged frame: "\n\x03@<id>[,<id>...] <len>\n<payload>"
+// Every frame (file, compressed, tagged) starts with a newline and then its marker, and clients only
+// look for markers right after a newline. Commands may not contain control characters, so neither
+// can appear in anyone's chat text.
+
+// --- Cluster ---
+// Several server processes can form one chat network: "server <my-index> <ip:port>,<ip:port>,..." with the
+// same node list on every node. The ID space is cut into blocks; each block belongs to one node, found by
+// consistent hashing, and a node only issues IDs from its own blocks. Nodes keep a TCP link to every peer
+// and forward messages for remote IDs and broadcasts over it, batching whatever queued up during a write.
+// A link is only accepted from the address listed for the node it claims to be, and, when the nodes share
+// a secret in the CHAT_CLUSTER_SECRET environment variable, only with that secret in its hello line.
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_VNODES 64 // Points per node on the hash ring
+#define ID_BLOCK_SIZE 4096 // IDs per ownership block (a VOPEN range always fits in one)
+#define CLUSTER_QUEUE_LIMIT (4 * 1024 * 1024) // Bytes queued for one peer before forwards are refused
+#define CLUSTER_RETRY_MS 1000 // Delay between attempts to (re)connect a peer link
+#define CLUSTER_SECRET_ENV "CHAT_CLUSTER_SECRET" // Environment variable holding the shared link secret
+#define CLUSTER_SECRET_MAX 64 // Longest secret; it may not contain whitespace
+
+// --- Hot restart ---
+// "server --takeover [...]" started beside a running server with the same arguments takes over its
+// listening socket, every connection and the session state through a named pipe, so an upgrade drops
+// no one. Connection threads park at their next wait for input, the old process duplicates each socket
+// into the new one (WSADuplicateSocket) and exits once the new process has imported everything.
+#define HANDOFF_PIPE_NAME "\\\\.\\pipe\\multiClientHandoff%d" // One per listening port
+#define HANDOFF_MAGIC 0x46444E48U // "HNDF"
+#define HANDOFF_PARK_TIMEOUT_MS 2000 // Connections still busy after this (a file relay) are handed over detached and RESUME
+#define HANDOFF_TRANSFER_TIMEOUT_MS 10000 // Once connections are parked, the whole transfer and ack must finish within this
+#define HANDOFF_EXIT_WAIT_MS 5000 // How long the new process waits for the old one to exit after the ack
+
+// --- Shared memory ---
+// A client on this host may move its connection onto a pair of shared-memory rings with "SHM" (layout
+// and protocol in shm_ring.h): the slot's writer copies output into one ring instead of calling WSASend,
+// the connection thread reads commands from the other, and the TCP connection, now silent, only tells
+// us when the client has gone. Everything above the transport (registry, queues, resume tail) is shared.
+#define SHM_LOCAL_PREFIX "127." // Only clients connecting from a loopback address may attach
+
+// One queued delivery; its len bytes follow the header
+typedef struct OutboundItem {
+    struct OutboundItem *next;
+    LONG64 queued_at; // QueryPerformanceCounter at enqueue
+    int control;
+    int replay; // A RESUME handshake and replay: its bytes are already in the stream, so the tail skips them
+    int len;
+    char data[1];
+} OutboundItem;
+
+// FIFO of queued deliveries (deficit is only used by bulk flows)
+typedef struct {
+    OutboundItem *head, *tail;
+    int deficit;
+} OutboundQueue;
+
+// A connection moved onto shared memory. Owned by its connection thread; the slot's writer only uses
+// it while holding a writer_busy count, so the thread unmaps it once that has dropped to zero.
+typedef struct {
+    char name[SHM_NAME_MAX];
+    HANDLE mapping;
+    char *base;
+    ShmRing commands, output; // Client -> server, server -> client
+    volatile LONG closed; // The connection is over: a writer waiting for room gives up
+    int writer_busy; // Guarded by cs
+    WSAEVENT socket_event; // FD_CLOSE of the silent TCP connection
+    int peer_closed;
+} ShmLink;
+
 // Structure to hold client information
 typedef struct {
     int id;
@@ -25,30 +200,353 @@ typedef struct {
     char ip[INET_ADDRSTRLEN_IPV4]; // Use defined constant
     // Removed thread_handle as it was not effectively used
     int active; // Flag to indicate if the slot is in use
+    char resume_token[RESUME_TOKEN_LEN + 1]; // Secret the client presents with RESUME
+    unsigned long long stream_offset; // Total bytes sent (or buffered) to this client so far
+    char *tail; // Last RESUME_TAIL_SIZE bytes of that stream, indexed by offset % RESUME_TAIL_SIZE
+    time_t detached_since; // 0 while connected; when the connection dropped otherwise
+    int receiving_file; // A SENDFILE relay owns the socket; other output stays queued meanwhile
+    int compress; // Negotiated dictionary version; 0 sends everything raw
+    int virtual_head; // First virtual session carried by this connection (-1 if none)
+    int virtual_count;
+    int handoff_parked; // Hot restart: the connection's thread stopped reading (after a takeover: has yet to start)
+    char *handoff_pending; // Input that thread had read but not handled yet
+    int handoff_pending_len;
+    int handoff_line_mode;
+    OutboundQueue control_queue; // Outbound scheduling: drained before any bulk queue
+    OutboundQueue bulk_queues[OUTBOUND_FLOWS];
+    int bulk_cursor; // Deficit round robin position
+    int bulk_bytes; // Queued bulk bytes, bounded by OUTBOUND_QUEUE_LIMIT
+    int control_bytes; // Queued control bytes, bounded by OUTBOUND_CONTROL_LIMIT
+    int spilled; // Detached or receiving a file when its bulk queue filled: bulk went to the offline log, and
+                 // later bulk follows it there until the client reads again (RESUME or the end of the file)
+    int writing; // The writer is sending outside cs; a file relay waits for it
+    HANDLE outbound_ready; // Wakes the slot's writer thread (both created on the slot's first use)
+    ShmLink *shm; // Output goes to shared memory instead of the socket; NULL for plain TCP
 } Client;
 
+// A logical user carried by another client's connection. Free entries are chained through next_in_bucket.
+typedef struct {
+    int id; // -1 while free
+    int host; // Index in clients[] of the connection carrying it
+    int next_in_bucket; // ID hash chain
+    int next_on_host; // The host's other virtual sessions
+    RateLimit rate; // The session's own SEND limit, charged by the host connection's thread
+} VirtualSession;
+
+// A message compressed at most once, however many recipients it has (built on first use)
+typedef struct {
+    char *data; // Frame header + payload
+    int len;
+    int state; // 0 = not tried yet, 1 = built, -1 = not worth compressing
+} CompressedFrame;
+
+
+// Compression counters, updated under cs
+typedef struct {
+    long long compressed; // Messages compressed
+    long long skipped; // Messages that did not shrink
+    long long input_bytes, output_bytes; // Totals over compressed messages (frame headers included)
+    long long cpu_ticks; // QueryPerformanceCounter ticks spent compressing
+    long long egress_raw, egress_sent; // Bytes offered to compressing clients vs. bytes actually sent
+} CompressionStats;
+
+// One page of the file relay ring
+typedef struct {
+    char *data; // FILE_RELAY_PAGE_SIZE bytes, page aligned
+    char header[32]; // "CHUNK <n>\n"
+    WSABUF buffers[2];
+    WSAOVERLAPPED send_overlapped;
+    int send_pending;
+} FileRelayPage;
+
+// On-disk record header; the formatted message ("MSG <sender>: <text>\n") follows it
+typedef struct {
+    uint32_t magic;        // OFFLINE_RECORD_MAGIC once the record is fully written
+    uint32_t length;       // Payload bytes after the header
+    int32_t recipient_id;  // Who the message is waiting for
+    uint32_t delivered;    // Set after replay; compaction discards delivered records
+    uint64_t seq;          // Global append order
+    char token[RESUME_TOKEN_LEN]; // The recipient's LOGIN secret, so it survives a restart
+} OfflineRecordHeader;
+
+// One memory-mapped segment file
+typedef struct {
+    unsigned int number;   // File name suffix, increases monotonically
+    HANDLE file;
+    HANDLE mapping;
+    char *base;            // Mapped view, NULL if the slot is unused
+    size_t used;           // Append offset
+    size_t flushed;        // Bytes already handed to FlushViewOfFile
+    int live_records;      // Records not yet delivered
+    int total_records;
+    int pins;              // Replays currently sending straight from this mapping
+    int delivered_dirty;   // Delivered flags changed since the last flush
+} OfflineSegment;
+
+// In-memory index node: where one undelivered record lives
+typedef struct OfflineIndexNode {
+    int segment;           // Slot in offline_segments
+    size_t offset;         // Offset of the record header
+    struct OfflineIndexNode *next;
+} OfflineIndexNode;
+
+// Per-recipient queue, kept in append order
+typedef struct OfflineRecipient {
+    int recipient_id;
+    char token[RESUME_TOKEN_LEN + 1]; // What LOGIN must present; "" = the ID cannot be reclaimed
+    OfflineIndexNode *head, *tail;
+    struct OfflineRecipient *next; // Hash chain
+} OfflineRecipient;
+
+// One history ring slot. seq is 0 while a writer is filling the slot and the entry's
+// sequence number once it is complete, so readers can detect torn copies without locking.
+typedef struct {
+    volatile LONG64 seq;
+    volatile LONG writer; // Only contended if the ring wraps during a single write
+    int length;
+    char data[HISTORY_ENTRY_SIZE];
+} HistorySlot;
+
+// Start of a hot restart handoff. client_count HandoffClient records follow, then virtual_count
+// (id, host slot) pairs, then one (length, data) entry per history sequence number from
+// history_first_seq up to history_next_seq (length -1 for an entry that was being rewritten).
+typedef struct {
+    uint32_t magic; // HANDOFF_MAGIC
+    DWORD old_pid;
+    LONG64 started_at; // QueryPerformanceCounter when the old process began the handoff
+    int next_client_id;
+    int client_count;
+    int virtual_count;
+    LONG64 history_first_seq, history_next_seq;
+    WSAPROTOCOL_INFOA listener;
+} HandoffHeader;
+
+// One client slot in a handoff; its unhandled input (pending_len bytes), resume tail (tail_len
+// bytes, oldest first) and not yet sent output (queued_len bytes, in send order) follow it
+typedef struct {
+    int slot, id;
+    char ip[INET_ADDRSTRLEN_IPV4];
+    char resume_token[RESUME_TOKEN_LEN + 1];
+    unsigned long long stream_offset;
+    int compress;
+    time_t detached_since;
+    int spilled; // Its later bulk goes to the offline log, which the new process replays on RESUME
+    int has_socket; // 0: the slot arrives detached and its client has to RESUME
+    WSAPROTOCOL_INFOA socket_info;
+    int pending_len, line_mode, tail_len, queued_len;
+    int replay_len; // Leading queued bytes that are a RESUME replay, not to be counted in the stream again
+} HandoffClient;
+
 Client clients[MAX_CLIENTS];
 int next_client_id = 1; // Start normal IDs from 1
 CRITICAL_SECTION cs; // Critical section for synchronizing access to shared data (clients array, next_client_id)
 
+int compress_dict_table[1 << COMPRESS_HASH_BITS]; // Hash table after indexing the dictionary alone (compress_codec.h)
+CompressionStats compress_stats; // Guarded by cs
+
+// One point of the consistent-hash ring
+typedef struct {
+    uint32_t hash;
+    int node;
+} RingPoint;
+
+// A peer node. Records for it are appended to queue by any thread and written by its link thread,
+// which swaps the queue for an empty buffer so everything queued during one write goes out in the next.
+typedef struct {
+    char ip[INET_ADDRSTRLEN_IPV4];
+    int port;
+    CRITICAL_SECTION lock; // Guards queue and queue_len
+    char *queue, *sending; // Two buffers of CLUSTER_QUEUE_LIMIT bytes
+    int queue_len;
+    HANDLE wake; // Set when records are queued
+    volatile LONG connected;
+    volatile LONG64 records_forwarded, batches_written;
+} ClusterNode;
+
+VirtualSession virtual_sessions[MAX_VIRTUAL_SESSIONS];
+int virtual_buckets[VIRTUAL_BUCKETS];
+int virtual_free = -1; // Head of the free list
+int virtual_total = 0; // Registered virtual sessions
+
+// Cluster membership; fixed after startup, so read without locking
+ClusterNode cluster_nodes[CLUSTER_MAX_NODES];
+int cluster_size = 1; // 1 = standalone server
+int cluster_self = 0; // Our index in the node list
+RingPoint cluster_ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+int cluster_ring_size = 0;
+char cluster_secret[CLUSTER_SECRET_MAX + 1] = ""; // Empty = links are checked by address only
+int server_port = SERVER_PORT;
+
+// Offline log state, guarded by its own lock so appends never wait on the clients array
+CRITICAL_SECTION offline_cs;
+OfflineSegment offline_segments[OFFLINE_MAX_SEGMENTS];
+int offline_active_segment = -1; // Slot currently being appended to
+unsigned int offline_next_segment_number = 1;
+uint64_t offline_next_seq = 1;
+OfflineRecipient *offline_index[OFFLINE_INDEX_BUCKETS];
+
+// History ring: writers claim sequence numbers atomically, readers never take a lock
+HistorySlot *history_slots = NULL;
+LONG64 history_capacity = 0; // Power of two
+volatile LONG64 history_next_seq = 1; // Sequence number the next entry will get
+
+// Outbound queueing latency (enqueue to sent) over the last OUTBOUND_REPORT_INTERVAL control messages, guarded by cs
+long long outbound_control_latency[OUTBOUND_LATENCY_BUCKETS]; // Bucket b counts latencies below 2^b microseconds
+long long outbound_bulk_latency[OUTBOUND_LATENCY_BUCKETS];
+long long outbound_bulk_sent = 0, outbound_bulk_dropped = 0;
+long long outbound_bulk_spilled = 0; // Moved to the offline log for a detached client
+long long outbound_control_dropped = 0; // Control messages refused by a full control queue
+int outbound_control_count = 0;
+LARGE_INTEGER outbound_frequency;
+
+// Placement counters (commands handled, by where they ran relative to their socket's RSS processor)
+volatile LONG64 placement_commands = 0;
+volatile LONG64 placement_same_cpu = 0, placement_same_node = 0, placement_remote = 0, placement_unplaced = 0;
+
+// Hot restart state
+SOCKET listen_socket = INVALID_SOCKET;
+volatile LONG handoff_started = 0; // Set while connection threads are being parked
+volatile LONG handoff_busy = 0; // Connections being accepted or registered, which a handoff waits for
+SOCKET handoff_wake_socket = INVALID_SOCKET; // Loopback datagram socket in every wait for input; one datagram wakes them all
+HANDLE handoff_resume_event = NULL; // Set when a handoff is abandoned, to unpark the threads
+HANDLE handoff_io_event = NULL; // Completion event for the overlapped pipe reads and writes
+ULONGLONG handoff_deadline = 0; // GetTickCount64 time at which pipe I/O gives up
+
 // --- Function Prototypes ---
 // Thread function to handle communication with a single client
 unsigned __stdcall handle_client(void *arg);
-// Function to remove a client from the active list
-void remove_client(SOCKET client_socket);
+// Function to remove a client slot from the active list
+void remove_client(int client_index);
+// Function to keep a dropped client's slot around for RESUME
+void detach_client(SOCKET client_socket);
+// Function to check client input for bytes that could start a frame on another client's stream
+int has_control_characters(const char* text);
+// Functions that queue output for a client; its writer thread sends it and records it in the resume tail
+int deliver_to_client(int client_index, WSABUF* buffers, DWORD count, int flow);
+int send_to_socket(SOCKET client_socket, const char* data, int len);
+int send_vectored_to_socket(SOCKET client_socket, WSABUF* buffers, DWORD count, int flow);
+void append_to_tail(Client* client, const char* data, ULONG len);
+// Outbound scheduling: per-slot writer threads, the next item by priority, and the latency report
+int outbound_start(int client_index);
+OutboundItem* outbound_next(Client* client);
+OutboundItem* outbound_queue_replay(Client* client, int len);
+void outbound_clear(Client* client);
+int outbound_spill(int client_index);
+int outbound_spill_item(int client_index, const char* data, int len);
+unsigned __stdcall outbound_writer_thread(void *arg);
+void outbound_record(const OutboundItem* item, LONG64 sent_at);
+// Shared-memory transport for same-host clients
+ShmLink* shm_attach(SOCKET client_socket, const char* client_ip);
+void shm_detach(ShmLink* link);
+void shm_free(ShmLink* link);
+int shm_wait_for_input(ShmLink* link);
+int shm_recv(ShmLink* link, SOCKET s, char* out, int cap);
+int shm_send(ShmLink* link, WSABUF* buffers, DWORD count);
+// Function to take over a dropped (or dying) session on a new connection
+int resume_session(SOCKET client_socket, const char* token, unsigned long long last_offset, const char* client_ip);
+// Function to compare a presented secret (resume token, cluster secret) in constant time
+int secret_matches(const char* expected, const char* given);
+// Thread that frees slots whose grace window expired
+unsigned __stdcall session_reaper_thread(void *arg);
 // Function to send a message from one client to another
 void send_message_to_client(int target_id, const char* message, int sender_id);
 // Function to broadcast informational messages to all clients (excluding sender)
 void broadcast_info(const char* message, int exclude_id);
 // Function to broadcast a user message to all clients (excluding sender)
 void broadcast_message(const char* message, int sender_id);
+// Function to let a connected client take back a previously issued, now inactive ID
+int reclaim_client_id(SOCKET client_socket, int old_id, int wanted_id, const char* token);
+// Function to relay a file from one client's connection to another's. Returns 0 if the sender is gone.
+int relay_file(SOCKET sender_socket, int sender_id, int target_id, long long size, const char* name);
+// Function to deliver to any registered ID, connected or virtual. Caller holds cs.
+int deliver_to_id(int id, const char* message, int len);
+
+// Virtual sessions: registry, tagged delivery and the commands of a connection that hosts them
+void virtual_init(void);
+int virtual_find(int id);
+int virtual_open(int host, int count, int* first_id);
+void virtual_restore(int host, int id);
+void virtual_close(int index);
+int virtual_release_host(int host);
+int deliver_tagged(int host, const char* tags, int tags_len, const char* message, int len, int flow);
+int deliver_to_hosted(int host, const char* message, int len, int exclude_id, int flow);
+void handle_virtual_command(SOCKET client_socket, char* line);
+
+// Cluster: ID ownership, issuing IDs from our blocks, peer links and forwarding
+int cluster_init(int self, char* node_list);
+int cluster_owner(int id);
+int claim_client_ids(int count);
+int cluster_forward(int node, const char* record, int len);
+void cluster_forward_all(const char* record, int len);
+int notify_id(int id, const char* message);
+unsigned __stdcall cluster_link_thread(void *arg);
+int cluster_link_allowed(int node, const char* secret, const char* peer_ip);
+void handle_node_link(SOCKET node_socket, int node);
+void broadcast_local(const char* message, int len, int exclude_id, int flow);
+
+// Rate limiting: charge a SEND against a connection's buckets
+
+// Placement: pin a connection's thread near its receive queue and count where commands run
+int place_connection_thread(SOCKET s, PROCESSOR_NUMBER* rss_cpu, USHORT* rss_node);
+void placement_note(int placed, const PROCESSOR_NUMBER* rss_cpu, USHORT rss_node);
+USHORT placement_local_node(void);
+
+// Hot restart: parking connection threads, the old process's side of the pipe and the new one's
+void handoff_init(void);
+int wait_for_input(SOCKET s);
+void park_for_handoff(SOCKET client_socket, const char* pending, int pending_len, int line_mode);
+int adopt_handoff_client(SOCKET client_socket, int* client_id, char* pending, int* pending_len, int* line_mode);
+int handoff_io(HANDLE pipe, void* data, DWORD len, int writing, DWORD* done);
+int handoff_write(HANDLE pipe, const void* data, DWORD len);
+int handoff_read(HANDLE pipe, void* data, DWORD len);
+unsigned __stdcall handoff_listener_thread(void *arg);
+int hand_off(HANDLE pipe, DWORD new_pid);
+int handoff_send_client(HANDLE pipe, int slot, DWORD new_pid);
+int handoff_receive(HANDLE* old_process, LONG64* started_at);
+int handoff_receive_client(HANDLE pipe, int* adopted);
+
+// Compression: dictionary index, codec, and per-recipient delivery of raw or compressed messages
+int build_compressed_frame(const char* message, int len, CompressedFrame* frame);
+int deliver_message(int client_index, const char* message, int len, CompressedFrame* frame, int flow);
+
+// History ring: set up, record a message, and stream the backlog to a client
+int history_init(void);
+void history_append(const char* message);
+void send_history(SOCKET client_socket, int last_n, LONG64 since_seq);
+
+// Offline log: open/recover, append, replay and background maintenance
+int offline_log_open(void);
+OfflineRecipient* offline_find_recipient(int recipient_id, int create);
+int offline_map_segment(unsigned int number, int create);
+void offline_drop_segment(int slot);
+int offline_write_record(int recipient_id, uint64_t seq, const char* token, const char* payload, uint32_t len, int* out_segment, size_t* out_offset);
+int offline_log_append(int recipient_id, const char* message, int len);
+void offline_log_remember(int recipient_id, const char* token);
+int offline_log_check_token(int recipient_id, const char* token);
+int offline_log_replay(int recipient_id, SOCKET target_socket);
+void offline_log_compact(void);
+unsigned __stdcall offline_log_maintenance_thread(void *arg);
 
 // --- Main Function ---
-int main() {
+int main(int argc, char *argv[]) {
     WSADATA wsa;
-    SOCKET server_socket, client_socket;
+    SOCKET client_socket;
     struct sockaddr_in server, client;
     int c = sizeof(struct sockaddr_in);
+    int takeover = 0, adopted = 0;
+    HANDLE old_process = NULL;
+    LONG64 handoff_started_at = 0;
+
+    // Hot restart: take over the server already running with the same arguments
+    if (argc > 1 && strcmp(argv[1], "--takeover") == 0) {
+        takeover = 1;
+        argv[1] = argv[0];
+        argc--; argv++;
+    }
+    if (argc != 1 && argc != 3) {
+        printf("Usage: %s [--takeover] [<node-index> <ip:port>,<ip:port>,...]\n", argv[0]);
+        return 1;
+    }
 
     printf("Initializing Winsock...\n");
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
@@ -59,72 +557,216 @@ int main() {
 
     // Initialize the critical section for thread safety
     InitializeCriticalSection(&cs);
+    InitializeCriticalSection(&offline_cs);
+
+    // Cluster node: our listening port comes from our entry in the node list
+    if (argc == 3 && !cluster_init(atoi(argv[1]), argv[2])) {
+        printf("Invalid cluster configuration. Node index must be in range and every node given as ip:port.\n");
+        WSACleanup(); return 1;
+    }
+
+    compress_init(compress_dict_table);
+    QueryPerformanceFrequency(&outbound_frequency);
+
+    if (!history_init()) {
+        printf("Could not allocate the message history ring.\n");
+        WSACleanup(); return 1;
+    }
 
     // Initialize client array slots
     for(int i = 0; i < MAX_CLIENTS; ++i) {
         clients[i].active = 0;
         clients[i].socket = INVALID_SOCKET;
         clients[i].id = -1;
+        clients[i].virtual_head = -1;
+        clients[i].virtual_count = 0;
+        clients[i].handoff_parked = 0;
+        clients[i].handoff_pending = NULL;
         // clients[i].ip remains uninitialized, but won't be used if active is 0
     }
+    virtual_init();
+    handoff_init();
 
-    // Create server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (server_socket == INVALID_SOCKET) {
-        printf("Could not create socket. Error Code: %d\n", WSAGetLastError());
-        WSACleanup(); return 1;
+    if (takeover) {
+        adopted = handoff_receive(&old_process, &handoff_started_at);
+        if (adopted == -1) {
+            WSACleanup(); return 1;
+        }
+        // The old process still has the offline log mapped until it exits. If it is still running, it
+        // gave up before our ack arrived and kept serving: two servers must not share the connections.
+        if (old_process != NULL) {
+            if (WaitForSingleObject(old_process, HANDOFF_EXIT_WAIT_MS) != WAIT_OBJECT_0) {
+                printf("[Hot Restart] The old process is still running; it abandoned the handoff. Exiting.\n");
+                WSACleanup(); return 1;
+            }
+            CloseHandle(old_process);
+        }
     }
-    printf("Server socket created.\n");
-
-    // Prepare the sockaddr_in structure
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY; // Listen on any available network interface
-    server.sin_port = htons(SERVER_PORT);
 
-    // Bind the socket to the specified IP and port
-    if (bind(server_socket, (struct sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
-        printf("Bind failed. Error Code: %d\n", WSAGetLastError());
-        closesocket(server_socket); WSACleanup(); return 1;
+    // Recover queued messages from a previous run; IDs they are waiting for stay reserved
+    int highest_queued_id = offline_log_open();
+    if (highest_queued_id >= next_client_id) {
+        next_client_id = highest_queued_id + 1;
+    }
+    HANDLE reaperHandle = (HANDLE)_beginthreadex(NULL, 0, session_reaper_thread, NULL, 0, NULL);
+    if (reaperHandle == NULL) {
+        printf("Failed to create session reaper thread. Error code: %d\n", GetLastError());
+    } else {
+        CloseHandle(reaperHandle);
+    }
+    HANDLE maintenanceHandle = (HANDLE)_beginthreadex(NULL, 0, offline_log_maintenance_thread, NULL, 0, NULL);
+    if (maintenanceHandle == NULL) {
+        printf("Failed to create offline log maintenance thread. Error code: %d\n", GetLastError());
+    } else {
+        CloseHandle(maintenanceHandle);
     }
-    printf("Socket bound to port %d.\n", SERVER_PORT);
 
-    // Start listening for incoming connections
-    if (listen(server_socket, 5) == SOCKET_ERROR) { // Max 5 pending connections
-        printf("Listen failed. Error Code: %d\n", WSAGetLastError());
-        closesocket(server_socket); WSACleanup(); return 1;
+    // A takeover already has the listening socket
+    if (!takeover) {
+        // Create server socket
+        listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listen_socket == INVALID_SOCKET) {
+            printf("Could not create socket. Error Code: %d\n", WSAGetLastError());
+            WSACleanup(); return 1;
+        }
+        printf("Server socket created.\n");
+
+        // Prepare the sockaddr_in structure
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = INADDR_ANY; // Listen on any available network interface
+        server.sin_port = htons((u_short)server_port);
+
+        // Bind the socket to the specified IP and port
+        if (bind(listen_socket, (struct sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
+            printf("Bind failed. Error Code: %d\n", WSAGetLastError());
+            closesocket(listen_socket); WSACleanup(); return 1;
+        }
+        printf("Socket bound to port %d.\n", server_port);
+
+#if ACCEPT_FAST_OPEN
+        // Must be set before listen
+        DWORD fast_open = 1;
+        if (setsockopt(listen_socket, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&fast_open, sizeof(fast_open)) == SOCKET_ERROR) {
+            printf("TCP Fast Open unavailable. Error Code: %d\n", WSAGetLastError());
+        }
+#endif
+
+        // Start listening for incoming connections; those arriving during a hot restart wait in the backlog too
+        if (listen(listen_socket, SOMAXCONN_HINT(ACCEPT_BACKLOG)) == SOCKET_ERROR) {
+            printf("Listen failed. Error Code: %d\n", WSAGetLastError());
+            closesocket(listen_socket); WSACleanup(); return 1;
+        }
     }
+    // Non-blocking, so one wake-up can drain the whole backlog
+    u_long non_blocking = 1;
+    ioctlsocket(listen_socket, FIONBIO, &non_blocking);
 
-    printf("Server listening on port %d...\n", SERVER_PORT);
+    printf("Server listening on port %d...\n", server_port);
     printf("Broadcast ID is set to %d\n", BROADCAST_ID);
 
-    // Accept incoming connections and handle them in new threads
-    while ((client_socket = accept(server_socket, (struct sockaddr*)&client, &c)) != INVALID_SOCKET) {
-        printf("Connection accepted from %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-
-        // Create a new thread to handle the client
-        // Use uintptr_t for safe casting of the socket handle
-        uintptr_t client_socket_ptr = (uintptr_t)client_socket;
-        HANDLE threadHandle = (HANDLE)_beginthreadex(NULL, 0, handle_client, (void*)client_socket_ptr, 0, NULL);
+    // Peer links start once we can accept theirs
+    for (int i = 0; i < cluster_size; i++) {
+        if (i == cluster_self) continue;
+        HANDLE linkHandle = (HANDLE)_beginthreadex(NULL, 0, cluster_link_thread, (void*)(uintptr_t)i, 0, NULL);
+        if (linkHandle == NULL) {
+            printf("Failed to create link thread for node %d. Error code: %d\n", i, GetLastError());
+        } else {
+            CloseHandle(linkHandle);
+        }
+    }
 
-        if (threadHandle == NULL) {
-             printf("Failed to create thread for client. Error code: %d\n", GetLastError());
-             closesocket(client_socket); // Close the socket if thread creation fails
+    // A later version of this server can take over from us
+    if (handoff_wake_socket != INVALID_SOCKET) {
+        HANDLE handoffHandle = (HANDLE)_beginthreadex(NULL, 0, handoff_listener_thread, NULL, 0, NULL);
+        if (handoffHandle == NULL) {
+            printf("Failed to create hot restart thread. Error code: %d\n", GetLastError());
         } else {
-             // We don't need to wait on this thread handle, so close it to prevent resource leaks
-             CloseHandle(threadHandle);
+            CloseHandle(handoffHandle);
+        }
+    }
+
+    if (takeover) {
+        // Adopted connections carry on where their old threads stopped
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (!clients[i].active || !clients[i].handoff_parked) continue;
+            HANDLE threadHandle = (HANDLE)_beginthreadex(NULL, 0, handle_client, (void*)(uintptr_t)clients[i].socket, 0, NULL);
+            if (threadHandle == NULL) {
+                printf("Failed to create thread for adopted client %d. Error code: %d\n", clients[i].id, GetLastError());
+                clients[i].handoff_parked = 0;
+                free(clients[i].handoff_pending);
+                clients[i].handoff_pending = NULL;
+                detach_client(clients[i].socket);
+            } else {
+                CloseHandle(threadHandle);
+            }
         }
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+        printf("[Hot Restart] Took over %d connection(s); service gap %.1f ms.\n", adopted,
+               (double)(now.QuadPart - handoff_started_at) * 1000.0 / (double)frequency.QuadPart);
     }
 
-    // If the accept loop terminates, it's usually due to a critical error or server shutdown
-    if (client_socket == INVALID_SOCKET) {
-        printf("Accept failed. Error Code: %d\n", WSAGetLastError());
+    // Accept incoming connections and handle them in new threads
+    int accept_error = 0;
+    while (!accept_error) {
+        // During a hot restart new connections stay in the backlog for the next process
+        InterlockedIncrement(&handoff_busy);
+        if (!wait_for_input(listen_socket)) {
+            InterlockedDecrement(&handoff_busy);
+            park_for_handoff(INVALID_SOCKET, NULL, 0, 0);
+            continue;
+        }
+        // Take everything that is waiting, then wait again
+        int accepted = 0;
+        while (1) {
+            c = sizeof(struct sockaddr_in);
+            client_socket = accept(listen_socket, (struct sockaddr*)&client, &c);
+            if (client_socket == INVALID_SOCKET) {
+                int error = WSAGetLastError();
+                // The peer gave up while queued: not the listener's fault
+                if (error == WSAEWOULDBLOCK || error == WSAECONNRESET) break;
+                printf("Accept failed. Error Code: %d\n", error);
+                accept_error = 1;
+                break;
+            }
+            if (accepted++ > 0) InterlockedIncrement(&handoff_busy); // One count per connection being registered
+            u_long blocking = 0;
+            ioctlsocket(client_socket, FIONBIO, &blocking); // Accepted sockets inherit the listener's mode
+            printf("Connection accepted from %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+
+            // Create a new thread to handle the client
+            // Use uintptr_t for safe casting of the socket handle
+            uintptr_t client_socket_ptr = (uintptr_t)client_socket;
+            HANDLE threadHandle = (HANDLE)_beginthreadex(NULL, 0, handle_client, (void*)client_socket_ptr, 0, NULL);
+
+            if (threadHandle == NULL) {
+                 printf("Failed to create thread for client. Error code: %d\n", GetLastError());
+                 closesocket(client_socket); // Close the socket if thread creation fails
+                 InterlockedDecrement(&handoff_busy);
+            } else {
+                 // We don't need to wait on this thread handle, so close it to prevent resource leaks
+                 CloseHandle(threadHandle);
+            }
+        }
+        if (accepted == 0) InterlockedDecrement(&handoff_busy);
+        if (accepted > 1) printf("Accepted %d queued connections in one pass.\n", accepted);
     }
 
     printf("Shutting down server...\n");
+    // Make sure queued messages reach the disk
+    EnterCriticalSection(&offline_cs);
+    for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+        if (offline_segments[i].base != NULL) {
+            FlushViewOfFile(offline_segments[i].base, offline_segments[i].used);
+            FlushFileBuffers(offline_segments[i].file);
+        }
+    }
+    LeaveCriticalSection(&offline_cs);
     // Clean up the critical section
     DeleteCriticalSection(&cs);
     // Close the server listening socket
-    closesocket(server_socket);
+    closesocket(listen_socket);
     // Clean up Winsock
     WSACleanup();
     return 0;
@@ -138,13 +780,35 @@ unsigned __stdcall handle_client(void *arg) {
     char client_ip[INET_ADDRSTRLEN_IPV4] = {0}; // Initialize to zero
     int current_client_id = -1;
     int client_array_index = -1; // Store the index in the clients array
+    char pending[BUFFER_SIZE]; // Received bytes not yet handled as a command
+    int pending_len = 0;
+    int line_mode = 0;
+    RateLimit rate; // Flood protection for this connection's own SENDs (virtual sessions have their own)
+    memset(&rate, 0, sizeof(rate));
+    ShmLink *shm = NULL; // Set once the client moves onto shared memory
+
+    PROCESSOR_NUMBER rss_cpu;
+    USHORT rss_node = 0;
+    int placed = place_connection_thread(client_socket, &rss_cpu, &rss_node);
+
+    // A connection taken over in a hot restart is registered already and may have input read ahead
+    int adopted = adopt_handoff_client(client_socket, &current_client_id, pending, &pending_len, &line_mode);
+
+    // Output waits in the slot's queues, where control traffic can still overtake bulk, not in the kernel
+    int send_buffer = OUTBOUND_SEND_BUFFER;
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, (const char*)&send_buffer, sizeof(send_buffer));
 
     // Get client IP address
     struct sockaddr_in addr;
     int len = sizeof(addr);
     if (getpeername(client_socket, (struct sockaddr*)&addr, &len) == SOCKET_ERROR) {
          printf("getpeername failed for a new client. Error: %d\n", WSAGetLastError());
-         closesocket(client_socket);
+         if (adopted) {
+             detach_client(client_socket);
+         } else {
+             closesocket(client_socket);
+             InterlockedDecrement(&handoff_busy);
+         }
          _endthreadex(1); // Exit the thread
          return 1;
     }
@@ -152,19 +816,87 @@ unsigned __stdcall handle_client(void *arg) {
     strncpy(client_ip, inet_ntoa(addr.sin_addr), sizeof(client_ip) - 1);
     client_ip[sizeof(client_ip) - 1] = '\0'; // Ensure null termination
 
+    // A reconnecting client sends "RESUME <token> <bytes-received>\n" right away; give it a moment.
+    // A new one that says "HELLO\n" needs no wait at all.
+    fd_set read_set;
+    struct timeval hello_wait = { 0, RESUME_HELLO_WAIT_MS * 1000 };
+    FD_ZERO(&read_set);
+    FD_SET(client_socket, &read_set);
+    if (!adopted && select(0, &read_set, NULL, NULL, &hello_wait) == 1) {
+        int peeked = recv(client_socket, buffer, BUFFER_SIZE - 1, MSG_PEEK);
+        if (peeked > 7 && _strnicmp(buffer, "RESUME ", 7) == 0) {
+            char token[RESUME_TOKEN_LEN + 1] = {0};
+            unsigned long long last_offset = 0;
+            char *line_end;
+            buffer[peeked] = '\0';
+            line_end = strchr(buffer, '\n');
+            // Consume only the RESUME line; anything after it is a normal command
+            recv(client_socket, buffer, line_end ? (int)(line_end - buffer) + 1 : peeked, 0);
+            if (sscanf(buffer + 7, "%32s %llu", token, &last_offset) == 2) {
+                current_client_id = resume_session(client_socket, token, last_offset, client_ip);
+            }
+            if (current_client_id == -1) {
+                // Not resumable (unknown token, grace expired, or the gap left the tail): start over
+                const char *resume_failed = "ERROR Resume failed. Registering as a new client.\n";
+                send(client_socket, resume_failed, strlen(resume_failed), 0);
+            }
+        } else if (peeked >= 5 && _strnicmp(buffer, "HELLO", 5) == 0) {
+            char *line_end;
+            buffer[peeked] = '\0';
+            line_end = strchr(buffer, '\n');
+            recv(client_socket, buffer, line_end ? (int)(line_end - buffer) + 1 : peeked, 0);
+        } else if (peeked > 5 && _strnicmp(buffer, "NODE ", 5) == 0) {
+            // Another cluster node's link: "NODE <index> [<secret>]\n", then forwarded records until it drops
+            char secret[CLUSTER_SECRET_MAX + 1] = {0};
+            char *line_end;
+            int node = -1;
+            buffer[peeked] = '\0';
+            line_end = strchr(buffer, '\n');
+            recv(client_socket, buffer, line_end ? (int)(line_end - buffer) + 1 : peeked, 0);
+            buffer[line_end ? (int)(line_end - buffer) : peeked] = '\0';
+            sscanf(buffer + 5, "%d %64s", &node, secret);
+            InterlockedDecrement(&handoff_busy); // Links are not handed over; the peer reconnects
+            if (cluster_link_allowed(node, secret, client_ip)) {
+                handle_node_link(client_socket, node);
+            } else {
+                printf("Rejected a link from %s claiming to be node %d.\n", client_ip, node);
+            }
+            closesocket(client_socket);
+            _endthreadex(0);
+            return 0;
+        }
+    }
+
     // Register client in the shared clients array
     EnterCriticalSection(&cs);
-    for(int i = 0; i < MAX_CLIENTS; ++i) {
+    for(int i = 0; current_client_id == -1 && i < MAX_CLIENTS; ++i) {
         if (!clients[i].active) {
-            // Skip the broadcast ID if it happens to be the next available ID
-            if (next_client_id == BROADCAST_ID) {
-                 next_client_id++;
-            }
-            clients[i].id = next_client_id++;
+            // The slot's writer thread (started on its first use) sends everything queued for it
+            if (!outbound_start(i)) break;
+            // Next ID from a block this node owns (never the broadcast ID)
+            int new_id = claim_client_ids(1);
+            if (new_id == -1) break;
+            clients[i].id = new_id;
             clients[i].socket = client_socket;
             strncpy(clients[i].ip, client_ip, sizeof(clients[i].ip) - 1);
             clients[i].ip[sizeof(clients[i].ip) - 1] = '\0';
             clients[i].active = 1;
+            clients[i].stream_offset = 0;
+            clients[i].detached_since = 0;
+            clients[i].spilled = 0;
+            clients[i].receiving_file = 0;
+            clients[i].compress = 0;
+            clients[i].virtual_head = -1;
+            clients[i].virtual_count = 0;
+            if (clients[i].tail == NULL) {
+                clients[i].tail = (char*)malloc(RESUME_TAIL_SIZE); // Kept for the slot's lifetime
+            }
+            for (int t = 0; t < RESUME_TOKEN_LEN; t++) {
+                unsigned int r = 0;
+                rand_s(&r);
+                clients[i].resume_token[t] = "0123456789abcdef"[r & 15];
+            }
+            clients[i].resume_token[RESUME_TOKEN_LEN] = '\0';
             client_array_index = i; // Store the index
             current_client_id = clients[i].id;
             printf("Registered client ID %d (%s) at index %d\n", current_client_id, client_ip, client_array_index);
@@ -172,6 +904,7 @@ unsigned __stdcall handle_client(void *arg) {
         }
     }
     LeaveCriticalSection(&cs);
+    if (!adopted) InterlockedDecrement(&handoff_busy); // Registered (or refused): a handoff may park us now
 
     // Handle case where server is full
     if (current_client_id == -1) {
@@ -184,36 +917,74 @@ unsigned __stdcall handle_client(void *arg) {
         return 1;
     }
 
-    // Send the assigned ID to the client
-    sprintf(buffer, "ID %d", current_client_id);
-    if (send(client_socket, buffer, strlen(buffer), 0) == SOCKET_ERROR) {
-        printf("Failed to send ID to client %d. Error: %d\n", current_client_id, WSAGetLastError());
-        // Removal will be handled by the receive loop breaking or during cleanup
-        // remove_client(client_socket); // Avoid removing here, let the loop handle it
-        _endthreadex(1); // Exit the thread
-        return 1;
-    }
+    if (client_array_index != -1) {
+        // Send the assigned ID and resume token to the client (first bytes of its stream)
+        sprintf(buffer, "ID %d TOKEN %s", current_client_id, clients[client_array_index].resume_token);
+        if (send_to_socket(client_socket, buffer, strlen(buffer)) == SOCKET_ERROR) {
+            printf("Failed to send ID to client %d. Error: %d\n", current_client_id, WSAGetLastError());
+            // Removal will be handled by the receive loop breaking or during cleanup
+            // remove_client(client_socket); // Avoid removing here, let the loop handle it
+            _endthreadex(1); // Exit the thread
+            return 1;
+        }
 
-    // Broadcast client joined information to others
-    sprintf(buffer, "INFO User %d (%s) has joined.", current_client_id, client_ip);
-    broadcast_info(buffer, current_client_id); // Exclude the joining client
+        // Broadcast client joined information to others
+        sprintf(buffer, "INFO User %d (%s) has joined.", current_client_id, client_ip);
+        broadcast_info(buffer, current_client_id); // Exclude the joining client
+    }
+    // A resumed session keeps its ID silently: nobody saw it leave, so nobody sees it join
 
-    // Main receive loop for this client
+    // Main receive loop for this client. A receive without a newline is one command (typed input);
+    // once a client terminates commands with '\n' it may pipeline them, and the stream is split into lines.
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE); // Clear the buffer before receiving
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
+        char *line_end = line_mode ? (char*)memchr(pending, '\n', pending_len) : NULL;
+        if (line_end == NULL) {
+            if (pending_len >= BUFFER_SIZE - 1) {
+                // No newline within a whole buffer: drop the line rather than the connection
+                pending_len = 0;
+                sprintf(buffer, "ERROR Command too long.");
+                send_to_socket(client_socket, buffer, strlen(buffer));
+            }
+            // Block until input arrives; a hot restart parks the connection here instead
+            if (!(shm != NULL ? shm_wait_for_input(shm) : wait_for_input(client_socket))) {
+                park_for_handoff(client_socket, pending, pending_len, line_mode);
+                continue;
+            }
+            int bytes_received = (shm != NULL) ? shm_recv(shm, client_socket, pending + pending_len, BUFFER_SIZE - 1 - pending_len)
+                                               : recv(client_socket, pending + pending_len, BUFFER_SIZE - 1 - pending_len, 0);
 
-        if (bytes_received <= 0) {
-            // Handle disconnection (graceful or error)
-            if (bytes_received == 0) {
-                printf("Client ID %d disconnected gracefully.\n", current_client_id);
-            } else {
-                printf("recv failed for client ID %d. Error: %d.\n", current_client_id, WSAGetLastError());
+            if (bytes_received <= 0) {
+                // Handle disconnection (graceful or error)
+                if (bytes_received == 0) {
+                    printf("Client ID %d disconnected gracefully.\n", current_client_id);
+                } else {
+                    printf("recv failed for client ID %d. Error: %d.\n", current_client_id, WSAGetLastError());
+                }
+                break; // Exit the receive loop on disconnection
             }
-            break; // Exit the receive loop on disconnection
-        }
+            placement_note(placed, &rss_cpu, rss_node);
+            pending_len += bytes_received;
+            if (!line_mode && memchr(pending, '\n', pending_len) != NULL) line_mode = 1;
+            if (line_mode) continue; // Take complete lines from the top of the loop
 
-        buffer[bytes_received] = '\0'; // Null-terminate the received data
+            memcpy(buffer, pending, pending_len); // The whole receive is the command
+            buffer[pending_len] = '\0';
+            pending_len = 0;
+        } else {
+            int line_len = (int)(line_end - pending);
+            memcpy(buffer, pending, line_len);
+            buffer[line_len] = '\0';
+            if (line_len > 0 && buffer[line_len - 1] == '\r') buffer[line_len - 1] = '\0';
+            pending_len -= line_len + 1;
+            memmove(pending, line_end + 1, pending_len);
+            if (buffer[0] == '\0') continue; // Blank line
+        }
+        if (has_control_characters(buffer)) {
+            // A frame marker inside a message would let its recipient mistake chat for a frame
+            sprintf(buffer, "ERROR Commands and messages cannot contain control characters.");
+            send_to_socket(client_socket, buffer, strlen(buffer));
+            continue;
+        }
 
         // --- Process client commands ---
         if (_stricmp(buffer, "LIST") == 0) {
@@ -227,7 +998,8 @@ unsigned __stdcall handle_client(void *arg) {
             for (int i = 0; i < MAX_CLIENTS; i++) {
                 if (clients[i].active) {
                     char entry[128]; // Buffer for a single client entry
-                    sprintf(entry, "ID: %d (%s) %s\n", clients[i].id, clients[i].ip, (clients[i].id == current_client_id) ? "(You)" : "");
+                    sprintf(entry, "ID: %d (%s%s) %s\n", clients[i].id, clients[i].ip, clients[i].shm != NULL ? ", shared memory" : "",
+                            (clients[i].id == current_client_id) ? "(You)" : "");
                     // Check if adding this entry would overflow the response buffer
                     if (strlen(response) + strlen(entry) < sizeof(response) - 1) {
                         strcat(response, entry);
@@ -246,13 +1018,33 @@ unsigned __stdcall handle_client(void *arg) {
                     strcat(response, "(No active clients found)\n");
                  }
             }
+            // Virtual sessions are far too many to list one by one
+            EnterCriticalSection(&cs);
+            if (virtual_total > 0) {
+                char entry[128];
+                int hosted_here = 0;
+                for (int i = 0; i < MAX_CLIENTS; i++) {
+                    if (clients[i].active && clients[i].socket == client_socket) hosted_here = clients[i].virtual_count;
+                }
+                sprintf(entry, "Virtual sessions: %d (%d on your connection)\n", virtual_total, hosted_here);
+                if (strlen(response) + strlen(entry) < sizeof(response) - 1) strcat(response, entry);
+            }
+            LeaveCriticalSection(&cs);
+            if (cluster_size > 1) {
+                // Only this node's clients are listed; users on other nodes are still reachable by ID
+                char entry[128];
+                int links_up = 0;
+                for (int i = 0; i < cluster_size; i++) links_up += (i != cluster_self && cluster_nodes[i].connected);
+                sprintf(entry, "Cluster: node %d of %d, %d of %d peer link(s) up\n", cluster_self, cluster_size, links_up, cluster_size - 1);
+                if (strlen(response) + strlen(entry) < sizeof(response) - 1) strcat(response, entry);
+            }
             if (strlen(response) + strlen("----------------------\n") < sizeof(response) - 1) {
                 strcat(response, "----------------------\n");
             }
 
 
             // Send the generated list back to the requesting client
-            if (send(client_socket, response, strlen(response), 0) == SOCKET_ERROR) {
+            if (send_to_socket(client_socket, response, strlen(response)) == SOCKET_ERROR) {
                  printf("Failed to send list to client ID %d. Error: %d\n", current_client_id, WSAGetLastError());
                  break; // Assume connection lost if sending fails
             }
@@ -266,8 +1058,14 @@ unsigned __stdcall handle_client(void *arg) {
             if (message_start != NULL && sscanf(buffer + 5, "%d", &target_id) == 1) {
                 message_start++; // Move past the space to the start of the message
 
-                // Check if the message part is not empty
-                if (strlen(message_start) > 0) {
+                // Flood protection comes before any work is done for the message
+                char refusal[128];
+                LONG64 wait = (strlen(message_start) > 0) ? rate_charge(&rate, (int)strlen(message_start), target_id == BROADCAST_ID, refusal) : 0;
+                if (wait < 0) {
+                    // Refused; a muted connection only hears about it once
+                    if (refusal[0] != '\0') send_to_socket(client_socket, refusal, strlen(refusal));
+                } else if (strlen(message_start) > 0) { // Check if the message part is not empty
+                    if (wait > 0) Sleep((DWORD)wait); // RATE_QUEUE: this connection's commands wait, nobody else's do
                     // Check if the target ID is the special broadcast ID
                     if (target_id == BROADCAST_ID) {
                         printf("Client %d broadcasting: %s\n", current_client_id, message_start);
@@ -280,29 +1078,115 @@ unsigned __stdcall handle_client(void *arg) {
                 } else {
                     // Message is empty
                     sprintf(buffer, "ERROR Message cannot be empty.");
-                    send(client_socket, buffer, strlen(buffer), 0); // Send error back to sender
+                    send_to_socket(client_socket, buffer, strlen(buffer)); // Send error back to sender
                 }
             } else {
                 // Invalid SEND command format
                  sprintf(buffer, "ERROR Invalid SEND format. Use: SEND <id> <message>");
-                 send(client_socket, buffer, strlen(buffer), 0); // Send error back to sender
+                 send_to_socket(client_socket, buffer, strlen(buffer)); // Send error back to sender
+            }
+
+        } else if (_strnicmp(buffer, "HISTORY", 7) == 0) {
+            // Handle HISTORY command: HISTORY <n> for the last n entries, HISTORY SINCE <seq> for everything newer
+            long long since_seq = 0;
+            int last_n = 0;
+            if (_strnicmp(buffer, "HISTORY SINCE ", 14) == 0 && sscanf(buffer + 14, "%lld", &since_seq) == 1 && since_seq >= 0) {
+                send_history(client_socket, 0, (LONG64)since_seq);
+            } else if (sscanf(buffer + 7, "%d", &last_n) == 1 && last_n > 0) {
+                send_history(client_socket, last_n, -1);
+            } else {
+                sprintf(buffer, "ERROR Invalid HISTORY format. Use: HISTORY <n> or HISTORY SINCE <seq>");
+                send_to_socket(client_socket, buffer, strlen(buffer));
+            }
+
+        } else if (_strnicmp(buffer, "SENDFILE ", 9) == 0) {
+            // Handle SENDFILE command: the next <size> bytes on this connection are file data
+            int target_id = -1;
+            long long file_size = 0;
+            char file_name[FILE_NAME_MAX + 1];
+            if (shm != NULL) {
+                // The file's bytes would have to come through the command ring
+                sprintf(buffer, "ERROR SENDFILE is not available over shared memory.");
+                send_to_socket(client_socket, buffer, strlen(buffer));
+            } else if (sscanf(buffer + 9, "%d %lld %255s", &target_id, &file_size, file_name) == 3 && file_size > 0) {
+                if (!relay_file(client_socket, current_client_id, target_id, file_size, file_name)) {
+                    break; // Sender disconnected mid-transfer
+                }
+            } else {
+                sprintf(buffer, "ERROR Invalid SENDFILE format. Use: SENDFILE <id> <size> <name>");
+                send_to_socket(client_socket, buffer, strlen(buffer));
+            }
+
+        } else if (_strnicmp(buffer, "COMPRESS ", 9) == 0) {
+            // Negotiate compression: only the dictionary this server was built with can be used
+            int version = atoi(buffer + 9);
+            int accepted = (version == COMPRESS_DICT_VERSION);
+            sprintf(buffer, "COMPRESS %s %d", accepted ? "ON" : "OFF", COMPRESS_DICT_VERSION);
+            send_to_socket(client_socket, buffer, strlen(buffer)); // The reply itself is always raw
+            EnterCriticalSection(&cs);
+            for (int i = 0; i < MAX_CLIENTS; i++) {
+                if (clients[i].active && clients[i].socket == client_socket) {
+                    clients[i].compress = accepted ? version : 0;
+                    break;
+                }
+            }
+            LeaveCriticalSection(&cs);
+
+        } else if (_strnicmp(buffer, "LOGIN ", 6) == 0) {
+            // Handle LOGIN command: take back an earlier ID and receive messages queued for it
+            int wanted_id = -1;
+            char token[RESUME_TOKEN_LEN + 1] = {0};
+            if (sscanf(buffer + 6, "%d %32s", &wanted_id, token) == 2 &&
+                reclaim_client_id(client_socket, current_client_id, wanted_id, token)) {
+                int previous_id = current_client_id;
+                current_client_id = wanted_id;
+                // The connection now resumes (and later logs in again) with that ID's token
+                sprintf(buffer, "ID %d TOKEN %s", current_client_id, token);
+                send_to_socket(client_socket, buffer, strlen(buffer));
+                sprintf(buffer, "INFO User %d (%s) is now User %d.", previous_id, client_ip, current_client_id);
+                broadcast_info(buffer, current_client_id);
+                int replayed = offline_log_replay(current_client_id, client_socket);
+                if (replayed > 0) {
+                    printf("Replayed %d queued message(s) to client ID %d\n", replayed, current_client_id);
+                }
+            } else {
+                sprintf(buffer, "ERROR Cannot log in as that ID. Use LOGIN <id> <token> with the token the ID was issued with; it must not be connected.");
+                send_to_socket(client_socket, buffer, strlen(buffer));
+            }
+
+        } else if (_strnicmp(buffer, "VOPEN ", 6) == 0 || buffer[0] == '@') {
+            // Virtual sessions: "VOPEN <count>" registers IDs on this connection, "@<id> <command>" acts as one
+            handle_virtual_command(client_socket, buffer);
+
+        } else if (_stricmp(buffer, "SHM") == 0) {
+            // Handle SHM command: move this connection onto shared-memory rings (clients on this host)
+            if (shm == NULL) {
+                shm = shm_attach(client_socket, client_ip);
+            } else {
+                sprintf(buffer, "ERROR This connection already uses shared memory.");
+                send_to_socket(client_socket, buffer, strlen(buffer));
             }
 
+        } else if (_stricmp(buffer, "STATS") == 0) {
+            // Handle STATS command: flood protection counters, server-wide and for this connection
+            sprintf(buffer, "STATS rate-limit %s: %lld allowed, %lld queued, %lld rejected, %lld dropped while muted, %lld mutes; "
+                    "your connection: %lld limited",
+                    rate_action_names[RATE_ACTION], (long long)rate_allowed, (long long)rate_queued, (long long)rate_rejected,
+                    (long long)rate_dropped, (long long)rate_mutes, rate.limited);
+            send_to_socket(client_socket, buffer, strlen(buffer));
+
         } else {
             // Handle unknown commands
             printf("Client ID %d sent unknown command: %s\n", current_client_id, buffer);
-            sprintf(buffer, "ERROR Unknown command. Use LIST, SEND <id> <message>");
-            send(client_socket, buffer, strlen(buffer), 0); // Send error back to sender
+            sprintf(buffer, "ERROR Unknown command. Use LIST, SEND <id> <message>, HISTORY <n>, LOGIN <id> <token>, SENDFILE <id> <size> <name>, VOPEN <count>, SHM, STATS");
+            send_to_socket(client_socket, buffer, strlen(buffer)); // Send error back to sender
         }
     } // End of while(1) receive loop
 
     // --- Client Disconnected ---
-    // Broadcast client left information
-    sprintf(buffer, "INFO User %d (%s) has left.", current_client_id, client_ip);
-    broadcast_info(buffer, current_client_id); // Exclude the leaving client
-
-    // Remove the client from the active list
-    remove_client(client_socket);
+    // Hold the slot for RESUME_GRACE_SECONDS; the reaper announces the departure if it expires
+    if (shm != NULL) shm_detach(shm);
+    detach_client(client_socket);
 
     _endthreadex(0); // Exit the thread cleanly
     return 0; // Should not be reached after _endthreadex
@@ -310,113 +1194,2623 @@ unsigned __stdcall handle_client(void *arg) {
 
 // --- Utility Functions ---
 
-// Function to remove a client from the active list
-void remove_client(SOCKET client_socket) {
+// Function to remove a client slot from the active list (grace window over, or never resumed)
+void remove_client(int client_index) {
+    EnterCriticalSection(&cs); // Lock access to the clients array
+    if (clients[client_index].active) {
+        printf("Removing client ID %d (%s) from index %d\n", clients[client_index].id, clients[client_index].ip, client_index);
+        // Clean up socket resources (a detached client has none left)
+        if (clients[client_index].socket != INVALID_SOCKET) {
+            closesocket(clients[client_index].socket);
+        }
+        // The ID's token stays valid for LOGIN, which also replays whatever gets queued for it,
+        // starting with the messages still waiting in this slot (its virtual sessions' included)
+        offline_log_remember(clients[client_index].id, clients[client_index].resume_token);
+        int spilled = outbound_spill(client_index);
+        if (spilled > 0) {
+            printf("Moved %d undelivered message(s) for client ID %d to the offline log\n", spilled, clients[client_index].id);
+        }
+        // The connection's virtual sessions go with it; each can come back with LOGIN and the host's token
+        int released = virtual_release_host(client_index);
+        if (released > 0) {
+            printf("Released %d virtual session(s) hosted by client ID %d\n", released, clients[client_index].id);
+        }
+        // Mark the slot as inactive and reset values
+        clients[client_index].active = 0;
+        clients[client_index].id = -1;
+        clients[client_index].socket = INVALID_SOCKET;
+        clients[client_index].detached_since = 0;
+        clients[client_index].spilled = 0;
+        outbound_clear(&clients[client_index]); // Replies and notices nobody will resume for
+        // No need to clear IP string or tail explicitly, active flag is sufficient
+    }
+    LeaveCriticalSection(&cs); // Release the lock
+}
+
+// Function to check a command for control characters (tab and carriage return are allowed)
+int has_control_characters(const char* text) {
+    for (const unsigned char *p = (const unsigned char*)text; *p; p++) {
+        if (*p < 0x20 && *p != '\t' && *p != '\r') return 1;
+    }
+    return 0;
+}
+
+// Function to keep a dropped client's slot around for RESUME
+void detach_client(SOCKET client_socket) {
     EnterCriticalSection(&cs); // Lock access to the clients array
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        // Find the client by their socket
+        // Find the client by their socket; if a RESUME already moved the slot to a new
+        // connection there is nothing to detach and we only close our own socket
         if (clients[i].active && clients[i].socket == client_socket) {
-            printf("Removing client ID %d (%s) from index %d\n", clients[i].id, clients[i].ip, i);
-            // Clean up socket resources
-            closesocket(clients[i].socket);
-            // Mark the slot as inactive and reset values
-            clients[i].active = 0;
-            clients[i].id = -1;
+            printf("Client ID %d (%s) detached; holding ID for %d seconds.\n", clients[i].id, clients[i].ip, RESUME_GRACE_SECONDS);
             clients[i].socket = INVALID_SOCKET;
-            // No need to clear IP string explicitly, active flag is sufficient
-            break; // Found and removed the client, exit loop
+            clients[i].detached_since = time(NULL);
+            break;
         }
     }
     LeaveCriticalSection(&cs); // Release the lock
+    closesocket(client_socket);
 }
 
-// Function to send a message from one client to another
-void send_message_to_client(int target_id, const char* message, int sender_id) {
-    SOCKET target_socket = INVALID_SOCKET;
-    char formatted_message[BUFFER_SIZE + 64]; // Buffer for formatted message
+// Append bytes to a client's resume tail. Caller holds cs.
+void append_to_tail(Client* client, const char* data, ULONG len) {
+    if (client->tail == NULL) return;
+    if (len > RESUME_TAIL_SIZE) {
+        // Only the last RESUME_TAIL_SIZE bytes can ever be replayed
+        client->stream_offset += len - RESUME_TAIL_SIZE;
+        data += len - RESUME_TAIL_SIZE;
+        len = RESUME_TAIL_SIZE;
+    }
+    while (len > 0) {
+        size_t pos = (size_t)(client->stream_offset % RESUME_TAIL_SIZE);
+        ULONG chunk = (ULONG)(RESUME_TAIL_SIZE - pos);
+        if (chunk > len) chunk = len;
+        memcpy(client->tail + pos, data, chunk);
+        client->stream_offset += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+// Queue output for the client in a slot; flow is OUTBOUND_CONTROL or the sender ID of a bulk message.
+// Its writer thread sends it and records it in the resume tail; a detached client's output stays queued
+// until it resumes (a file recipient's until the file is done), and once its bulk queue fills, its bulk
+// moves to the offline log instead, as does control traffic past OUTBOUND_CONTROL_LIMIT. A client that is
+// reading but too slowly loses new bulk past OUTBOUND_QUEUE_LIMIT and new control traffic once
+// OUTBOUND_CONTROL_LIMIT is queued (one item may take the control queue past the limit, so a handoff
+// can restore a connection's whole queue).
+// Returns the bytes queued, or OUTBOUND_DROPPED if the message was dropped. Caller holds cs.
+int deliver_to_client(int client_index, WSABUF* buffers, DWORD count, int flow) {
+    Client *client = &clients[client_index];
+    int total = 0;
+    LARGE_INTEGER now;
+
+    for (DWORD i = 0; i < count; i++) total += (int)buffers[i].len;
+    if (total == 0) return 0;
+    int not_reading = (client->socket == INVALID_SOCKET || client->receiving_file);
+    int control_full = (flow == OUTBOUND_CONTROL && client->control_bytes >= OUTBOUND_CONTROL_LIMIT);
+    if (not_reading && (control_full ||
+        (flow != OUTBOUND_CONTROL && (client->spilled || client->bulk_bytes + total > OUTBOUND_QUEUE_LIMIT)))) {
+        // Nobody is reading chat: keep the message in the log, bulk behind what was queued before it
+        if (flow != OUTBOUND_CONTROL && !client->spilled) {
+            outbound_spill(client_index);
+            client->spilled = 1;
+        }
+        char *message = (char*)malloc(total);
+        if (message == NULL) return SOCKET_ERROR;
+        int len = 0;
+        for (DWORD i = 0; i < count; i++) {
+            memcpy(message + len, buffers[i].buf, buffers[i].len);
+            len += (int)buffers[i].len;
+        }
+        int kept = outbound_spill_item(client_index, message, len);
+        free(message);
+        return kept ? total : OUTBOUND_DROPPED;
+    }
+    if (control_full) {
+        outbound_control_dropped++; // The client has stopped reading even its replies
+        return OUTBOUND_DROPPED;
+    }
+    if (flow != OUTBOUND_CONTROL && client->bulk_bytes + total > OUTBOUND_QUEUE_LIMIT) {
+        outbound_bulk_dropped++; // The client reads too slowly
+        return OUTBOUND_DROPPED;
+    }
+    OutboundItem *item = (OutboundItem*)malloc(sizeof(OutboundItem) + total);
+    if (item == NULL) return SOCKET_ERROR;
+    item->len = 0;
+    for (DWORD i = 0; i < count; i++) {
+        memcpy(item->data + item->len, buffers[i].buf, buffers[i].len);
+        item->len += (int)buffers[i].len;
+    }
+    QueryPerformanceCounter(&now);
+    item->queued_at = now.QuadPart;
+    item->control = (flow == OUTBOUND_CONTROL);
+    item->replay = 0;
+    item->next = NULL;
+
+    OutboundQueue *queue = item->control ? &client->control_queue : &client->bulk_queues[(unsigned int)flow % OUTBOUND_FLOWS];
+    if (queue->tail != NULL) queue->tail->next = item;
+    else queue->head = item;
+    queue->tail = item;
+    if (item->control) client->control_bytes += total;
+    else client->bulk_bytes += total;
+    SetEvent(client->outbound_ready);
+    return total;
+}
+
+// Send to a client identified by socket (falls back to a plain send for unregistered sockets)
+int send_vectored_to_socket(SOCKET client_socket, WSABUF* buffers, DWORD count, int flow) {
+    int result = SOCKET_ERROR;
+    int found = 0;
 
     EnterCriticalSection(&cs); // Lock access to the clients array
-    // Find the target client's socket by ID
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && clients[i].id == target_id) {
-            target_socket = clients[i].socket;
-            break; // Found the target client
+        if (clients[i].active && clients[i].socket == client_socket) {
+            result = deliver_to_client(i, buffers, count, flow);
+            found = 1;
+            break;
         }
     }
     LeaveCriticalSection(&cs); // Release the lock
 
-    // Format the message: MSG <sender_id>: <message>
-    sprintf(formatted_message, "MSG %d: %s", sender_id, message);
+    if (!found) {
+        DWORD bytes_sent = 0;
+        if (WSASend(client_socket, buffers, count, &bytes_sent, 0, NULL, NULL) != SOCKET_ERROR) {
+            result = (int)bytes_sent;
+        }
+    }
+    return result;
+}
+
+int send_to_socket(SOCKET client_socket, const char* data, int len) {
+    WSABUF buffer = { (ULONG)len, (char*)data };
+    return send_vectored_to_socket(client_socket, &buffer, 1, OUTBOUND_CONTROL); // Replies are control traffic
+}
+
+// --- Outbound Scheduling ---
 
-    if (target_socket != INVALID_SOCKET) {
-        // Send the formatted message to the target client
-        if (send(target_socket, formatted_message, strlen(formatted_message), 0) == SOCKET_ERROR) {
-            printf("Failed to relay message from %d to %d. Error: %d\n", sender_id, target_id, WSAGetLastError());
-            // Note: A send failure here might indicate the client disconnected unexpectedly
-            // You might consider calling remove_client(target_socket) here, but be careful
-            // as it might be called concurrently if the receive thread also detected the disconnect.
-            // Letting the receive thread's error handling manage removal is usually safer.
+// Start the writer thread of a slot on the slot's first use; it serves every later occupant too.
+// Returns 0 if it could not be started. Caller holds cs.
+int outbound_start(int client_index) {
+    Client *client = &clients[client_index];
+    if (client->outbound_ready != NULL) return 1;
+    client->outbound_ready = CreateEvent(NULL, FALSE, FALSE, NULL); // Auto-reset
+    if (client->outbound_ready == NULL) return 0;
+    HANDLE writerHandle = (HANDLE)_beginthreadex(NULL, 0, outbound_writer_thread, (void*)(uintptr_t)client_index, 0, NULL);
+    if (writerHandle == NULL) {
+        printf("Failed to create writer thread for slot %d. Error code: %d\n", client_index, GetLastError());
+        CloseHandle(client->outbound_ready);
+        client->outbound_ready = NULL;
+        return 0;
+    }
+    CloseHandle(writerHandle);
+    return 1;
+}
+
+// Take the next item to send: control first, then the bulk queues by deficit round robin. A queue
+// whose head does not fit its deficit earns OUTBOUND_QUANTUM bytes and waits for the next round, so
+// each sender gets an equal share of the connection in bytes. Caller holds cs.
+OutboundItem* outbound_next(Client* client) {
+    OutboundQueue *queue = &client->control_queue;
+    if (queue->head == NULL) {
+        if (client->bulk_bytes == 0) return NULL;
+        while (1) {
+            queue = &client->bulk_queues[client->bulk_cursor];
+            if (queue->head != NULL && queue->head->len <= queue->deficit) break;
+            if (queue->head == NULL) queue->deficit = 0; // Idle queues bank no credit
+            else queue->deficit += OUTBOUND_QUANTUM;
+            client->bulk_cursor = (client->bulk_cursor + 1) % OUTBOUND_FLOWS;
         }
+    }
+    OutboundItem *item = queue->head;
+    queue->head = item->next;
+    if (queue->head == NULL) queue->tail = NULL;
+    if (item->control) {
+        client->control_bytes -= item->len;
     } else {
-        // Target client ID not found or is inactive
-        SOCKET sender_socket = INVALID_SOCKET;
-        // Prepare an error message to send back to the original sender
-        sprintf(formatted_message, "ERROR User ID %d not found or is inactive.", target_id);
+        queue->deficit -= item->len;
+        client->bulk_bytes -= item->len;
+    }
+    return item;
+}
 
-        EnterCriticalSection(&cs); // Lock to find sender's socket
-        // Find the sender's socket to send the error message back
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-             if (clients[i].active && clients[i].id == sender_id) {
-                 sender_socket = clients[i].socket;
-                 break; // Found the sender
-             }
-        }
-        LeaveCriticalSection(&cs); // Release the lock
+// Put a RESUME replay of len bytes (filled in by the caller before it wakes the writer) at the head of
+// the control queue, so it goes out before anything queued while the client was away. A replay still
+// queued for an earlier connection is dropped: the new one starts from where the client says it is.
+// Returns NULL if out of memory. Caller holds cs.
+OutboundItem* outbound_queue_replay(Client* client, int len) {
+    OutboundQueue *queue = &client->control_queue;
+    while (queue->head != NULL && queue->head->replay) {
+        OutboundItem *stale = queue->head;
+        queue->head = stale->next;
+        if (queue->head == NULL) queue->tail = NULL;
+        client->control_bytes -= stale->len;
+        free(stale);
+    }
+    OutboundItem *item = (OutboundItem*)malloc(sizeof(OutboundItem) + len);
+    if (item == NULL) return NULL;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    item->queued_at = now.QuadPart;
+    item->control = 1;
+    item->replay = 1;
+    item->len = len;
+    item->next = queue->head;
+    queue->head = item;
+    if (queue->tail == NULL) queue->tail = item;
+    client->control_bytes += len;
+    return item;
+}
 
-        if (sender_socket != INVALID_SOCKET) {
-            // Send the error message to the original sender
-            send(sender_socket, formatted_message, strlen(formatted_message), 0);
+// Drop everything queued for a slot. Caller holds cs.
+void outbound_clear(Client* client) {
+    OutboundItem *item;
+    while ((item = outbound_next(client)) != NULL) free(item);
+    for (int f = 0; f < OUTBOUND_FLOWS; f++) client->bulk_queues[f].deficit = 0;
+}
+
+// Move a slot's queued bulk into the offline log for its ID (and its virtual sessions' IDs), oldest
+// first across the flows, so it outlives the connection. Replies and notices stay queued. Returns the messages kept. Caller holds cs.
+int outbound_spill(int client_index) {
+    Client *client = &clients[client_index];
+    int spilled = 0;
+
+    while (client->bulk_bytes > 0) {
+        OutboundQueue *oldest = NULL;
+        for (int f = 0; f < OUTBOUND_FLOWS; f++) {
+            OutboundQueue *queue = &client->bulk_queues[f];
+            if (queue->head != NULL && (oldest == NULL || queue->head->queued_at < oldest->head->queued_at)) oldest = queue;
         }
+        if (oldest == NULL) break;
+        OutboundItem *item = oldest->head;
+        oldest->head = item->next;
+        if (oldest->head == NULL) oldest->tail = NULL;
+        client->bulk_bytes -= item->len;
+        spilled += outbound_spill_item(client_index, item->data, item->len);
+        free(item);
     }
+    for (int f = 0; f < OUTBOUND_FLOWS; f++) client->bulk_queues[f].deficit = 0;
+    return spilled;
 }
 
-// Function to broadcast informational messages to all clients (excluding sender)
-void broadcast_info(const char* message, int exclude_id) {
-    printf("Broadcasting INFO: %s (excluding %d)\n", message, exclude_id);
-    EnterCriticalSection(&cs); // Lock access to the clients array
-    // Iterate through all client slots
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-         // If the client is active AND their ID is not the excluded ID
-         if (clients[i].active && clients[i].id != exclude_id) {
-               // Send the message
-               if (send(clients[i].socket, message, strlen(message), 0) == SOCKET_ERROR) {
-                    printf("INFO Broadcast failed for client %d. Error: %d\n", clients[i].id, WSAGetLastError());
-                    // Similar to send_message_to_client, handle removal in the receive thread
-               }
-         }
+// Append one delivery for the connection in clients[client_index] to the offline log, as the plain
+// text a fresh connection can read: compressed frames are expanded, a tagged frame is logged for each
+// virtual session it names, and each message ends in a newline like other logged ones. Returns the
+// number of records kept. Caller holds cs.
+int outbound_spill_item(int client_index, const char* data, int len) {
+    Client *client = &clients[client_index];
+    char *expanded = NULL;
+    const char *tags = NULL;
+    int tags_len = 0, raw_len, compressed_len, header_len = 0;
+    int kept = 0, wanted = 0;
+
+    if (len > 1 && data[0] == '\n' && data[1] == COMPRESS_MARKER &&
+        sscanf(data + 2, "Z %d %d\n%n", &raw_len, &compressed_len, &header_len) == 2 && header_len > 0 &&
+        raw_len > 0 && compressed_len == len - 2 - header_len) {
+        expanded = (char*)malloc(raw_len + 1);
+        if (expanded == NULL || decompress_message((const unsigned char*)data + 2 + header_len, compressed_len, expanded, raw_len) != raw_len) {
+            free(expanded);
+            outbound_bulk_dropped++;
+            return 0;
+        }
+        data = expanded;
+        len = raw_len;
+    } else if (len > 3 && data[0] == '\n' && data[1] == SESSION_MARKER && data[2] == '@') {
+        // "\n\x03@<tags> <len>\n<payload>": the payload goes to each tagged session's own log
+        const char *space = (const char*)memchr(data + 3, ' ', len - 3);
+        const char *line_end = space != NULL ? (const char*)memchr(space, '\n', len - (space - data)) : NULL;
+        if (line_end == NULL || atoi(space + 1) != len - (int)(line_end + 1 - data)) {
+            outbound_bulk_dropped++;
+            return 0;
+        }
+        tags = data + 3;
+        tags_len = (int)(space - tags);
+        len -= (int)(line_end + 1 - data);
+        data = line_end + 1;
+    }
+    if (len > 0 && data[len - 1] != '\n') {
+        if (expanded == NULL) {
+            expanded = (char*)malloc(len + 1);
+            if (expanded == NULL) {
+                outbound_bulk_dropped++;
+                return 0;
+            }
+            memcpy(expanded, data, len);
+            data = expanded;
+        }
+        expanded[len++] = '\n';
     }
-    LeaveCriticalSection(&cs); // Release the lock
-}
 
-// Function to broadcast a user message to all clients (excluding sender)
-void broadcast_message(const char* message, int sender_id) {
-    char formatted_message[BUFFER_SIZE + 64]; // Buffer for formatted message
+    if (tags == NULL) {
+        wanted = 1;
+        kept = offline_log_append(client->id, data, len);
+    } else if (tags[0] == '*') {
+        // Every session on the connection, or all but the sender ("*-<id>")
+        int excluded = tags_len > 2 ? atoi(tags + 2) : -1;
+        for (int index = client->virtual_head; index != -1; index = virtual_sessions[index].next_on_host) {
+            if (virtual_sessions[index].id == excluded) continue;
+            wanted++;
+            kept += offline_log_append(virtual_sessions[index].id, data, len);
+        }
+    } else {
+        for (const char *p = tags; p < tags + tags_len; ) {
+            wanted++;
+            kept += offline_log_append(atoi(p), data, len);
+            const char *comma = (const char*)memchr(p, ',', tags + tags_len - p);
+            p = comma != NULL ? comma + 1 : tags + tags_len;
+        }
+    }
+    outbound_bulk_spilled += kept;
+    outbound_bulk_dropped += wanted - kept;
+    free(expanded);
+    return kept;
+}
 
-    // Format message: MSG <sender_id> (Broadcast): <message>
-    sprintf(formatted_message, "MSG %d (Broadcast): %s", sender_id, message);
-    printf("Broadcasting MSG: %s\n", formatted_message); // Log the broadcast action on the server
+// Writer thread of one slot: sends whatever is queued, a batch per WSASend, outside cs
+unsigned __stdcall outbound_writer_thread(void *arg) {
+    Client *client = &clients[(int)(uintptr_t)arg];
+    OutboundItem *batch[OUTBOUND_BATCH];
+    WSABUF buffers[OUTBOUND_BATCH];
 
-    EnterCriticalSection(&cs); // Lock access to the clients array
-    // Iterate through all client slots
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        // If the client is active AND their ID is not the original sender's ID
-        if (clients[i].active && clients[i].id != sender_id) {
-            // Send the formatted message
-            if (send(clients[i].socket, formatted_message, strlen(formatted_message), 0) == SOCKET_ERROR) {
-                 printf("MSG Broadcast failed for client %d. Error: %d\n", clients[i].id, WSAGetLastError());
-                 // Handle removal in the receive thread
+    while (1) {
+        WaitForSingleObject(client->outbound_ready, INFINITE);
+        while (1) {
+            DWORD count = 0, bytes_sent = 0;
+            EnterCriticalSection(&cs);
+            SOCKET s = client->socket;
+            ShmLink *link = client->shm;
+            // A detached client keeps its queue for RESUME; a file relay owns the socket until it is done
+            while (count < OUTBOUND_BATCH && client->active && s != INVALID_SOCKET && !client->receiving_file) {
+                OutboundItem *item = outbound_next(client);
+                if (item == NULL) break;
+                // The stream (and so the resume tail) is counted in the order bytes actually go out
+                if (!item->replay) append_to_tail(client, item->data, (ULONG)item->len);
+                batch[count] = item;
+                buffers[count].buf = item->data;
+                buffers[count].len = (ULONG)item->len;
+                count++;
             }
+            client->writing = (count > 0);
+            if (count > 0 && link != NULL) link->writer_busy++;
+            LeaveCriticalSection(&cs);
+            if (count == 0) break;
+
+            int result = (link != NULL) ? shm_send(link, buffers, count) : WSASend(s, buffers, count, &bytes_sent, 0, NULL, NULL);
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            EnterCriticalSection(&cs);
+            client->writing = 0;
+            if (link != NULL) link->writer_busy--;
+            for (DWORD i = 0; i < count; i++) outbound_record(batch[i], now.QuadPart);
+            LeaveCriticalSection(&cs);
+            for (DWORD i = 0; i < count; i++) free(batch[i]);
+            // The reader notices the drop; a RESUME replays these bytes from the tail and wakes us again
+            if (result == SOCKET_ERROR) break;
         }
     }
-    LeaveCriticalSection(&cs); // Release the lock
-}
\ No newline at end of file
+    return 0;
+}
+
+// Count one sent item; every OUTBOUND_REPORT_INTERVAL control messages print how long control and
+// bulk output waited in the queues. Caller holds cs.
+void outbound_record(const OutboundItem* item, LONG64 sent_at) {
+    long long us = (sent_at - item->queued_at) * 1000000 / outbound_frequency.QuadPart;
+    int bucket = 0;
+    while (bucket < OUTBOUND_LATENCY_BUCKETS - 1 && (1LL << bucket) <= us) bucket++;
+
+    if (!item->control) {
+        outbound_bulk_latency[bucket]++;
+        outbound_bulk_sent++;
+        return;
+    }
+    outbound_control_latency[bucket]++;
+    if (++outbound_control_count < OUTBOUND_REPORT_INTERVAL) return;
+
+    long long c50 = 0, c99 = 0, c999 = 0, b50 = 0, b99 = 0, seen = 0, bulk_seen = 0;
+    for (int b = 0; b < OUTBOUND_LATENCY_BUCKETS; b++) {
+        seen += outbound_control_latency[b];
+        if (c50 == 0 && seen * 2 >= outbound_control_count) c50 = 1LL << b;
+        if (c99 == 0 && seen * 100 >= outbound_control_count * 99LL) c99 = 1LL << b;
+        if (c999 == 0 && seen * 1000 >= outbound_control_count * 999LL) c999 = 1LL << b;
+        bulk_seen += outbound_bulk_latency[b];
+        if (b50 == 0 && outbound_bulk_sent > 0 && bulk_seen * 2 >= outbound_bulk_sent) b50 = 1LL << b;
+        if (b99 == 0 && outbound_bulk_sent > 0 && bulk_seen * 100 >= outbound_bulk_sent * 99) b99 = 1LL << b;
+        outbound_control_latency[b] = 0;
+        outbound_bulk_latency[b] = 0;
+    }
+    printf("[Outbound] %d control messages queued p50 < %lld us, p99 < %lld us, p99.9 < %lld us; "
+           "meanwhile %lld bulk queued p50 < %lld us, p99 < %lld us; %lld bulk and %lld control dropped so far (queue full), %lld spilled to the offline log\n",
+           outbound_control_count, c50, c99, c999, outbound_bulk_sent, b50, b99, outbound_bulk_dropped, outbound_control_dropped,
+           outbound_bulk_spilled);
+    outbound_control_count = 0;
+    outbound_bulk_sent = 0;
+}
+
+// --- Shared Memory Transport ---
+
+// Move a same-host connection onto shared-memory rings: create the region and its doorbells, switch the
+// slot's writer over once it is idle, and send "SHM <name> <ring-size>" as the last bytes on the TCP
+// stream. Returns the link, or NULL after telling the client why not.
+ShmLink* shm_attach(SOCKET client_socket, const char* client_ip) {
+    char line[SHM_NAME_MAX + 32];
+    unsigned int nonce = 0;
+    int slot = -1, client_id = -1;
+    ShmLink *link = NULL;
+
+    EnterCriticalSection(&cs);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].socket == client_socket) {
+            slot = i;
+            client_id = clients[i].id;
+            break;
+        }
+    }
+    LeaveCriticalSection(&cs);
+    if (slot == -1 || strncmp(client_ip, SHM_LOCAL_PREFIX, strlen(SHM_LOCAL_PREFIX)) != 0) {
+        sprintf(line, "ERROR SHM is only available to clients on the server's host.");
+        send_to_socket(client_socket, line, strlen(line));
+        return NULL;
+    }
+
+    // The name is the capability: only this client learns it, over its own connection
+    link = (ShmLink*)calloc(1, sizeof(ShmLink));
+    rand_s(&nonce);
+    if (link != NULL) {
+        sprintf(link->name, "Local\\multiClientShm%d_%d_%08x", server_port, client_id, nonce);
+        link->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)SHM_REGION_SIZE, link->name);
+        if (link->mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(link->mapping); // Someone else's region: never share it
+            link->mapping = NULL;
+        }
+        if (link->mapping != NULL) link->base = (char*)MapViewOfFile(link->mapping, FILE_MAP_ALL_ACCESS, 0, 0, SHM_REGION_SIZE);
+        link->socket_event = WSACreateEvent();
+    }
+    if (link == NULL || link->base == NULL || link->socket_event == WSA_INVALID_EVENT ||
+        !shm_ring_events(&link->commands, &link->output, link->base, link->name, 1)) {
+        printf("Could not set up shared memory for %s. Error: %lu\n", client_ip, GetLastError());
+        if (link != NULL) shm_free(link);
+        sprintf(line, "ERROR Shared memory is not available right now.");
+        send_to_socket(client_socket, line, strlen(line));
+        return NULL;
+    }
+    ShmRegionHeader *header = (ShmRegionHeader*)link->base; // Fresh pages are zero
+    header->ring_size = SHM_RING_SIZE;
+
+    // The writer may be halfway through a WSASend; everything after it goes to the ring
+    while (1) {
+        EnterCriticalSection(&cs);
+        if (!clients[slot].writing) break; // Keeps cs
+        LeaveCriticalSection(&cs);
+        Sleep(1);
+    }
+    if (!clients[slot].active || clients[slot].socket != client_socket) {
+        LeaveCriticalSection(&cs); // A RESUME took the slot meanwhile
+        shm_free(link);
+        return NULL;
+    }
+    header->client_id = clients[slot].id;
+    header->magic = SHM_MAGIC;
+    sprintf(line, "SHM %s %d", link->name, SHM_RING_SIZE);
+    append_to_tail(&clients[slot], line, (ULONG)strlen(line)); // Part of the counted stream like any reply
+    clients[slot].shm = link;
+    LeaveCriticalSection(&cs);
+
+    send(client_socket, line, strlen(line), 0);
+    WSAEventSelect(client_socket, link->socket_event, FD_CLOSE); // The socket is non-blocking from here on
+    SetEvent(clients[slot].outbound_ready); // Anything queued meanwhile now goes to the ring
+    printf("Client ID %d (%s) moved to shared memory (%s).\n", header->client_id, client_ip, link->name);
+    return link;
+}
+
+// The connection is over (or a RESUME moved its slot): stop the writer using the rings, then unmap them.
+// The client keeps its own view until it lets go.
+void shm_detach(ShmLink* link) {
+    InterlockedExchange(&link->closed, 1);
+    SetEvent(link->output.space_event); // A writer waiting for room wakes up and gives up
+    while (1) {
+        EnterCriticalSection(&cs);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].shm == link) clients[i].shm = NULL;
+        }
+        int busy = link->writer_busy;
+        LeaveCriticalSection(&cs);
+        if (busy == 0) break;
+        Sleep(1);
+    }
+    shm_free(link);
+}
+
+void shm_free(ShmLink* link) {
+    shm_ring_close_events(&link->commands, &link->output);
+    if (link->base != NULL) UnmapViewOfFile(link->base);
+    if (link->mapping != NULL) CloseHandle(link->mapping);
+    if (link->socket_event != NULL && link->socket_event != WSA_INVALID_EVENT) WSACloseEvent(link->socket_event);
+    free(link);
+}
+
+// Connection thread: block until the command ring has bytes or the TCP connection has closed.
+// Returns 0 instead if a hot restart wants this thread parked (like wait_for_input).
+int shm_wait_for_input(ShmLink* link) {
+    HANDLE events[2] = { link->commands.data_event, link->socket_event };
+    while (!handoff_started) {
+        // Spins a while before giving up, which is where an active client's latency is won
+        if (link->peer_closed || shm_ring_wait(&link->commands, 0, 0) != 0) return 1;
+        InterlockedExchange(&link->commands.index->consumer_sleeping, 1);
+        if (shm_ring_used(&link->commands) == 0 &&
+            WaitForMultipleObjects(2, events, FALSE, SHM_WAIT_MS) == WAIT_OBJECT_0 + 1) {
+            link->peer_closed = 1; // Only FD_CLOSE is selected
+        }
+        InterlockedExchange(&link->commands.index->consumer_sleeping, 0);
+    }
+    return 0;
+}
+
+// Connection thread: take commands from the ring. Once it is empty and the TCP connection has closed,
+// report that as recv does (0, or SOCKET_ERROR after a reset or if the client corrupted the ring).
+int shm_recv(ShmLink* link, SOCKET s, char* out, int cap) {
+    int received = shm_ring_read(&link->commands, out, cap);
+    if (received != 0) return (received < 0) ? SOCKET_ERROR : received;
+    return recv(s, out, cap, 0);
+}
+
+// Writer thread: copy a batch into the output ring, waiting for room while the client reads. Returns
+// SOCKET_ERROR once the connection thread has closed the link or the client corrupted the ring.
+int shm_send(ShmLink* link, WSABUF* buffers, DWORD count) {
+    int total = 0;
+    for (DWORD i = 0; i < count; i++) {
+        ULONG done = 0;
+        while (done < buffers[i].len) {
+            int written = link->closed ? -1 : shm_ring_write(&link->output, buffers[i].buf + done, (int)(buffers[i].len - done));
+            if (written < 0) return SOCKET_ERROR;
+            if (written == 0 && shm_ring_wait(&link->output, 1, SHM_WAIT_MS) < 0) return SOCKET_ERROR;
+            done += (ULONG)written;
+        }
+        total += (int)done;
+    }
+    return total;
+}
+
+// Returns 1 if given equals expected. There is no early exit, so the time taken depends only on the
+// length of expected and does not reveal how much of a guess was right.
+int secret_matches(const char* expected, const char* given) {
+    size_t expected_len = strlen(expected), given_len = strlen(given);
+    unsigned char difference = (unsigned char)(expected_len != given_len);
+    for (size_t i = 0; i < expected_len; i++) {
+        difference |= (unsigned char)(expected[i] ^ (i < given_len ? given[i] : 0));
+    }
+    return difference == 0;
+}
+
+// Function to take over a dropped (or dying) session on a new connection.
+// Returns the resumed ID, or -1 if the token is unknown or the gap is no longer in the tail.
+int resume_session(SOCKET client_socket, const char* token, unsigned long long last_offset, const char* client_ip) {
+    char line[64 + RESUME_TOKEN_LEN];
+    int resumed_id = -1;
+    int expired_id = -1; // A session given up on here is announced like one the reaper frees
+    char expired_ip[INET_ADDRSTRLEN_IPV4];
+
+    EnterCriticalSection(&cs); // Lock access to the clients array (no new bytes while we replay)
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Client *client = &clients[i];
+        if (!client->active || !secret_matches(client->resume_token, token)) continue;
+
+        if (client->tail == NULL || last_offset > client->stream_offset ||
+            client->stream_offset - last_offset > RESUME_TAIL_SIZE) {
+            printf("Resume for client ID %d refused: gap of %llu bytes is outside the tail.\n",
+                   client->id, client->stream_offset - last_offset);
+            // That session can never resume now; free the ID at once so the client can LOGIN to it
+            // and collect what was waiting for it
+            if (client->socket == INVALID_SOCKET) {
+                expired_id = client->id;
+                strcpy(expired_ip, client->ip);
+                remove_client(i);
+            }
+            break;
+        }
+
+        if (client->socket != INVALID_SOCKET) {
+            // The old connection is still open (we have not noticed it die yet). Shutting it
+            // down wakes its handler thread, which then finds the slot is no longer its own.
+            shutdown(client->socket, SD_BOTH);
+        }
+        client->socket = client_socket;
+        client->shm = NULL; // A resumed session is plain TCP; the old connection's thread unmaps its rings
+        client->detached_since = 0;
+        strncpy(client->ip, client_ip, sizeof(client->ip) - 1);
+        client->ip[sizeof(client->ip) - 1] = '\0';
+        resumed_id = client->id;
+
+        // Handshake line (not part of the counted stream), then the bytes the client missed. Both are
+        // copied out of the tail now and sent by the writer, ahead of everything else: a client that
+        // stops reading must not block a send made under cs.
+        int line_len = sprintf(line, "RESUMED %d %s\n", resumed_id, client->resume_token);
+        unsigned long long replayed = client->stream_offset - last_offset;
+        OutboundItem *replay = outbound_queue_replay(client, line_len + (int)replayed);
+        if (replay == NULL) {
+            printf("Resume for client ID %d failed: out of memory.\n", resumed_id);
+            client->socket = INVALID_SOCKET;
+            client->detached_since = time(NULL);
+            resumed_id = -1;
+            break;
+        }
+        memcpy(replay->data, line, line_len);
+        for (int done = 0; done < (int)replayed; ) {
+            size_t pos = (size_t)((last_offset + done) % RESUME_TAIL_SIZE);
+            int chunk = (int)(RESUME_TAIL_SIZE - pos);
+            if (chunk > (int)replayed - done) chunk = (int)replayed - done;
+            memcpy(replay->data + line_len + done, client->tail + pos, chunk);
+            done += chunk;
+        }
+        SetEvent(client->outbound_ready); // Whatever was queued meanwhile follows the replay
+        if (client->spilled) {
+            // The rest went to the offline log while the queue was full; it is the oldest bulk left
+            client->spilled = 0;
+            offline_log_replay(resumed_id, client_socket);
+        }
+        printf("Client ID %d (%s) resumed its session; replayed %llu bytes.\n", resumed_id, client_ip, replayed);
+        break;
+    }
+    LeaveCriticalSection(&cs); // Release the lock
+    if (expired_id != -1) {
+        sprintf(line, "INFO User %d (%s) has left.", expired_id, expired_ip);
+        broadcast_info(line, expired_id);
+    }
+    return resumed_id;
+}
+
+// Thread that frees slots whose resume grace window expired and announces the departure
+unsigned __stdcall session_reaper_thread(void *arg) {
+    while (1) {
+        int expired_ids[MAX_CLIENTS];
+        char expired_ips[MAX_CLIENTS][INET_ADDRSTRLEN_IPV4];
+        int expired_hosted[MAX_CLIENTS]; // Virtual sessions that left with the connection
+        int expired_count = 0;
+        char info[128];
+
+        Sleep(1000);
+
+        time_t now = time(NULL);
+        EnterCriticalSection(&cs); // Lock access to the clients array
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].active && clients[i].socket == INVALID_SOCKET &&
+                difftime(now, clients[i].detached_since) >= RESUME_GRACE_SECONDS) {
+                expired_ids[expired_count] = clients[i].id;
+                strcpy(expired_ips[expired_count], clients[i].ip);
+                expired_hosted[expired_count] = clients[i].virtual_count;
+                expired_count++;
+                remove_client(i);
+            }
+        }
+        LeaveCriticalSection(&cs); // Release the lock
+
+        // Broadcast client left information
+        for (int i = 0; i < expired_count; i++) {
+            sprintf(info, "INFO User %d (%s) has left.", expired_ids[i], expired_ips[i]);
+            broadcast_info(info, expired_ids[i]);
+            if (expired_hosted[i] > 0) {
+                // One notice for the whole group rather than one per virtual user
+                sprintf(info, "INFO %d virtual user(s) hosted by User %d have left.", expired_hosted[i], expired_ids[i]);
+                broadcast_info(info, expired_ids[i]);
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to send a message from one client to another
+void send_message_to_client(int target_id, const char* message, int sender_id) {
+    char formatted_message[BUFFER_SIZE + 64]; // Buffer for formatted message
+    int target_index = -1;
+    int virtual_index = -1; // Set instead when the target is a virtual session
+    int was_issued; // The ID belonged to someone once, so it may come back with LOGIN
+    int owner = cluster_owner(target_id);
+
+    if (owner != cluster_self) {
+        // Another node owns the ID: it delivers (or queues) the message and reports back to the sender
+        int len = sprintf(formatted_message, "M %d %d %s\n", sender_id, target_id, message);
+        if (!cluster_forward(owner, formatted_message, len)) {
+            sprintf(formatted_message, "ERROR User ID %d is on node %d, which cannot be reached.", target_id, owner);
+            notify_id(sender_id, formatted_message);
+        }
+        return;
+    }
+
+    EnterCriticalSection(&cs); // Lock access to the clients array
+    // Find the target client by ID (a client inside its resume grace window still counts)
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].id == target_id) {
+            target_index = i;
+            break; // Found the target client
+        }
+    }
+    if (target_index == -1) virtual_index = virtual_find(target_id);
+    was_issued = (target_id > 0 && target_id < next_client_id && target_id != BROADCAST_ID);
+
+    if (target_index != -1 || virtual_index != -1) {
+        // Format the message: MSG <sender_id>: <message>
+        int len = sprintf(formatted_message, "MSG %d: %s", sender_id, message);
+        int result;
+        if (target_index != -1) {
+            CompressedFrame frame = { NULL, 0, 0 };
+            // Send (or buffer, if the target is reconnecting) while still holding the lock
+            result = deliver_message(target_index, formatted_message, len, &frame, sender_id);
+            free(frame.data);
+        } else {
+            char tag[16];
+            int tag_len = sprintf(tag, "%d", target_id);
+            result = deliver_tagged(virtual_sessions[virtual_index].host, tag, tag_len, formatted_message, len, sender_id);
+        }
+        if (result == SOCKET_ERROR) {
+            printf("Failed to relay message from %d to %d. Error: %d\n", sender_id, target_id, WSAGetLastError());
+            // Note: A send failure here might indicate the client disconnected unexpectedly.
+            // Letting the receive thread's error handling manage removal is usually safer.
+        }
+        LeaveCriticalSection(&cs); // Release the lock
+        if (result == OUTBOUND_DROPPED) {
+            // The recipient's queue is full: the sender should know rather than assume it arrived
+            sprintf(formatted_message, "ERROR User ID %d is not keeping up. Message dropped.", target_id);
+            notify_id(sender_id, formatted_message);
+        }
+        return;
+    }
+    LeaveCriticalSection(&cs); // Release the lock
+
+    if (was_issued) {
+        // Store and forward: keep the message until the recipient logs back in
+        int len = sprintf(formatted_message, "MSG %d: %s\n", sender_id, message);
+        if (offline_log_append(target_id, formatted_message, len)) {
+            sprintf(formatted_message, "INFO User %d is offline. Message queued for delivery.", target_id);
+        } else {
+            sprintf(formatted_message, "ERROR User ID %d is offline and the message could not be queued.", target_id);
+        }
+    } else {
+        // Target client ID not found or is inactive
+        sprintf(formatted_message, "ERROR User ID %d not found or is inactive.", target_id);
+    }
+
+    // Send the outcome back to the original sender (who may be on another node)
+    notify_id(sender_id, formatted_message);
+}
+
+// Function to broadcast informational messages to all clients (excluding sender)
+void broadcast_info(const char* message, int exclude_id) {
+    char record[BUFFER_SIZE + 64];
+    printf("Broadcasting INFO: %s (excluding %d)\n", message, exclude_id);
+    // Each peer node gets one record and fans it out to its own clients
+    cluster_forward_all(record, sprintf(record, "I %d %s\n", exclude_id, message));
+    history_append(message);
+    broadcast_local(message, (int)strlen(message), exclude_id, OUTBOUND_CONTROL);
+}
+
+// Function to broadcast a user message to all clients (excluding sender)
+void broadcast_message(const char* message, int sender_id) {
+    char formatted_message[BUFFER_SIZE + 64]; // Buffer for formatted message
+
+    cluster_forward_all(formatted_message, sprintf(formatted_message, "B %d %s\n", sender_id, message));
+    // Format message: MSG <sender_id> (Broadcast): <message>
+    int len = sprintf(formatted_message, "MSG %d (Broadcast): %s", sender_id, message);
+    printf("Broadcasting MSG: %s\n", formatted_message); // Log the broadcast action on the server
+    history_append(formatted_message);
+    broadcast_local(formatted_message, len, sender_id, sender_id);
+}
+
+// Function to deliver a formatted broadcast to every client of this node (excluding one ID).
+// flow is OUTBOUND_CONTROL for INFO notices and the sender ID for messages.
+void broadcast_local(const char* message, int len, int exclude_id, int flow) {
+    CompressedFrame frame = { NULL, 0, 0 }; // Compressed once, on the first recipient that wants it
+
+    EnterCriticalSection(&cs); // Lock access to the clients array
+    // Iterate through all client slots
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // If the client is active AND their ID is not the excluded ID
+        if (clients[i].active && clients[i].id != exclude_id) {
+            // Send the message
+            if (deliver_message(i, message, len, &frame, flow) == SOCKET_ERROR) {
+                 printf("Broadcast failed for client %d. Error: %d\n", clients[i].id, WSAGetLastError());
+                 // Handle removal in the receive thread
+            }
+        }
+        // Everyone hosted on this connection gets the message in one tagged frame
+        if (clients[i].active && clients[i].virtual_count > 0) {
+            deliver_to_hosted(i, message, len, exclude_id, flow);
+        }
+    }
+    LeaveCriticalSection(&cs); // Release the lock
+    free(frame.data);
+}
+// Function to let a connected client take back a previously issued, now inactive ID. The token
+// must be the one the ID was issued with; the ID being given up keeps its own for a later LOGIN.
+int reclaim_client_id(SOCKET client_socket, int old_id, int wanted_id, const char* token) {
+    int reclaimed = 0;
+
+    EnterCriticalSection(&cs); // Lock access to the clients array
+    if (wanted_id > 0 && wanted_id < next_client_id && wanted_id != BROADCAST_ID && wanted_id != old_id &&
+        cluster_owner(wanted_id) == cluster_self) { // IDs of other nodes log in there
+        int in_use = 0;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].active && clients[i].id == wanted_id) {
+                in_use = 1; // Someone is connected with that ID right now
+                break;
+            }
+        }
+        if (virtual_find(wanted_id) != -1) {
+            in_use = 1; // A virtual session on some connection holds it
+        }
+        if (!in_use && !offline_log_check_token(wanted_id, token)) {
+            printf("Refused LOGIN as ID %d: wrong token\n", wanted_id);
+            in_use = 1;
+        }
+        for (int i = 0; !in_use && i < MAX_CLIENTS; i++) {
+            if (clients[i].active && clients[i].socket == client_socket) {
+                printf("Client ID %d (%s) logged in as ID %d\n", old_id, clients[i].ip, wanted_id);
+                offline_log_remember(old_id, clients[i].resume_token);
+                clients[i].id = wanted_id;
+                strcpy(clients[i].resume_token, token);
+                reclaimed = 1;
+                break;
+            }
+        }
+    }
+    LeaveCriticalSection(&cs); // Release the lock
+    return reclaimed;
+}
+
+// --- Virtual Sessions ---
+// IDs hash into virtual_buckets; each host connection also chains its own sessions so they can be
+// broadcast to as a group and released together. Everything here runs under cs.
+
+void virtual_init(void) {
+    for (int i = 0; i < VIRTUAL_BUCKETS; i++) {
+        virtual_buckets[i] = -1;
+    }
+    for (int i = MAX_VIRTUAL_SESSIONS - 1; i >= 0; i--) {
+        virtual_sessions[i].id = -1;
+        virtual_sessions[i].next_in_bucket = virtual_free;
+        virtual_free = i;
+    }
+}
+
+// Index of the virtual session holding an ID, or -1
+int virtual_find(int id) {
+    if (id <= 0) return -1;
+    for (int index = virtual_buckets[id % VIRTUAL_BUCKETS]; index != -1; index = virtual_sessions[index].next_in_bucket) {
+        if (virtual_sessions[index].id == id) return index;
+    }
+    return -1;
+}
+
+// Register count new IDs, first_id onwards, on the connection in clients[host].
+// All or nothing: returns count, or 0 if the registry is too full.
+int virtual_open(int host, int count, int* first_id) {
+    if (count <= 0 || count > MAX_VIRTUAL_SESSIONS - virtual_total) return 0;
+    *first_id = claim_client_ids(count); // Contiguous, inside one of our blocks
+    if (*first_id == -1) return 0;
+    for (int n = 0; n < count; n++) {
+        int index = virtual_free;
+        VirtualSession *v = &virtual_sessions[index];
+        virtual_free = v->next_in_bucket;
+        v->id = *first_id + n;
+        v->host = host;
+        memset(&v->rate, 0, sizeof(v->rate));
+        v->next_in_bucket = virtual_buckets[v->id % VIRTUAL_BUCKETS];
+        virtual_buckets[v->id % VIRTUAL_BUCKETS] = index;
+        v->next_on_host = clients[host].virtual_head;
+        clients[host].virtual_head = index;
+    }
+    clients[host].virtual_count += count;
+    virtual_total += count;
+    return count;
+}
+
+// Register one ID taken over in a hot restart on the connection in clients[host]
+void virtual_restore(int host, int id) {
+    if (virtual_free == -1 || virtual_find(id) != -1) return;
+    int index = virtual_free;
+    VirtualSession *v = &virtual_sessions[index];
+    virtual_free = v->next_in_bucket;
+    v->id = id;
+    v->host = host;
+    memset(&v->rate, 0, sizeof(v->rate));
+    v->next_in_bucket = virtual_buckets[id % VIRTUAL_BUCKETS];
+    virtual_buckets[id % VIRTUAL_BUCKETS] = index;
+    v->next_on_host = clients[host].virtual_head;
+    clients[host].virtual_head = index;
+    clients[host].virtual_count++;
+    virtual_total++;
+}
+
+// End a virtual session. Its ID stays issued: messages for it go to the offline log, and LOGIN with
+// the host connection's token takes it back.
+void virtual_close(int index) {
+    VirtualSession *v = &virtual_sessions[index];
+    offline_log_remember(v->id, clients[v->host].resume_token);
+    int *link = &virtual_buckets[v->id % VIRTUAL_BUCKETS];
+    while (*link != index) link = &virtual_sessions[*link].next_in_bucket;
+    *link = v->next_in_bucket;
+    link = &clients[v->host].virtual_head;
+    while (*link != index) link = &virtual_sessions[*link].next_on_host;
+    *link = v->next_on_host;
+    clients[v->host].virtual_count--;
+    virtual_total--;
+    v->id = -1;
+    v->next_in_bucket = virtual_free;
+    virtual_free = index;
+}
+
+// Close every virtual session carried by clients[host]; returns how many there were
+int virtual_release_host(int host) {
+    int released = 0;
+    while (clients[host].virtual_head != -1) {
+        virtual_close(clients[host].virtual_head); // Always the head, so unlinking from the host is O(1)
+        released++;
+    }
+    return released;
+}
+
+// Send one tagged frame to the connection in clients[host]. tags names the recipients: "<id>",
+// "<id>,<id>,...", "*" (every session on the connection) or "*-<id>" (all but one). The frame is part
+// of the host's stream, so it is buffered and replayed with it across a RESUME.
+int deliver_tagged(int host, const char* tags, int tags_len, const char* message, int len, int flow) {
+    char head[3] = { '\n', SESSION_MARKER, '@' };
+    char length_line[16];
+    WSABUF buffers[4];
+
+    buffers[0].buf = head;
+    buffers[0].len = 3;
+    buffers[1].buf = (char*)tags;
+    buffers[1].len = (ULONG)tags_len;
+    buffers[2].buf = length_line;
+    buffers[2].len = (ULONG)sprintf(length_line, " %d\n", len);
+    buffers[3].buf = (char*)message;
+    buffers[3].len = (ULONG)len;
+    return deliver_to_client(host, buffers, 4, flow);
+}
+
+// Broadcast to the virtual sessions on one connection: a single frame however many there are
+int deliver_to_hosted(int host, const char* message, int len, int exclude_id, int flow) {
+    char tags[24];
+    int excluded = virtual_find(exclude_id);
+    int tags_len;
+
+    if (excluded != -1 && virtual_sessions[excluded].host == host) {
+        if (clients[host].virtual_count == 1) return 0; // The sender is the only one here
+        tags_len = sprintf(tags, "*-%d", exclude_id);
+    } else {
+        tags_len = sprintf(tags, "*");
+    }
+    return deliver_tagged(host, tags, tags_len, message, len, flow);
+}
+
+// Deliver to whoever holds an ID: a connected (or resuming) client or a virtual session. Used for
+// replies and errors, so it is control traffic. Returns SOCKET_ERROR if nobody does.
+int deliver_to_id(int id, const char* message, int len) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].id == id) {
+            WSABUF buffer = { (ULONG)len, (char*)message };
+            return deliver_to_client(i, &buffer, 1, OUTBOUND_CONTROL);
+        }
+    }
+    int index = virtual_find(id);
+    if (index != -1) {
+        char tag[16];
+        int tag_len = sprintf(tag, "%d", id);
+        return deliver_tagged(virtual_sessions[index].host, tag, tag_len, message, len, OUTBOUND_CONTROL);
+    }
+    return SOCKET_ERROR;
+}
+
+// "VOPEN <count>" from a host connection, or "@<id> SEND <id> <message>" / "@<id> CLOSE" acting as
+// one of its virtual sessions. Each session's SENDs are charged to its own rate limit.
+void handle_virtual_command(SOCKET client_socket, char* line) {
+    char reply[BUFFER_SIZE + 64];
+    int host = -1, host_id = -1;
+
+    EnterCriticalSection(&cs);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].socket == client_socket) {
+            host = i;
+            host_id = clients[i].id;
+            break;
+        }
+    }
+    if (host == -1) {
+        LeaveCriticalSection(&cs);
+        return;
+    }
+
+    if (_strnicmp(line, "VOPEN ", 6) == 0) {
+        int wanted = atoi(line + 6), first_id = 0;
+        int opened = (wanted <= VIRTUAL_OPEN_MAX) ? virtual_open(host, wanted, &first_id) : 0;
+        int hosted = clients[host].virtual_count, total = virtual_total;
+        LeaveCriticalSection(&cs);
+        if (opened == 0) {
+            sprintf(reply, "ERROR Cannot open virtual sessions. Use: VOPEN <1-%d> (at most %d in total).",
+                    VIRTUAL_OPEN_MAX, MAX_VIRTUAL_SESSIONS);
+            send_to_socket(client_socket, reply, strlen(reply));
+            return;
+        }
+        // The host learns its IDs before anyone can message them
+        sprintf(reply, "VIDS %d %d", first_id, opened);
+        send_to_socket(client_socket, reply, strlen(reply));
+        printf("Client ID %d opened virtual sessions %d-%d (%d on its connection, %d in total)\n",
+               host_id, first_id, first_id + opened - 1, hosted, total);
+        sprintf(reply, "INFO Users %d-%d have joined (virtual, via User %d).", first_id, first_id + opened - 1, host_id);
+        broadcast_info(reply, host_id);
+        return;
+    }
+
+    int virtual_id = -1, command_start = 0;
+    sscanf(line + 1, "%d %n", &virtual_id, &command_start);
+    int index = virtual_find(virtual_id);
+    if (command_start == 0 || index == -1 || virtual_sessions[index].host != host) {
+        LeaveCriticalSection(&cs);
+        sprintf(reply, "ERROR Virtual session %d is not open on this connection.", virtual_id);
+        send_to_socket(client_socket, reply, strlen(reply));
+        return;
+    }
+    char *command = line + 1 + command_start;
+    if (_stricmp(command, "CLOSE") == 0) {
+        virtual_close(index);
+        LeaveCriticalSection(&cs);
+        sprintf(reply, "INFO User %d has left.", virtual_id);
+        broadcast_info(reply, virtual_id);
+        return;
+    }
+    // Charge a SEND while the session is certain to exist; any wait happens outside cs
+    int target_id = -1;
+    char *message_start = NULL;
+    LONG64 wait = 0;
+    if (_strnicmp(command, "SEND ", 5) == 0) {
+        message_start = strchr(command + 5, ' ');
+        if (message_start != NULL && sscanf(command + 5, "%d", &target_id) == 1 && message_start[1] != '\0') {
+            message_start++;
+            wait = rate_charge(&virtual_sessions[index].rate, (int)strlen(message_start), target_id == BROADCAST_ID, reply);
+        } else {
+            message_start = NULL;
+        }
+    }
+    LeaveCriticalSection(&cs);
+
+    if (_strnicmp(command, "SEND ", 5) == 0) {
+        if (message_start != NULL) {
+            if (wait < 0) {
+                if (reply[0] == '\0') return; // Muted
+                EnterCriticalSection(&cs);
+                deliver_to_id(virtual_id, reply, (int)strlen(reply));
+                LeaveCriticalSection(&cs);
+                return;
+            }
+            if (wait > 0) Sleep((DWORD)wait);
+            if (target_id == BROADCAST_ID) {
+                broadcast_message(message_start, virtual_id);
+            } else {
+                send_message_to_client(target_id, message_start, virtual_id);
+            }
+            return;
+        }
+        sprintf(reply, "ERROR Invalid SEND format. Use: @<id> SEND <id> <message>");
+    } else {
+        sprintf(reply, "ERROR Unknown command for a virtual session. Use: @<id> SEND <id> <message> or @<id> CLOSE");
+    }
+    EnterCriticalSection(&cs);
+    deliver_to_id(virtual_id, reply, (int)strlen(reply));
+    LeaveCriticalSection(&cs);
+}
+
+// --- Cluster ---
+// Records on a peer link are single lines: "M <sender> <target> <text>" (a message for an ID the receiving
+// node owns), "R <id> <text>" (a server notice for an ID it owns), "B <sender> <text>" (a user broadcast)
+// and "I <exclude> <info>" (an INFO broadcast). Broadcasts are fanned out by every node to its own clients.
+
+uint32_t cluster_hash(uint32_t a, uint32_t b) {
+    uint32_t h = 2166136261U; // FNV-1a over both words, then a finalizer so nearby inputs spread out
+    for (int i = 0; i < 4; i++) { h = (h ^ ((a >> (8 * i)) & 0xFF)) * 16777619U; }
+    for (int i = 0; i < 4; i++) { h = (h ^ ((b >> (8 * i)) & 0xFF)) * 16777619U; }
+    h ^= h >> 16; h *= 0x85EBCA6BU; h ^= h >> 13; h *= 0xC2B2AE35U; h ^= h >> 16;
+    return h;
+}
+
+int compare_ring_points(const void* a, const void* b) {
+    uint32_t x = ((const RingPoint*)a)->hash, y = ((const RingPoint*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// Parse "ip:port,ip:port,..." and build the hash ring. Every node must be given the same list.
+int cluster_init(int self, char* node_list) {
+    int count = 0;
+    for (char *entry = strtok(node_list, ","); entry != NULL; entry = strtok(NULL, ",")) {
+        char *colon = strchr(entry, ':');
+        if (count == CLUSTER_MAX_NODES || colon == NULL) return 0;
+        *colon = '\0';
+        ClusterNode *node = &cluster_nodes[count++];
+        strncpy(node->ip, entry, sizeof(node->ip) - 1);
+        node->port = atoi(colon + 1);
+        if (inet_addr(node->ip) == INADDR_NONE || node->port <= 0 || node->port > 65535) return 0;
+        InitializeCriticalSection(&node->lock);
+        node->queue = (char*)malloc(CLUSTER_QUEUE_LIMIT);
+        node->sending = (char*)malloc(CLUSTER_QUEUE_LIMIT);
+        node->wake = CreateEvent(NULL, FALSE, FALSE, NULL); // Auto-reset
+        if (node->queue == NULL || node->sending == NULL || node->wake == NULL) return 0;
+    }
+    if (self < 0 || self >= count) return 0;
+    const char *secret = getenv(CLUSTER_SECRET_ENV);
+    if (secret != NULL && (strlen(secret) > CLUSTER_SECRET_MAX || strpbrk(secret, " \t\r\n") != NULL)) {
+        printf("%s must be at most %d characters without whitespace.\n", CLUSTER_SECRET_ENV, CLUSTER_SECRET_MAX);
+        return 0;
+    }
+    if (secret != NULL) strcpy(cluster_secret, secret);
+    cluster_size = count;
+    cluster_self = self;
+    server_port = cluster_nodes[self].port;
+
+    for (int node = 0; node < count; node++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            cluster_ring[cluster_ring_size].hash = cluster_hash((uint32_t)node, (uint32_t)v);
+            cluster_ring[cluster_ring_size].node = node;
+            cluster_ring_size++;
+        }
+    }
+    qsort(cluster_ring, cluster_ring_size, sizeof(RingPoint), compare_ring_points);
+
+    int owned = 0; // Share of the first 1024 blocks, as a sanity check of the ring's balance
+    for (int block = 0; block < 1024; block++) owned += (cluster_owner(block * ID_BLOCK_SIZE) == self);
+    printf("Cluster node %d of %d; owns %.1f%% of the ID space.\n", self, count, owned * 100.0 / 1024);
+    if (cluster_secret[0] == '\0') {
+        printf("%s is not set: peer links are checked by address only.\n", CLUSTER_SECRET_ENV);
+    }
+    return 1;
+}
+
+// Node that owns an ID: the first ring point at or after the hash of the ID's block
+int cluster_owner(int id) {
+    if (cluster_size <= 1 || id <= 0) return cluster_self;
+    uint32_t h = cluster_hash((uint32_t)(id / ID_BLOCK_SIZE), 0xB10CU);
+    int lo = 0, hi = cluster_ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cluster_ring[mid].hash < h) lo = mid + 1; else hi = mid;
+    }
+    return cluster_ring[lo == cluster_ring_size ? 0 : lo].node;
+}
+
+// Issue count consecutive IDs (at most ID_BLOCK_SIZE) from a block this node owns, skipping the
+// broadcast ID. Returns the first, or -1 if the ID space is exhausted. Caller holds cs.
+int claim_client_ids(int count) {
+    while (next_client_id <= INT_MAX - 2 * ID_BLOCK_SIZE) {
+        int block_end = (next_client_id / ID_BLOCK_SIZE + 1) * ID_BLOCK_SIZE;
+        if (cluster_owner(next_client_id) != cluster_self || next_client_id + count > block_end) {
+            next_client_id = block_end;
+        } else if (next_client_id <= BROADCAST_ID && next_client_id + count > BROADCAST_ID) {
+            next_client_id = BROADCAST_ID + 1;
+        } else {
+            int first_id = next_client_id;
+            next_client_id += count;
+            return first_id;
+        }
+    }
+    return -1;
+}
+
+// Queue a record for a peer's link. Refused (0) while the link is down or its queue is full,
+// so the sender hears about it instead of the message vanishing.
+int cluster_forward(int node, const char* record, int len) {
+    ClusterNode *peer = &cluster_nodes[node];
+    int queued = 0;
+
+    EnterCriticalSection(&peer->lock);
+    if (peer->connected && peer->queue_len + len <= CLUSTER_QUEUE_LIMIT) {
+        memcpy(peer->queue + peer->queue_len, record, len);
+        peer->queue_len += len;
+        queued = 1;
+    }
+    LeaveCriticalSection(&peer->lock);
+    if (queued) {
+        InterlockedIncrement64(&peer->records_forwarded);
+        SetEvent(peer->wake);
+    }
+    return queued;
+}
+
+// One copy of a broadcast record per peer, however many clients each has
+void cluster_forward_all(const char* record, int len) {
+    for (int i = 0; i < cluster_size; i++) {
+        if (i != cluster_self) cluster_forward(i, record, len);
+    }
+}
+
+// Deliver a server notice to an ID wherever it lives. Returns 0 if it could not be delivered or forwarded.
+int notify_id(int id, const char* message) {
+    char record[BUFFER_SIZE + 128];
+    int owner = cluster_owner(id);
+
+    if (owner != cluster_self) {
+        int len = snprintf(record, sizeof(record) - 1, "R %d %s", id, message);
+        if (len < 0 || len > (int)sizeof(record) - 2) len = (int)sizeof(record) - 2;
+        record[len++] = '\n';
+        return cluster_forward(owner, record, len);
+    }
+    EnterCriticalSection(&cs);
+    int result = deliver_to_id(id, message, (int)strlen(message));
+    LeaveCriticalSection(&cs);
+    return result > 0;
+}
+
+// Outgoing link to one peer: connect (and reconnect), then write whatever has been queued as one batch
+unsigned __stdcall cluster_link_thread(void *arg) {
+    int node = (int)(uintptr_t)arg;
+    ClusterNode *peer = &cluster_nodes[node];
+    struct sockaddr_in address, local;
+    char hello[32 + CLUSTER_SECRET_MAX];
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(peer->ip);
+    address.sin_port = htons((u_short)peer->port);
+    // Connect from our own listed address: the peer accepts the link only from there
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = inet_addr(cluster_nodes[cluster_self].ip);
+    sprintf(hello, cluster_secret[0] ? "NODE %d %s\n" : "NODE %d\n", cluster_self, cluster_secret);
+
+    while (1) {
+        SOCKET link = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (link != INVALID_SOCKET && bind(link, (struct sockaddr*)&local, sizeof(local)) == SOCKET_ERROR) {
+            printf("Could not bind the link to node %d to %s. Error: %d\n", node, cluster_nodes[cluster_self].ip, WSAGetLastError());
+        }
+        if (link == INVALID_SOCKET || connect(link, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+            send(link, hello, (int)strlen(hello), 0) == SOCKET_ERROR) {
+            if (link != INVALID_SOCKET) closesocket(link);
+            Sleep(CLUSTER_RETRY_MS);
+            continue;
+        }
+        BOOL no_delay = TRUE; // Batching happens here; Nagle would only add delay on top
+        setsockopt(link, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+        printf("Link to node %d (%s:%d) is up.\n", node, peer->ip, peer->port);
+        InterlockedExchange(&peer->connected, 1);
+
+        while (1) {
+            WaitForSingleObject(peer->wake, INFINITE);
+            // Take everything queued so far; records queued during this write go out in the next batch
+            EnterCriticalSection(&peer->lock);
+            char *batch = peer->queue;
+            int batch_len = peer->queue_len;
+            peer->queue = peer->sending;
+            peer->queue_len = 0;
+            peer->sending = batch;
+            LeaveCriticalSection(&peer->lock);
+
+            int sent = 0;
+            while (sent < batch_len) {
+                int n = send(link, batch + sent, batch_len - sent, 0);
+                if (n == SOCKET_ERROR) break;
+                sent += n;
+            }
+            if (sent < batch_len) break;
+            if (batch_len > 0) InterlockedIncrement64(&peer->batches_written);
+        }
+        InterlockedExchange(&peer->connected, 0);
+        printf("Link to node %d lost (error %d) after %lld records in %lld batches. Reconnecting...\n",
+               node, WSAGetLastError(), peer->records_forwarded, peer->batches_written);
+        closesocket(link);
+        Sleep(CLUSTER_RETRY_MS);
+    }
+    return 0;
+}
+
+// Act on one record from a peer
+void handle_node_record(char* record) {
+    char formatted_message[BUFFER_SIZE + 64];
+    int a = 0, b = 0, n = 0;
+
+    if (record[0] == 'M' && sscanf(record + 1, "%d %d %n", &a, &b, &n) == 2 && n > 0) {
+        if (cluster_owner(b) == cluster_self) {
+            send_message_to_client(b, record + 1 + n, a);
+        } else {
+            // The nodes disagree about ownership (different node lists): never bounce it back and forth
+            sprintf(formatted_message, "ERROR User ID %d is not owned by node %d. Check the cluster configuration.", b, cluster_self);
+            notify_id(a, formatted_message);
+        }
+    } else if (record[0] == 'R' && sscanf(record + 1, "%d %n", &a, &n) == 1 && n > 0) {
+        EnterCriticalSection(&cs);
+        deliver_to_id(a, record + 1 + n, (int)strlen(record + 1 + n));
+        LeaveCriticalSection(&cs);
+    } else if (record[0] == 'B' && sscanf(record + 1, "%d %n", &a, &n) == 1 && n > 0) {
+        int len = snprintf(formatted_message, sizeof(formatted_message), "MSG %d (Broadcast): %s", a, record + 1 + n);
+        if (len < 0 || len >= (int)sizeof(formatted_message)) len = (int)sizeof(formatted_message) - 1;
+        history_append(formatted_message);
+        broadcast_local(formatted_message, len, a, a);
+    } else if (record[0] == 'I' && sscanf(record + 1, "%d %n", &a, &n) == 1 && n > 0) {
+        history_append(record + 1 + n);
+        broadcast_local(record + 1 + n, (int)strlen(record + 1 + n), a, OUTBOUND_CONTROL);
+    }
+}
+
+// Whether a "NODE <index> [<secret>]" hello may open a link: the index must name another node, the
+// connection must come from that node's listed address, and the secret must match ours (compared in
+// constant time by secret_matches).
+int cluster_link_allowed(int node, const char* secret, const char* peer_ip) {
+    if (node < 0 || node >= cluster_size || node == cluster_self) return 0;
+    if (strcmp(peer_ip, cluster_nodes[node].ip) != 0) return 0;
+    return secret_matches(cluster_secret, secret);
+}
+
+// Incoming link from a peer (already checked by cluster_link_allowed): split the stream into records
+// until the peer goes away
+void handle_node_link(SOCKET node_socket, int node) {
+    char pending[BUFFER_SIZE * 4];
+    int pending_len = 0;
+    long long records = 0;
+
+    printf("Node %d linked in.\n", node);
+    while (1) {
+        int received = recv(node_socket, pending + pending_len, (int)sizeof(pending) - 1 - pending_len, 0);
+        if (received <= 0) break;
+        pending_len += received;
+
+        char *start = pending, *line_end;
+        while ((line_end = (char*)memchr(start, '\n', pending_len - (start - pending))) != NULL) {
+            *line_end = '\0';
+            if (!has_control_characters(start)) handle_node_record(start); // Peers relay only checked input
+            records++;
+            start = line_end + 1;
+        }
+        pending_len -= (int)(start - pending);
+        memmove(pending, start, pending_len);
+        if (pending_len == (int)sizeof(pending) - 1) pending_len = 0; // Longer than any record we send
+    }
+    printf("Link from node %d closed after %lld records.\n", node, records);
+}
+
+// --- Placement ---
+
+// Move the calling thread next to the socket's receive queue. Returns 0 if RSS information is unavailable
+// (RSS off, a loopback connection, or an older Windows); the thread then stays where the scheduler puts it.
+int place_connection_thread(SOCKET s, PROCESSOR_NUMBER* rss_cpu, USHORT* rss_node) {
+#if PLACEMENT_ENABLED
+    SOCKET_PROCESSOR_AFFINITY affinity;
+    GROUP_AFFINITY node_mask;
+    DWORD returned = 0;
+
+    if (WSAIoctl(s, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &affinity, sizeof(affinity), &returned, NULL, NULL) == SOCKET_ERROR) {
+        return 0;
+    }
+    *rss_cpu = affinity.Processor;
+    *rss_node = affinity.NumaNodeId;
+    SetThreadIdealProcessorEx(GetCurrentThread(), rss_cpu, NULL);
+    if (GetNumaNodeProcessorMaskEx(affinity.NumaNodeId, &node_mask)) {
+        SetThreadGroupAffinity(GetCurrentThread(), &node_mask, NULL);
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// Count where a command is being handled relative to its socket's RSS processor
+void placement_note(int placed, const PROCESSOR_NUMBER* rss_cpu, USHORT rss_node) {
+    if (!placed) {
+        InterlockedIncrement64(&placement_unplaced);
+    } else {
+        PROCESSOR_NUMBER now;
+        USHORT node = 0;
+        GetCurrentProcessorNumberEx(&now);
+        if (now.Group == rss_cpu->Group && now.Number == rss_cpu->Number) {
+            InterlockedIncrement64(&placement_same_cpu);
+        } else if (GetNumaProcessorNodeEx(&now, &node) && node == rss_node) {
+            InterlockedIncrement64(&placement_same_node);
+        } else {
+            InterlockedIncrement64(&placement_remote);
+        }
+    }
+    if (InterlockedIncrement64(&placement_commands) % PLACEMENT_REPORT_INTERVAL == 0) {
+        printf("[Placement] %lld commands: %lld on the RSS CPU, %lld on its NUMA node, %lld on another node, %lld without RSS information\n",
+               (long long)placement_commands, (long long)placement_same_cpu, (long long)placement_same_node,
+               (long long)placement_remote, (long long)placement_unplaced);
+    }
+}
+
+// NUMA node of the processor the calling thread is running on
+USHORT placement_local_node(void) {
+    PROCESSOR_NUMBER now;
+    USHORT node = 0;
+    GetCurrentProcessorNumberEx(&now);
+    if (!GetNumaProcessorNodeEx(&now, &node)) node = 0;
+    return node;
+}
+
+// --- Hot Restart ---
+// The running server waits on a named pipe. A new process connects and sends its process ID; every
+// connection thread then parks at its next wait for input and, with cs and offline_cs held for good,
+// the state is written to the pipe: the listening socket and each connection duplicated for the new
+// process, each slot's session (ID, token, resume tail, input read but not handled yet), the virtual
+// sessions and the history ring. The old process exits once the new one acknowledges. Records in
+// flight on cluster links are not handed over; the links reconnect to the new process.
+
+// Create the wake socket and event every wait for input uses. Without them hot restart is disabled.
+void handoff_init(void) {
+    struct sockaddr_in addr;
+
+    u_long non_blocking = 1;
+
+    handoff_resume_event = CreateEventA(NULL, TRUE, FALSE, NULL); // Manual reset: releases every parked thread
+    handoff_io_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    handoff_wake_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (handoff_resume_event == NULL || handoff_io_event == NULL || handoff_wake_socket == INVALID_SOCKET) {
+        printf("[Hot Restart] Disabled: could not create the wake socket. Error: %d\n", WSAGetLastError());
+        if (handoff_wake_socket != INVALID_SOCKET) closesocket(handoff_wake_socket);
+        handoff_wake_socket = INVALID_SOCKET;
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(handoff_wake_socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        printf("[Hot Restart] Disabled: could not bind the wake socket. Error: %d\n", WSAGetLastError());
+        closesocket(handoff_wake_socket);
+        handoff_wake_socket = INVALID_SOCKET;
+        return;
+    }
+    // Any waiting thread may drain a stray datagram, so a recv must never block on one another took
+    ioctlsocket(handoff_wake_socket, FIONBIO, &non_blocking);
+}
+
+// Block until the socket is readable. Returns 0 instead if a hot restart wants this thread parked.
+// A wake datagram with no handoff running (one left by an abandoned handoff, or sent by anyone else
+// to the loopback port) is drained, or every select would return at once from then on.
+int wait_for_input(SOCKET s) {
+    fd_set read_set;
+    char stray;
+    while (!handoff_started) {
+        FD_ZERO(&read_set);
+        FD_SET(s, &read_set);
+        if (handoff_wake_socket != INVALID_SOCKET) FD_SET(handoff_wake_socket, &read_set);
+        // On error the recv that follows reports it
+        if (select(0, &read_set, NULL, NULL, NULL) <= 0 || FD_ISSET(s, &read_set)) break;
+        recv(handoff_wake_socket, &stray, 1, 0); // Checked again above: a handoff sets the flag before it sends
+    }
+    return !handoff_started;
+}
+
+// Park the calling thread for a hot restart, leaving the input it had read in its slot (the accept
+// loop passes INVALID_SOCKET). Returns only if the handoff is abandoned; otherwise the process exits.
+void park_for_handoff(SOCKET client_socket, const char* pending, int pending_len, int line_mode) {
+    EnterCriticalSection(&cs);
+    for (int i = 0; client_socket != INVALID_SOCKET && i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].socket == client_socket) {
+            clients[i].handoff_pending = (char*)malloc(pending_len + 1);
+            if (clients[i].handoff_pending == NULL) break; // Not parked: handed over detached instead
+            if (pending_len > 0) memcpy(clients[i].handoff_pending, pending, pending_len);
+            clients[i].handoff_pending_len = pending_len;
+            clients[i].handoff_line_mode = line_mode;
+            clients[i].handoff_parked = 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&cs);
+
+    WaitForSingleObject(handoff_resume_event, INFINITE);
+
+    EnterCriticalSection(&cs);
+    for (int i = 0; client_socket != INVALID_SOCKET && i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].socket == client_socket && clients[i].handoff_parked) {
+            free(clients[i].handoff_pending);
+            clients[i].handoff_pending = NULL;
+            clients[i].handoff_parked = 0;
+            break;
+        }
+    }
+    LeaveCriticalSection(&cs);
+}
+
+// After a takeover: if this connection was adopted from the old process, return its ID and the input
+// its old thread had read ahead. Returns 1 if so.
+int adopt_handoff_client(SOCKET client_socket, int* client_id, char* pending, int* pending_len, int* line_mode) {
+    int adopted = 0;
+    EnterCriticalSection(&cs);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].socket == client_socket && clients[i].handoff_parked) {
+            *client_id = clients[i].id;
+            *pending_len = clients[i].handoff_pending_len;
+            if (*pending_len > 0) memcpy(pending, clients[i].handoff_pending, *pending_len);
+            *line_mode = clients[i].handoff_line_mode;
+            free(clients[i].handoff_pending);
+            clients[i].handoff_pending = NULL;
+            clients[i].handoff_parked = 0;
+            adopted = 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&cs);
+    return adopted;
+}
+
+// One overlapped read or write on the handoff pipe. If it has not completed by handoff_deadline it is
+// cancelled and fails, so a stalled peer cannot keep the old process frozen with cs held.
+int handoff_io(HANDLE pipe, void* data, DWORD len, int writing, DWORD* done) {
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = handoff_io_event;
+    BOOL finished = writing ? WriteFile(pipe, data, len, NULL, &overlapped) : ReadFile(pipe, data, len, NULL, &overlapped);
+    if (!finished && GetLastError() != ERROR_IO_PENDING) return 0;
+
+    ULONGLONG now = GetTickCount64();
+    DWORD wait = now < handoff_deadline ? (DWORD)(handoff_deadline - now) : 0;
+    if (WaitForSingleObject(handoff_io_event, wait) != WAIT_OBJECT_0) {
+        CancelIoEx(pipe, &overlapped);
+        GetOverlappedResult(pipe, &overlapped, done, TRUE); // overlapped must outlive the cancelled operation
+        printf("[Hot Restart] The other process stopped responding.\n");
+        return 0;
+    }
+    return GetOverlappedResult(pipe, &overlapped, done, FALSE);
+}
+
+int handoff_write(HANDLE pipe, const void* data, DWORD len) {
+    DWORD written;
+    while (len > 0) {
+        if (!handoff_io(pipe, (void*)data, len, 1, &written)) return 0;
+        data = (const char*)data + written;
+        len -= written;
+    }
+    return 1;
+}
+
+int handoff_read(HANDLE pipe, void* data, DWORD len) {
+    DWORD got;
+    while (len > 0) {
+        if (!handoff_io(pipe, data, len, 0, &got) || got == 0) return 0;
+        data = (char*)data + got;
+        len -= got;
+    }
+    return 1;
+}
+
+// Old side: wait on the pipe for a new process to take over
+unsigned __stdcall handoff_listener_thread(void *arg) {
+    char name[64];
+    sprintf(name, HANDOFF_PIPE_NAME, server_port);
+    HANDLE pipe = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+                                   PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 64 * 1024, 64 * 1024, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        printf("[Hot Restart] Could not create %s. Error: %d\n", name, GetLastError());
+        return 1;
+    }
+    printf("[Hot Restart] Waiting for a takeover on %s\n", name);
+    while (1) {
+        DWORD new_pid = 0, unused;
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.hEvent = handoff_io_event;
+        if (!ConnectNamedPipe(pipe, &overlapped)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING) {
+                error = GetOverlappedResult(pipe, &overlapped, &unused, TRUE) ? ERROR_PIPE_CONNECTED : GetLastError();
+            }
+            if (error != ERROR_PIPE_CONNECTED) {
+                Sleep(100);
+                continue;
+            }
+        }
+        // Parking has its own timeout; the deadline covers the rest (hand_off restarts it)
+        handoff_deadline = GetTickCount64() + HANDOFF_TRANSFER_TIMEOUT_MS;
+        if (handoff_read(pipe, &new_pid, sizeof(new_pid)) && hand_off(pipe, new_pid)) {
+            ExitProcess(0); // cs is still held, so nothing else runs before we are gone
+        }
+        DisconnectNamedPipe(pipe);
+    }
+}
+
+// Old side: hand everything to process new_pid. Returns 1 once it has acknowledged, with cs and
+// offline_cs still held; on failure, including no ack within HANDOFF_TRANSFER_TIMEOUT_MS of the
+// connections being parked, both are released and the parked threads carry on.
+int hand_off(HANDLE pipe, DWORD new_pid) {
+    HandoffHeader header;
+    LARGE_INTEGER started;
+    struct sockaddr_in wake_addr;
+    int wake_len = sizeof(wake_addr);
+    char ack = 0;
+    int ok = 1, busy;
+
+    QueryPerformanceCounter(&started);
+    printf("[Hot Restart] Process %lu is taking over; parking connections...\n", (unsigned long)new_pid);
+
+    // 1. Every connection thread and the accept loop park at their next wait for input
+    ResetEvent(handoff_resume_event);
+    InterlockedExchange(&handoff_started, 1);
+    getsockname(handoff_wake_socket, (struct sockaddr*)&wake_addr, &wake_len);
+    sendto(handoff_wake_socket, "W", 1, 0, (struct sockaddr*)&wake_addr, wake_len); // Never read: wakes every select
+    ULONGLONG deadline = GetTickCount64() + HANDOFF_PARK_TIMEOUT_MS;
+    while (1) {
+        EnterCriticalSection(&cs);
+        busy = handoff_busy;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].active && clients[i].socket != INVALID_SOCKET && !clients[i].handoff_parked) busy++;
+            busy += clients[i].writing; // A writer in the middle of a send
+        }
+        if (busy == 0 || GetTickCount64() >= deadline) break; // Keeps cs
+        LeaveCriticalSection(&cs);
+        Sleep(1);
+    }
+    if (busy > 0) printf("[Hot Restart] %d connection(s) still busy; they are handed over detached.\n", busy);
+    handoff_deadline = GetTickCount64() + HANDOFF_TRANSFER_TIMEOUT_MS;
+
+    // 2. Nothing is delivered from here on, so the snapshot stays exact. Queued messages go to disk.
+    EnterCriticalSection(&offline_cs);
+    for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+        if (offline_segments[i].base != NULL) {
+            FlushViewOfFile(offline_segments[i].base, offline_segments[i].used);
+            FlushFileBuffers(offline_segments[i].file);
+        }
+    }
+
+    // 3. Header, slots, virtual sessions, history
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.old_pid = GetCurrentProcessId();
+    header.started_at = started.QuadPart;
+    header.next_client_id = next_client_id;
+    for (int i = 0; i < MAX_CLIENTS; i++) header.client_count += clients[i].active;
+    header.virtual_count = virtual_total;
+    header.history_next_seq = history_next_seq;
+    header.history_first_seq = header.history_next_seq - history_capacity;
+    if (header.history_first_seq < 1) header.history_first_seq = 1;
+    if (WSADuplicateSocketA(listen_socket, new_pid, &header.listener) != 0) {
+        printf("[Hot Restart] Could not duplicate the listening socket. Error: %d\n", WSAGetLastError());
+        ok = 0;
+    }
+    ok = ok && handoff_write(pipe, &header, sizeof(header));
+    for (int i = 0; ok && i < MAX_CLIENTS; i++) {
+        if (clients[i].active) ok = handoff_send_client(pipe, i, new_pid);
+    }
+    for (int i = 0; ok && i < MAX_VIRTUAL_SESSIONS; i++) {
+        if (virtual_sessions[i].id == -1) continue;
+        int pair[2] = { virtual_sessions[i].id, virtual_sessions[i].host };
+        ok = handoff_write(pipe, pair, sizeof(pair));
+    }
+    for (LONG64 seq = header.history_first_seq; ok && seq < header.history_next_seq; seq++) {
+        HistorySlot *slot = &history_slots[seq & (history_capacity - 1)];
+        int length = (slot->seq == seq) ? slot->length : -1;
+        ok = handoff_write(pipe, &length, sizeof(length)) && (length <= 0 || handoff_write(pipe, slot->data, length));
+    }
+
+    // 4. Once acknowledged, the new process has its own handles to every socket and ours may go
+    ok = ok && handoff_read(pipe, &ack, 1) && ack == 'K';
+    if (ok) {
+        printf("[Hot Restart] Handed over to process %lu; exiting.\n", (unsigned long)new_pid);
+        fflush(stdout);
+        return 1;
+    }
+
+    printf("[Hot Restart] Handoff to process %lu failed; resuming service.\n", (unsigned long)new_pid);
+    LeaveCriticalSection(&offline_cs);
+    recv(handoff_wake_socket, &ack, 1, 0); // Drain the wake datagram before anyone waits again
+    InterlockedExchange(&handoff_started, 0);
+    LeaveCriticalSection(&cs);
+    SetEvent(handoff_resume_event);
+    return 0;
+}
+
+// Old side: one client slot. Only a parked connection moves; a busy one (in a file relay) arrives
+// detached and its client resumes. Caller holds cs.
+int handoff_send_client(HANDLE pipe, int slot, DWORD new_pid) {
+    Client *client = &clients[slot];
+    HandoffClient record;
+
+    memset(&record, 0, sizeof(record));
+    record.slot = slot;
+    record.id = client->id;
+    memcpy(record.ip, client->ip, sizeof(record.ip));
+    memcpy(record.resume_token, client->resume_token, sizeof(record.resume_token));
+    record.stream_offset = client->stream_offset;
+    record.compress = client->compress;
+    record.detached_since = client->detached_since;
+    record.spilled = client->spilled;
+    if (client->socket != INVALID_SOCKET) {
+        // Shared memory dies with this process: such a client resumes over TCP
+        if (client->handoff_parked && client->shm == NULL && WSADuplicateSocketA(client->socket, new_pid, &record.socket_info) == 0) {
+            record.has_socket = 1;
+            record.pending_len = client->handoff_pending_len;
+            record.line_mode = client->handoff_line_mode;
+        } else {
+            record.detached_since = time(NULL);
+        }
+    }
+    if (client->tail != NULL) {
+        record.tail_len = client->stream_offset < RESUME_TAIL_SIZE ? (int)client->stream_offset : RESUME_TAIL_SIZE;
+    }
+    for (OutboundItem *item = client->control_queue.head; item != NULL; item = item->next) {
+        record.queued_len += item->len;
+        if (item->replay) record.replay_len += item->len; // Only ever at the head
+    }
+    record.queued_len += client->bulk_bytes;
+    if (!handoff_write(pipe, &record, sizeof(record))) return 0;
+    if (record.pending_len > 0 && !handoff_write(pipe, client->handoff_pending, record.pending_len)) return 0;
+
+    // The tail in stream order, oldest byte first
+    unsigned long long from = client->stream_offset - record.tail_len;
+    for (int done = 0; done < record.tail_len; ) {
+        size_t pos = (size_t)((from + done) % RESUME_TAIL_SIZE);
+        int chunk = (int)(RESUME_TAIL_SIZE - pos);
+        if (chunk > record.tail_len - done) chunk = record.tail_len - done;
+        if (!handoff_write(pipe, client->tail + pos, chunk)) return 0;
+        done += chunk;
+    }
+
+    // Queued output, control first; the new process sends it ahead of anything it queues itself
+    for (OutboundItem *item = client->control_queue.head; item != NULL; item = item->next) {
+        if (!handoff_write(pipe, item->data, item->len)) return 0;
+    }
+    for (int f = 0; f < OUTBOUND_FLOWS; f++) {
+        for (OutboundItem *item = client->bulk_queues[f].head; item != NULL; item = item->next) {
+            if (!handoff_write(pipe, item->data, item->len)) return 0;
+        }
+    }
+    return 1;
+}
+
+// New side: connect to the server running on our port and import its state before any thread starts.
+// Returns the number of connections adopted, or -1 if there was nothing to take over or the handoff broke off.
+int handoff_receive(HANDLE* old_process, LONG64* started_at) {
+    char name[64];
+    HandoffHeader header;
+    DWORD pid = GetCurrentProcessId();
+    int adopted = 0, ok;
+
+    if (handoff_io_event == NULL) return -1; // handoff_init already said why
+    sprintf(name, HANDOFF_PIPE_NAME, server_port);
+    HANDLE pipe = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        printf("[Hot Restart] No server to take over on port %d (%s). Error: %d\n", server_port, name, GetLastError());
+        return -1;
+    }
+    // The old process first parks its connections, then has the transfer timeout for the rest
+    handoff_deadline = GetTickCount64() + HANDOFF_PARK_TIMEOUT_MS + HANDOFF_TRANSFER_TIMEOUT_MS;
+    printf("[Hot Restart] Taking over the server on port %d...\n", server_port);
+    ok = handoff_write(pipe, &pid, sizeof(pid)) && handoff_read(pipe, &header, sizeof(header)) && header.magic == HANDOFF_MAGIC;
+    if (ok) {
+        listen_socket = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &header.listener, 0, WSA_FLAG_OVERLAPPED);
+        ok = listen_socket != INVALID_SOCKET;
+        if (header.next_client_id > next_client_id) next_client_id = header.next_client_id;
+    }
+    for (int n = 0; ok && n < header.client_count; n++) {
+        ok = handoff_receive_client(pipe, &adopted);
+    }
+    for (int n = 0; ok && n < header.virtual_count; n++) {
+        int pair[2];
+        ok = handoff_read(pipe, pair, sizeof(pair));
+        if (ok && pair[1] >= 0 && pair[1] < MAX_CLIENTS && clients[pair[1]].active) virtual_restore(pair[1], pair[0]);
+    }
+    for (LONG64 seq = header.history_first_seq; ok && seq < header.history_next_seq; seq++) {
+        HistorySlot *slot = &history_slots[seq & (history_capacity - 1)];
+        int length;
+        ok = handoff_read(pipe, &length, sizeof(length)) && length <= HISTORY_ENTRY_SIZE;
+        if (ok && length >= 0) {
+            ok = length == 0 || handoff_read(pipe, slot->data, length);
+            slot->length = length;
+            slot->seq = seq;
+        }
+    }
+    if (ok) history_next_seq = header.history_next_seq;
+
+    // Open the old process before acknowledging: it exits as soon as it sees the ack
+    if (ok) *old_process = OpenProcess(SYNCHRONIZE, FALSE, header.old_pid);
+    ok = ok && handoff_write(pipe, "K", 1);
+    CloseHandle(pipe);
+    if (!ok) {
+        printf("[Hot Restart] The handoff broke off; the running server keeps serving.\n");
+        return -1;
+    }
+    *started_at = header.started_at;
+    printf("[Hot Restart] Imported %d session(s), %d virtual session(s) and %lld history entries.\n",
+           header.client_count, virtual_total, (long long)(header.history_next_seq - header.history_first_seq));
+    return adopted;
+}
+
+// New side: one client slot. An adopted connection is left parked for main to start its thread.
+int handoff_receive_client(HANDLE pipe, int* adopted) {
+    HandoffClient record;
+
+    if (!handoff_read(pipe, &record, sizeof(record))) return 0;
+    if (record.slot < 0 || record.slot >= MAX_CLIENTS || record.pending_len < 0 || record.pending_len > BUFFER_SIZE - 1 ||
+        record.tail_len < 0 || record.tail_len > RESUME_TAIL_SIZE || record.queued_len < 0) return 0;
+
+    Client *client = &clients[record.slot];
+    if (client->tail == NULL) client->tail = (char*)malloc(RESUME_TAIL_SIZE);
+    client->handoff_pending = (char*)malloc(record.pending_len + 1);
+    if (client->tail == NULL || client->handoff_pending == NULL) return 0;
+    if (record.pending_len > 0 && !handoff_read(pipe, client->handoff_pending, record.pending_len)) return 0;
+    unsigned long long from = record.stream_offset - record.tail_len;
+    for (int done = 0; done < record.tail_len; ) {
+        size_t pos = (size_t)((from + done) % RESUME_TAIL_SIZE);
+        int chunk = (int)(RESUME_TAIL_SIZE - pos);
+        if (chunk > record.tail_len - done) chunk = record.tail_len - done;
+        if (!handoff_read(pipe, client->tail + pos, chunk)) return 0;
+        done += chunk;
+    }
+    if (!outbound_start(record.slot)) return 0;
+    if (record.queued_len > 0) {
+        WSABUF queued;
+        char *received = (char*)malloc(record.queued_len);
+        queued.buf = received;
+        queued.len = (ULONG)record.queued_len;
+        if (queued.buf == NULL || !handoff_read(pipe, queued.buf, queued.len)) {
+            free(queued.buf);
+            return 0;
+        }
+        if (record.replay_len > 0 && record.replay_len <= record.queued_len) {
+            // A RESUME replay the old process had not sent yet stays uncounted in the stream
+            OutboundItem *replay = outbound_queue_replay(client, record.replay_len);
+            if (replay == NULL) {
+                free(queued.buf);
+                return 0;
+            }
+            memcpy(replay->data, queued.buf, record.replay_len);
+            queued.buf += record.replay_len;
+            queued.len -= (ULONG)record.replay_len;
+        }
+        if (queued.len > 0) deliver_to_client(record.slot, &queued, 1, OUTBOUND_CONTROL);
+        free(received);
+    }
+
+    client->id = record.id;
+    memcpy(client->ip, record.ip, sizeof(client->ip));
+    memcpy(client->resume_token, record.resume_token, sizeof(client->resume_token));
+    client->stream_offset = record.stream_offset;
+    client->compress = record.compress;
+    client->receiving_file = 0;
+    client->socket = INVALID_SOCKET;
+    client->detached_since = record.detached_since;
+    client->spilled = record.spilled;
+    client->active = 1;
+    if (record.has_socket) {
+        SOCKET s = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &record.socket_info, 0, WSA_FLAG_OVERLAPPED);
+        if (s != INVALID_SOCKET) {
+            client->socket = s;
+            client->detached_since = 0;
+            client->handoff_pending_len = record.pending_len;
+            client->handoff_line_mode = record.line_mode;
+            client->handoff_parked = 1;
+            SetEvent(client->outbound_ready); // Now the writer can send what the old process had queued
+            (*adopted)++;
+            return 1;
+        }
+        printf("[Hot Restart] Could not adopt the connection of client %d. Error: %d\n", record.id, WSAGetLastError());
+        client->detached_since = time(NULL);
+    }
+    free(client->handoff_pending);
+    client->handoff_pending = NULL;
+    return 1;
+}
+
+// --- Offline Message Log ---
+// Appends go to the active segment under offline_cs only; the per-recipient index lives in
+// memory and is rebuilt from the segment files at startup. The maintenance thread flushes
+// dirty pages and compacts sealed segments so delivered records are eventually dropped.
+
+#define OFFLINE_RECORD_SIZE(len) ((sizeof(OfflineRecordHeader) + (size_t)(len) + 7) & ~(size_t)7)
+
+// Find (or create) the queue for a recipient. Caller holds offline_cs.
+OfflineRecipient* offline_find_recipient(int recipient_id, int create) {
+    unsigned int bucket = (unsigned int)recipient_id % OFFLINE_INDEX_BUCKETS;
+    for (OfflineRecipient *r = offline_index[bucket]; r != NULL; r = r->next) {
+        if (r->recipient_id == recipient_id) return r;
+    }
+    if (!create) return NULL;
+    OfflineRecipient *r = (OfflineRecipient*)calloc(1, sizeof(OfflineRecipient));
+    if (r == NULL) return NULL;
+    r->recipient_id = recipient_id;
+    r->next = offline_index[bucket];
+    offline_index[bucket] = r;
+    return r;
+}
+
+// Map a segment file into a free slot. Returns the slot or -1. Caller holds offline_cs.
+int offline_map_segment(unsigned int number, int create) {
+    char path[MAX_PATH];
+    int slot = -1;
+
+    for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+        if (offline_segments[i].base == NULL) { slot = i; break; }
+    }
+    if (slot == -1) {
+        printf("[Offline Log] All %d segment slots are in use.\n", OFFLINE_MAX_SEGMENTS);
+        return -1;
+    }
+
+    sprintf(path, OFFLINE_LOG_DIR "\\segment_%06u.log", number);
+    // A new segment never replaces a file that is already there, even one offline_log_open skipped
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                              create ? CREATE_NEW : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("[Offline Log] Could not open %s. Error: %d\n", path, GetLastError());
+        return -1;
+    }
+    // Mapping a fixed size also grows a new file to OFFLINE_SEGMENT_SIZE (zero filled)
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, OFFLINE_SEGMENT_SIZE, NULL);
+    if (mapping == NULL) {
+        printf("[Offline Log] Could not map %s. Error: %d\n", path, GetLastError());
+        CloseHandle(file);
+        return -1;
+    }
+    char *base = (char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, OFFLINE_SEGMENT_SIZE);
+    if (base == NULL) {
+        printf("[Offline Log] Could not map a view of %s. Error: %d\n", path, GetLastError());
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return -1;
+    }
+
+    memset(&offline_segments[slot], 0, sizeof(OfflineSegment));
+    offline_segments[slot].number = number;
+    offline_segments[slot].file = file;
+    offline_segments[slot].mapping = mapping;
+    offline_segments[slot].base = base;
+    return slot;
+}
+
+// Unmap a segment and delete its file. Caller holds offline_cs.
+void offline_drop_segment(int slot) {
+    char path[MAX_PATH];
+    OfflineSegment *seg = &offline_segments[slot];
+
+    sprintf(path, OFFLINE_LOG_DIR "\\segment_%06u.log", seg->number);
+    UnmapViewOfFile(seg->base);
+    CloseHandle(seg->mapping);
+    CloseHandle(seg->file);
+    DeleteFileA(path);
+    printf("[Offline Log] Removed segment %u (%d records, all delivered).\n", seg->number, seg->total_records);
+    memset(seg, 0, sizeof(OfflineSegment));
+    if (offline_active_segment == slot) offline_active_segment = -1;
+}
+
+// Write one record into the active segment, starting a new segment when it is full.
+// Caller holds offline_cs. Returns 1 and the record location on success.
+int offline_write_record(int recipient_id, uint64_t seq, const char* token, const char* payload, uint32_t len, int* out_segment, size_t* out_offset) {
+    size_t needed = OFFLINE_RECORD_SIZE(len);
+    if (needed > OFFLINE_SEGMENT_SIZE) return 0;
+
+    if (offline_active_segment == -1 ||
+        offline_segments[offline_active_segment].used + needed > OFFLINE_SEGMENT_SIZE) {
+        // Seal the current segment; it stays mapped until compaction drops it
+        int slot = offline_map_segment(offline_next_segment_number, 1);
+        if (slot == -1) return 0;
+        offline_next_segment_number++;
+        offline_active_segment = slot;
+    }
+
+    OfflineSegment *seg = &offline_segments[offline_active_segment];
+    OfflineRecordHeader *hdr = (OfflineRecordHeader*)(seg->base + seg->used);
+    hdr->length = len;
+    hdr->recipient_id = recipient_id;
+    hdr->delivered = 0;
+    hdr->seq = seq;
+    memcpy(hdr->token, token, RESUME_TOKEN_LEN);
+    memcpy(hdr + 1, payload, len);
+    MemoryBarrier(); // The magic is written last so a torn record is never replayed
+    hdr->magic = OFFLINE_RECORD_MAGIC;
+
+    *out_segment = offline_active_segment;
+    *out_offset = seg->used;
+    seg->used += needed;
+    seg->live_records++;
+    seg->total_records++;
+    return 1;
+}
+
+int compare_segment_numbers(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+// Open the log directory and rebuild the index from existing segments.
+// Returns the highest recipient ID that still has queued messages (0 if none).
+int offline_log_open(void) {
+    WIN32_FIND_DATAA find_data;
+    unsigned int numbers[OFFLINE_MAX_SEGMENTS];
+    unsigned int highest_number = 0;
+    int count = 0, skipped = 0, highest_id = 0, recovered = 0;
+
+    CreateDirectoryA(OFFLINE_LOG_DIR, NULL); // Fails harmlessly if it already exists
+
+    HANDLE find = FindFirstFileA(OFFLINE_LOG_DIR "\\segment_*.log", &find_data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            unsigned int number;
+            if (sscanf(find_data.cFileName, "segment_%u.log", &number) != 1) continue;
+            // New segments are numbered after every file on disk, including those that do not fit
+            if (number > highest_number) highest_number = number;
+            if (count < OFFLINE_MAX_SEGMENTS - 1) numbers[count++] = number; // One slot stays free for appends
+            else skipped++;
+        } while (FindNextFileA(find, &find_data));
+        FindClose(find);
+    }
+    qsort(numbers, count, sizeof(numbers[0]), compare_segment_numbers);
+
+    EnterCriticalSection(&offline_cs);
+    if (highest_number >= offline_next_segment_number) offline_next_segment_number = highest_number + 1;
+    for (int n = 0; n < count; n++) {
+        int slot = offline_map_segment(numbers[n], 0);
+        if (slot == -1) continue;
+        OfflineSegment *seg = &offline_segments[slot];
+
+        // Walk records until the first unwritten (zero magic) or damaged one
+        size_t offset = 0;
+        while (offset + sizeof(OfflineRecordHeader) <= OFFLINE_SEGMENT_SIZE) {
+            OfflineRecordHeader *hdr = (OfflineRecordHeader*)(seg->base + offset);
+            if (hdr->magic != OFFLINE_RECORD_MAGIC ||
+                hdr->length > OFFLINE_SEGMENT_SIZE - offset - sizeof(OfflineRecordHeader)) {
+                break;
+            }
+            seg->total_records++;
+            if (hdr->seq >= offline_next_seq) offline_next_seq = hdr->seq + 1;
+            if (!hdr->delivered) {
+                OfflineRecipient *r = offline_find_recipient(hdr->recipient_id, 1);
+                OfflineIndexNode *node = (OfflineIndexNode*)malloc(sizeof(OfflineIndexNode));
+                if (r != NULL && node != NULL) {
+                    memcpy(r->token, hdr->token, RESUME_TOKEN_LEN); // The newest record's token wins
+                    node->segment = slot;
+                    node->offset = offset;
+                    node->next = NULL;
+                    if (r->tail) r->tail->next = node; else r->head = node;
+                    r->tail = node;
+                    seg->live_records++;
+                    recovered++;
+                    if (hdr->recipient_id > highest_id) highest_id = hdr->recipient_id;
+                } else {
+                    free(node);
+                }
+            }
+            offset += OFFLINE_RECORD_SIZE(hdr->length);
+        }
+        seg->used = offset;
+        seg->flushed = offset;
+        if (seg->live_records == 0) offline_drop_segment(slot);
+    }
+    LeaveCriticalSection(&offline_cs);
+
+    printf("[Offline Log] Opened '%s': %d segment(s), %d queued message(s) recovered.\n", OFFLINE_LOG_DIR, count, recovered);
+    if (skipped > 0) {
+        printf("[Offline Log] %d older segment file(s) left unread (only %d fit); raise OFFLINE_MAX_SEGMENTS to recover them.\n",
+               skipped, OFFLINE_MAX_SEGMENTS - 1);
+    }
+    return highest_id;
+}
+
+// Queue a formatted message for an offline recipient. Returns 1 on success.
+int offline_log_append(int recipient_id, const char* message, int len) {
+    int segment;
+    size_t offset;
+    OfflineIndexNode *node = (OfflineIndexNode*)malloc(sizeof(OfflineIndexNode));
+    if (node == NULL) return 0;
+
+    EnterCriticalSection(&offline_cs);
+    OfflineRecipient *r = offline_find_recipient(recipient_id, 1);
+    if (r == NULL || !offline_write_record(recipient_id, offline_next_seq, r->token, message, (uint32_t)len, &segment, &offset)) {
+        LeaveCriticalSection(&offline_cs);
+        free(node);
+        return 0;
+    }
+    offline_next_seq++;
+    node->segment = segment;
+    node->offset = offset;
+    node->next = NULL;
+    if (r->tail) r->tail->next = node; else r->head = node;
+    r->tail = node;
+    LeaveCriticalSection(&offline_cs);
+    return 1;
+}
+
+// Keep the token an ID was issued with once nobody is connected as it, so LOGIN can check it
+void offline_log_remember(int recipient_id, const char* token) {
+    EnterCriticalSection(&offline_cs);
+    OfflineRecipient *r = offline_find_recipient(recipient_id, 1);
+    if (r != NULL) {
+        strncpy(r->token, token, RESUME_TOKEN_LEN);
+        r->token[RESUME_TOKEN_LEN] = '\0';
+    }
+    LeaveCriticalSection(&offline_cs);
+}
+
+// Returns 1 if token is the one remembered for the ID
+int offline_log_check_token(int recipient_id, const char* token) {
+    EnterCriticalSection(&offline_cs);
+    OfflineRecipient *r = offline_find_recipient(recipient_id, 0);
+    int valid = r != NULL && r->token[0] != '\0' && secret_matches(r->token, token);
+    LeaveCriticalSection(&offline_cs);
+    return valid;
+}
+
+// Send every message queued for a recipient, in order, straight from the mapped segments into its
+// outbound queue. Returns the number of messages delivered; anything not taken stays queued.
+int offline_log_replay(int recipient_id, SOCKET target_socket) {
+    OfflineIndexNode *list, *node;
+    int delivered = 0;
+
+    // Detach the queue and pin its segments so compaction leaves the mappings alone
+    EnterCriticalSection(&offline_cs);
+    OfflineRecipient *r = offline_find_recipient(recipient_id, 0);
+    if (r == NULL || r->head == NULL) {
+        LeaveCriticalSection(&offline_cs);
+        return 0;
+    }
+    list = r->head;
+    r->head = r->tail = NULL;
+    for (node = list; node != NULL; node = node->next) {
+        offline_segments[node->segment].pins++;
+    }
+    LeaveCriticalSection(&offline_cs);
+
+    node = list;
+    while (node != NULL) {
+        WSABUF buffers[OFFLINE_REPLAY_BATCH];
+        OfflineIndexNode *batch_start = node;
+        DWORD count = 0;
+
+        // Gather a batch into one vectored send
+        while (node != NULL && count < OFFLINE_REPLAY_BATCH) {
+            OfflineRecordHeader *hdr = (OfflineRecordHeader*)(offline_segments[node->segment].base + node->offset);
+            buffers[count].buf = (char*)(hdr + 1);
+            buffers[count].len = hdr->length;
+            count++;
+            node = node->next;
+        }
+        if (send_vectored_to_socket(target_socket, buffers, count, OUTBOUND_BACKLOG) <= 0) {
+            // A full outbound queue too: the rest waits for the next LOGIN
+            printf("[Offline Log] Replay to ID %d failed. Error: %d\n", recipient_id, WSAGetLastError());
+            node = batch_start; // Keep this batch queued
+            break;
+        }
+
+        // Mark the batch delivered
+        EnterCriticalSection(&offline_cs);
+        while (batch_start != node) {
+            OfflineIndexNode *next = batch_start->next;
+            OfflineSegment *seg = &offline_segments[batch_start->segment];
+            ((OfflineRecordHeader*)(seg->base + batch_start->offset))->delivered = 1;
+            seg->delivered_dirty = 1;
+            seg->live_records--;
+            seg->pins--;
+            free(batch_start);
+            batch_start = next;
+            delivered++;
+        }
+        LeaveCriticalSection(&offline_cs);
+    }
+
+    if (node != NULL) {
+        // Put the undelivered remainder back at the front of the queue
+        EnterCriticalSection(&offline_cs);
+        OfflineIndexNode *last = node;
+        for (OfflineIndexNode *n = node; n != NULL; n = n->next) {
+            offline_segments[n->segment].pins--;
+            last = n;
+        }
+        r = offline_find_recipient(recipient_id, 1);
+        if (r != NULL) {
+            last->next = r->head;
+            r->head = node;
+            if (r->tail == NULL) r->tail = last;
+        }
+        LeaveCriticalSection(&offline_cs);
+    }
+    return delivered;
+}
+
+// Drop sealed segments with nothing left to deliver and rewrite mostly-delivered ones
+void offline_log_compact(void) {
+    EnterCriticalSection(&offline_cs);
+    for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+        OfflineSegment *seg = &offline_segments[i];
+        if (seg->base == NULL || i == offline_active_segment || seg->pins > 0) continue;
+
+        if (seg->live_records > 0 && seg->live_records * 100 < seg->total_records * OFFLINE_COMPACT_LIVE_PERCENT) {
+            // Move the few live records to the active segment; list order (and so replay order) is unchanged
+            int moved = 0;
+            for (int b = 0; b < OFFLINE_INDEX_BUCKETS; b++) {
+                for (OfflineRecipient *r = offline_index[b]; r != NULL; r = r->next) {
+                    for (OfflineIndexNode *n = r->head; n != NULL; n = n->next) {
+                        if (n->segment != i) continue;
+                        OfflineRecordHeader *hdr = (OfflineRecordHeader*)(seg->base + n->offset);
+                        int new_segment;
+                        size_t new_offset;
+                        if (!offline_write_record(hdr->recipient_id, hdr->seq, hdr->token, (const char*)(hdr + 1), hdr->length, &new_segment, &new_offset)) {
+                            continue; // Out of space; the record stays where it is
+                        }
+                        hdr->delivered = 1;
+                        seg->delivered_dirty = 1;
+                        seg->live_records--;
+                        n->segment = new_segment;
+                        n->offset = new_offset;
+                        moved++;
+                    }
+                }
+            }
+            printf("[Offline Log] Compacted segment %u: moved %d live record(s).\n", seg->number, moved);
+        }
+        if (seg->live_records == 0) {
+            offline_drop_segment(i);
+        }
+    }
+    LeaveCriticalSection(&offline_cs);
+}
+
+// Background thread: push newly appended bytes and changed delivered flags to disk and compact,
+// off the receive path
+unsigned __stdcall offline_log_maintenance_thread(void *arg) {
+    char *flush_start[OFFLINE_MAX_SEGMENTS];
+    size_t flush_len[OFFLINE_MAX_SEGMENTS];
+
+    while (1) {
+        Sleep(OFFLINE_MAINTENANCE_INTERVAL_MS);
+
+        // Appends only touch the end of a segment; delivered flags can change anywhere in a sealed one
+        EnterCriticalSection(&offline_cs);
+        for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+            OfflineSegment *seg = &offline_segments[i];
+            flush_start[i] = NULL;
+            if (seg->base == NULL) continue;
+            if (seg->delivered_dirty) {
+                flush_start[i] = seg->base;
+                flush_len[i] = seg->used;
+            } else if (seg->used > seg->flushed) {
+                flush_start[i] = seg->base + seg->flushed;
+                flush_len[i] = seg->used - seg->flushed;
+            } else {
+                continue;
+            }
+            seg->delivered_dirty = 0;
+            seg->flushed = seg->used;
+            seg->pins++; // Keep the view mapped while flushing without the lock
+        }
+        LeaveCriticalSection(&offline_cs);
+
+        int flushed = 0;
+        for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+            if (flush_start[i] == NULL) continue;
+            FlushViewOfFile(flush_start[i], flush_len[i]);
+            flushed = 1;
+        }
+        if (flushed) {
+            EnterCriticalSection(&offline_cs);
+            for (int i = 0; i < OFFLINE_MAX_SEGMENTS; i++) {
+                if (flush_start[i] != NULL) offline_segments[i].pins--;
+            }
+            LeaveCriticalSection(&offline_cs);
+        }
+
+        offline_log_compact();
+    }
+    return 0;
+}
+
+// --- Message History Ring ---
+
+// Allocate the ring: the largest power-of-two slot count that fits HISTORY_MEMORY_BUDGET
+int history_init(void) {
+    LONG64 slots = 1;
+    while (slots * 2 * (LONG64)sizeof(HistorySlot) <= HISTORY_MEMORY_BUDGET) {
+        slots *= 2;
+    }
+    history_slots = (HistorySlot*)calloc((size_t)slots, sizeof(HistorySlot));
+    if (history_slots == NULL) return 0;
+    history_capacity = slots;
+    printf("Message history keeps the last %lld entries (%lld bytes).\n", (long long)slots, (long long)(slots * sizeof(HistorySlot)));
+    return 1;
+}
+
+// Record a broadcast/INFO message under the next sequence number
+void history_append(const char* message) {
+    LONG64 seq = InterlockedIncrement64(&history_next_seq) - 1;
+    HistorySlot *slot = &history_slots[seq & (history_capacity - 1)];
+    int length = (int)strlen(message);
+    if (length > HISTORY_ENTRY_SIZE) length = HISTORY_ENTRY_SIZE;
+
+    while (InterlockedCompareExchange(&slot->writer, 1, 0) != 0) {
+        Sleep(0); // Another writer lapped the ring onto this slot; wait for it
+    }
+    slot->seq = 0; // Mark as being rewritten
+    MemoryBarrier();
+    memcpy(slot->data, message, length);
+    slot->length = length;
+    MemoryBarrier();
+    slot->seq = seq; // Publish
+    InterlockedExchange(&slot->writer, 0);
+}
+
+// Stream history to one client with a single vectored send. Either the last last_n
+// entries (since_seq < 0) or every entry newer than since_seq.
+void send_history(SOCKET client_socket, int last_n, LONG64 since_seq) {
+    LONG64 end_seq = history_next_seq; // Entries before this have been claimed
+    LONG64 oldest = end_seq - history_capacity;
+    LONG64 start_seq;
+    if (oldest < 1) oldest = 1;
+
+    if (since_seq >= 0) {
+        start_seq = since_seq + 1;
+    } else {
+        start_seq = end_seq - last_n;
+    }
+    if (start_seq < oldest) start_seq = oldest;
+    int wanted = (int)(end_seq > start_seq ? end_seq - start_seq : 0);
+
+    // Readers copy out of the ring (it may be overwritten at any time) into private storage
+    char *copies = (char*)malloc((size_t)wanted * (HISTORY_ENTRY_SIZE + 32) + 128);
+    WSABUF *buffers = (WSABUF*)malloc(((size_t)wanted + 2) * sizeof(WSABUF));
+    if (copies == NULL || buffers == NULL) {
+        free(copies);
+        free(buffers);
+        const char *error_msg = "ERROR History is temporarily unavailable.";
+        send_to_socket(client_socket, error_msg, strlen(error_msg));
+        return;
+    }
+
+    char *header = copies;
+    char *cursor = copies + 128;
+    DWORD count = 1; // buffers[0] is the header, filled in once we know how many entries survived
+    LONG64 first_sent = 0, last_sent = 0;
+    for (LONG64 seq = start_seq; seq < end_seq; seq++) {
+        HistorySlot *slot = &history_slots[seq & (history_capacity - 1)];
+        if (slot->seq != seq) continue; // Still being written, or already overwritten
+        int prefix = sprintf(cursor, "#%lld ", (long long)seq);
+        int length = slot->length;
+        if (length < 0 || length > HISTORY_ENTRY_SIZE) continue;
+        memcpy(cursor + prefix, slot->data, length);
+        MemoryBarrier();
+        if (slot->seq != seq) continue; // A writer replaced it while we copied: drop the torn copy
+        cursor[prefix + length] = '\n';
+        buffers[count].buf = cursor;
+        buffers[count].len = prefix + length + 1;
+        cursor += prefix + length + 1;
+        count++;
+        if (first_sent == 0) first_sent = seq;
+        last_sent = seq;
+    }
+
+    buffers[0].buf = header;
+    buffers[0].len = sprintf(header, "HISTORY %lu %lld %lld\n", (unsigned long)(count - 1), (long long)first_sent, (long long)last_sent);
+
+    int result = send_vectored_to_socket(client_socket, buffers, count, OUTBOUND_BACKLOG);
+    if (result == SOCKET_ERROR) {
+        printf("Failed to send history. Error: %d\n", WSAGetLastError());
+    } else if (result == OUTBOUND_DROPPED) {
+        // More than the client's outbound queue may hold on top of what it already has
+        const char *error_msg = "ERROR History is temporarily unavailable.";
+        send_to_socket(client_socket, error_msg, strlen(error_msg));
+    }
+    free(buffers);
+    free(copies);
+}
+
+// --- File Relay ---
+
+// Relay <size> bytes from the sender's connection to the target as CHUNK frames.
+// Returns 0 if the sender's connection failed (the caller drops it), 1 otherwise.
+int relay_file(SOCKET sender_socket, int sender_id, int target_id, long long size, const char* name) {
+    char line[FILE_NAME_MAX + 128];
+    SOCKET target_socket = INVALID_SOCKET;
+    int target_index = -1;
+
+    // Claim the target's connection; other output for it stays queued until we are done
+    EnterCriticalSection(&cs);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].id == target_id && target_id != sender_id &&
+            clients[i].socket != INVALID_SOCKET && !clients[i].receiving_file && clients[i].shm == NULL) {
+            target_index = i;
+            target_socket = clients[i].socket;
+            clients[i].receiving_file = 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&cs);
+
+    // The writer may be halfway through a send; the file frame must not land inside it
+    while (target_index != -1) {
+        EnterCriticalSection(&cs);
+        int writing = clients[target_index].writing;
+        LeaveCriticalSection(&cs);
+        if (!writing) break;
+        Sleep(1);
+    }
+
+    if (target_index == -1) {
+        sprintf(line, "ERROR User ID %d is not available for a file transfer.", target_id);
+        send_to_socket(sender_socket, line, strlen(line));
+        return 1;
+    }
+
+    FileRelayPage pages[FILE_RELAY_PAGES];
+    // On this thread's NUMA node, which placement made the connection's node
+    char *ring = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL, (SIZE_T)FILE_RELAY_PAGES * FILE_RELAY_PAGE_SIZE,
+                                           MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE, placement_local_node());
+    memset(pages, 0, sizeof(pages));
+    for (int i = 0; ring != NULL && i < FILE_RELAY_PAGES; i++) {
+        pages[i].data = ring + (size_t)i * FILE_RELAY_PAGE_SIZE;
+        pages[i].send_overlapped.hEvent = WSACreateEvent();
+    }
+
+    long long received = 0;
+    int sender_failed = 0, target_failed = (ring == NULL);
+    LARGE_INTEGER start, end, frequency;
+    QueryPerformanceCounter(&start);
+
+    // File header frame on the target's stream, then tell the sender to start streaming. Its leading
+    // newline is chat stream (the client counts it like the text before it); the frame itself is not.
+    sprintf(line, "\n%cFILE %d %lld %s\n", FILE_MARKER, sender_id, size, name);
+    if (!target_failed && send(target_socket, line, strlen(line), 0) == SOCKET_ERROR) target_failed = 1;
+    if (!target_failed) {
+        EnterCriticalSection(&cs);
+        append_to_tail(&clients[target_index], "\n", 1);
+        LeaveCriticalSection(&cs);
+    }
+    if (target_failed) {
+        sprintf(line, "ERROR User ID %d is not available for a file transfer.", target_id);
+        send_to_socket(sender_socket, line, strlen(line));
+        // The sender waits for FILEREADY, so nothing needs draining
+        size = 0;
+    } else {
+        sprintf(line, "FILEREADY %lld", size);
+        send_to_socket(sender_socket, line, strlen(line));
+        printf("Relaying file '%s' (%lld bytes) from client %d to %d\n", name, size, sender_id, target_id);
+    }
+
+    for (long long page_no = 0, next_progress = FILE_PROGRESS_STEP; received < size; page_no++) {
+        FileRelayPage *page = &pages[page_no % FILE_RELAY_PAGES];
+        DWORD transferred = 0, flags = 0;
+
+        // Reuse the page only once the target has taken its previous contents
+        if (page->send_pending) {
+            if (!WSAGetOverlappedResult(target_socket, &page->send_overlapped, &transferred, TRUE, &flags)) target_failed = 1;
+            page->send_pending = 0;
+        }
+
+        // Never read past the file: the next command follows it on the same connection
+        int want = (size - received < FILE_RELAY_PAGE_SIZE) ? (int)(size - received) : FILE_RELAY_PAGE_SIZE;
+        int n = recv(sender_socket, page->data, want, 0);
+        if (n <= 0) {
+            sender_failed = 1;
+            break;
+        }
+        received += n;
+        if (target_failed) continue; // Keep draining so the sender's stream stays in sync
+
+        page->buffers[0].buf = page->header;
+        page->buffers[0].len = sprintf(page->header, "CHUNK %d\n", n);
+        page->buffers[1].buf = page->data;
+        page->buffers[1].len = n;
+        WSAResetEvent(page->send_overlapped.hEvent);
+        if (WSASend(target_socket, page->buffers, 2, NULL, 0, &page->send_overlapped, NULL) == SOCKET_ERROR &&
+            WSAGetLastError() != WSA_IO_PENDING) {
+            target_failed = 1;
+        } else {
+            page->send_pending = 1;
+        }
+
+        if (received >= next_progress && received < size) {
+            sprintf(line, "FILEPROGRESS %lld %lld", received, size);
+            send_to_socket(sender_socket, line, strlen(line));
+            next_progress += FILE_PROGRESS_STEP;
+        }
+    }
+
+    // Let in-flight sends finish before the pages go away
+    for (int i = 0; i < FILE_RELAY_PAGES; i++) {
+        DWORD transferred = 0, flags = 0;
+        if (pages[i].send_pending &&
+            !WSAGetOverlappedResult(target_socket, &pages[i].send_overlapped, &transferred, TRUE, &flags)) {
+            target_failed = 1;
+        }
+        if (pages[i].send_overlapped.hEvent != NULL) WSACloseEvent(pages[i].send_overlapped.hEvent);
+    }
+    if (ring != NULL) VirtualFree(ring, 0, MEM_RELEASE);
+
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    double mb_per_s = seconds > 0.0 ? (received / (1024.0 * 1024.0)) / seconds : 0.0;
+
+    // Close the file frame, then release the target to its writer, which sends whatever queued up meanwhile
+    if (size > 0) {
+        if (!target_failed) {
+            if (sender_failed) sprintf(line, "FILEABORT sender disconnected\n");
+            else sprintf(line, "FILEEND\n");
+            send(target_socket, line, strlen(line), 0);
+        }
+        if (sender_failed) {
+            printf("File transfer from %d to %d aborted: sender disconnected after %lld of %lld bytes\n", sender_id, target_id, received, size);
+        } else if (target_failed) {
+            printf("File transfer from %d to %d aborted: recipient unreachable\n", sender_id, target_id);
+            sprintf(line, "FILEABORT recipient %d disconnected", target_id);
+            send_to_socket(sender_socket, line, strlen(line));
+        } else {
+            printf("File transfer from %d to %d complete: %lld bytes in %.2f s (%.1f MB/s)\n", sender_id, target_id, received, seconds, mb_per_s);
+            sprintf(line, "FILEDONE %lld %.2f %.1f", received, seconds, mb_per_s);
+            send_to_socket(sender_socket, line, strlen(line));
+        }
+    }
+
+    EnterCriticalSection(&cs);
+    Client *target = &clients[target_index];
+    if (target->active && target->receiving_file) {
+        target->receiving_file = 0;
+        SetEvent(target->outbound_ready);
+        if (target->spilled && target->socket != INVALID_SOCKET) {
+            // Chat that outgrew the queue during the transfer went to the offline log; it follows now
+            target->spilled = 0;
+            int replayed = offline_log_replay(target->id, target->socket);
+            printf("Delivered %d message(s) held for client %d during the transfer\n", replayed, target->id);
+        }
+    }
+    LeaveCriticalSection(&cs);
+
+    return !sender_failed;
+}
+
+// --- Message Compression ---
+
+// Compress a message into a ready-to-send frame and account for it. Caller holds cs.
+// Returns 1 if frame now holds a compressed frame, 0 if the message goes out raw.
+int build_compressed_frame(const char* message, int len, CompressedFrame* frame) {
+    char header[48];
+    LARGE_INTEGER start, end;
+
+    frame->state = -1;
+    frame->data = (char*)malloc(sizeof(header) + len);
+    if (frame->data == NULL) return 0;
+
+    QueryPerformanceCounter(&start);
+    int compressed = compress_message(compress_dict_table, message, len, (unsigned char*)frame->data + sizeof(header), len);
+    QueryPerformanceCounter(&end);
+    compress_stats.cpu_ticks += end.QuadPart - start.QuadPart;
+
+    if (compressed == 0) {
+        compress_stats.skipped++;
+        free(frame->data);
+        frame->data = NULL;
+        return 0;
+    }
+    int header_len = sprintf(header, "\n%cZ %d %d\n", COMPRESS_MARKER, len, compressed);
+    memcpy(frame->data, header, header_len);
+    memmove(frame->data + header_len, frame->data + sizeof(header), compressed);
+    frame->len = header_len + compressed;
+    frame->state = 1;
+
+    compress_stats.compressed++;
+    compress_stats.input_bytes += len;
+    compress_stats.output_bytes += frame->len;
+    if (compress_stats.compressed % COMPRESS_REPORT_INTERVAL == 0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        long long attempts = compress_stats.compressed + compress_stats.skipped;
+        printf("[Compression] %lld messages compressed, %lld sent raw: ratio %.2f, %.2f us CPU per message; "
+               "egress %lld bytes instead of %lld (%.1f%% saved)\n",
+               compress_stats.compressed, compress_stats.skipped,
+               (double)compress_stats.input_bytes / (double)compress_stats.output_bytes,
+               (double)compress_stats.cpu_ticks * 1000000.0 / (double)frequency.QuadPart / (double)attempts,
+               compress_stats.egress_sent, compress_stats.egress_raw,
+               compress_stats.egress_raw > 0 ? 100.0 * (compress_stats.egress_raw - compress_stats.egress_sent) / compress_stats.egress_raw : 0.0);
+    }
+    return 1;
+}
+
+// Deliver a message to one client, compressed if it negotiated compression and the message is
+// large enough. The frame is shared across recipients so a broadcast is compressed only once.
+// Caller holds cs.
+int deliver_message(int client_index, const char* message, int len, CompressedFrame* frame, int flow) {
+    Client *client = &clients[client_index];
+
+    if (client->compress) {
+        if (len >= COMPRESS_MIN_SIZE && frame->state == 0) {
+            build_compressed_frame(message, len, frame);
+        }
+        if (len >= COMPRESS_MIN_SIZE && frame->state == 1) {
+            WSABUF buffer = { (ULONG)frame->len, frame->data };
+            compress_stats.egress_raw += len;
+            compress_stats.egress_sent += frame->len;
+            return deliver_to_client(client_index, &buffer, 1, flow);
+        }
+        compress_stats.egress_raw += len;
+        compress_stats.egress_sent += len;
+    }
+    WSABUF buffer = { (ULONG)len, (char*)message };
+    return deliver_to_client(client_index, &buffer, 1, flow);
+}
@@ -0,0 +1,327 @@
+// shm_bench.c
+// Same-host transport benchmark for the multiClient server: a sender and a receiver session exchange
+// pipelined messages over loopback TCP, then again with both sessions moved onto shared-memory rings
+// ("SHM", see shm_ring.h), and the throughput and one-way latency of the two runs are printed. Both
+// sessions live in this process, so one clock timestamps both ends.
+//
+// The server's flood protection holds one sender to RATE_MESSAGES_PER_SEC; build it with
+// RATE_ACTION RATE_OFF for throughput runs.
+//
+// Build: gcc shm_bench.c -o shm_bench -lws2_32
+// Usage: shm_bench <port> [messages] [window]
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <winsock2.h>
+#include <windows.h>
+#include <process.h> // For _beginthreadex
+#include <stdlib.h>
+#include <string.h>
+#include "shm_ring.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define DEFAULT_MESSAGES 100000
+#define DEFAULT_WINDOW 256 // Messages in flight at once
+#define READ_SIZE 65536 // Bytes taken from the stream per read
+#define REPLY_BUFFER_SIZE 4096 // Enough for the lines before the ID and SHM replies
+#define REPLY_TIMEOUT_MS 5000 // How long to wait for the ID and SHM replies
+#define IDLE_TIMEOUT_MS 5000 // Give up on the rest once nothing has arrived for this long
+
+// One session, on its TCP connection or (shm = 1) on the rings the server gave it
+typedef struct {
+    SOCKET sock;
+    int id;
+    int shm;
+    HANDLE mapping;
+    char *base;
+    ShmRing commands, output;
+} BenchSession;
+
+// --- Global Variables ---
+int message_count = DEFAULT_MESSAGES;
+LARGE_INTEGER frequency;
+LONGLONG *sent_at = NULL; // Send time per sequence number
+unsigned char *delivered = NULL; // Per sequence number, so duplicates are not counted twice
+double *latency_ms = NULL;
+volatile LONG received_count = 0;
+volatile LONG receiver_stop = 0;
+BenchSession receiver;
+
+// --- Function Prototypes ---
+int session_open(BenchSession *s, int port);
+int session_attach_shm(BenchSession *s);
+void session_close(BenchSession *s);
+int session_send(BenchSession *s, const char *data, int len);
+int session_read(BenchSession *s, char *out, int cap, DWORD timeout_ms);
+int run_transport(int port, int use_shm, int window);
+unsigned __stdcall receiver_thread(void *arg);
+int compare_doubles(const void *a, const void *b);
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    WSADATA wsa;
+    int window = DEFAULT_WINDOW;
+
+    if (argc < 2) {
+        printf("Usage: %s <port> [messages] [window]\n", argv[0]);
+        printf("Times messages between two local sessions over loopback TCP and over shared memory.\n");
+        return 1;
+    }
+    if (argc > 2) message_count = atoi(argv[2]);
+    if (argc > 3) window = atoi(argv[3]);
+    if (message_count <= 0 || window <= 0) {
+        printf("Messages and window must be positive.\n");
+        return 1;
+    }
+
+    sent_at = (LONGLONG*)malloc(message_count * sizeof(LONGLONG));
+    delivered = (unsigned char*)malloc(message_count);
+    latency_ms = (double*)malloc(message_count * sizeof(double));
+    if (sent_at == NULL || delivered == NULL || latency_ms == NULL) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError());
+        return 1;
+    }
+
+    printf("Sending %d messages with up to %d in flight, once per transport...\n", message_count, window);
+    int ok = run_transport(atoi(argv[1]), 0, window);
+    if (ok) ok = run_transport(atoi(argv[1]), 1, window);
+
+    WSACleanup();
+    free(sent_at);
+    free(delivered);
+    free(latency_ms);
+    return ok ? 0 : 1;
+}
+
+// One run: register a sender and a receiver, move both onto shared memory if asked, then keep the window
+// full until everything has arrived or the stream stalls, and report
+int run_transport(int port, int use_shm, int window) {
+    const char *label = use_shm ? "Shared memory" : "Loopback TCP";
+    BenchSession sender;
+    HANDLE thread;
+    char message[64];
+
+    memset(sent_at, 0, message_count * sizeof(LONGLONG));
+    memset(delivered, 0, message_count);
+    received_count = 0;
+    receiver_stop = 0;
+    if (!session_open(&sender, port) || !session_open(&receiver, port)) {
+        printf("%s: could not register two sessions on port %d.\n", label, port);
+        return 0;
+    }
+    if (use_shm && (!session_attach_shm(&sender) || !session_attach_shm(&receiver))) {
+        printf("%s: the server did not hand out its rings (is it on this host?).\n", label);
+        session_close(&sender);
+        session_close(&receiver);
+        return 0;
+    }
+    thread = (HANDLE)_beginthreadex(NULL, 0, receiver_thread, NULL, 0, NULL);
+    if (thread == NULL) {
+        printf("Failed to create the receiver thread. Error: %lu\n", GetLastError());
+        return 0;
+    }
+
+    LARGE_INTEGER start, end;
+    LONG last_seen = 0;
+    ULONGLONG last_progress = GetTickCount64();
+    int sent = 0;
+    QueryPerformanceCounter(&start);
+    while (received_count < message_count && GetTickCount64() - last_progress < IDLE_TIMEOUT_MS) {
+        if (sent < message_count && sent - received_count < window) {
+            LARGE_INTEGER now;
+            int len = sprintf(message, "SEND %d BENCH %d;\n", receiver.id, sent);
+            QueryPerformanceCounter(&now);
+            sent_at[sent] = now.QuadPart;
+            if (!session_send(&sender, message, len)) break;
+            sent++;
+        } else {
+            SwitchToThread(); // Window full: the receiver has work to do
+        }
+        if (received_count != last_seen) {
+            last_seen = received_count;
+            last_progress = GetTickCount64();
+        }
+    }
+    QueryPerformanceCounter(&end);
+    InterlockedExchange(&receiver_stop, 1);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    session_close(&sender);
+    session_close(&receiver);
+
+    int count = received_count;
+    double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    printf("\n--- %s ---\n", label);
+    printf("Delivered: %d of %d in %.3f s (%.0f messages/s)\n", count, message_count, seconds,
+           seconds > 0.0 ? count / seconds : 0.0);
+    if (sent > count) printf("Lost or late: %d\n", sent - count);
+    if (count > 0) {
+        double sum = 0.0;
+        qsort(latency_ms, count, sizeof(double), compare_doubles);
+        for (int i = 0; i < count; i++) sum += latency_ms[i];
+        printf("Latency: min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+               latency_ms[0], sum / count, latency_ms[count / 2], latency_ms[(int)(count * 0.99)],
+               latency_ms[(int)(count * 0.999)], latency_ms[count - 1]);
+    }
+    return 1;
+}
+
+// Reads the receiver's stream and times every "BENCH <seq>;" in it. A message may be split across
+// reads, so an unfinished one is carried over to the next.
+unsigned __stdcall receiver_thread(void *arg) {
+    char *stream = (char*)malloc(2 * READ_SIZE + 1);
+    int have = 0;
+
+    while (stream != NULL && !receiver_stop) {
+        int n = session_read(&receiver, stream + have, READ_SIZE, 100);
+        if (n < 0) break;
+        if (n == 0) continue;
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        have += n;
+        stream[have] = '\0';
+
+        char *p = stream, *keep = NULL;
+        while ((p = strstr(p, "BENCH ")) != NULL) {
+            char *end = strchr(p + 6, ';');
+            if (end == NULL) {
+                keep = p; // Unfinished
+                break;
+            }
+            int seq = atoi(p + 6);
+            p = end + 1;
+            if (seq < 0 || seq >= message_count || sent_at[seq] == 0 || delivered[seq]) continue;
+            delivered[seq] = 1;
+            latency_ms[received_count] = (double)(now.QuadPart - sent_at[seq]) * 1000.0 / (double)frequency.QuadPart;
+            InterlockedIncrement(&received_count);
+        }
+        // Carry the unfinished message, or the last few bytes in case "BENCH " itself was cut
+        if (keep == NULL) keep = (have > 5) ? stream + have - 5 : stream;
+        have = (int)(stream + have - keep);
+        memmove(stream, keep, have);
+    }
+    free(stream);
+    return 0;
+}
+
+// --- Sessions ---
+
+// Connect to the server on this host and wait for "ID <id> ...". Returns 0 on failure.
+int session_open(BenchSession *s, int port) {
+    struct sockaddr_in addr;
+    char reply[REPLY_BUFFER_SIZE];
+    int have = 0;
+
+    memset(s, 0, sizeof(*s));
+    s->id = -1;
+    s->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s->sock == INVALID_SOCKET) return 0;
+    BOOL no_delay = TRUE;
+    setsockopt(s->sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((u_short)port);
+    if (connect(s->sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        send(s->sock, "HELLO\n", 6, 0) == SOCKET_ERROR) {
+        session_close(s);
+        return 0;
+    }
+    ULONGLONG deadline = GetTickCount64() + REPLY_TIMEOUT_MS;
+    while (s->id == -1 && have < (int)sizeof(reply) - 1 && GetTickCount64() < deadline) {
+        int n = session_read(s, reply + have, (int)sizeof(reply) - 1 - have, 100);
+        if (n < 0) break;
+        have += n;
+        reply[have] = '\0';
+        char *id = strstr(reply, "ID ");
+        if (id != NULL) s->id = atoi(id + 3);
+    }
+    if (s->id == -1) {
+        session_close(s);
+        return 0;
+    }
+    return 1;
+}
+
+// Send "SHM", wait for "SHM <name> <size>" (the last bytes on the TCP stream) and map the region.
+// Returns 0 on failure.
+int session_attach_shm(BenchSession *s) {
+    char reply[REPLY_BUFFER_SIZE], name[SHM_NAME_MAX] = "";
+    int have = 0, size = 0;
+
+    if (send(s->sock, "SHM\n", 4, 0) == SOCKET_ERROR) return 0;
+    ULONGLONG deadline = GetTickCount64() + REPLY_TIMEOUT_MS;
+    while (name[0] == '\0' && have < (int)sizeof(reply) - 1 && GetTickCount64() < deadline) {
+        int n = session_read(s, reply + have, (int)sizeof(reply) - 1 - have, 100);
+        if (n < 0) return 0;
+        have += n;
+        reply[have] = '\0';
+        char *line = strstr(reply, "SHM ");
+        if (line != NULL && sscanf(line + 4, "%63s %d", name, &size) == 2 && size == SHM_RING_SIZE) break;
+        if (strstr(reply, "ERROR ") != NULL) return 0;
+        name[0] = '\0';
+    }
+    if (name[0] == '\0') return 0;
+
+    s->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (s->mapping != NULL) s->base = (char*)MapViewOfFile(s->mapping, FILE_MAP_ALL_ACCESS, 0, 0, SHM_REGION_SIZE);
+    if (s->base == NULL || ((ShmRegionHeader*)s->base)->magic != SHM_MAGIC ||
+        !shm_ring_events(&s->commands, &s->output, s->base, name, 0)) {
+        return 0;
+    }
+    s->shm = 1;
+    return 1;
+}
+
+void session_close(BenchSession *s) {
+    shm_ring_close_events(&s->commands, &s->output);
+    if (s->base != NULL) UnmapViewOfFile(s->base);
+    if (s->mapping != NULL) CloseHandle(s->mapping);
+    if (s->sock != INVALID_SOCKET) closesocket(s->sock); // Ends the session on the server either way
+    s->base = NULL;
+    s->mapping = NULL;
+    s->sock = INVALID_SOCKET;
+    s->shm = 0;
+}
+
+// Send all of data on the session's transport. Returns 0 on failure.
+int session_send(BenchSession *s, const char *data, int len) {
+    if (!s->shm) return send(s->sock, data, len, 0) == len;
+    while (len > 0) {
+        int written = shm_ring_write(&s->commands, data, len);
+        if (written < 0) return 0;
+        if (written == 0 && shm_ring_wait(&s->commands, 1, SHM_WAIT_MS) < 0) return 0;
+        data += written;
+        len -= written;
+    }
+    return 1;
+}
+
+// Read what has arrived, waiting up to timeout_ms. Returns the bytes read, 0 on timeout, -1 on failure.
+int session_read(BenchSession *s, char *out, int cap, DWORD timeout_ms) {
+    if (s->shm) {
+        int n = shm_ring_read(&s->output, out, cap);
+        if (n == 0 && shm_ring_wait(&s->output, 0, timeout_ms) > 0) n = shm_ring_read(&s->output, out, cap);
+        return n;
+    }
+    fd_set read_set;
+    struct timeval wait = { (long)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000 };
+    FD_ZERO(&read_set);
+    FD_SET(s->sock, &read_set);
+    int ready = select(0, &read_set, NULL, NULL, &wait);
+    if (ready <= 0) return ready;
+    int n = recv(s->sock, out, cap, 0);
+    return (n > 0) ? n : -1;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,154 @@
+// shm_ring.h
+// Shared-memory transport between the multiClient server and clients on the same host.
+//
+// A client that is already registered over TCP sends "SHM"; the server answers "SHM <name> <ring-size>"
+// as the last thing on the TCP stream. <name> is a file mapping holding an ShmRegionHeader and two
+// single-producer/single-consumer byte rings: commands (client -> server) and output (server -> client).
+// Each ring carries exactly the bytes its TCP direction would, so nothing above the transport changes.
+// The TCP connection stays open but silent; its close ends the session as before.
+//
+// Neither side takes a lock. A producer publishes its tail with a full barrier and then rings the
+// consumer's doorbell (a named auto-reset event "<name>.<ring><d|s>") only if the consumer said it is
+// about to sleep; the consumer spins briefly before saying so, so a busy pair makes no system calls.
+// Both peers must treat every index in the region as untrusted.
+//
+// Header-only (static functions), so server.c still builds on its own.
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <windows.h>
+#include <stdio.h> // For sprintf
+#include <string.h> // For memcpy
+
+#define SHM_MAGIC 0x4D485343U // "CSHM"
+#define SHM_RING_SIZE (1024 * 1024) // Bytes per direction (a power of two)
+#define SHM_NAME_MAX 64 // Mapping name, "Local\\..."
+#define SHM_SPIN_COUNT 4000 // Polls of an empty (or full) ring before sleeping on its event
+#define SHM_WAIT_MS 100 // Longest sleep on an event, so closes and hot restarts are still noticed
+
+// One direction's indices; each on its own cache line so producer and consumer do not share one
+typedef struct {
+    volatile LONG64 head; // Bytes consumed so far (consumer writes)
+    char pad1[56];
+    volatile LONG64 tail; // Bytes produced so far (producer writes)
+    char pad2[56];
+    volatile LONG consumer_sleeping; // Consumer may be in WaitForSingleObject on the data event
+    volatile LONG producer_sleeping; // Producer may be in WaitForSingleObject on the space event
+    char pad3[56];
+} ShmRingIndex;
+
+// Start of the mapping; the command ring's bytes follow it, then the output ring's
+typedef struct {
+    DWORD magic;
+    DWORD ring_size;
+    int client_id;
+    char pad[52];
+    ShmRingIndex commands; // Client -> server
+    ShmRingIndex output; // Server -> client
+} ShmRegionHeader;
+
+#define SHM_REGION_SIZE (sizeof(ShmRegionHeader) + 2 * (size_t)SHM_RING_SIZE)
+
+// A process's view of one ring
+typedef struct {
+    ShmRingIndex *index;
+    char *data;
+    HANDLE data_event; // Wakes the consumer
+    HANDLE space_event; // Wakes the producer
+} ShmRing;
+
+// Bytes waiting in the ring, or -1 if the peer has corrupted the indices
+static LONG64 shm_ring_used(ShmRing *ring) {
+    LONG64 used = ring->index->tail - ring->index->head;
+    return (used < 0 || used > SHM_RING_SIZE) ? -1 : used;
+}
+
+// Copy up to len bytes in; returns the bytes written (0 if full, -1 if corrupt)
+static int shm_ring_write(ShmRing *ring, const char *data, int len) {
+    LONG64 used = shm_ring_used(ring);
+    if (used < 0) return -1;
+    LONG64 tail = ring->index->tail;
+    int count = (int)(SHM_RING_SIZE - used);
+    if (count > len) count = len;
+    if (count == 0) return 0;
+    size_t pos = (size_t)(tail & (SHM_RING_SIZE - 1));
+    size_t first = SHM_RING_SIZE - pos;
+    if (first > (size_t)count) first = (size_t)count;
+    memcpy(ring->data + pos, data, first);
+    memcpy(ring->data, data + first, count - first);
+    InterlockedExchange64(&ring->index->tail, tail + count); // Publishes the bytes; full barrier
+    if (ring->index->consumer_sleeping) SetEvent(ring->data_event);
+    return count;
+}
+
+// Copy up to cap bytes out; returns the bytes read (0 if empty, -1 if corrupt)
+static int shm_ring_read(ShmRing *ring, char *out, int cap) {
+    LONG64 used = shm_ring_used(ring);
+    if (used < 0) return -1;
+    LONG64 head = ring->index->head;
+    int count = (used < cap) ? (int)used : cap;
+    if (count == 0) return 0;
+    size_t pos = (size_t)(head & (SHM_RING_SIZE - 1));
+    size_t first = SHM_RING_SIZE - pos;
+    if (first > (size_t)count) first = (size_t)count;
+    memcpy(out, ring->data + pos, first);
+    memcpy(out + first, ring->data, count - first);
+    InterlockedExchange64(&ring->index->head, head + count); // Frees the space; full barrier
+    if (ring->index->producer_sleeping) SetEvent(ring->space_event);
+    return count;
+}
+
+// Wait until the ring has bytes (for_space = 0) or room (for_space = 1), spinning first and then
+// sleeping at most timeout_ms. Returns 1 if it has, 0 on timeout, -1 if corrupt.
+static int shm_ring_wait(ShmRing *ring, int for_space, DWORD timeout_ms) {
+    volatile LONG *sleeping = for_space ? &ring->index->producer_sleeping : &ring->index->consumer_sleeping;
+    LONG64 used;
+    for (int spin = 0; spin < SHM_SPIN_COUNT; spin++) {
+        used = shm_ring_used(ring);
+        if (used < 0) return -1;
+        if (for_space ? used < SHM_RING_SIZE : used > 0) return 1;
+        YieldProcessor();
+    }
+    InterlockedExchange(sleeping, 1); // Announce the sleep before the last look (full barrier)
+    used = shm_ring_used(ring);
+    if (used >= 0 && !(for_space ? used < SHM_RING_SIZE : used > 0)) {
+        WaitForSingleObject(for_space ? ring->space_event : ring->data_event, timeout_ms);
+        used = shm_ring_used(ring);
+    }
+    InterlockedExchange(sleeping, 0);
+    if (used < 0) return -1;
+    return for_space ? used < SHM_RING_SIZE : used > 0;
+}
+
+// Map the rings of a region and open (create = 0) or create their events. Returns 0 on failure.
+static int shm_ring_events(ShmRing *commands, ShmRing *output, char *base, const char *name, int create) {
+    char event_name[SHM_NAME_MAX + 8];
+    ShmRing *rings[2] = { commands, output };
+    ShmRegionHeader *header = (ShmRegionHeader*)base;
+
+    commands->index = &header->commands;
+    commands->data = base + sizeof(ShmRegionHeader);
+    output->index = &header->output;
+    output->data = commands->data + SHM_RING_SIZE;
+    for (int r = 0; r < 2; r++) {
+        for (int e = 0; e < 2; e++) {
+            HANDLE *event = e ? &rings[r]->space_event : &rings[r]->data_event;
+            sprintf(event_name, "%s.%c%c", name, r ? 'o' : 'c', e ? 's' : 'd');
+            *event = create ? CreateEventA(NULL, FALSE, FALSE, event_name) : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, event_name);
+            if (*event == NULL) return 0;
+        }
+    }
+    return 1;
+}
+
+// Close the events of both rings (NULL handles are skipped)
+static void shm_ring_close_events(ShmRing *commands, ShmRing *output) {
+    ShmRing *rings[2] = { commands, output };
+    for (int r = 0; r < 2; r++) {
+        if (rings[r]->data_event != NULL) CloseHandle(rings[r]->data_event);
+        if (rings[r]->space_event != NULL) CloseHandle(rings[r]->space_event);
+        rings[r]->data_event = rings[r]->space_event = NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,172 @@
+// storm_bench.c
+// Connect-storm benchmark for the multiClient server: opens every connection at once, as a network blip
+// reconnecting a whole client population would, and measures each one's time to an answer: its ID, or
+// the refusal once MAX_CLIENTS slots are taken. Every session lives on one chat loop in this process.
+//
+// Build: gcc storm_bench.c chat_client.c -o storm_bench -lws2_32 -lmswsock
+// Usage: storm_bench <ip> <port> [connections]
+// More than ~16k connections from one machine need a wider ephemeral port range, e.g.
+//   netsh int ipv4 set dynamicport tcp start=10000 num=55000
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "chat_client.h"
+#include <stdio.h>
+#include <stdint.h> // For intptr_t
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define DEFAULT_CONNECTIONS 50000
+#define IDLE_TIMEOUT_MS 30000 // Give up on the rest once nothing has been answered for this long
+
+// --- Global Variables ---
+// Everything runs on the main thread, which also runs the chat loop
+ChatLoop *loop = NULL;
+int connection_count = DEFAULT_CONNECTIONS;
+LARGE_INTEGER frequency;
+ChatSession **sessions = NULL; // NULL once closed
+LONGLONG *started_at = NULL; // chat_connect time per connection
+unsigned char *answered = NULL; // Per connection: 0 = waiting, 1 = ID, 2 = refused, 3 = closed unanswered
+double *id_ms = NULL, *answer_ms = NULL; // Time to ID / time to any answer, in arrival order
+int id_count = 0, refused_count = 0, lost_count = 0, answer_count = 0;
+ULONGLONG last_progress = 0;
+
+// --- Function Prototypes ---
+void record_answer(ChatSession *s, int kind);
+void on_registered(ChatSession *s, int id, int resumed);
+void on_message(ChatSession *s, const char *text);
+void on_closed(ChatSession *s);
+void print_percentiles(const char *label, double *values, int count);
+int compare_doubles(const void *a, const void *b);
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    WSADATA wsa;
+    ChatCallbacks callbacks = { on_registered, on_message, NULL, NULL, NULL, NULL, NULL, on_closed, NULL, NULL };
+
+    if (argc < 3) {
+        printf("Usage: %s <ip> <port> [connections]\n", argv[0]);
+        printf("Opens every connection at once and measures the time until each gets its ID.\n");
+        return 1;
+    }
+    if (argc > 3) connection_count = atoi(argv[3]);
+    if (connection_count <= 0) {
+        printf("Connections must be positive.\n");
+        return 1;
+    }
+
+    sessions = (ChatSession**)calloc(connection_count, sizeof(ChatSession*));
+    started_at = (LONGLONG*)calloc(connection_count, sizeof(LONGLONG));
+    answered = (unsigned char*)calloc(connection_count, 1);
+    id_ms = (double*)malloc(connection_count * sizeof(double));
+    answer_ms = (double*)malloc(connection_count * sizeof(double));
+    if (sessions == NULL || started_at == NULL || answered == NULL || id_ms == NULL || answer_ms == NULL) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError());
+        return 1;
+    }
+    loop = chat_loop_create();
+    if (loop == NULL) {
+        printf("Could not create the chat loop. Error: %lu\n", GetLastError());
+        WSACleanup();
+        return 1;
+    }
+
+    // 1. The storm: every connect is queued before the loop runs once
+    LARGE_INTEGER start, end;
+    int opened = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < connection_count; i++) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        started_at[i] = now.QuadPart;
+        sessions[i] = chat_connect(loop, argv[1], atoi(argv[2]), &callbacks, (void*)(intptr_t)i);
+        if (sessions[i] == NULL) {
+            printf("Invalid server IP address (or out of memory after %d connections).\n", i);
+            break;
+        }
+        opened++;
+    }
+    printf("Opened %d connections to %s:%s...\n", opened, argv[1], argv[2]);
+
+    // 2. Run until every connection has its answer or answers stop coming
+    last_progress = GetTickCount64();
+    while (answer_count < opened && GetTickCount64() - last_progress < IDLE_TIMEOUT_MS) {
+        chat_loop_run(loop, 100);
+    }
+    QueryPerformanceCounter(&end);
+
+    // 3. Report
+    double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    printf("\n--- Connect Storm ---\n");
+    printf("Answered: %d of %d in %.3f s (%.0f connections/s)\n", answer_count, opened, seconds,
+           seconds > 0.0 ? answer_count / seconds : 0.0);
+    printf("Got an ID: %d, refused (server full): %d, closed without an answer: %d, no answer: %d\n",
+           id_count, refused_count, lost_count, opened - answer_count);
+    print_percentiles("Time to ID", id_ms, id_count);
+    print_percentiles("Time to any answer", answer_ms, answer_count);
+
+    // 4. Cleanup
+    for (int i = 0; i < opened; i++) {
+        if (sessions[i] != NULL) chat_close(sessions[i]);
+    }
+    while (chat_loop_run(loop, 100) > 0) {
+    }
+    chat_loop_destroy(loop);
+    WSACleanup();
+    free(sessions);
+    free(started_at);
+    free(answered);
+    free(id_ms);
+    free(answer_ms);
+    return 0;
+}
+
+// --- Session Callbacks ---
+
+// First answer on a connection: kind 1 = ID, 2 = refused, 3 = closed before any answer
+void record_answer(ChatSession *s, int kind) {
+    int i = (int)(intptr_t)chat_user(s);
+    LARGE_INTEGER now;
+    if (answered[i]) return;
+    QueryPerformanceCounter(&now);
+    double ms = (double)(now.QuadPart - started_at[i]) * 1000.0 / (double)frequency.QuadPart;
+    answered[i] = (unsigned char)kind;
+    if (kind == 1) id_ms[id_count++] = ms;
+    else if (kind == 2) refused_count++;
+    else lost_count++;
+    answer_ms[answer_count++] = ms;
+    last_progress = GetTickCount64();
+}
+
+void on_registered(ChatSession *s, int id, int resumed) {
+    record_answer(s, 1);
+}
+
+void on_message(ChatSession *s, const char *text) {
+    if (strncmp(text, "ERROR Server is full", 20) == 0) record_answer(s, 2);
+}
+
+void on_closed(ChatSession *s) {
+    record_answer(s, 3);
+    sessions[(int)(intptr_t)chat_user(s)] = NULL;
+}
+
+void print_percentiles(const char *label, double *values, int count) {
+    if (count == 0) return;
+    qsort(values, count, sizeof(double), compare_doubles);
+    printf("%s: min %.1f ms, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", label, values[0],
+           values[count / 2], values[(int)(count * 0.9)], values[(int)(count * 0.99)], values[count - 1]);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
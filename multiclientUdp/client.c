@@ -9,11 +9,29 @@
 #include <stdint.h>
 #include <process.h>
 #include <string.h>
+#include <stdlib.h>
+#include "../multiClient/compress_codec.h" // Shared with the servers
+#include "../multiClient/batch_mode.h" // --batch records and summary, shared with the TCP client
 
 #pragma comment(lib, "ws2_32.lib")
 
 #define BUFFER_SIZE 2048
 #define KEEP_ALIVE_INTERVAL_MS 20000 // Send keep-alive every 20 seconds
+#define HELLO_PADDED_LEN 48 // HELLOs are padded with spaces: the server ignores any shorter than its COOKIE reply
+
+// --- Fragmentation (must match the server) ---
+#define FRAG_PAYLOAD_SIZE 1200 // Payload per fragment; header + payload stays under a 1500-byte MTU
+#define FRAG_HEADER_MAX 48 // Upper bound for the "FRAG <msg_id> <index> <count> " header
+#define MAX_MESSAGE_SIZE (1024 * 1024) // Largest message that can be sent or received (1 MB)
+#define REASM_MAX_SLOTS 4 // Messages from the server being reassembled at once
+#define REASM_TIMEOUT_MS 5000 // Incomplete messages are dropped after this long
+
+// --- Multicast (must match the server) ---
+// A server started with --multicast offers its group after our ID; we join it, and once the server's
+// probe arrives there broadcasts come only by multicast as "\x03M <seq> <exclude-id>\n<message>".
+#define MCAST_JOIN 1 // 0 ignores the offer and keeps every broadcast unicast (to test the fallback)
+#define MCAST_MARKER '\x03' // First byte of a tagged broadcast
+#define MCAST_DEDUP_WINDOW 64 // Sequence numbers remembered for dropping the second copy of a broadcast
 
 // --- Global Variables ---
 SOCKET client_socket = INVALID_SOCKET;
@@ -25,37 +43,94 @@ HANDLE keep_alive_thread_handle = NULL; // Handle for the new thread
 volatile int running = 0;
 int my_id = -1;
 
+FILE *ui = NULL; // Prompts and local errors: stdout, or stderr in batch mode so stdout stays machine-readable
+
+// Multicast group membership; only the receive thread touches these
+SOCKET multicast_socket = INVALID_SOCKET;
+struct in_addr multicast_source; // The server's address on group datagrams (from the MCAST offer)
+int multicast_confirmed = 0; // Our probe arrived on the group
+int multicast_started = 0; // multicast_highest is valid
+unsigned int multicast_highest = 0; // Highest broadcast sequence number seen
+unsigned long long multicast_seen = 0; // Bit i: multicast_highest - i has been handled
+long long multicast_received = 0, multicast_duplicates = 0;
+
+// One partially received fragmented message from the server
+typedef struct {
+    int in_use;
+    unsigned int msg_id;
+    int frag_count;
+    int frags_received;
+    unsigned char *received; // Per-fragment "already stored" flags
+    char *data;
+    int total_len;
+    ULONGLONG start_tick;
+} ReassemblySlot;
+
+ReassemblySlot reassembly_slots[REASM_MAX_SLOTS]; // Only used by the receive thread
+unsigned int next_msg_id = 0; // Only the main thread sends messages large enough to fragment
+
 // --- Function Prototypes ---
 unsigned __stdcall receive_thread(void *arg);
 unsigned __stdcall keep_alive_thread(void *arg); // New keep-alive thread function
+int send_to_server(const char* message, int len);
+int send_hello(const char* cookie);
+int reassemble_fragment(const char* datagram, int len, char** out_message);
+void handle_server_message(const char* buffer);
+void handle_datagram(const char* data, int len);
+void multicast_join(const char* group, int port);
+int multicast_duplicate(unsigned int seq);
+void handle_tagged(const char* data, int len);
+int run_command(char* input_buffer, char* message_buffer);
+void run_batch(FILE* script, char* input_buffer, char* message_buffer);
 
 // --- Main Function ---
-int main() {
+int main(int argc, char *argv[]) {
     WSADATA wsa;
-    char input_buffer[BUFFER_SIZE];
-    char message_buffer[BUFFER_SIZE];
+    FILE *script = NULL; // Batch mode command source
+    // Heap buffers so a pasted line of up to MAX_MESSAGE_SIZE can be sent (fragmented)
+    char *input_buffer = (char*)malloc(MAX_MESSAGE_SIZE);
+    char *message_buffer = (char*)malloc(MAX_MESSAGE_SIZE + 32);
+    if (input_buffer == NULL || message_buffer == NULL) {
+        printf("Out of memory.\n"); return 1;
+    }
 
-    // 1. Get server details
-    printf("Enter server IP: ");
-    scanf("%19s", server_ip_str);
-    printf("Enter server port: ");
-    scanf("%d", &server_port_int);
-    getchar(); // Consume newline
+    ui = stdout;
+    if (argc >= 4 && _stricmp(argv[3], "--batch") == 0) {
+        // client <ip> <port> --batch [script]: the script defaults to stdin (a pipe)
+        ui = stderr;
+        strncpy(server_ip_str, argv[1], sizeof(server_ip_str) - 1);
+        server_ip_str[sizeof(server_ip_str) - 1] = '\0';
+        server_port_int = atoi(argv[2]);
+        script = (argc > 4 && strcmp(argv[4], "-") != 0) ? fopen(argv[4], "r") : stdin;
+        if (script == NULL) {
+            fprintf(stderr, "Cannot open script '%s'.\n", argv[4]); return 1;
+        }
+        batch_init();
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [<server IP> <port> --batch [<script> | -]]\n", argv[0]); return 1;
+    } else {
+        // 1. Get server details
+        printf("Enter server IP: ");
+        scanf("%19s", server_ip_str);
+        printf("Enter server port: ");
+        scanf("%d", &server_port_int);
+        getchar(); // Consume newline
+    }
 
     // 2. Initialize Winsock
-    printf("Initializing Winsock...\n");
+    fprintf(ui, "Initializing Winsock...\n");
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        printf("WSAStartup failed. Error Code: %d\n", WSAGetLastError()); return 1;
+        fprintf(ui, "WSAStartup failed. Error Code: %d\n", WSAGetLastError()); return 1;
     }
-    printf("Winsock Initialized.\n");
+    fprintf(ui, "Winsock Initialized.\n");
 
     // 3. Create UDP socket
     client_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (client_socket == INVALID_SOCKET) {
-        printf("Could not create socket. Error Code: %d\n", WSAGetLastError());
+        fprintf(ui, "Could not create socket. Error Code: %d\n", WSAGetLastError());
         WSACleanup(); return 1;
     }
-    printf("UDP Socket created.\n");
+    fprintf(ui, "UDP Socket created.\n");
 
     // *** Ensure the socket is bound ***
     // This helps maintain a consistent source port.
@@ -64,13 +139,13 @@ int main() {
     client_bind_addr.sin_addr.s_addr = INADDR_ANY;
     client_bind_addr.sin_port = htons(0); // System assigns ephemeral port
     if (bind(client_socket, (struct sockaddr*)&client_bind_addr, sizeof(client_bind_addr)) == SOCKET_ERROR) {
-         printf("Warning: Failed to bind client socket. Error: %d. Port stability might be affected.\n", WSAGetLastError());
+         fprintf(ui, "Warning: Failed to bind client socket. Error: %d. Port stability might be affected.\n", WSAGetLastError());
          // Continue even if bind fails, but it's less ideal
     } else {
          // Optional: Get the assigned port if needed
          int addr_len = sizeof(client_bind_addr);
          if(getsockname(client_socket, (struct sockaddr*)&client_bind_addr, &addr_len) == 0) {
-              printf("Client bound to local port %d\n", ntohs(client_bind_addr.sin_port));
+              fprintf(ui, "Client bound to local port %d\n", ntohs(client_bind_addr.sin_port));
          }
     }
 
@@ -82,7 +157,7 @@ int main() {
     server_addr.sin_addr.s_addr = inet_addr(server_ip_str);
 
     if (server_addr.sin_addr.s_addr == INADDR_NONE) {
-        printf("Invalid server IP address provided: %s\n", server_ip_str);
+        fprintf(ui, "Invalid server IP address provided: %s\n", server_ip_str);
         closesocket(client_socket); WSACleanup(); return 1;
     }
 
@@ -92,14 +167,14 @@ int main() {
     // Start Receive Thread
     receive_thread_handle = (HANDLE)_beginthreadex(NULL, 0, receive_thread, NULL, 0, NULL);
     if (receive_thread_handle == NULL) {
-         printf("Failed to create receive thread. Error: %d\n", GetLastError());
+         fprintf(ui, "Failed to create receive thread. Error: %d\n", GetLastError());
          running = 0; closesocket(client_socket); WSACleanup(); return 1;
     }
 
     // Start Keep-Alive Thread
     keep_alive_thread_handle = (HANDLE)_beginthreadex(NULL, 0, keep_alive_thread, NULL, 0, NULL);
      if (keep_alive_thread_handle == NULL) {
-         printf("Failed to create keep-alive thread. Error: %d\n", GetLastError());
+         fprintf(ui, "Failed to create keep-alive thread. Error: %d\n", GetLastError());
          // Continue without keep-alive? Or exit? For robustness, let's exit.
          running = 0; // Signal receive thread to stop too
          WaitForSingleObject(receive_thread_handle, 1000);
@@ -107,12 +182,10 @@ int main() {
          closesocket(client_socket); WSACleanup(); return 1;
      }
 
-    // 6. Send initial message
-    printf("Sending initial LIST command to register with server...\n");
-    const char* initial_msg = "LIST";
-    if (sendto(client_socket, initial_msg, strlen(initial_msg), 0,
-              (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        printf("Initial sendto failed. Error: %d\n", WSAGetLastError());
+    // 6. Send initial message: the server answers with a cookie, and echoing it back gets us an ID
+    fprintf(ui, "Sending HELLO to register with server...\n");
+    if (send_hello(NULL) == SOCKET_ERROR) {
+        fprintf(ui, "Initial sendto failed. Error: %d\n", WSAGetLastError());
         running = 0; // Signal threads
         WaitForSingleObject(receive_thread_handle, 1000);
         WaitForSingleObject(keep_alive_thread_handle, 100); // Doesn't block long
@@ -122,29 +195,34 @@ int main() {
     }
 
     // 7. Wait briefly for ID assignment (as before)
-    printf("Waiting for ID from server...\n");
+    fprintf(ui, "Waiting for ID from server...\n");
     int wait_count = 0;
     while (my_id == -1 && running && wait_count < 100) { // Wait max ~5 seconds
         Sleep(50);
         wait_count++;
     }
      if (my_id == -1 && running) {
-         printf("Did not receive ID from server in time. Proceeding anyway...\n");
+         fprintf(ui, "Did not receive ID from server in time. Proceeding anyway...\n");
      } else if (!running) {
-         printf("Connection lost before receiving ID.\n");
+         fprintf(ui, "Connection lost before receiving ID.\n");
      }
 
 
-    printf("\n--- Commands ---\n");
-    printf("LIST             - Get list of clients\n");
-    printf("<id> <message>   - Send a message to client <id> (Use 101 for broadcast)\n");
-    printf("EXIT             - Quit the application\n");
-    printf("------------------\n");
+    if (batch_mode) {
+        run_batch(script, input_buffer, message_buffer);
+    } else {
+        printf("\n--- Commands ---\n");
+        printf("LIST             - Get list of clients\n");
+        printf("<id> <message>   - Send a message to client <id> (Use 101 for broadcast)\n");
+        printf("STATS            - Show the server's rate limiting counters\n");
+        printf("EXIT             - Quit the application\n");
+        printf("------------------\n");
+    }
 
-    // 8. Main Command Loop (no changes needed here)
-    while (running) {
+    // 8. Main Command Loop
+    while (running && !batch_mode) {
         printf("> "); // Prompt
-        if (fgets(input_buffer, BUFFER_SIZE, stdin) == NULL) {
+        if (fgets(input_buffer, MAX_MESSAGE_SIZE, stdin) == NULL) {
             if (running) printf("Input error. Exiting.\n");
             break;
         }
@@ -152,41 +230,14 @@ int main() {
 
         if (strlen(input_buffer) == 0) continue;
 
-        if (_stricmp(input_buffer, "EXIT") == 0) {
+        if (!run_command(input_buffer, message_buffer)) {
             printf("Exiting...\n");
             break;
         }
-
-        if (_stricmp(input_buffer, "LIST") == 0) {
-             if (sendto(client_socket, "LIST", 4, 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-                 printf("Failed to send LIST command. Error: %d\n", WSAGetLastError());
-                 running = 0; // Assume connection issue
-             }
-        }
-        else {
-            int target_id = -1;
-            char *message_start = strchr(input_buffer, ' ');
-
-            if (message_start != NULL && sscanf(input_buffer, "%d", &target_id) == 1 && target_id > 0)
-            {
-                message_start++;
-                if (strlen(message_start) > 0) {
-                    sprintf(message_buffer, "SEND %d %s", target_id, message_start);
-                     if (sendto(client_socket, message_buffer, strlen(message_buffer), 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-                         printf("Failed to send message. Error: %d\n", WSAGetLastError());
-                         running = 0;
-                     }
-                } else {
-                     printf("Invalid format: Message cannot be empty.\n");
-                }
-            } else {
-                 printf("Unknown command or invalid format. Use: LIST, EXIT, or <id> <message>\n");
-            }
-        }
     }
 
     // 9. Cleanup
-    printf("Cleaning up...\n");
+    fprintf(ui, "Cleaning up...\n");
     running = 0; // Signal threads to stop
 
     if (client_socket != INVALID_SOCKET) {
@@ -196,21 +247,120 @@ int main() {
 
     // Wait for threads to finish
     if (receive_thread_handle != NULL) {
-        printf("Waiting for receive thread to exit...\n");
+        fprintf(ui, "Waiting for receive thread to exit...\n");
         WaitForSingleObject(receive_thread_handle, 2000);
         CloseHandle(receive_thread_handle);
     }
      if (keep_alive_thread_handle != NULL) {
-        printf("Waiting for keep-alive thread to exit...\n");
+        fprintf(ui, "Waiting for keep-alive thread to exit...\n");
         WaitForSingleObject(keep_alive_thread_handle, 100); // Should exit quickly
         CloseHandle(keep_alive_thread_handle);
     }
 
+    if (batch_mode) {
+        print_batch_summary();
+        if (multicast_received > 0) {
+            fprintf(stderr, "Tagged broadcasts: %lld received, %lld duplicates dropped%s\n", multicast_received,
+                    multicast_duplicates, multicast_confirmed ? " (multicast confirmed)" : "");
+        }
+    }
+    free(input_buffer);
+    free(message_buffer);
     WSACleanup();
-    printf("Cleanup complete. Goodbye.\n");
+    fprintf(ui, "Cleanup complete. Goodbye.\n");
     return 0;
 }
 
+// --- Commands ---
+// Parse one command line and send it; returns 0 for EXIT. Problems are reported on ui.
+int run_command(char* input_buffer, char* message_buffer) {
+    if (_stricmp(input_buffer, "EXIT") == 0) {
+        return 0;
+    }
+
+    if (_stricmp(input_buffer, "LIST") == 0 || _stricmp(input_buffer, "STATS") == 0) {
+         const char *command = (_stricmp(input_buffer, "LIST") == 0) ? "LIST" : "STATS";
+         if (sendto(client_socket, command, (int)strlen(command), 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+             fprintf(ui, "Failed to send %s command. Error: %d\n", command, WSAGetLastError());
+             running = 0; // Assume connection issue
+         } else {
+             commands_sent++;
+         }
+    }
+    else {
+        int target_id = -1;
+        char *message_start = strchr(input_buffer, ' ');
+
+        if (message_start != NULL && sscanf(input_buffer, "%d", &target_id) == 1 && target_id > 0)
+        {
+            message_start++;
+            if (strlen(message_start) > 0) {
+                int message_len = sprintf(message_buffer, "SEND %d %s", target_id, message_start);
+                LARGE_INTEGER now;
+                QueryPerformanceCounter(&now);
+                if (batch_mode && target_id == my_id) {
+                    record_self_send(now.QuadPart); // Before sending
+                }
+                 if (send_to_server(message_buffer, message_len) == SOCKET_ERROR) {
+                     fprintf(ui, "Failed to send message. Error: %d\n", WSAGetLastError());
+                     running = 0;
+                 } else {
+                     commands_sent++;
+                 }
+            } else {
+                 fprintf(ui, "Invalid format: Message cannot be empty.\n");
+            }
+        } else {
+             fprintf(ui, "Unknown command or invalid format. Use: LIST, EXIT, or <id> <message>\n");
+        }
+    }
+    return 1;
+}
+
+// --- Batch Mode ---
+
+// Send every script line back-to-back (see batch_next_command); EXIT ends the script early
+void run_batch(FILE* script, char* input_buffer, char* message_buffer) {
+    char *command = (char*)malloc(MAX_MESSAGE_SIZE);
+    if (command == NULL) return;
+
+    while (running && batch_next_command(script, input_buffer, command, MAX_MESSAGE_SIZE, my_id)) {
+        if (!run_command(command, message_buffer)) break;
+    }
+    free(command);
+    batch_finish(script, &running);
+}
+
+// Send a message to the server, splitting it into "FRAG <msg_id> <index> <count> " datagrams if needed
+int send_to_server(const char* message, int len) {
+    char datagram[FRAG_HEADER_MAX + FRAG_PAYLOAD_SIZE];
+
+    if (len <= FRAG_PAYLOAD_SIZE) {
+        return sendto(client_socket, message, len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    }
+
+    unsigned int msg_id = ++next_msg_id;
+    int frag_count = (len + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
+    for (int index = 0; index < frag_count; index++) {
+        int offset = index * FRAG_PAYLOAD_SIZE;
+        int chunk = (len - offset < FRAG_PAYLOAD_SIZE) ? len - offset : FRAG_PAYLOAD_SIZE;
+        int header_len = sprintf(datagram, "FRAG %u %d %d ", msg_id, index, frag_count);
+        memcpy(datagram + header_len, message + offset, chunk);
+        if (sendto(client_socket, datagram, header_len + chunk, 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+    }
+    return len;
+}
+
+// Send "HELLO" (keep-alive or first contact) or "HELLO <cookie>", padded with spaces to HELLO_PADDED_LEN
+int send_hello(const char* cookie) {
+    char hello[HELLO_PADDED_LEN + 1];
+    int len = (cookie != NULL) ? sprintf(hello, "HELLO %.32s", cookie) : sprintf(hello, "HELLO");
+    memset(hello + len, ' ', HELLO_PADDED_LEN - len);
+    return send_to_server(hello, HELLO_PADDED_LEN);
+}
+
 
 // --- Receive Thread --- (No changes needed in receive logic)
 unsigned __stdcall receive_thread(void *arg) {
@@ -218,11 +368,23 @@ unsigned __stdcall receive_thread(void *arg) {
     struct sockaddr_in sender_addr;
     int sender_addr_len = sizeof(sender_addr);
 
-    printf("[Receive Thread] Started.\n");
+    fprintf(ui, "[Receive Thread] Started.\n");
 
     while (running) {
+        SOCKET source = client_socket;
+        if (multicast_socket != INVALID_SOCKET) {
+            // Wait on the group as well; a socket error falls through to the recvfrom below
+            fd_set readable;
+            struct timeval wait = { 1, 0 };
+            FD_ZERO(&readable);
+            FD_SET(client_socket, &readable);
+            FD_SET(multicast_socket, &readable);
+            int ready = select(0, &readable, NULL, NULL, &wait);
+            if (ready == 0) continue;
+            if (ready != SOCKET_ERROR && !FD_ISSET(client_socket, &readable)) source = multicast_socket;
+        }
         memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recvfrom(client_socket, buffer, BUFFER_SIZE - 1, 0,
+        int bytes_received = recvfrom(source, buffer, BUFFER_SIZE - 1, 0,
                                      (struct sockaddr*)&sender_addr, &sender_addr_len);
 
         if (!running) break;
@@ -231,7 +393,7 @@ unsigned __stdcall receive_thread(void *arg) {
              if (running) {
                  int error_code = WSAGetLastError();
                   if (error_code != WSAECONNRESET && error_code != WSAEINTR && error_code != WSAENOTSOCK && error_code != WSAEINVAL) {
-                      printf("\n[Receive Thread] recvfrom failed. Error: %d\n", error_code);
+                      fprintf(ui, "\n[Receive Thread] recvfrom failed. Error: %d\n", error_code);
                       running = 0; // Signal main thread on critical errors
                  } else if (error_code != WSAECONNRESET) {
                       // Error likely due to socket closure by main thread
@@ -244,6 +406,16 @@ unsigned __stdcall receive_thread(void *arg) {
         }
 
 
+        if (source == multicast_socket) {
+            // Group traffic leaves the server's socket, from the address it named in the offer (or the
+            // one we talk to); anyone else on the segment can send to the group too
+            if (sender_addr.sin_port == server_addr.sin_port &&
+                (sender_addr.sin_addr.s_addr == multicast_source.s_addr || sender_addr.sin_addr.s_addr == server_addr.sin_addr.s_addr)) {
+                buffer[bytes_received] = '\0';
+                handle_tagged(buffer, bytes_received);
+            }
+            continue;
+        }
         if (sender_addr.sin_addr.s_addr != server_addr.sin_addr.s_addr ||
             sender_addr.sin_port != server_addr.sin_port)
         {
@@ -255,30 +427,279 @@ unsigned __stdcall receive_thread(void *arg) {
 
         buffer[bytes_received] = '\0';
 
-        // Process different message types from server
-        if (my_id == -1 && strncmp(buffer, "ID ", 3) == 0) {
-            if (sscanf(buffer + 3, "%d", &my_id) == 1) {
-                printf("\n*** Successfully registered with server. Your ID is: %d ***\n> ", my_id);
-            } else {
-                 printf("\n[Receive Thread] Received invalid ID format: %s\n", buffer);
+        if (strncmp(buffer, "FRAG ", 5) == 0) {
+            // Part of a large message (big LIST or paste): display it once complete
+            char *message = NULL;
+            int message_len = reassemble_fragment(buffer, bytes_received, &message);
+            if (message_len > 0) {
+                handle_datagram(message, message_len);
+                free(message);
             }
+        } else {
+            handle_datagram(buffer, bytes_received);
         }
-        else if (strncmp(buffer, "MSG ", 4) == 0) { printf("\n%s\n> ", buffer); }
-        else if (strncmp(buffer, "INFO ", 5) == 0) { printf("\n[%s]\n> ", buffer); }
-        else if (strncmp(buffer, "ERROR ", 6) == 0) { printf("\n[Server Error: %s]\n> ", buffer + 6); }
-        else { printf("\n%s\n> ", buffer); } // Assume LIST response or unknown
-        fflush(stdout);
     }
 
-    printf("[Receive Thread] Exiting...\n");
+    for (int i = 0; i < REASM_MAX_SLOTS; i++) {
+        free(reassembly_slots[i].data);
+        free(reassembly_slots[i].received);
+    }
+    if (multicast_socket != INVALID_SOCKET) closesocket(multicast_socket); // Also leaves the group
+    fprintf(ui, "[Receive Thread] Exiting...\n");
     return 0;
 }
 
+// Process different message types from server
+void handle_server_message(const char* buffer) {
+    // The server does not know this address (first contact, or our slot timed out): echo its cookie
+    if (strncmp(buffer, "COOKIE ", 7) == 0) {
+        if (my_id != -1) {
+            fprintf(ui, "\n[Server no longer knows us; registering again]\n");
+            my_id = -1;
+            multicast_confirmed = 0;
+            multicast_started = 0; // A restarted server numbers its broadcasts afresh
+        }
+        send_hello(buffer + 7);
+        return;
+    }
+    // Multicast offer: join the group, then tell the server so it probes it
+    if (strncmp(buffer, "MCAST ", 6) == 0 && strncmp(buffer + 6, "PROBE ", 6) != 0) {
+        char group[INET_ADDRSTRLEN], source[INET_ADDRSTRLEN] = "";
+        int port = 0;
+        if (MCAST_JOIN && sscanf(buffer + 6, "%15s %d %15s", group, &port, source) >= 2) {
+            // Without a source (an older server) only the address we talk to is trusted on the group
+            multicast_source.s_addr = (source[0] != '\0') ? inet_addr(source) : server_addr.sin_addr.s_addr;
+            multicast_join(group, port);
+        }
+        return;
+    }
+    if (batch_mode && !(my_id == -1 && strncmp(buffer, "ID ", 3) == 0)) {
+        const char *type = "TEXT"; // LIST output and anything unrecognised
+        if (strncmp(buffer, "MSG ", 4) == 0) {
+            type = "MSG";
+            received_msg++;
+            record_self_delivery(buffer, my_id);
+        } else if (strncmp(buffer, "INFO ", 5) == 0) {
+            type = "INFO";
+            received_info++;
+        } else if (strncmp(buffer, "ERROR ", 6) == 0) {
+            type = "ERROR";
+            received_error++;
+        } else {
+            if (strncmp(buffer, "COMPRESS ", 9) == 0) type = "COMPRESS";
+            received_other++;
+        }
+        batch_output(type, buffer);
+        return;
+    }
+    if (my_id == -1 && strncmp(buffer, "ID ", 3) == 0) {
+        if (sscanf(buffer + 3, "%d", &my_id) == 1) {
+            char offer[32];
+            if (batch_mode) batch_output("ID", buffer + 3);
+            else printf("\n*** Successfully registered with server. Your ID is: %d ***\n> ", my_id);
+            // Offer compression with our dictionary
+            sprintf(offer, "COMPRESS %d", COMPRESS_DICT_VERSION);
+            send_to_server(offer, (int)strlen(offer));
+        } else {
+             printf("\n[Receive Thread] Received invalid ID format: %s\n", buffer);
+        }
+    }
+    else if (strncmp(buffer, "MSG ", 4) == 0) { printf("\n%s\n> ", buffer); }
+    else if (strncmp(buffer, "INFO ", 5) == 0) { printf("\n[%s]\n> ", buffer); }
+    else if (strncmp(buffer, "ERROR ", 6) == 0) { printf("\n[Server Error: %s]\n> ", buffer + 6); }
+    else if (strncmp(buffer, "COMPRESS ", 9) == 0) {
+        printf("\n[Compression %s]\n> ", strncmp(buffer + 9, "ON", 2) == 0 ? "enabled" : "not available (dictionary mismatch)");
+    }
+    else { printf("\n%s\n> ", buffer); } // Assume LIST response or unknown
+    fflush(stdout);
+}
+
+// Expand a compressed message if needed, then process it
+void handle_datagram(const char* data, int len) {
+    int raw_len = 0, compressed_len = 0, header_len = 0;
+
+    if (len > 0 && data[0] == MCAST_MARKER) {
+        handle_tagged(data, len); // Unicast copy of a broadcast while we are joining the group
+        return;
+    }
+    if (len == 0 || data[0] != COMPRESS_MARKER) {
+        handle_server_message(data);
+        return;
+    }
+    if (sscanf(data + 1, "Z %d %d%n", &raw_len, &compressed_len, &header_len) != 2 || data[1 + header_len] != '\n' ||
+        raw_len <= 0 || raw_len > MAX_MESSAGE_SIZE || compressed_len != len - header_len - 2) {
+        fprintf(ui, "\n[Receive Thread] Malformed compressed message dropped.\n> ");
+        fflush(ui);
+        return;
+    }
+    char *message = (char*)malloc((size_t)raw_len + 1);
+    if (message == NULL) return;
+    if (decompress_message((const unsigned char*)data + header_len + 2, compressed_len, message, raw_len) == raw_len) {
+        message[raw_len] = '\0';
+        handle_server_message(message);
+    } else {
+        fprintf(ui, "\n[Receive Thread] Corrupt compressed message dropped.\n> ");
+        fflush(ui);
+    }
+    free(message);
+}
+
+// --- Multicast ---
+
+// Join the group on a socket of its own (shared with other clients on this machine) and send
+// "MCAST JOIN". On any failure we stay unicast, which the server handles without being told.
+void multicast_join(const char* group, int port) {
+    struct sockaddr_in bind_addr;
+    struct ip_mreq membership;
+    BOOL reuse = TRUE;
+
+    if (multicast_socket != INVALID_SOCKET) {
+        send_to_server("MCAST JOIN", 10); // Registered again: already a member
+        return;
+    }
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET) return;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_addr.s_addr = INADDR_ANY;
+    bind_addr.sin_port = htons((u_short)port);
+    membership.imr_multiaddr.s_addr = inet_addr(group);
+    // A server on this machine sends over loopback; otherwise let the routing table pick the interface
+    membership.imr_interface.s_addr = (ntohl(server_addr.sin_addr.s_addr) >> 24 == 127) ? server_addr.sin_addr.s_addr : INADDR_ANY;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) == SOCKET_ERROR ||
+        bind(s, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) == SOCKET_ERROR ||
+        setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR) {
+        fprintf(ui, "\n[Could not join multicast group %s:%d (error %d); broadcasts stay unicast]\n", group, port, WSAGetLastError());
+        closesocket(s);
+        return;
+    }
+    multicast_socket = s;
+    send_to_server("MCAST JOIN", 10);
+}
+
+// Returns 1 if broadcast seq was already handled (it came both ways, or twice on the group), else marks
+// it handled. A jump far behind the window means the server restarted, so the window starts over.
+int multicast_duplicate(unsigned int seq) {
+    int ahead = (int)(seq - multicast_highest);
+    if (!multicast_started || ahead <= -MCAST_DEDUP_WINDOW) {
+        multicast_started = 1;
+        multicast_highest = seq;
+        multicast_seen = 1;
+        return 0;
+    }
+    if (ahead > 0) {
+        multicast_seen = (ahead >= MCAST_DEDUP_WINDOW) ? 1 : (multicast_seen << ahead) | 1;
+        multicast_highest = seq;
+        return 0;
+    }
+    if (multicast_seen & (1ULL << -ahead)) return 1;
+    multicast_seen |= 1ULL << -ahead;
+    return 0;
+}
+
+// A datagram from the group (or a tagged unicast copy): our probe, or a broadcast to pass on once
+void handle_tagged(const char* data, int len) {
+    unsigned int seq = 0;
+    int exclude_id = -1, header_len = 0;
+
+    if (strncmp(data, "MCAST PROBE ", 12) == 0) {
+        if (my_id != -1 && atoi(data + 12) == my_id && !multicast_confirmed) {
+            multicast_confirmed = 1;
+            send_to_server("MCAST OK", 8);
+            fprintf(ui, "\n[Receiving broadcasts by multicast]\n");
+        }
+        return;
+    }
+    if (len < 2 || data[0] != MCAST_MARKER || sscanf(data + 1, "M %u %d%n", &seq, &exclude_id, &header_len) != 2 ||
+        data[1 + header_len] != '\n') {
+        return;
+    }
+    multicast_received++;
+    if (multicast_duplicate(seq)) {
+        multicast_duplicates++;
+        return;
+    }
+    if (exclude_id != -1 && exclude_id == my_id) return; // Our own broadcast
+    handle_datagram(data + header_len + 2, len - header_len - 2);
+}
+
+// Store one "FRAG <msg_id> <index> <count> <payload>" datagram from the server.
+// Returns the message length (caller frees *out_message) once complete, -1 otherwise.
+int reassemble_fragment(const char* datagram, int len, char** out_message) {
+    unsigned int msg_id;
+    int index, frag_count, header_len = 0;
+    ReassemblySlot *slot = NULL;
+    ULONGLONG now = GetTickCount64();
+
+    *out_message = NULL;
+    // The header ends at exactly one space: a space before %n would also swallow whitespace the payload starts with
+    if (sscanf(datagram, "FRAG %u %d %d%n", &msg_id, &index, &frag_count, &header_len) != 3 || header_len == 0 ||
+        header_len >= len || datagram[header_len++] != ' ' ||
+        frag_count <= 0 || frag_count > (MAX_MESSAGE_SIZE + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE ||
+        index < 0 || index >= frag_count) {
+        return -1;
+    }
+    int payload_len = len - header_len;
+    if (payload_len <= 0 || payload_len > FRAG_PAYLOAD_SIZE || (index < frag_count - 1 && payload_len != FRAG_PAYLOAD_SIZE)) {
+        return -1;
+    }
+
+    // Drop stale messages, then look for this one
+    for (int i = 0; i < REASM_MAX_SLOTS; i++) {
+        if (reassembly_slots[i].in_use && now - reassembly_slots[i].start_tick > REASM_TIMEOUT_MS) {
+            free(reassembly_slots[i].data);
+            free(reassembly_slots[i].received);
+            memset(&reassembly_slots[i], 0, sizeof(reassembly_slots[i]));
+        }
+        if (reassembly_slots[i].in_use && reassembly_slots[i].msg_id == msg_id) {
+            slot = &reassembly_slots[i];
+        }
+    }
+
+    if (slot == NULL) {
+        for (int i = 0; i < REASM_MAX_SLOTS; i++) {
+            if (!reassembly_slots[i].in_use) { slot = &reassembly_slots[i]; break; }
+        }
+        if (slot == NULL) return -1; // Table full; the message is lost like any dropped datagram
+        slot->data = (char*)malloc((size_t)frag_count * FRAG_PAYLOAD_SIZE + 1);
+        slot->received = (unsigned char*)calloc(frag_count, 1);
+        if (slot->data == NULL || slot->received == NULL) {
+            free(slot->data); free(slot->received);
+            slot->data = NULL; slot->received = NULL;
+            return -1;
+        }
+        slot->in_use = 1;
+        slot->msg_id = msg_id;
+        slot->frag_count = frag_count;
+        slot->frags_received = 0;
+        slot->total_len = -1;
+        slot->start_tick = now;
+    } else if (slot->frag_count != frag_count) {
+        return -1;
+    }
+
+    if (slot->received[index]) return -1; // Duplicate
+
+    memcpy(slot->data + (size_t)index * FRAG_PAYLOAD_SIZE, datagram + header_len, payload_len);
+    slot->received[index] = 1;
+    slot->frags_received++;
+    if (index == frag_count - 1) slot->total_len = index * FRAG_PAYLOAD_SIZE + payload_len;
+    if (slot->frags_received < slot->frag_count) return -1;
+
+    int message_len = slot->total_len;
+    *out_message = slot->data;
+    (*out_message)[message_len] = '\0';
+    free(slot->received);
+    memset(slot, 0, sizeof(*slot));
+    return message_len;
+}
+
 
 // --- Keep-Alive Thread --- (NEW)
+// The keep-alive is a HELLO without a cookie: a server that still knows us only refreshes our slot, and
+// one that has forgotten us (restart, timeout) answers with a cookie, so we register again.
 unsigned __stdcall keep_alive_thread(void *arg) {
-     const char* ping_msg = "PING";
-     printf("[Keep-Alive Thread] Started. Sending PING every %d ms.\n", KEEP_ALIVE_INTERVAL_MS);
+     fprintf(ui, "[Keep-Alive Thread] Started. Sending HELLO every %d ms.\n", KEEP_ALIVE_INTERVAL_MS);
 
      while(running) {
           // Wait for the interval
@@ -287,14 +708,14 @@ unsigned __stdcall keep_alive_thread(void *arg) {
           // Check if still running after sleep
           if (!running) break;
 
-          // Send PING message
+          // Send keep-alive HELLO
           if (client_socket != INVALID_SOCKET) {
-               if (sendto(client_socket, ping_msg, strlen(ping_msg), 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR)
+               if (send_hello(NULL) == SOCKET_ERROR)
                {
                    int error = WSAGetLastError();
-                   // Don't necessarily stop the client on PING failure, could be temporary network issue
+                   // Don't necessarily stop the client on keep-alive failure, could be temporary network issue
                    // But log it. If it fails consistently, the receive thread will likely detect connection loss.
-                   printf("[Keep-Alive Thread] sendto PING failed. Error: %d\n", error);
+                   fprintf(ui, "[Keep-Alive Thread] sendto HELLO failed. Error: %d\n", error);
                    // Maybe add logic to stop after N consecutive failures? For simplicity, just log.
                } else {
                     // printf("."); // Optional: print something small to show pings are sending
@@ -303,6 +724,6 @@ unsigned __stdcall keep_alive_thread(void *arg) {
           }
      }
 
-     printf("[Keep-Alive Thread] Exiting.\n");
+     fprintf(ui, "[Keep-Alive Thread] Exiting.\n");
      return 0;
 }
\ No newline at end of file
@@ -1,15 +1,24 @@
 // server_udp.c
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
+#define _CRT_RAND_S // For rand_s (cookie key)
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0601
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601 // Windows 7: processor groups and the RSS query used for thread placement
+#endif
 
 #include <stdio.h>
 #include <winsock2.h>
 #include <ws2tcpip.h> // Required for sockaddr_in definition
+#include <mstcpip.h> // For SIO_QUERY_RSS_PROCESSOR_INFO
 #include <windows.h>
 #include <stdint.h>
 #include <process.h>
 #include <string.h>
+#include <stdlib.h>   // For malloc, calloc, free
 #include <time.h>     // For timeout checking
+#include "../multiClient/compress_codec.h" // Shared with the TCP chat
+#include "../multiClient/rate_limit.h" // Token buckets shared with the TCP chat
 
 #pragma comment(lib, "ws2_32.lib")
 
@@ -19,19 +28,202 @@
 #define BROADCAST_ID 101
 #define CLIENT_TIMEOUT_SECONDS 60 // Inactivity threshold
 
+// --- Fragmentation ---
+// Messages longer than FRAG_PAYLOAD_SIZE are split into datagrams of the form
+// "FRAG <msg_id> <index> <count> <payload bytes>" so nothing relies on IP-level fragmentation.
+#define FRAG_PAYLOAD_SIZE 1200 // Payload per fragment; header + payload stays well under a 1500-byte MTU
+#define FRAG_HEADER_MAX 48 // Upper bound for the "FRAG ..." text header
+#define MAX_MESSAGE_SIZE (1024 * 1024) // Largest message that can be fragmented and reassembled (1 MB)
+#define REASM_MAX_SLOTS 32 // Partially received messages tracked at once
+#define REASM_TIMEOUT_MS 5000 // Incomplete messages are dropped after this long
+#define REASM_MEMORY_CAP (8 * 1024 * 1024) // Total bytes the reassembly table may hold
+#define REASM_MAX_PER_SENDER 2 // Messages one address:port may have open at once; a newer one evicts its oldest
+
+// --- Compression ---
+// A client that sends "COMPRESS <version>" gets messages of COMPRESS_MIN_SIZE bytes or more as
+// "\x02Z <raw-len> <compressed-len>\n<payload>" (fragmented like any other message if still too big).
+// The codec and its dictionary are in ../multiClient/compress_codec.h, shared with the TCP chat.
+#define COMPRESS_MIN_SIZE 64 // Shorter messages go out raw
+#define COMPRESS_REPORT_INTERVAL 1000 // Print compression statistics every this many compressed messages
+
+// --- Worker pool ---
+// Commands are handled off the receive thread, so one heavy command (a LIST, a broadcast to everyone)
+// does not hold up everybody else's. Each sender hashes to a lane, a FIFO that only one worker runs at a
+// time, which keeps a sender's commands in order. Lanes with work wait in per-worker deques; a worker
+// takes the oldest lane from its own deque and, when that is empty, steals the newest from another's.
+// "server 0" handles every command inline on the receive thread instead (for comparison).
+#define WORK_MAX_WORKERS 16
+#define WORK_LANES 1024 // Sender lanes; a sender's commands always go to the same one
+#define WORK_LANE_BATCH 8 // Commands a worker runs from one lane before the next lane gets a turn
+#define WORK_REPORT_INTERVAL 10000 // Print throughput and latency every this many commands
+#define WORK_LATENCY_BUCKETS 32 // Power-of-two microsecond histogram
+
+// --- Placement ---
+// Workers are pinned one per processor, filling one NUMA node before the next, and each worker's deque
+// lives in memory on its node. An idle worker steals from workers on its own node before crossing to
+// another. The receive thread prefers the processor that RSS steers the socket's packets to. All
+// datagrams arrive on that one socket, so a sender's lane is still chosen by hashing its address, not
+// by where RSS put its packets.
+#define PLACEMENT_ENABLED 1 // 0 leaves every thread where the scheduler puts it
+
+// --- Rate limiting ---
+// Every client has its own buckets (limits and actions are in rate_limit.h, shared with the TCP chat).
+// Only the sender's lane runs its commands, so a charge takes no lock; SENDs held back by RATE_QUEUE wait
+// in a list that rate_release_thread runs when they are due, so neither the lane nor its worker waits
+// for them.
+
+// --- Registration cookies ---
+// A datagram from an address that has no slot gets "COOKIE <16 hex digits>" back and nothing else: no
+// slot, no ID, no INFO, no reassembly. The cookie is SipHash-2-4 of the address, port and current epoch
+// under a key drawn at startup, so the server keeps nothing per challenge. Only "HELLO <cookie>" from
+// that same address claims a slot, which a sender spoofing addresses it cannot receive at never sees.
+// Only a HELLO is answered, and only one padded to at least the length of the reply, so a spoofed
+// datagram cannot be amplified and a COOKIE from another server is never answered; on top of that the
+// replies share one token bucket, so a flood of padded HELLOs gets a bounded stream of cookies.
+#define COOKIE_EPOCH_MS 30000 // Cookies of this epoch and the previous one are accepted
+#define COOKIE_HEX_LEN 16
+#define COOKIE_HELLO_MIN_LEN (7 + COOKIE_HEX_LEN) // Shorter HELLOs from unknown addresses get no reply
+#define COOKIE_REPLIES_PER_SEC 1000 // Over every address together
+#define COOKIE_REPLY_BURST 2000
+
+// --- Multicast ---
+// With --multicast, a new client hears "MCAST <group> <port> <source>" after its ID; source is the address
+// group datagrams leave from, so the client can ignore anyone else sending to the group. A client that
+// joins the group says "MCAST JOIN", gets "MCAST PROBE <id>" on the group, and answers "MCAST OK" once the
+// probe arrives.
+// Broadcasts and INFO then reach confirmed clients as one shared "\x03M <seq> <exclude-id>\n<message>"
+// datagram; everyone else keeps getting a unicast copy (tagged the same way once they have joined, so a
+// client between JOIN and OK can drop whichever copy arrives second). Messages too big for one datagram
+// are unicast to everybody.
+#define MCAST_GROUP "239.255.90.1" // Organisation-local scope
+#define MCAST_PORT 9002
+#define MCAST_TTL 1 // Never leaves the segment
+#define MCAST_MARKER '\x03' // First byte of a tagged broadcast
+
+
 typedef struct {
     int id;
     struct sockaddr_in addr; // Store client address (IP + Port)
     char ip_str[INET_ADDRSTRLEN]; // Store string version for convenience
     time_t last_heard_time;   // For timeout detection
     int active;               // Flag if slot is used
+    int compress;             // Negotiated dictionary version; 0 sends everything raw
+    RateLimit rate;           // Touched only by the client's lane
+    int multicast;            // 0 = unicast only, 1 = joined the group, 2 = confirmed (no unicast broadcasts)
 } ClientInfoUDP;
 
+// A SEND held back by RATE_QUEUE until its buckets have refilled
+typedef struct RateHeld {
+    struct RateHeld *next;
+    ULONGLONG due; // GetTickCount64 when it may run
+    struct sockaddr_in addr;
+    int sender_id, target_id;
+    char message[1]; // Null-terminated
+} RateHeld;
+
+// A message compressed at most once, however many recipients it has (built on first use)
+typedef struct {
+    char *data; // Header + payload
+    int len;
+    int state; // 0 = not tried yet, 1 = built, -1 = not worth compressing
+} CompressedFrame;
+
+// Compression counters, updated under cs
+typedef struct {
+    long long compressed; // Messages compressed
+    long long skipped; // Messages that did not shrink
+    long long input_bytes, output_bytes; // Totals over compressed messages (headers included)
+    long long cpu_ticks; // QueryPerformanceCounter ticks spent compressing
+    long long egress_raw, egress_sent; // Bytes offered to compressing clients vs. bytes actually sent
+} CompressionStats;
+
+// A received command waiting in a lane
+typedef struct WorkItem {
+    struct WorkItem *next;
+    struct sockaddr_in addr; // Sender
+    LARGE_INTEGER received_at; // When recvfrom returned it (for the latency report)
+    int len;
+    char *data; // Stored right after the item, or a reassembled message the item owns
+} WorkItem;
+
+// One sender lane
+typedef struct {
+    CRITICAL_SECTION lock;
+    WorkItem *head, *tail;
+    int scheduled; // Waiting in a deque or being run; guarded by lock
+} WorkLane;
+
+// Lanes ready to run, owned by one worker. A lane sits in at most one deque, so the ring never overflows.
+typedef struct {
+    CRITICAL_SECTION lock;
+    int lanes[WORK_LANES];
+    int first, count; // Oldest entry and number of entries
+    volatile LONG64 executed, stolen, stolen_remote; // stolen_remote: from a worker on another node
+    int pinned; // cpu is valid
+    PROCESSOR_NUMBER cpu;
+    USHORT node;
+} WorkDeque;
+
+// One partially received fragmented message
+typedef struct {
+    int in_use;
+    struct sockaddr_in addr; // Sender of the fragments
+    unsigned int msg_id;     // Sender-chosen message id
+    int frag_count;          // Total number of fragments expected
+    int frags_received;      // Fragments stored so far
+    unsigned char *received; // Per-fragment "already stored" flags
+    char *data;              // frag_count * FRAG_PAYLOAD_SIZE (+1 for the terminator)
+    int total_len;           // Known once the last fragment has arrived
+    size_t bytes_reserved;   // Amount charged against REASM_MEMORY_CAP
+    ULONGLONG start_tick;    // When the first fragment arrived (for timeout)
+    LARGE_INTEGER start_counter; // High-resolution start time (for throughput)
+} ReassemblySlot;
+
 ClientInfoUDP clients[MAX_CLIENTS];
 int next_client_id = 1;
 CRITICAL_SECTION cs;
 SOCKET server_socket = INVALID_SOCKET; // Global server socket
 
+// Reassembly state is only touched by the main receive loop, so it needs no lock
+ReassemblySlot reassembly_slots[REASM_MAX_SLOTS];
+size_t reassembly_bytes_in_use = 0;
+size_t reassembly_bytes_high_water = 0;
+volatile LONG next_msg_id = 0; // Outgoing message ids (sends happen from several threads)
+
+int compress_dict_table[1 << COMPRESS_HASH_BITS]; // Hash table after indexing the dictionary alone (compress_codec.h)
+CompressionStats compress_stats; // Guarded by cs
+
+// Worker pool (unused with 0 workers)
+int work_worker_count = 0;
+WorkLane work_lanes[WORK_LANES];
+WorkDeque *work_deques[WORK_MAX_WORKERS]; // Each allocated on its worker's NUMA node
+HANDLE work_ready = NULL; // Semaphore: one unit per lane waiting in a deque
+LARGE_INTEGER work_frequency;
+
+// Latency report over the last WORK_REPORT_INTERVAL commands, guarded by work_stats_cs
+CRITICAL_SECTION work_stats_cs;
+long long work_latency[WORK_LATENCY_BUCKETS]; // Bucket b counts latencies below 2^b microseconds
+int work_stats_count = 0;
+LARGE_INTEGER work_stats_start;
+
+// SENDs held back by RATE_QUEUE, in due order (the counters are in rate_limit.h)
+CRITICAL_SECTION rate_cs; // Guards rate_held
+RateHeld *rate_held = NULL;
+HANDLE rate_wake = NULL; // Set when a SEND is held, so the release thread recomputes its wait
+
+// Registration cookies: the key never changes after startup; the counters are for STATS
+uint64_t cookie_key[2];
+CRITICAL_SECTION cookie_cs; // Guards cookie_replies (the receive loop and the workers both answer HELLOs)
+TokenBucket cookie_replies;
+volatile LONG64 cookies_sent = 0, cookies_accepted = 0, cookies_rejected = 0, cookies_withheld = 0;
+
+// Multicast delivery (--multicast) and what broadcasts cost in egress datagrams, both guarded by cs
+int multicast_enabled = 0;
+struct sockaddr_in multicast_addr;
+char multicast_offer[64]; // "MCAST <group> <port> <source>", sent after every ID
+unsigned int multicast_seq = 0;
+long long broadcasts_sent = 0, broadcast_datagrams = 0, broadcast_multicast = 0, broadcast_recipients = 0;
+
 // --- Function Prototypes ---
 void initialize_clients();
 int find_client_by_addr(const struct sockaddr_in* addr);
@@ -39,16 +231,61 @@ int register_client(const struct sockaddr_in* addr);
 void update_client_time(int client_index);
 void remove_client(int client_index);
 void process_datagram(char* buffer, int len, const struct sockaddr_in* client_addr);
+int reassemble_fragment(const char* datagram, int len, const struct sockaddr_in* addr, char** out_message);
+void release_reassembly_slot(ReassemblySlot* slot);
+void expire_reassembly_slots(void);
 void send_to_client_addr(const struct sockaddr_in* addr, const char* message);
+int send_bytes_to_client_addr(const struct sockaddr_in* addr, const char* data, int len);
+int send_fragmented(const struct sockaddr_in* addr, const char* message, int len);
 void send_message_to_client_id(int target_id, const char* message, int sender_id, const struct sockaddr_in* sender_addr);
 void broadcast_message(const char* message, int sender_id, const struct sockaddr_in* sender_addr);
 void broadcast_info(const char* message, const struct sockaddr_in* exclude_addr);
+void broadcast_deliver(const char* message, int len, const struct sockaddr_in* exclude_addr);
+int multicast_start(const char* interface_ip);
 unsigned __stdcall check_timeouts_thread(void *arg);
+int build_compressed_frame(const char* message, int len, CompressedFrame* frame);
+int deliver_message(int client_index, const char* message, int len, CompressedFrame* frame);
+int work_pool_start(int workers);
+void dispatch_command(char* data, int len, const struct sockaddr_in* addr, int owned, LARGE_INTEGER received_at);
+void work_push(int worker, int lane);
+int work_take(int worker, int steal);
+void work_run_lane(int worker, int lane_index);
+unsigned __stdcall work_thread(void *arg);
+void work_record(LARGE_INTEGER received_at);
+int placement_plan(int workers, PROCESSOR_NUMBER* cpus, USHORT* nodes);
+void place_receive_thread(void);
+void rate_hold(LONG64 wait, int target_id, const char* message, int sender_id, const struct sockaddr_in* sender_addr);
+unsigned __stdcall rate_release_thread(void *arg);
+void run_send(int target_id, const char* message, int sender_id, const struct sockaddr_in* sender_addr);
+int cookie_init(void);
+uint64_t cookie_make(const struct sockaddr_in* addr, ULONGLONG epoch);
+int cookie_admit(const char* datagram, int len, const struct sockaddr_in* addr);
 
 // --- Main Function ---
-int main() {
+int main(int argc, char *argv[]) {
     WSADATA wsa;
     struct sockaddr_in server_addr;
+    SYSTEM_INFO system_info;
+    int workers, usage_error = 0;
+    const char *multicast_arg = NULL; // "" = default interface
+
+    // Default: one worker per processor
+    GetSystemInfo(&system_info);
+    workers = (int)system_info.dwNumberOfProcessors;
+    for (int i = 1; i < argc; i++) {
+        if (_stricmp(argv[i], "--multicast") == 0) {
+            multicast_arg = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : "";
+        } else if (i == 1) {
+            workers = atoi(argv[i]);
+        } else {
+            usage_error = 1;
+        }
+    }
+    if (usage_error || workers < 0) {
+        printf("Usage: %s [workers] [--multicast [interface IP]]   (0 workers = handle commands on the receive thread)\n", argv[0]);
+        return 1;
+    }
+    if (workers > WORK_MAX_WORKERS) workers = WORK_MAX_WORKERS;
 
     printf("Initializing Winsock...\n");
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
@@ -58,6 +295,12 @@ int main() {
 
     InitializeCriticalSection(&cs);
     initialize_clients();
+    compress_init(compress_dict_table);
+    InitializeCriticalSection(&cookie_cs);
+    if (!cookie_init()) {
+        printf("Could not draw a registration cookie key.\n");
+        WSACleanup(); return 1;
+    }
 
     // Create UDP socket
     server_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -80,6 +323,9 @@ int main() {
     printf("Socket bound to port %d.\n", SERVER_PORT);
     printf("UDP Server listening on port %d...\n", SERVER_PORT);
     printf("Broadcast ID is %d. Client timeout is %d seconds.\n", BROADCAST_ID, CLIENT_TIMEOUT_SECONDS);
+    if (multicast_arg != NULL && !multicast_start(multicast_arg)) {
+        printf("Multicast could not be set up; broadcasts stay unicast.\n");
+    }
 
     // Start timeout checker thread
     HANDLE timeoutThreadHandle = (HANDLE)_beginthreadex(NULL, 0, check_timeouts_thread, NULL, 0, NULL);
@@ -90,6 +336,23 @@ int main() {
           CloseHandle(timeoutThreadHandle); // Detach
      }
 
+    // SENDs held back by the rate limiter run from their own thread
+    InitializeCriticalSection(&rate_cs);
+    if (RATE_ACTION == RATE_QUEUE) {
+        rate_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        HANDLE rateThreadHandle = (rate_wake != NULL) ? (HANDLE)_beginthreadex(NULL, 0, rate_release_thread, NULL, 0, NULL) : NULL;
+        if (rateThreadHandle == NULL) {
+            printf("Failed to create rate limiter thread. Error: %d\n", GetLastError());
+        } else {
+            CloseHandle(rateThreadHandle);
+        }
+    }
+
+    if (!work_pool_start(workers)) {
+        printf("Could not start the worker pool; handling commands on the receive thread.\n");
+    }
+    place_receive_thread();
+
 
     // Main receive loop
     char recv_buffer[BUFFER_SIZE];
@@ -100,6 +363,8 @@ int main() {
         memset(recv_buffer, 0, BUFFER_SIZE);
         int bytes_received = recvfrom(server_socket, recv_buffer, BUFFER_SIZE - 1, 0,
                                      (struct sockaddr*)&client_addr, &client_addr_len);
+        LARGE_INTEGER received_at;
+        QueryPerformanceCounter(&received_at);
 
         if (bytes_received == SOCKET_ERROR) {
             int error = WSAGetLastError();
@@ -121,8 +386,21 @@ int main() {
 
         if (bytes_received > 0) {
              recv_buffer[bytes_received] = '\0'; // Null-terminate
-             // Process the received datagram
-             process_datagram(recv_buffer, bytes_received, &client_addr);
+             // An address without a slot gets nothing but a cookie until it echoes one back
+             if (find_client_by_addr(&client_addr) == -1 && !cookie_admit(recv_buffer, bytes_received, &client_addr)) {
+                  continue;
+             }
+             if (strncmp(recv_buffer, "FRAG ", 5) == 0) {
+                  // Part of a large message: only process once every fragment is in
+                  char *message = NULL;
+                  int message_len = reassemble_fragment(recv_buffer, bytes_received, &client_addr, &message);
+                  if (message_len > 0) {
+                       dispatch_command(message, message_len, &client_addr, 1, received_at);
+                  }
+             } else {
+                  // Process the received datagram
+                  dispatch_command(recv_buffer, bytes_received, &client_addr, 0, received_at);
+             }
         }
     }
 
@@ -185,6 +463,9 @@ int register_client(const struct sockaddr_in* addr) {
                  strcpy(clients[i].ip_str, inet_ntoa(addr->sin_addr));
                  clients[i].last_heard_time = time(NULL); // Set current time
                  clients[i].active = 1;
+                 clients[i].compress = 0;
+                 memset(&clients[i].rate, 0, sizeof(clients[i].rate));
+                 clients[i].multicast = 0;
                  client_index = i;
                  printf("Registered new client ID %d from %s:%d\n", clients[i].id, clients[i].ip_str, ntohs(addr->sin_port));
                  break;
@@ -250,8 +531,14 @@ void process_datagram(char* buffer, int len, const struct sockaddr_in* client_ad
     int client_index = find_client_by_addr(client_addr);
     int client_id;
 
-    // --- Start: Client Registration/Timestamp Update (No Change) ---
+    // --- Start: Client Registration/Timestamp Update ---
     if (client_index == -1) {
+        // The receive loop only lets a checked HELLO through, but the slot may have timed out since
+        // (a keep-alive HELLO without a cookie is then answered with one, anything else dropped)
+        if (_strnicmp(buffer, "HELLO ", 6) != 0 || buffer[5 + strspn(buffer + 5, " ")] == '\0') {
+             cookie_admit(buffer, len, client_addr);
+             return;
+        }
         client_id = register_client(client_addr);
         if (client_id == -1) {
              printf("Server full, dropping datagram from %s:%d\n", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
@@ -261,8 +548,10 @@ void process_datagram(char* buffer, int len, const struct sockaddr_in* client_ad
          client_index = find_client_by_addr(client_addr); // Find index again
          sprintf(response_buffer, "ID %d", client_id);
          send_to_client_addr(client_addr, response_buffer);
+         if (multicast_enabled) send_to_client_addr(client_addr, multicast_offer);
          sprintf(response_buffer, "INFO User %d (%s:%d) has joined.", client_id, clients[client_index].ip_str, ntohs(client_addr->sin_port));
          broadcast_info(response_buffer, client_addr);
+         return; // HELLO itself needs no further handling
     } else {
          client_id = clients[client_index].id;
          update_client_time(client_index); // Crucial: Update time on ANY received packet
@@ -282,9 +571,22 @@ void process_datagram(char* buffer, int len, const struct sockaddr_in* client_ad
     }
     // --- End check for PING ---
 
+    // A HELLO without a cookie is the client's keep-alive (a server that has forgotten the client answers
+    // it with a cookie); a repeated "HELLO <cookie>" (the ID reply was lost) just gets the ID again
+    if (_strnicmp(buffer, "HELLO", 5) == 0 && buffer[5 + strspn(buffer + 5, " ")] == '\0') {
+         return;
+    }
+    if (_strnicmp(buffer, "HELLO ", 6) == 0) {
+         sprintf(response_buffer, "ID %d", client_id);
+         send_to_client_addr(client_addr, response_buffer);
+         if (multicast_enabled) send_to_client_addr(client_addr, multicast_offer);
+         return;
+    }
+
     // Handle LIST (No Change)
      if (_stricmp(buffer, "LIST") == 0) {
-        char list_response[BUFFER_SIZE * 2] = "";
+        // Sized for every slot so the roster is never truncated; large lists go out fragmented
+        char list_response[64 + MAX_CLIENTS * 32] = "";
         EnterCriticalSection(&cs);
         // ... (build list response - same as before) ...
         strcat(list_response, "--- Active Clients ---\n");
@@ -300,10 +602,15 @@ void process_datagram(char* buffer, int len, const struct sockaddr_in* client_ad
         if (message_start != NULL && sscanf(buffer + 5, "%d", &target_id) == 1) {
             message_start++;
             if (strlen(message_start) > 0) {
-                 if (target_id == BROADCAST_ID) {
-                     broadcast_message(message_start, client_id, client_addr);
+                 // Flood protection comes before any work is done for the message
+                 LONG64 wait = rate_charge(&clients[client_index].rate, (int)strlen(message_start), target_id == BROADCAST_ID, response_buffer);
+                 if (wait < 0) {
+                     // Refused; a muted client only hears about it once
+                     if (response_buffer[0] != '\0') send_to_client_addr(client_addr, response_buffer);
+                 } else if (wait > 0) {
+                     rate_hold(wait, target_id, message_start, client_id, client_addr);
                  } else {
-                     send_message_to_client_id(target_id, message_start, client_id, client_addr);
+                     run_send(target_id, message_start, client_id, client_addr);
                  }
             } else {
                  send_to_client_addr(client_addr, "ERROR Message cannot be empty.");
@@ -312,92 +619,825 @@ void process_datagram(char* buffer, int len, const struct sockaddr_in* client_ad
              send_to_client_addr(client_addr, "ERROR Invalid SEND format. Use: SEND <id> <message>");
         }
     }
+    // Handle COMPRESS <version>: only the dictionary this server was built with can be used
+    else if (_strnicmp(buffer, "COMPRESS ", 9) == 0) {
+        int version = atoi(buffer + 9);
+        int accepted = (version == COMPRESS_DICT_VERSION);
+        sprintf(response_buffer, "COMPRESS %s %d", accepted ? "ON" : "OFF", COMPRESS_DICT_VERSION);
+        send_to_client_addr(client_addr, response_buffer);
+        EnterCriticalSection(&cs);
+        if (clients[client_index].active) clients[client_index].compress = accepted ? version : 0;
+        LeaveCriticalSection(&cs);
+    }
+    // Handle MCAST JOIN / MCAST OK: the client joined the group / our probe reached it there
+    else if (_stricmp(buffer, "MCAST JOIN") == 0 || _stricmp(buffer, "MCAST OK") == 0) {
+        int confirmed = (_stricmp(buffer, "MCAST OK") == 0);
+        if (!multicast_enabled) {
+            send_to_client_addr(client_addr, "ERROR Multicast is not enabled on this server.");
+            return;
+        }
+        EnterCriticalSection(&cs);
+        if (clients[client_index].active) clients[client_index].multicast = confirmed ? 2 : 1;
+        LeaveCriticalSection(&cs);
+        if (confirmed) {
+            printf("Client ID %d now receives broadcasts by multicast.\n", client_id);
+        } else {
+            // Unicast copies stay on until the probe proves the group reaches the client
+            sprintf(response_buffer, "MCAST PROBE %d", client_id);
+            if (sendto(server_socket, response_buffer, (int)strlen(response_buffer), 0,
+                       (struct sockaddr*)&multicast_addr, sizeof(multicast_addr)) == SOCKET_ERROR) {
+                printf("Multicast probe for client ID %d failed. Error: %d\n", client_id, WSAGetLastError());
+            }
+        }
+    }
+    // Handle STATS: flood protection counters, server-wide and for this client
+    else if (_stricmp(buffer, "STATS") == 0) {
+        sprintf(response_buffer, "STATS rate-limit %s: %lld allowed, %lld queued, %lld rejected, %lld dropped while muted, %lld mutes; "
+                "you: %lld limited; cookies: %lld sent, %lld accepted, %lld rejected, %lld withheld",
+                rate_action_names[RATE_ACTION], (long long)rate_allowed, (long long)rate_queued, (long long)rate_rejected,
+                (long long)rate_dropped, (long long)rate_mutes, clients[client_index].rate.limited,
+                (long long)cookies_sent, (long long)cookies_accepted, (long long)cookies_rejected,
+                (long long)cookies_withheld);
+        EnterCriticalSection(&cs);
+        if (broadcasts_sent > 0) {
+            sprintf(response_buffer + strlen(response_buffer), "; broadcasts (multicast %s): %lld, %.2f datagrams each "
+                    "(%lld multicast) for %.2f recipients each",
+                    multicast_enabled ? "on" : "off", broadcasts_sent, (double)broadcast_datagrams / (double)broadcasts_sent,
+                    broadcast_multicast, (double)broadcast_recipients / (double)broadcasts_sent);
+        }
+        LeaveCriticalSection(&cs);
+        send_to_client_addr(client_addr, response_buffer);
+    }
     // Handle unknown commands (PING is now handled above)
     else {
          printf("Client ID %d sent unknown command: %s\n", client_id, buffer);
-         send_to_client_addr(client_addr, "ERROR Unknown command. Use LIST or SEND <id> <message>");
+         send_to_client_addr(client_addr, "ERROR Unknown command. Use LIST, SEND <id> <message> or STATS");
     }
 }
 
 // ... (send_to_client_addr, send_message_to_client_id, broadcast_message, broadcast_info - same as before) ...
 // ... (check_timeouts_thread - same as before) ...
 
+// --- Worker Pool ---
+
+// Start the workers. With 0 workers (or on failure) commands stay on the receive thread.
+int work_pool_start(int workers) {
+    InitializeCriticalSection(&work_stats_cs);
+    QueryPerformanceFrequency(&work_frequency);
+    QueryPerformanceCounter(&work_stats_start);
+    if (workers == 0) {
+        printf("Handling commands inline on the receive thread.\n");
+        return 1;
+    }
+    work_ready = CreateSemaphoreA(NULL, 0, WORK_LANES, NULL);
+    if (work_ready == NULL) return 0;
+    for (int i = 0; i < WORK_LANES; i++) {
+        InitializeCriticalSectionAndSpinCount(&work_lanes[i].lock, 1000);
+    }
+    PROCESSOR_NUMBER cpus[WORK_MAX_WORKERS];
+    USHORT nodes[WORK_MAX_WORKERS];
+    int planned = PLACEMENT_ENABLED ? placement_plan(workers, cpus, nodes) : 0;
+    for (int w = 0; w < workers; w++) {
+        USHORT node = planned > 0 ? nodes[w % planned] : 0;
+        work_deques[w] = (WorkDeque*)VirtualAllocExNuma(GetCurrentProcess(), NULL, sizeof(WorkDeque),
+                                                        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE, node);
+        if (work_deques[w] == NULL) work_deques[w] = (WorkDeque*)calloc(1, sizeof(WorkDeque));
+        if (work_deques[w] == NULL) return 0;
+        InitializeCriticalSectionAndSpinCount(&work_deques[w]->lock, 1000);
+        if (planned > 0) {
+            work_deques[w]->pinned = 1;
+            work_deques[w]->cpu = cpus[w % planned];
+            work_deques[w]->node = node;
+        }
+    }
+    work_worker_count = workers; // Before the threads start: they steal from every deque
+    for (int w = 0; w < workers; w++) {
+        HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, work_thread, (void*)(uintptr_t)w, 0, NULL);
+        if (thread == NULL) {
+            printf("Failed to create worker %d. Error: %d\n", w, GetLastError());
+            if (w == 0) {
+                work_worker_count = 0;
+                return 0;
+            }
+            // The missing workers' deques are still served by stealing
+            break;
+        }
+        CloseHandle(thread);
+    }
+    printf("Worker pool: %d workers, %d sender lanes.\n", workers, WORK_LANES);
+    return 1;
+}
+
+// Hand a received command to the pool (or run it here with no pool). owned: data is a malloc'ed
+// reassembled message that is freed once handled; otherwise it is copied.
+void dispatch_command(char* data, int len, const struct sockaddr_in* addr, int owned, LARGE_INTEGER received_at) {
+    if (work_worker_count == 0) {
+        process_datagram(data, len, addr);
+        work_record(received_at);
+        if (owned) free(data);
+        return;
+    }
+
+    WorkItem *item = (WorkItem*)malloc(sizeof(WorkItem) + (owned ? 0 : len + 1));
+    if (item == NULL) {
+        if (owned) free(data);
+        return;
+    }
+    item->next = NULL;
+    item->addr = *addr;
+    item->received_at = received_at;
+    item->len = len;
+    if (owned) {
+        item->data = data;
+    } else {
+        item->data = (char*)(item + 1);
+        memcpy(item->data, data, len + 1);
+    }
+
+    // Same sender, same lane
+    unsigned int lane_index = (addr->sin_addr.s_addr * 2654435761U ^ addr->sin_port) % WORK_LANES;
+    WorkLane *lane = &work_lanes[lane_index];
+    int was_idle;
+    EnterCriticalSection(&lane->lock);
+    if (lane->tail != NULL) lane->tail->next = item; else lane->head = item;
+    lane->tail = item;
+    was_idle = !lane->scheduled;
+    lane->scheduled = 1;
+    LeaveCriticalSection(&lane->lock);
+    if (was_idle) work_push(lane_index % work_worker_count, lane_index);
+}
+
+// Queue a lane on a worker's deque and wake one worker
+void work_push(int worker, int lane) {
+    WorkDeque *deque = work_deques[worker];
+    EnterCriticalSection(&deque->lock);
+    deque->lanes[(deque->first + deque->count) % WORK_LANES] = lane;
+    deque->count++;
+    LeaveCriticalSection(&deque->lock);
+    ReleaseSemaphore(work_ready, 1, NULL);
+}
+
+// Take a lane from a deque: the owner takes the oldest, a thief the newest. Returns -1 if empty.
+int work_take(int worker, int steal) {
+    WorkDeque *deque = work_deques[worker];
+    int lane = -1;
+    EnterCriticalSection(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            lane = deque->lanes[(deque->first + deque->count - 1) % WORK_LANES];
+        } else {
+            lane = deque->lanes[deque->first];
+            deque->first = (deque->first + 1) % WORK_LANES;
+        }
+        deque->count--;
+    }
+    LeaveCriticalSection(&deque->lock);
+    return lane;
+}
+
+// Run up to WORK_LANE_BATCH commands from a lane, then requeue it behind the lanes already waiting
+void work_run_lane(int worker, int lane_index) {
+    WorkLane *lane = &work_lanes[lane_index];
+    for (int n = 0; n < WORK_LANE_BATCH; n++) {
+        EnterCriticalSection(&lane->lock);
+        WorkItem *item = lane->head;
+        if (item == NULL) {
+            lane->scheduled = 0;
+            LeaveCriticalSection(&lane->lock);
+            return;
+        }
+        lane->head = item->next;
+        if (lane->head == NULL) lane->tail = NULL;
+        LeaveCriticalSection(&lane->lock);
+
+        process_datagram(item->data, item->len, &item->addr);
+        work_record(item->received_at);
+        InterlockedIncrement64(&work_deques[worker]->executed);
+        if (item->data != (char*)(item + 1)) free(item->data);
+        free(item);
+    }
+
+    EnterCriticalSection(&lane->lock);
+    int more = lane->head != NULL;
+    if (!more) lane->scheduled = 0;
+    LeaveCriticalSection(&lane->lock);
+    if (more) work_push(worker, lane_index);
+}
+
+unsigned __stdcall work_thread(void *arg) {
+    int self = (int)(uintptr_t)arg;
+    WorkDeque *own = work_deques[self];
+
+    if (own->pinned) {
+        GROUP_AFFINITY pin;
+        memset(&pin, 0, sizeof(pin));
+        pin.Group = own->cpu.Group;
+        pin.Mask = (ULONG_PTR)1 << own->cpu.Number;
+        SetThreadGroupAffinity(GetCurrentThread(), &pin, NULL);
+    }
+    while (1) {
+        // Every unit taken matches a lane in some deque, so the search below always ends
+        WaitForSingleObject(work_ready, INFINITE);
+        int lane = work_take(self, 0);
+        while (lane == -1) {
+            // Victims on our own node first (pass 0), then the rest
+            for (int pass = 0; lane == -1 && pass < 2; pass++) {
+                for (int k = 1; lane == -1 && k < work_worker_count; k++) {
+                    int victim = (self + k) % work_worker_count;
+                    int same_node = work_deques[victim]->node == own->node;
+                    if (same_node != (pass == 0)) continue;
+                    lane = work_take(victim, 1);
+                    if (lane != -1) {
+                        InterlockedIncrement64(&own->stolen);
+                        if (!same_node) InterlockedIncrement64(&own->stolen_remote);
+                    }
+                }
+            }
+            if (lane == -1) lane = work_take(self, 0);
+        }
+        work_run_lane(self, lane);
+    }
+    return 0;
+}
+
+// Processors for the workers, one each, filling NUMA node 0 first, then node 1, and so on.
+// Returns how many were found (0 if the topology cannot be read); workers beyond that share them round-robin.
+int placement_plan(int workers, PROCESSOR_NUMBER* cpus, USHORT* nodes) {
+    ULONG highest_node = 0;
+    int count = 0;
+    if (!GetNumaHighestNodeNumber(&highest_node)) return 0;
+    for (ULONG node = 0; node <= highest_node && count < workers; node++) {
+        GROUP_AFFINITY mask;
+        if (!GetNumaNodeProcessorMaskEx((USHORT)node, &mask)) continue;
+        for (int bit = 0; bit < (int)(sizeof(ULONG_PTR) * 8) && count < workers; bit++) {
+            if (!(mask.Mask & ((ULONG_PTR)1 << bit))) continue;
+            cpus[count].Group = mask.Group;
+            cpus[count].Number = (BYTE)bit;
+            cpus[count].Reserved = 0;
+            nodes[count] = (USHORT)node;
+            count++;
+        }
+    }
+    if (count > 0) printf("Placement: %d worker processor(s) over %lu NUMA node(s).\n", count, highest_node + 1);
+    return count;
+}
+
+// Prefer the processor RSS steers the socket's packets to for the receive thread (best effort: the
+// query fails where RSS is off or unsupported)
+void place_receive_thread(void) {
+#if PLACEMENT_ENABLED
+    SOCKET_PROCESSOR_AFFINITY affinity;
+    DWORD returned = 0;
+    if (WSAIoctl(server_socket, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &affinity, sizeof(affinity), &returned, NULL, NULL) == 0) {
+        SetThreadIdealProcessorEx(GetCurrentThread(), &affinity.Processor, NULL);
+        printf("Placement: receive thread prefers processor %d:%d (NUMA node %d).\n",
+               affinity.Processor.Group, affinity.Processor.Number, affinity.NumaNodeId);
+    }
+#endif
+}
+
+// Count one handled command; every WORK_REPORT_INTERVAL commands print throughput and receive-to-done latency
+void work_record(LARGE_INTEGER received_at) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    long long us = (now.QuadPart - received_at.QuadPart) * 1000000 / work_frequency.QuadPart;
+    int bucket = 0;
+    while (bucket < WORK_LATENCY_BUCKETS - 1 && (1LL << bucket) <= us) bucket++;
+
+    EnterCriticalSection(&work_stats_cs);
+    work_latency[bucket]++;
+    if (++work_stats_count == WORK_REPORT_INTERVAL) {
+        long long p50 = 0, p99 = 0, p999 = 0, seen = 0, steals = 0;
+        for (int b = 0; b < WORK_LATENCY_BUCKETS; b++) {
+            seen += work_latency[b];
+            if (p50 == 0 && seen * 2 >= work_stats_count) p50 = 1LL << b;
+            if (p99 == 0 && seen * 100 >= work_stats_count * 99LL) p99 = 1LL << b;
+            if (p999 == 0 && seen * 1000 >= work_stats_count * 999LL) p999 = 1LL << b;
+            work_latency[b] = 0;
+        }
+        long long remote_steals = 0;
+        for (int w = 0; w < work_worker_count; w++) {
+            steals += work_deques[w]->stolen;
+            remote_steals += work_deques[w]->stolen_remote;
+        }
+        double seconds = (double)(now.QuadPart - work_stats_start.QuadPart) / (double)work_frequency.QuadPart;
+        printf("[Work] %d commands in %.2f s (%.0f/s) on %s; latency p50 < %lld us, p99 < %lld us, p99.9 < %lld us; %lld steals so far (%lld across nodes)\n",
+               work_stats_count, seconds, seconds > 0.0 ? work_stats_count / seconds : 0.0,
+               work_worker_count > 0 ? "the worker pool" : "the receive thread", p50, p99, p999, steals, remote_steals);
+        work_stats_count = 0;
+        work_stats_start = now;
+    }
+    LeaveCriticalSection(&work_stats_cs);
+}
+
+// --- Fragment Reassembly ---
+
+// Free a slot's buffers and return its bytes to the memory budget
+void release_reassembly_slot(ReassemblySlot* slot) {
+    if (!slot->in_use) return;
+    free(slot->data);
+    free(slot->received);
+    reassembly_bytes_in_use -= slot->bytes_reserved;
+    memset(slot, 0, sizeof(*slot));
+}
+
+// Drop messages whose fragments stopped arriving
+void expire_reassembly_slots(void) {
+    ULONGLONG now = GetTickCount64();
+    for (int i = 0; i < REASM_MAX_SLOTS; i++) {
+        if (reassembly_slots[i].in_use && now - reassembly_slots[i].start_tick > REASM_TIMEOUT_MS) {
+            printf("[Reassembly] Message %u from %s:%d timed out with %d/%d fragments.\n",
+                   reassembly_slots[i].msg_id, inet_ntoa(reassembly_slots[i].addr.sin_addr),
+                   ntohs(reassembly_slots[i].addr.sin_port),
+                   reassembly_slots[i].frags_received, reassembly_slots[i].frag_count);
+            release_reassembly_slot(&reassembly_slots[i]);
+        }
+    }
+}
+
+// Store one "FRAG <msg_id> <index> <count> <payload>" datagram.
+// Returns the message length and hands ownership of the buffer to *out_message once the
+// last missing fragment arrives; returns -1 while incomplete or if the fragment was dropped.
+int reassemble_fragment(const char* datagram, int len, const struct sockaddr_in* addr, char** out_message) {
+    unsigned int msg_id;
+    int index, frag_count, header_len = 0;
+    ReassemblySlot *slot = NULL;
+
+    *out_message = NULL;
+    // The header ends at exactly one space: a space before %n would also swallow whitespace the payload starts with
+    if (sscanf(datagram, "FRAG %u %d %d%n", &msg_id, &index, &frag_count, &header_len) != 3 || header_len == 0 ||
+        header_len >= len || datagram[header_len++] != ' ' ||
+        frag_count <= 0 || frag_count > (MAX_MESSAGE_SIZE + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE ||
+        index < 0 || index >= frag_count) {
+        printf("Malformed fragment from %s:%d dropped.\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        return -1;
+    }
+
+    int payload_len = len - header_len;
+    // Every fragment except the last must be full so offsets can be computed from the index
+    if (payload_len <= 0 || payload_len > FRAG_PAYLOAD_SIZE || (index < frag_count - 1 && payload_len != FRAG_PAYLOAD_SIZE)) {
+        printf("Fragment %d of message %u from %s:%d has bad length %d, dropped.\n",
+               index, msg_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), payload_len);
+        return -1;
+    }
+
+    expire_reassembly_slots();
+
+    // Find the message this fragment belongs to, counting the sender's other open messages on the way
+    ReassemblySlot *sender_oldest = NULL;
+    int sender_open = 0;
+    for (int i = 0; i < REASM_MAX_SLOTS; i++) {
+        if (reassembly_slots[i].in_use && reassembly_slots[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            reassembly_slots[i].addr.sin_port == addr->sin_port) {
+            if (reassembly_slots[i].msg_id == msg_id) {
+                slot = &reassembly_slots[i];
+                break;
+            }
+            if (sender_oldest == NULL || reassembly_slots[i].start_tick < sender_oldest->start_tick) {
+                sender_oldest = &reassembly_slots[i];
+            }
+            sender_open++;
+        }
+    }
+
+    if (slot == NULL) {
+        size_t needed = (size_t)frag_count * FRAG_PAYLOAD_SIZE + 1 + (size_t)frag_count;
+        // One sender cannot take the whole table (or the memory cap) away from everyone else. A client
+        // sends its messages one after another, so its oldest open one has lost a fragment: give that up.
+        if (sender_open >= REASM_MAX_PER_SENDER) {
+            printf("[Reassembly] %s:%d has %d messages open, abandoning message %u with %d/%d fragments.\n",
+                   inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), sender_open, sender_oldest->msg_id,
+                   sender_oldest->frags_received, sender_oldest->frag_count);
+            release_reassembly_slot(sender_oldest);
+        }
+        if (reassembly_bytes_in_use + needed > REASM_MEMORY_CAP) {
+            printf("[Reassembly] Memory cap reached (%zu bytes in use), dropping message %u from %s:%d.\n",
+                   reassembly_bytes_in_use, msg_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+            return -1;
+        }
+        for (int i = 0; i < REASM_MAX_SLOTS; i++) {
+            if (!reassembly_slots[i].in_use) {
+                slot = &reassembly_slots[i];
+                break;
+            }
+        }
+        if (slot == NULL) {
+            printf("[Reassembly] No free slot, dropping message %u from %s:%d.\n", msg_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+            return -1;
+        }
+        slot->data = (char*)malloc((size_t)frag_count * FRAG_PAYLOAD_SIZE + 1);
+        slot->received = (unsigned char*)calloc(frag_count, 1);
+        if (slot->data == NULL || slot->received == NULL) {
+            free(slot->data);
+            free(slot->received);
+            slot->data = NULL;
+            slot->received = NULL;
+            return -1;
+        }
+        slot->in_use = 1;
+        slot->addr = *addr;
+        slot->msg_id = msg_id;
+        slot->frag_count = frag_count;
+        slot->frags_received = 0;
+        slot->total_len = -1;
+        slot->bytes_reserved = needed;
+        slot->start_tick = GetTickCount64();
+        QueryPerformanceCounter(&slot->start_counter);
+        reassembly_bytes_in_use += needed;
+        if (reassembly_bytes_in_use > reassembly_bytes_high_water) {
+            reassembly_bytes_high_water = reassembly_bytes_in_use;
+        }
+    } else if (slot->frag_count != frag_count) {
+        printf("Fragment count mismatch for message %u from %s:%d, dropped.\n", msg_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        return -1;
+    }
+
+    if (slot->received[index]) return -1; // Duplicate fragment
+
+    memcpy(slot->data + (size_t)index * FRAG_PAYLOAD_SIZE, datagram + header_len, payload_len);
+    slot->received[index] = 1;
+    slot->frags_received++;
+    if (index == frag_count - 1) {
+        slot->total_len = index * FRAG_PAYLOAD_SIZE + payload_len;
+    }
+
+    if (slot->frags_received < slot->frag_count) return -1;
+
+    // Complete: report throughput and the table's memory high-water mark, then hand over the buffer
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    double elapsed_ms = (double)(now.QuadPart - slot->start_counter.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    int message_len = slot->total_len;
+    printf("[Reassembly] Message %u from %s:%d: %d bytes in %d fragments, %.2f ms (%.2f MB/s). Memory in use %zu, high-water %zu bytes.\n",
+           msg_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), message_len, frag_count, elapsed_ms,
+           elapsed_ms > 0.0 ? (message_len / (1024.0 * 1024.0)) / (elapsed_ms / 1000.0) : 0.0,
+           reassembly_bytes_in_use, reassembly_bytes_high_water);
+
+    *out_message = slot->data;
+    (*out_message)[message_len] = '\0';
+    slot->data = NULL; // Ownership moves to the caller
+    release_reassembly_slot(slot);
+    return message_len;
+}
+
 // --- Sending Functions ---
 
-// Basic sendto wrapper
+// Basic sendto wrapper for text messages
 void send_to_client_addr(const struct sockaddr_in* addr, const char* message) {
-    if (sendto(server_socket, message, strlen(message), 0,
+    send_bytes_to_client_addr(addr, message, (int)strlen(message));
+}
+
+// sendto wrapper for arbitrary bytes (messages that do not fit one fragment are split up).
+// Returns the number of datagrams sent.
+int send_bytes_to_client_addr(const struct sockaddr_in* addr, const char* message, int len) {
+    if (len > FRAG_PAYLOAD_SIZE) {
+        return send_fragmented(addr, message, len);
+    }
+    if (sendto(server_socket, message, len, 0,
               (struct sockaddr*)addr, sizeof(*addr)) == SOCKET_ERROR)
     {
         // Log error, but don't necessarily remove client here, could be temporary
         printf("sendto failed to %s:%d. Error: %d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), WSAGetLastError());
+        return 0;
     }
+    return 1;
+}
+
+// Split a message into "FRAG <msg_id> <index> <count> " datagrams of at most FRAG_PAYLOAD_SIZE payload bytes.
+// Returns the number of datagrams sent.
+int send_fragmented(const struct sockaddr_in* addr, const char* message, int len) {
+    char datagram[FRAG_HEADER_MAX + FRAG_PAYLOAD_SIZE];
+    unsigned int msg_id = (unsigned int)InterlockedIncrement(&next_msg_id);
+    int frag_count = (len + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
+
+    if (len > MAX_MESSAGE_SIZE) {
+        printf("Refusing to send %d-byte message to %s:%d (limit %d).\n", len, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), MAX_MESSAGE_SIZE);
+        return 0;
+    }
+
+    for (int index = 0; index < frag_count; index++) {
+        int offset = index * FRAG_PAYLOAD_SIZE;
+        int chunk = (len - offset < FRAG_PAYLOAD_SIZE) ? len - offset : FRAG_PAYLOAD_SIZE;
+        int header_len = sprintf(datagram, "FRAG %u %d %d ", msg_id, index, frag_count);
+        memcpy(datagram + header_len, message + offset, chunk);
+        if (sendto(server_socket, datagram, header_len + chunk, 0,
+                  (struct sockaddr*)addr, sizeof(*addr)) == SOCKET_ERROR)
+        {
+            printf("sendto failed for fragment %d/%d to %s:%d. Error: %d\n", index + 1, frag_count,
+                   inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), WSAGetLastError());
+            return index; // The receiver cannot complete the message anyway
+        }
+    }
+    return frag_count;
 }
 
 // Send to a specific client ID (finds address first)
 void send_message_to_client_id(int target_id, const char* message, int sender_id, const struct sockaddr_in* sender_addr) {
-    struct sockaddr_in target_addr;
-    int found = 0;
-    char formatted_message[BUFFER_SIZE + 64];
+    int target_index = -1;
+    // Messages may be reassembled from fragments, so size the buffer from the message itself
+    char *formatted_message = (char*)malloc(strlen(message) + 64);
+    if (formatted_message == NULL) return;
 
     EnterCriticalSection(&cs);
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (clients[i].active && clients[i].id == target_id) {
-            target_addr = clients[i].addr; // Copy target address
-            found = 1;
+            target_index = i;
             break;
         }
     }
+    if (target_index != -1) {
+        int len = sprintf(formatted_message, "MSG %d: %s", sender_id, message);
+        CompressedFrame frame = { NULL, 0, 0 };
+        deliver_message(target_index, formatted_message, len, &frame);
+        free(frame.data);
+    }
     LeaveCriticalSection(&cs);
 
-    if (found) {
-        sprintf(formatted_message, "MSG %d: %s", sender_id, message);
-        send_to_client_addr(&target_addr, formatted_message);
-    } else {
+    if (target_index == -1) {
         // Inform sender that target was not found
         sprintf(formatted_message, "ERROR User ID %d not found or is inactive.", target_id);
         send_to_client_addr(sender_addr, formatted_message);
     }
+    free(formatted_message);
 }
 
 // Broadcast a user message to all clients except the sender
 void broadcast_message(const char* message, int sender_id, const struct sockaddr_in* sender_addr) {
-    char formatted_message[BUFFER_SIZE + 64];
-    sprintf(formatted_message, "MSG %d (Broadcast): %s", sender_id, message);
-    printf("Broadcasting MSG from %d: %s\n", sender_id, message);
+    char *formatted_message = (char*)malloc(strlen(message) + 64);
+    if (formatted_message == NULL) return;
+    int len = sprintf(formatted_message, "MSG %d (Broadcast): %s", sender_id, message);
+    printf("Broadcasting MSG from %d: %.200s\n", sender_id, message);
+    // Everyone EXCEPT the original sender (compare address)
+    broadcast_deliver(formatted_message, len, sender_addr);
+    free(formatted_message);
+}
+
+// Broadcast an informational message (e.g., join/leave)
+void broadcast_info(const char* message, const struct sockaddr_in* exclude_addr) {
+     printf("Broadcasting INFO: %s\n", message);
+     broadcast_deliver(message, (int)strlen(message), exclude_addr);
+}
+
+// Send one message to every active client but exclude_addr (may be NULL). Confirmed multicast clients
+// share a single group datagram; the rest get unicast copies, tagged with the same sequence number for
+// clients that have joined the group, so they can drop a copy that also arrives by multicast.
+void broadcast_deliver(const char* message, int len, const struct sockaddr_in* exclude_addr) {
+    CompressedFrame frame = { NULL, 0, 0 }; // Compressed once, on the first recipient that wants it
+    char tagged[FRAG_PAYLOAD_SIZE];
+    int tagged_len = 0, exclude_id = -1, datagrams = 0, multicast_datagrams = 0, recipients = 0;
 
     EnterCriticalSection(&cs);
+    if (exclude_addr != NULL) {
+        int exclude_index = find_client_by_addr(exclude_addr);
+        if (exclude_index != -1) exclude_id = clients[exclude_index].id;
+    }
+    if (multicast_enabled) {
+        // Worth a group datagram only if someone is confirmed on the group and it fits in one
+        int header_len = sprintf(tagged, "%cM %u %d\n", MCAST_MARKER, multicast_seq + 1, exclude_id);
+        for (int i = 0; i < MAX_CLIENTS && tagged_len == 0; i++) {
+            if (clients[i].active && clients[i].multicast == 2 && clients[i].id != exclude_id &&
+                header_len + len <= FRAG_PAYLOAD_SIZE) {
+                memcpy(tagged + header_len, message, len);
+                tagged_len = header_len + len;
+            }
+        }
+        if (tagged_len > 0) {
+            multicast_seq++;
+            if (sendto(server_socket, tagged, tagged_len, 0, (struct sockaddr*)&multicast_addr, sizeof(multicast_addr)) == SOCKET_ERROR) {
+                printf("Multicast sendto failed. Error: %d; falling back to unicast.\n", WSAGetLastError());
+                tagged_len = 0;
+            } else {
+                multicast_datagrams = 1;
+            }
+        }
+    }
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        // Send to all active clients EXCEPT the original sender (compare address)
-        if (clients[i].active &&
-            !(clients[i].addr.sin_addr.s_addr == sender_addr->sin_addr.s_addr &&
-              clients[i].addr.sin_port == sender_addr->sin_port) )
-        {
-             send_to_client_addr(&clients[i].addr, formatted_message);
+        if (!clients[i].active) continue;
+        // Skip the excluded address
+        if (exclude_addr != NULL &&
+            clients[i].addr.sin_addr.s_addr == exclude_addr->sin_addr.s_addr &&
+            clients[i].addr.sin_port == exclude_addr->sin_port) {
+            continue;
+        }
+        recipients++;
+        if (tagged_len > 0 && clients[i].multicast == 2) continue; // The group datagram covers it
+        if (tagged_len > 0 && clients[i].multicast == 1) {
+            datagrams += send_bytes_to_client_addr(&clients[i].addr, tagged, tagged_len);
+        } else {
+            datagrams += deliver_message(i, message, len, &frame);
         }
     }
+    datagrams += multicast_datagrams;
+    broadcasts_sent++;
+    broadcast_datagrams += datagrams;
+    broadcast_multicast += multicast_datagrams;
+    broadcast_recipients += recipients;
     LeaveCriticalSection(&cs);
+    free(frame.data);
+    if (multicast_enabled) {
+        printf("Broadcast reached %d client(s) with %d datagram(s)%s.\n", recipients, datagrams, multicast_datagrams ? ", one of them multicast" : "");
+    }
 }
 
-// Broadcast an informational message (e.g., join/leave)
-void broadcast_info(const char* message, const struct sockaddr_in* exclude_addr) {
-     printf("Broadcasting INFO: %s\n", message);
-     EnterCriticalSection(&cs);
-     for (int i = 0; i < MAX_CLIENTS; i++) {
-          if (clients[i].active) {
-               // Exclude specific address if provided
-               if (exclude_addr != NULL &&
-                   clients[i].addr.sin_addr.s_addr == exclude_addr->sin_addr.s_addr &&
-                   clients[i].addr.sin_port == exclude_addr->sin_port)
-               {
-                    continue; // Skip excluded client
-               }
-                send_to_client_addr(&clients[i].addr, message);
-          }
-     }
-     LeaveCriticalSection(&cs);
+// Prepare server_socket to send to the group: TTL 1, looped back to local members (clients on this
+// machine), out of interface_ip unless that is empty. Returns 0 if the socket refuses an option.
+int multicast_start(const char* interface_ip) {
+    DWORD ttl = MCAST_TTL, loop = 1;
+    struct sockaddr_in source;
+    int source_len = sizeof(source);
+
+    memset(&multicast_addr, 0, sizeof(multicast_addr));
+    multicast_addr.sin_family = AF_INET;
+    multicast_addr.sin_addr.s_addr = inet_addr(MCAST_GROUP);
+    multicast_addr.sin_port = htons(MCAST_PORT);
+    if (setsockopt(server_socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl)) == SOCKET_ERROR ||
+        setsockopt(server_socket, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop)) == SOCKET_ERROR) {
+        printf("Multicast socket options failed. Error: %d\n", WSAGetLastError());
+        return 0;
+    }
+    if (interface_ip[0] != '\0') {
+        struct in_addr interface_addr;
+        interface_addr.s_addr = inet_addr(interface_ip);
+        if (interface_addr.s_addr == INADDR_NONE ||
+            setsockopt(server_socket, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&interface_addr, sizeof(interface_addr)) == SOCKET_ERROR) {
+            printf("Cannot send multicast out of interface %s. Error: %d\n", interface_ip, WSAGetLastError());
+            return 0;
+        }
+        source.sin_addr = interface_addr;
+    } else {
+        // The address the routing table picks for the group is the one the datagrams will carry
+        SOCKET probe = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        int found = probe != INVALID_SOCKET &&
+                    connect(probe, (struct sockaddr*)&multicast_addr, sizeof(multicast_addr)) != SOCKET_ERROR &&
+                    getsockname(probe, (struct sockaddr*)&source, &source_len) != SOCKET_ERROR;
+        if (probe != INVALID_SOCKET) closesocket(probe);
+        if (!found) {
+            printf("Cannot tell which address multicast leaves from. Error: %d\n", WSAGetLastError());
+            return 0;
+        }
+    }
+    sprintf(multicast_offer, "MCAST %s %d %s", MCAST_GROUP, MCAST_PORT, inet_ntoa(source.sin_addr));
+    multicast_enabled = 1;
+    printf("Broadcasts go to multicast group %s:%d for clients that join it (interface %s, source %s).\n",
+           MCAST_GROUP, MCAST_PORT, interface_ip[0] != '\0' ? interface_ip : "default", inet_ntoa(source.sin_addr));
+    return 1;
+}
+
+
+// Deliver a SEND that passed the rate limiter
+void run_send(int target_id, const char* message, int sender_id, const struct sockaddr_in* sender_addr) {
+    if (target_id == BROADCAST_ID) {
+        broadcast_message(message, sender_id, sender_addr);
+    } else {
+        send_message_to_client_id(target_id, message, sender_id, sender_addr);
+    }
+}
+
+// --- Rate Limiting ---
+
+// Keep a charged SEND until it is due. Each held SEND of a client is due later than the one before,
+// so they run in order.
+void rate_hold(LONG64 wait, int target_id, const char* message, int sender_id, const struct sockaddr_in* sender_addr) {
+    size_t len = strlen(message);
+    RateHeld *held = (RateHeld*)malloc(sizeof(RateHeld) + len);
+    if (held == NULL || rate_wake == NULL) {
+        free(held);
+        run_send(target_id, message, sender_id, sender_addr); // Cannot hold it: send it now rather than lose it
+        return;
+    }
+    held->due = GetTickCount64() + (ULONGLONG)wait;
+    held->addr = *sender_addr;
+    held->sender_id = sender_id;
+    held->target_id = target_id;
+    memcpy(held->message, message, len + 1);
+
+    EnterCriticalSection(&rate_cs);
+    RateHeld **link = &rate_held;
+    while (*link != NULL && (*link)->due <= held->due) link = &(*link)->next;
+    held->next = *link;
+    *link = held;
+    LeaveCriticalSection(&rate_cs);
+    SetEvent(rate_wake);
+}
+
+// Run held SENDs as they fall due
+unsigned __stdcall rate_release_thread(void *arg) {
+    while (1) {
+        DWORD timeout = INFINITE;
+        RateHeld *due = NULL;
+        ULONGLONG now = GetTickCount64();
+
+        EnterCriticalSection(&rate_cs);
+        if (rate_held != NULL && rate_held->due <= now) {
+            due = rate_held;
+            rate_held = due->next;
+        } else if (rate_held != NULL) {
+            timeout = (DWORD)(rate_held->due - now);
+        }
+        LeaveCriticalSection(&rate_cs);
+
+        if (due != NULL) {
+            run_send(due->target_id, due->message, due->sender_id, &due->addr);
+            free(due);
+        } else {
+            WaitForSingleObject(rate_wake, timeout);
+        }
+    }
+    return 0;
+}
+
+// --- Registration Cookies ---
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+// Draw the 128-bit key from the system's cryptographic generator. Returns 0 on failure.
+int cookie_init(void) {
+    unsigned int words[4];
+    for (int i = 0; i < 4; i++) {
+        if (rand_s(&words[i]) != 0) return 0;
+    }
+    cookie_key[0] = ((uint64_t)words[0] << 32) | words[1];
+    cookie_key[1] = ((uint64_t)words[2] << 32) | words[3];
+    return 1;
+}
+
+// SipHash-2-4 of the two message words (address + port, epoch) under cookie_key. The input has a
+// fixed length, so it is absorbed as two blocks followed by the length block.
+uint64_t cookie_make(const struct sockaddr_in* addr, ULONGLONG epoch) {
+    uint64_t m[3];
+    uint64_t v0 = cookie_key[0] ^ 0x736f6d6570736575ULL, v1 = cookie_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = cookie_key[0] ^ 0x6c7967656e657261ULL, v3 = cookie_key[1] ^ 0x7465646279746573ULL;
+    m[0] = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+    m[1] = epoch;
+    m[2] = (uint64_t)16 << 56;
+    for (int i = 0; i < 3; i++) {
+        v3 ^= m[i];
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m[i];
+    }
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
+// Called on the receive loop for datagrams from addresses without a slot. Returns 1 for "HELLO <cookie>"
+// carrying a cookie of this or the previous epoch (trailing spaces are padding); anything else is
+// dropped (returns 0), and a HELLO at least COOKIE_HELLO_MIN_LEN long is first answered with a fresh
+// cookie while the reply bucket has tokens. Costs at most two hashes and one small sendto, and
+// allocates nothing.
+int cookie_admit(const char* datagram, int len, const struct sockaddr_in* addr) {
+    ULONGLONG epoch = GetTickCount64() / COOKIE_EPOCH_MS;
+    char reply[8 + COOKIE_HEX_LEN];
+    int start = 5, end = len, answer;
+
+    if (len < 5 || _strnicmp(datagram, "HELLO", 5) != 0 || (len > 5 && datagram[5] != ' ')) {
+        return 0;
+    }
+    while (start < end && datagram[start] == ' ') start++;
+    while (end > start && datagram[end - 1] == ' ') end--;
+    if (end > start) {
+        uint64_t echoed = 0;
+        int valid = (end - start == COOKIE_HEX_LEN);
+        for (int i = start; i < end && valid; i++) {
+            char c = datagram[i];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                        (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit < 0) valid = 0;
+            echoed = (echoed << 4) | (uint64_t)(digit & 0xf);
+        }
+        if (valid && (echoed == cookie_make(addr, epoch) || (epoch > 0 && echoed == cookie_make(addr, epoch - 1)))) {
+            InterlockedIncrement64(&cookies_accepted);
+            return 1;
+        }
+        InterlockedIncrement64(&cookies_rejected);
+    }
+
+    // Never send more than was received, nor more cookies than the bucket allows
+    answer = (len >= COOKIE_HELLO_MIN_LEN);
+    if (answer) {
+        EnterCriticalSection(&cookie_cs);
+        answer = (bucket_wait(&cookie_replies, 1, COOKIE_REPLIES_PER_SEC, COOKIE_REPLY_BURST, GetTickCount64()) == 0);
+        if (answer) cookie_replies.tokens -= 1000;
+        LeaveCriticalSection(&cookie_cs);
+    }
+    if (!answer) {
+        InterlockedIncrement64(&cookies_withheld);
+        return 0;
+    }
+    sprintf(reply, "COOKIE %016llx", (unsigned long long)cookie_make(addr, epoch));
+    sendto(server_socket, reply, (int)strlen(reply), 0, (const struct sockaddr*)addr, sizeof(*addr));
+    InterlockedIncrement64(&cookies_sent);
+    return 0;
+}
 
 // --- Timeout Checking Thread ---
 unsigned __stdcall check_timeouts_thread(void *arg) {
@@ -432,4 +1472,72 @@ unsigned __stdcall check_timeouts_thread(void *arg) {
      }
      printf("[Timeout Thread] Exiting.\n");
      return 0;
-}
\ No newline at end of file
+}
+
+// --- Message Compression ---
+
+// Compress a message into a ready-to-send datagram body and account for it. Caller holds cs.
+// Returns 1 if frame now holds a compressed message, 0 if the message goes out raw.
+int build_compressed_frame(const char* message, int len, CompressedFrame* frame) {
+    char header[48];
+    LARGE_INTEGER start, end;
+
+    frame->state = -1;
+    frame->data = (char*)malloc(sizeof(header) + len);
+    if (frame->data == NULL) return 0;
+
+    QueryPerformanceCounter(&start);
+    int compressed = compress_message(compress_dict_table, message, len, (unsigned char*)frame->data + sizeof(header), len);
+    QueryPerformanceCounter(&end);
+    compress_stats.cpu_ticks += end.QuadPart - start.QuadPart;
+
+    if (compressed == 0) {
+        compress_stats.skipped++;
+        free(frame->data);
+        frame->data = NULL;
+        return 0;
+    }
+    int header_len = sprintf(header, "%cZ %d %d\n", COMPRESS_MARKER, len, compressed);
+    memcpy(frame->data, header, header_len);
+    memmove(frame->data + header_len, frame->data + sizeof(header), compressed);
+    frame->len = header_len + compressed;
+    frame->state = 1;
+
+    compress_stats.compressed++;
+    compress_stats.input_bytes += len;
+    compress_stats.output_bytes += frame->len;
+    if (compress_stats.compressed % COMPRESS_REPORT_INTERVAL == 0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        long long attempts = compress_stats.compressed + compress_stats.skipped;
+        printf("[Compression] %lld messages compressed, %lld sent raw: ratio %.2f, %.2f us CPU per message; "
+               "egress %lld bytes instead of %lld (%.1f%% saved)\n",
+               compress_stats.compressed, compress_stats.skipped,
+               (double)compress_stats.input_bytes / (double)compress_stats.output_bytes,
+               (double)compress_stats.cpu_ticks * 1000000.0 / (double)frequency.QuadPart / (double)attempts,
+               compress_stats.egress_sent, compress_stats.egress_raw,
+               compress_stats.egress_raw > 0 ? 100.0 * (compress_stats.egress_raw - compress_stats.egress_sent) / compress_stats.egress_raw : 0.0);
+    }
+    return 1;
+}
+
+// Send a message to one client, compressed if it negotiated compression and the message is large
+// enough. The frame is shared across recipients so a broadcast is compressed only once. Caller holds cs.
+// Returns the number of datagrams sent.
+int deliver_message(int client_index, const char* message, int len, CompressedFrame* frame) {
+    ClientInfoUDP *client = &clients[client_index];
+
+    if (client->compress) {
+        if (len >= COMPRESS_MIN_SIZE && frame->state == 0) {
+            build_compressed_frame(message, len, frame);
+        }
+        if (len >= COMPRESS_MIN_SIZE && frame->state == 1) {
+            compress_stats.egress_raw += len;
+            compress_stats.egress_sent += frame->len;
+            return send_bytes_to_client_addr(&client->addr, frame->data, frame->len);
+        }
+        compress_stats.egress_raw += len;
+        compress_stats.egress_sent += len;
+    }
+    return send_bytes_to_client_addr(&client->addr, message, len);
+}
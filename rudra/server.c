@@ -1,27 +1,186 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <winsock2.h>
+#include <mstcpip.h>  // For SIO_UDP_CONNRESET
+#include <windows.h>
 #include <stdbool.h>  // Include for true/false constants
 
+#pragma comment(lib, "ws2_32.lib")
+
+// Reflector mode: many receives stay posted on a completion port; completions are dequeued in
+// batches and each datagram is sent straight back from the buffer it arrived in.
+#define RING_SIZE 512        // Receive buffers kept posted at all times
+#define DATAGRAM_SIZE 2048   // Largest datagram reflected in full
+#define BATCH_SIZE 64        // Completions dequeued per call
+#define MAX_WORKERS 64       // Upper bound for reflector threads
+#define RETRY_KEY 1          // Completion key of a slot whose receive could not be posted (the socket's key is 0)
+#define RETRY_DELAY_MS 1     // Back-off before posting such a slot again
+
+// One buffer of the ring: the source address of a received datagram becomes the destination of its reply
+typedef struct {
+    WSAOVERLAPPED overlapped;      // Must be first: completions hand back this pointer
+    WSABUF buf;
+    struct sockaddr_in peer;       // Filled by the receive, reused as-is by the send
+    int peer_len;
+    DWORD flags;
+    int sending;                   // 1 while the reply is in flight
+    char data[DATAGRAM_SIZE];
+} RingSlot;
+
+SOCKET sock;
+HANDLE completion_port;
+volatile LONG64 packets_reflected = 0;
+volatile LONG receive_retries = 0;  // Receives that failed to post and were queued for another try
+volatile LONG slots_lost = 0;       // Slots that could not even be queued, so the ring is that much smaller
+volatile LONG replies_failed = 0;   // Replies that could not be posted or did not complete (not counted as reflected)
+
+// Post a receive into a ring slot. Returns 0 if it failed right away (no completion will follow).
+int post_receive(RingSlot *slot) {
+    slot->sending = 0;
+    slot->buf.buf = slot->data;
+    slot->buf.len = DATAGRAM_SIZE;
+    slot->peer_len = sizeof(slot->peer);
+    slot->flags = 0;
+    memset(&slot->overlapped, 0, sizeof(slot->overlapped));
+    if (WSARecvFrom(sock, &slot->buf, 1, NULL, &slot->flags, (struct sockaddr *)&slot->peer, &slot->peer_len,
+                    &slot->overlapped, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
+        return 0;
+    }
+    return 1;
+}
+
+// Post a receive, or if that fails hand the slot to a reflector thread through the completion port to
+// be posted again, so a transient failure (e.g. WSAENOBUFS) does not shrink the ring for good
+void keep_receiving(RingSlot *slot) {
+    if (post_receive(slot)) {
+        return;
+    }
+    InterlockedIncrement(&receive_retries);
+    if (!PostQueuedCompletionStatus(completion_port, 0, RETRY_KEY, &slot->overlapped)) {
+        InterlockedIncrement(&slots_lost);
+    }
+}
+
+// Reflect the datagram in place: same buffer, same address, no copy
+int post_reply(RingSlot *slot, DWORD len) {
+    slot->sending = 1;
+    slot->buf.len = len;
+    memset(&slot->overlapped, 0, sizeof(slot->overlapped));
+    if (WSASendTo(sock, &slot->buf, 1, NULL, 0, (struct sockaddr *)&slot->peer, slot->peer_len,
+                  &slot->overlapped, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
+        return 0;
+    }
+    return 1;
+}
+
+DWORD WINAPI reflector_thread(LPVOID arg) {
+    OVERLAPPED_ENTRY entries[BATCH_SIZE];
+    ULONG count;
+
+    while (true) {
+        if (!GetQueuedCompletionStatusEx(completion_port, entries, BATCH_SIZE, &count, INFINITE, FALSE)) {
+            continue;
+        }
+        LONG64 reflected = 0;
+        for (ULONG i = 0; i < count; i++) {
+            RingSlot *slot = (RingSlot *)entries[i].lpOverlapped;
+            if (entries[i].lpCompletionKey == RETRY_KEY) {
+                Sleep(RETRY_DELAY_MS); // Whatever failed the post needs a moment
+                keep_receiving(slot);
+                continue;
+            }
+            // A non-zero status means the operation failed (e.g. a truncated datagram): just receive again
+            bool failed = entries[i].lpOverlapped->Internal != 0;
+            if (!slot->sending) {
+                // A receive completed: reflect it. A reply that cannot even be posted never completes, so
+                // the slot goes straight back to receiving without being counted.
+                if (!failed) {
+                    if (post_reply(slot, entries[i].dwNumberOfBytesTransferred)) {
+                        continue;
+                    }
+                    InterlockedIncrement(&replies_failed);
+                }
+            } else if (failed) {
+                InterlockedIncrement(&replies_failed);
+            } else {
+                reflected++; // Only a completed send counts
+            }
+            keep_receiving(slot);
+        }
+        InterlockedExchangeAdd64(&packets_reflected, reflected);
+    }
+    return 0;
+}
+
+// Run the reflector with the given number of threads and print packets per second
+int run_reflector(int workers) {
+    RingSlot *ring = (RingSlot *)calloc(RING_SIZE, sizeof(RingSlot));
+    if (ring == NULL) {
+        printf("Could not allocate the receive ring\n");
+        return 1;
+    }
+
+    // Without this, an ICMP port-unreachable from one vanished peer fails a later receive
+    BOOL report_resets = FALSE;
+    DWORD returned = 0;
+    WSAIoctl(sock, SIO_UDP_CONNRESET, &report_resets, sizeof(report_resets), NULL, 0, &returned, NULL, NULL);
+
+    completion_port = CreateIoCompletionPort((HANDLE)sock, NULL, 0, workers);
+    if (completion_port == NULL) {
+        printf("Could not create completion port\n");
+        free(ring);
+        return 1;
+    }
+    for (int i = 0; i < RING_SIZE; i++) {
+        keep_receiving(&ring[i]);
+    }
+    for (int i = 0; i < workers; i++) {
+        HANDLE thread = CreateThread(NULL, 0, reflector_thread, NULL, 0, NULL);
+        if (thread == NULL) {
+            printf("Could not create reflector thread\n");
+            return 1;
+        }
+        CloseHandle(thread);
+    }
+
+    printf("Reflecting with %d threads and %d posted receives\n", workers, RING_SIZE);
+    // Live counter instead of per-packet logging
+    while (true) {
+        Sleep(1000);
+        LONG64 packets = InterlockedExchange64(&packets_reflected, 0);
+        LONG retries = InterlockedExchange(&receive_retries, 0);
+        LONG failures = InterlockedExchange(&replies_failed, 0);
+        printf("\r%lld packets/s, %ld failed replies/s, %ld receive retries/s, %ld slots lost     ", packets, failures,
+               retries, slots_lost);
+        fflush(stdout);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     // Port to start the server on
     int SERVER_PORT = 8877;
 
     // Winsock initialization
     WSADATA wsaData;
-    SOCKET sock;
     struct sockaddr_in server_address;
     struct sockaddr_in client_address;
     int client_address_len = sizeof(client_address);
 
+    if (argc > 1 && _stricmp(argv[1], "reflect") != 0) {
+        printf("Usage: %s [reflect [threads]]\n", argv[0]);
+        return 1;
+    }
+
     // Initialize Winsock
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         printf("WSAStartup failed\n");
         return 1;
     }
 
-    // Create a UDP socket
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    // Create a UDP socket (overlapped, so it can also serve the reflector's completion port)
+    sock = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
     if (sock == INVALID_SOCKET) {
         printf("Could not create socket\n");
         WSACleanup();
@@ -42,12 +201,24 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (argc > 1) {
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        int workers = argc > 2 ? atoi(argv[2]) : (int)system_info.dwNumberOfProcessors;
+        if (workers < 1 || workers > MAX_WORKERS) workers = (int)system_info.dwNumberOfProcessors;
+        int result = run_reflector(workers);
+        closesocket(sock);
+        WSACleanup();
+        return result;
+    }
+
     // Run indefinitely
     while (true) {  // Now using 'true' after including stdbool.h
         char buffer[500];
 
-        // Receive data from client
-        int len = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_address, &client_address_len);
+        // Receive data from client (one byte is kept free for the terminator)
+        client_address_len = sizeof(client_address);
+        int len = recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&client_address, &client_address_len);
         if (len == SOCKET_ERROR) {
             printf("Error receiving data\n");
             continue;